@@ -27,6 +27,8 @@ if(NOT PS4)
 check_include_file("sys/poll.h" HAVE_SYS_POLL_H)
 endif()
 check_include_file("sys/socket.h" HAVE_SYS_SOCKET_H)
+check_include_file("sys/epoll.h" HAVE_SYS_EPOLL_H)
+check_include_file("sys/eventfd.h" HAVE_SYS_EVENTFD_H)
 check_include_file("sys/stat.h" HAVE_SYS_STAT_H)
 check_include_file("sys/types.h" HAVE_SYS_TYPES_H)
 check_include_file("sys/uio.h" HAVE_SYS_UIO_H)
@@ -49,6 +51,13 @@ check_struct_has_member("struct linger" l_linger network.h HAVE_LINGER)
 else()
 check_struct_has_member("struct linger" l_linger sys/socket.h HAVE_LINGER)
 endif()
+check_struct_has_member("struct io_uring_buf_reg" ring_entries linux/io_uring.h HAVE_LINUX_IO_URING_H)
+
+find_package(Threads)
+if(CMAKE_USE_PTHREADS_INIT)
+  set(HAVE_PTHREAD 1)
+  list(APPEND CORE_LIBRARIES Threads::Threads)
+endif()
 
 include(CheckCCompilerFlag)
 if(CMAKE_COMPILER_IS_GNUCC)
@@ -42,6 +42,9 @@
 /* Whether we have linger */
 #cmakedefine HAVE_LINGER "@HAVE_LINGER@"
 
+/* Whether we can use io_uring */
+#cmakedefine HAVE_LINUX_IO_URING_H "@HAVE_LINUX_IO_URING_H@"
+
 /* Define to 1 if you have the <stdint.h> header file. */
 #cmakedefine HAVE_STDINT_H "@HAVE_STDINT_H@"
 
@@ -63,6 +66,15 @@
 /* Define to 1 if you have the <sys/poll.h> header file. */
 #cmakedefine HAVE_SYS_POLL_H "@HAVE_SYS_POLL_H@"
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#cmakedefine HAVE_SYS_EPOLL_H "@HAVE_SYS_EPOLL_H@"
+
+/* Define to 1 if you have the <sys/eventfd.h> header file. */
+#cmakedefine HAVE_SYS_EVENTFD_H "@HAVE_SYS_EVENTFD_H@"
+
+/* Define to 1 if you have pthreads. */
+#cmakedefine HAVE_PTHREAD "@HAVE_PTHREAD@"
+
 /* Define to 1 if you have the <sys/socket.h> header file. */
 #cmakedefine HAVE_SYS_SOCKET_H "@HAVE_SYS_SOCKET_H@"
 
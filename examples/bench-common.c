@@ -0,0 +1,651 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench-common.h"
+
+#define PAD_TO_64BIT(len) ((len + 0x07) & 0xfffffff8)
+
+#define MAX_HANDLES 1024
+
+/* the server API takes directory entries at this stride */
+#define DIR_INFO_SIZE \
+        PAD_TO_64BIT(sizeof(struct smb2_fileidbothdirectoryinformation))
+#define DIR_INFO(i) \
+        ((struct smb2_fileidbothdirectoryinformation *)(dir_info + (i) * DIR_INFO_SIZE))
+
+const char *bench_mode_names[BENCH_NUM_MODES] = {
+        "plain",
+        "signed",
+        "sealed",
+};
+
+uint64_t bench_file_size = 16 * 1024 * 1024;
+int bench_dir_entries = 256;
+
+/*
+ * Server side
+ *
+ * The file id of a handle is its index in the handle table.
+ */
+enum bench_object {
+        OBJ_DATA,
+        OBJ_DIR,
+        OBJ_ENTRY,
+};
+
+struct bench_handle {
+        int used;
+        enum bench_object obj;
+        int dir_pos;
+};
+
+static char (*entry_names)[16];
+static uint8_t *dir_info;
+static struct bench_handle handles[MAX_HANDLES];
+static enum bench_mode server_mode;
+
+static struct bench_handle *find_handle(const smb2_file_id file_id)
+{
+        uint32_t idx;
+
+        memcpy(&idx, file_id, sizeof(idx));
+        if (idx >= MAX_HANDLES || !handles[idx].used) {
+                return NULL;
+        }
+        return &handles[idx];
+}
+
+static int lookup(const char *name, enum bench_object *obj)
+{
+        char *end;
+        long n;
+
+        if (!strcmp(name, "data")) {
+                *obj = OBJ_DATA;
+                return 0;
+        }
+        if (!strcmp(name, "dir") || name[0] == '\0') {
+                *obj = OBJ_DIR;
+                return 0;
+        }
+        if (!strncmp(name, "dir\\f", 5)) {
+                n = strtol(name + 5, &end, 10);
+                if (*end == '\0' && n >= 0 && n < bench_dir_entries) {
+                        *obj = OBJ_ENTRY;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+static uint64_t object_size(enum bench_object obj)
+{
+        return obj == OBJ_DATA ? bench_file_size : 0;
+}
+
+static uint32_t object_attributes(enum bench_object obj)
+{
+        return obj == OBJ_DIR ? SMB2_FILE_ATTRIBUTE_DIRECTORY :
+                SMB2_FILE_ATTRIBUTE_ARCHIVE;
+}
+
+static int authorize_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                             const char *user,
+                             const char *domain,
+                             const char *workstation)
+{
+        /* the password gives the session a key to sign and seal with */
+        smb2_set_user(smb2, user ? user : BENCH_USER);
+        smb2_set_password(smb2, BENCH_PASSWORD);
+        return 0;
+}
+
+static int session_handler(struct smb2_server *srvr, struct smb2_context *smb2)
+{
+        return 0;
+}
+
+static int logoff_handler(struct smb2_server *srvr, struct smb2_context *smb2)
+{
+        return 0;
+}
+
+static int tree_connect_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                                struct smb2_tree_connect_request *req,
+                                struct smb2_tree_connect_reply *rep)
+{
+        rep->share_type = SMB2_SHARE_TYPE_DISK;
+        rep->maximal_access = 0x101f01ff;
+        rep->share_flags = 0;
+        rep->capabilities = 0;
+
+        return 0;
+}
+
+static int tree_disconnect_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                                   const uint32_t tree_id)
+{
+        return 0;
+}
+
+static int create_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                          struct smb2_create_request *req,
+                          struct smb2_create_reply *rep)
+{
+        enum bench_object obj;
+        uint32_t idx;
+
+        if (lookup(req->name ? req->name : "", &obj) < 0) {
+                return -1;
+        }
+        for (idx = 0; idx < MAX_HANDLES; idx++) {
+                if (!handles[idx].used) {
+                        break;
+                }
+        }
+        if (idx == MAX_HANDLES) {
+                return -1;
+        }
+        handles[idx].used = 1;
+        handles[idx].obj = obj;
+        handles[idx].dir_pos = 0;
+
+        rep->create_action = 1; /* FILE_OPENED */
+        rep->file_attributes = object_attributes(obj);
+        rep->end_of_file = object_size(obj);
+        rep->allocation_size = object_size(obj);
+        memset(rep->file_id, 0, SMB2_FD_SIZE);
+        memcpy(rep->file_id, &idx, sizeof(idx));
+
+        return 0;
+}
+
+static int close_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                         struct smb2_close_request *req,
+                         struct smb2_close_reply *rep)
+{
+        struct bench_handle *h = find_handle(req->file_id);
+
+        if (h == NULL) {
+                return -1;
+        }
+        memset(rep, 0, sizeof(*rep));
+        if (req->flags & SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB) {
+                rep->flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
+                rep->file_attributes = object_attributes(h->obj);
+                rep->end_of_file = object_size(h->obj);
+                rep->allocation_size = object_size(h->obj);
+        }
+        h->used = 0;
+
+        return 0;
+}
+
+static int flush_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                         struct smb2_flush_request *req)
+{
+        return 0;
+}
+
+static int read_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                        struct smb2_read_request *req,
+                        struct smb2_read_reply *rep)
+{
+        struct bench_handle *h = find_handle(req->file_id);
+        uint64_t len = 0;
+
+        if (h == NULL || h->obj == OBJ_DIR) {
+                return -1;
+        }
+        if (h->obj == OBJ_DATA && req->offset < bench_file_size) {
+                len = bench_file_size - req->offset;
+                if (len > req->length) {
+                        len = req->length;
+                }
+        }
+        memset(rep, 0, sizeof(*rep));
+        if (len) {
+                /* freed by the library once the reply has been sent */
+                rep->data = malloc(len);
+                if (rep->data == NULL) {
+                        return -1;
+                }
+                memset(rep->data, 0x5a, len);
+        }
+        rep->data_length = (uint32_t)len;
+
+        return 0;
+}
+
+static int write_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                         struct smb2_write_request *req,
+                         struct smb2_write_reply *rep)
+{
+        struct bench_handle *h = find_handle(req->file_id);
+        uint64_t len = 0;
+
+        if (h == NULL || h->obj != OBJ_DATA) {
+                return -1;
+        }
+        /* the file does not grow */
+        if (req->offset < bench_file_size) {
+                len = bench_file_size - req->offset;
+                if (len > req->length) {
+                        len = req->length;
+                }
+        }
+        rep->count = (uint32_t)len;
+        rep->remaining = 0;
+
+        return 0;
+}
+
+static int ioctl_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                         struct smb2_ioctl_request *req,
+                         struct smb2_ioctl_reply *rep)
+{
+        memset(rep, 0, sizeof(*rep));
+        rep->ctl_code = req->ctl_code;
+        memcpy(rep->file_id, req->file_id, SMB2_FD_SIZE);
+
+        switch(rep->ctl_code) {
+        case SMB2_FSCTL_VALIDATE_NEGOTIATE_INFO:
+                break;
+        default:
+                /* copychunk is left to the library */
+                return -1;
+        }
+        return 0;
+}
+
+static int echo_handler(struct smb2_server *srvr, struct smb2_context *smb2)
+{
+        return 0;
+}
+
+static int query_directory_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                                   struct smb2_query_directory_request *req,
+                                   struct smb2_query_directory_reply *rep)
+{
+        struct bench_handle *h = find_handle(req->file_id);
+        uint32_t used = 0, size;
+        int n = 0;
+
+        if (h == NULL || h->obj != OBJ_DIR) {
+                return -1;
+        }
+        if (req->flags & (SMB2_RESTART_SCANS | SMB2_REOPEN)) {
+                h->dir_pos = 0;
+        }
+        /* as many entries as the client has room for */
+        while (h->dir_pos + n < bench_dir_entries) {
+                size = PAD_TO_64BIT(SMB2_FILEID_BOTH_DIRECTORY_INFORMATION_SIZE +
+                                    2 * strlen(DIR_INFO(h->dir_pos + n)->name));
+                if (used + size > req->output_buffer_length) {
+                        break;
+                }
+                used += size;
+                n++;
+                if (req->flags & SMB2_RETURN_SINGLE_ENTRY) {
+                        break;
+                }
+        }
+
+        /* the library encodes the entries, the array stays ours */
+        rep->output_buffer = (uint8_t *)DIR_INFO(h->dir_pos);
+        rep->output_buffer_length = n * DIR_INFO_SIZE;
+        h->dir_pos += n;
+
+        return 0;
+}
+
+static int query_info_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                              struct smb2_query_info_request *req,
+                              struct smb2_query_info_reply *rep)
+{
+        /* encoded into the reply before this returns, so static is fine */
+        static struct smb2_file_all_info all;
+        static struct smb2_file_network_open_info nopen;
+        struct bench_handle *h = find_handle(req->file_id);
+
+        if (h == NULL || req->info_type != SMB2_0_INFO_FILE) {
+                return -1;
+        }
+
+        memset(&all, 0, sizeof(all));
+        all.basic.file_attributes = object_attributes(h->obj);
+        all.standard.allocation_size = object_size(h->obj);
+        all.standard.end_of_file = object_size(h->obj);
+        all.standard.number_of_links = 1;
+        all.standard.directory = h->obj == OBJ_DIR;
+        all.index_number = h - handles;
+        all.access_flags = 0x001f01ff;
+
+        switch (req->file_info_class) {
+        case SMB2_FILE_ALL_INFORMATION:
+                rep->output_buffer = (uint8_t *)&all;
+                rep->output_buffer_length = sizeof(all);
+                break;
+        case SMB2_FILE_BASIC_INFORMATION:
+                rep->output_buffer = (uint8_t *)&all.basic;
+                rep->output_buffer_length = sizeof(all.basic);
+                break;
+        case SMB2_FILE_STANDARD_INFORMATION:
+                rep->output_buffer = (uint8_t *)&all.standard;
+                rep->output_buffer_length = sizeof(all.standard);
+                break;
+        case SMB2_FILE_NETWORK_OPEN_INFORMATION:
+                memset(&nopen, 0, sizeof(nopen));
+                nopen.allocation_size = object_size(h->obj);
+                nopen.end_of_file = object_size(h->obj);
+                nopen.file_attributes = object_attributes(h->obj);
+                rep->output_buffer = (uint8_t *)&nopen;
+                rep->output_buffer_length = sizeof(nopen);
+                break;
+        default:
+                return -1;
+        }
+        return 0;
+}
+
+static struct smb2_server_request_handlers share_handlers = {
+        NULL,
+        authorize_handler,
+        session_handler,
+        logoff_handler,
+        tree_connect_handler,
+        tree_disconnect_handler,
+        create_handler,
+        close_handler,
+        flush_handler,
+        read_handler,
+        write_handler,
+        NULL,
+        NULL,
+        NULL,
+        ioctl_handler,
+        NULL,
+        echo_handler,
+        query_directory_handler,
+        NULL,
+        query_info_handler,
+        NULL
+};
+
+void bench_session_handlers(struct smb2_server_request_handlers *handlers)
+{
+        handlers->authorize_user = authorize_handler;
+        handlers->session_established = session_handler;
+        handlers->logoff_cmd = logoff_handler;
+        handlers->tree_connect_cmd = tree_connect_handler;
+        handlers->tree_disconnect_cmd = tree_disconnect_handler;
+        handlers->ioctl_cmd = ioctl_handler;
+        handlers->echo_cmd = echo_handler;
+}
+
+static void on_new_client(struct smb2_context *smb2, void *cb_data)
+{
+        smb2_set_version(smb2, SMB2_VERSION_ANY);
+        if (server_mode == BENCH_SEALED) {
+                smb2_set_seal(smb2, 1);
+        }
+}
+
+static void run_server(const struct bench_server *bs)
+{
+        struct smb2_server server;
+        int err, i;
+
+        if (bs->handlers == NULL) {
+                entry_names = calloc(bench_dir_entries, sizeof(*entry_names));
+                dir_info = calloc(bench_dir_entries, DIR_INFO_SIZE);
+                if (entry_names == NULL || dir_info == NULL) {
+                        exit(1);
+                }
+                for (i = 0; i < bench_dir_entries; i++) {
+                        snprintf(entry_names[i], sizeof(entry_names[i]),
+                                 "f%05d", i);
+                        DIR_INFO(i)->file_index = i;
+                        DIR_INFO(i)->file_id = i + 1;
+                        DIR_INFO(i)->file_attributes =
+                                SMB2_FILE_ATTRIBUTE_ARCHIVE;
+                        DIR_INFO(i)->name = entry_names[i];
+                }
+        }
+        server_mode = bs->mode;
+
+        memset(&server, 0, sizeof(server));
+        server.handlers = bs->handlers ? bs->handlers : &share_handlers;
+        /* only signs if the client requires it */
+        server.signing_enabled = 1;
+        server.allow_anonymous = 1;
+        server.port = bs->port;
+        server.max_read_size = bs->max_read_size;
+        server.copychunk_max_chunks = bs->copychunk_max_chunks;
+        server.copychunk_max_chunk_size = bs->copychunk_max_chunk_size;
+        server.copychunk_max_total_size = bs->copychunk_max_total_size;
+
+        err = smb2_serve_port(&server, bs->max_connections, on_new_client,
+                              NULL);
+        exit(err ? 1 : 0);
+}
+
+/* The client must not end up benchmarking some other server */
+static int port_in_use(uint16_t port)
+{
+        struct sockaddr_in sin;
+        int fd, rc;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+                return 0;
+        }
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        rc = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+        close(fd);
+
+        return rc == 0;
+}
+
+pid_t bench_start_server(const struct bench_server *server)
+{
+        pid_t pid;
+
+        if (port_in_use(server->port)) {
+                fprintf(stderr, "Port %d is already in use\n", server->port);
+                return -1;
+        }
+
+        /* or the child prints what is buffered as well */
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+                perror("fork");
+                return -1;
+        }
+        if (pid == 0) {
+                run_server(server);
+        }
+        return pid;
+}
+
+void bench_stop_server(pid_t pid)
+{
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+}
+
+/*
+ * Client side
+ */
+struct smb2_context *bench_connect(pid_t pid, uint16_t port,
+                                   enum bench_mode mode,
+                                   int (*setup)(struct smb2_context *smb2))
+{
+        struct smb2_context *smb2;
+        siginfo_t info;
+        char server[64];
+        int i;
+
+        snprintf(server, sizeof(server), "127.0.0.1:%d", port);
+        for (i = 0; i < 50; i++) {
+                memset(&info, 0, sizeof(info));
+                waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT);
+                if (info.si_pid == pid) {
+                        fprintf(stderr, "The benchmark server failed to "
+                                "start\n");
+                        return NULL;
+                }
+                smb2 = smb2_init_context();
+                if (smb2 == NULL) {
+                        return NULL;
+                }
+                smb2_set_user(smb2, BENCH_USER);
+                smb2_set_password(smb2, BENCH_PASSWORD);
+                switch (mode) {
+                case BENCH_PLAIN:
+                        smb2_set_security_mode(smb2, 0);
+                        break;
+                case BENCH_SIGNED:
+                        smb2_set_security_mode(smb2,
+                                SMB2_NEGOTIATE_SIGNING_REQUIRED);
+                        break;
+                case BENCH_SEALED:
+                        smb2_set_security_mode(smb2, 0);
+                        smb2_set_version(smb2, SMB2_VERSION_ANY3);
+                        smb2_set_seal(smb2, 1);
+                        break;
+                default:
+                        break;
+                }
+                if (setup && setup(smb2) < 0) {
+                        fprintf(stderr, "%s\n", smb2_get_error(smb2));
+                        smb2_destroy_context(smb2);
+                        return NULL;
+                }
+                if (smb2_connect_share(smb2, server, "bench", NULL) == 0) {
+                        return smb2;
+                }
+                if (i == 49) {
+                        fprintf(stderr, "Failed to connect to the benchmark "
+                                "server: %s\n", smb2_get_error(smb2));
+                }
+                smb2_destroy_context(smb2);
+                /* give the server time to start listening */
+                usleep(100000);
+        }
+        return NULL;
+}
+
+double bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t bench_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double bench_cpu_time(void)
+{
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+double bench_end_time;
+uint64_t bench_reads_done;
+uint64_t bench_bytes_done;
+int bench_reads_in_flight;
+int bench_error;
+
+static void read_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct bench_read *br = private_data;
+
+        br->stream->in_flight--;
+        bench_reads_in_flight--;
+        if (status < 0) {
+                fprintf(stderr, "read failed: %s\n", smb2_get_error(smb2));
+                bench_error = 1;
+                return;
+        }
+        bench_reads_done++;
+        bench_bytes_done += status;
+        bench_issue_read(br);
+}
+
+void bench_issue_read(struct bench_read *br)
+{
+        struct bench_stream *s = br->stream;
+        uint32_t count = s->block;
+
+        if (bench_error || (bench_end_time && bench_now() >= bench_end_time)) {
+                return;
+        }
+        if (s->next >= bench_file_size) {
+                if (!bench_end_time) {
+                        return;
+                }
+                s->next = 0;
+        }
+        if (count > bench_file_size - s->next) {
+                count = (uint32_t)(bench_file_size - s->next);
+        }
+        if (smb2_pread_async(s->smb2, s->fh, br->buf, count, s->next,
+                             read_cb, br) < 0) {
+                fprintf(stderr, "pread failed: %s\n",
+                        smb2_get_error(s->smb2));
+                bench_error = 1;
+                return;
+        }
+        s->next += count;
+        s->in_flight++;
+        bench_reads_in_flight++;
+}
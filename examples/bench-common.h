@@ -0,0 +1,117 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BENCH_COMMON_H_
+#define _BENCH_COMMON_H_
+
+/*
+ * What the benchmarks have in common: a server, built on
+ * smb2_serve_port(), that is forked and serves a share without any
+ * backing storage, connecting to it over loopback and timing.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+
+#define BENCH_USER     "bench"
+#define BENCH_PASSWORD "bench"
+
+enum bench_mode {
+        BENCH_PLAIN,
+        BENCH_SIGNED,
+        BENCH_SEALED,
+        BENCH_NUM_MODES
+};
+
+extern const char *bench_mode_names[BENCH_NUM_MODES];
+
+/*
+ * The default share has the file "data", the directory "dir" and the
+ * empty files "dir/f00000" ... in it. Reads of "data" return 0x5a bytes
+ * and writes to it are dropped, so it can be larger than memory.
+ */
+extern uint64_t bench_file_size;
+extern int bench_dir_entries;
+
+struct bench_server {
+        uint16_t port;
+        enum bench_mode mode;
+        int max_connections;
+        /* 0 for the default of the library */
+        uint32_t max_read_size;
+        /* 0 for the defaults of the library */
+        uint32_t copychunk_max_chunks;
+        uint32_t copychunk_max_chunk_size;
+        uint32_t copychunk_max_total_size;
+        /* NULL for the default share */
+        struct smb2_server_request_handlers *handlers;
+};
+
+/* Fills in the handlers that let a session in and connect to any share,
+ * for benchmarks that serve a share of their own.
+ */
+void bench_session_handlers(struct smb2_server_request_handlers *handlers);
+
+/* Returns the pid of the server or -1 */
+pid_t bench_start_server(const struct bench_server *server);
+void bench_stop_server(pid_t pid);
+
+/* Connects to the share of the server pid listens on port for. setup is
+ * called for each new context before it connects, unless NULL.
+ */
+struct smb2_context *bench_connect(pid_t pid, uint16_t port,
+                                   enum bench_mode mode,
+                                   int (*setup)(struct smb2_context *smb2));
+
+double bench_now(void);
+uint64_t bench_now_ns(void);
+/* CPU time used by the process, in seconds */
+double bench_cpu_time(void);
+
+/*
+ * Reads of a file on the server with a number of them in flight. The
+ * reads of a stream are sequential. They stop at the end of the file, or
+ * if bench_end_time is set, go on from the start until then.
+ */
+struct bench_stream {
+        struct smb2_context *smb2;
+        struct smb2fh *fh;
+        uint32_t block;
+        uint64_t next;
+        int in_flight;
+};
+
+struct bench_read {
+        struct bench_stream *stream;
+        uint8_t *buf;
+};
+
+extern double bench_end_time;
+extern uint64_t bench_reads_done;
+extern uint64_t bench_bytes_done;
+extern int bench_reads_in_flight;
+extern int bench_error;
+
+/* Issues the next read, which issues the one after it when it completes */
+void bench_issue_read(struct bench_read *br);
+
+#endif /* !_BENCH_COMMON_H_ */
@@ -0,0 +1,129 @@
+/* -*-  mode:c++; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * smb2-cat-async written with the C++20 coroutine layer.
+ *
+ * Reads the file in chunks with up to <depth> reads in flight and writes
+ * them to stdout in order.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <smb2/libsmb2-coro.hpp>
+
+#define CHUNK (64 * 1024)
+
+static void usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-cat-coro [-d <depth>] <smb2-url>\n\n"
+                "URL format: "
+                "smb://[<domain;][<username>@]<host>[:<port>]/<share>/<path>\n");
+        exit(1);
+}
+
+static smb2::task<std::vector<uint8_t>>
+read_chunk(const smb2::file &f, uint64_t offset)
+{
+        std::vector<uint8_t> buf(CHUNK);
+        uint32_t count;
+
+        count = co_await f.pread(buf.data(), CHUNK, offset);
+        buf.resize(count);
+        co_return buf;
+}
+
+static smb2::task<>
+cat(struct smb2_context *smb2, struct smb2_url *url, int depth)
+{
+        co_await smb2::connect_share(smb2, url->server, url->share,
+                                     url->user ? url->user : "");
+
+        smb2::file f = co_await smb2::open(smb2, url->path, O_RDONLY);
+        struct smb2_stat_64 st = co_await f.fstat();
+
+        for (uint64_t offset = 0; offset < st.smb2_size; ) {
+                std::vector<smb2::task<std::vector<uint8_t>>> reads;
+
+                for (int i = 0; i < depth && offset < st.smb2_size; i++) {
+                        reads.push_back(read_chunk(f, offset));
+                        offset += CHUNK;
+                }
+                for (auto &buf : co_await smb2::when_all(std::move(reads))) {
+                        if (write(STDOUT_FILENO, buf.data(), buf.size()) < 0) {
+                                co_return;
+                        }
+                }
+        }
+
+        co_await f.close();
+        co_await smb2::disconnect_share(smb2);
+}
+
+int main(int argc, char *argv[])
+{
+        struct smb2_context *smb2;
+        struct smb2_url *url;
+        int depth = 8;
+        int opt, rc = 0;
+
+        while ((opt = getopt(argc, argv, "d:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        depth = atoi(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind >= argc || depth <= 0) {
+                usage();
+        }
+
+        smb2 = smb2_init_context();
+        if (smb2 == NULL) {
+                fprintf(stderr, "Failed to init context\n");
+                exit(0);
+        }
+
+        url = smb2_parse_url(smb2, argv[optind]);
+        if (url == NULL) {
+                fprintf(stderr, "Failed to parse url: %s\n",
+                        smb2_get_error(smb2));
+                exit(0);
+        }
+
+        smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+        try {
+                smb2::sync_wait(smb2, cat(smb2, url, depth));
+        } catch (const smb2::error &e) {
+                fprintf(stderr, "smb2-cat-coro failed: %s\n", e.what());
+                rc = 10;
+        }
+
+        smb2_destroy_url(url);
+        smb2_destroy_context(smb2);
+
+        return rc;
+}
@@ -0,0 +1,540 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Loopback benchmark for the client and the server.
+ *
+ * Forks a server, built on smb2_serve_port(), that keeps its share in
+ * memory and runs a set of workloads against it over localhost with the
+ * async API, with a fixed number of commands in flight:
+ *
+ *   echo      : SMB2 ECHO, the cost of a round trip
+ *   seqread   : sequential reads of the file "data"
+ *   seqwrite  : sequential writes to "data"
+ *   randread  : reads at random offsets in "data"
+ *   randwrite : writes at random offsets in "data"
+ *   stat      : smb2_stat_async(), a compound of create, query info
+ *               and close
+ *   openclose : smb2_open_async() followed by smb2_close_async()
+ *   readdir   : smb2_opendir_async() of the directory "dir"
+ *   copy      : smb2_copy_range_async() of all of "data" onto itself.
+ *               The server's copychunk limits are below the ones the
+ *               client starts with, so the limits are negotiated on
+ *               the first copy while several requests are in flight.
+ *
+ * Each workload is run with the connection unsigned, signed and sealed,
+ * and a fresh server is forked for each of these. The results are printed
+ * to stdout as CSV so that they can be compared between builds.
+ *
+ * As nothing but libsmb2 is involved this shows where the time goes in
+ * the hot paths of the library, on both sides, without a Samba server.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "bench-common.h"
+
+struct bench_slot {
+        uint64_t start;
+        uint8_t *buf;
+        struct smb2_stat_64 st;
+        char path[32];
+};
+
+struct bench_test {
+        const char *name;
+        int (*issue)(struct bench_slot *slot);
+        int has_data;
+        int random;
+};
+
+static struct smb2_context *client;
+static struct smb2fh *data_fh;
+static const struct bench_test *test;
+static uint32_t block_size;
+static uint64_t next_offset;
+static uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t end_time;
+static uint64_t ops_done;
+static uint64_t bytes_done;
+static int ops_in_flight;
+
+static uint64_t *latencies;
+static uint64_t num_latencies;
+static uint64_t max_latencies;
+
+static uint64_t next_random(void)
+{
+        rand_state ^= rand_state << 13;
+        rand_state ^= rand_state >> 7;
+        rand_state ^= rand_state << 17;
+        return rand_state;
+}
+
+static uint64_t next_io_offset(void)
+{
+        uint64_t offset;
+
+        if (test->random) {
+                return next_random() % (bench_file_size / block_size) * block_size;
+        }
+        if (next_offset + block_size > bench_file_size) {
+                next_offset = 0;
+        }
+        offset = next_offset;
+        next_offset += block_size;
+        return offset;
+}
+
+static const char *next_entry(struct bench_slot *slot)
+{
+        snprintf(slot->path, sizeof(slot->path), "dir/f%05d",
+                 (int)(next_random() % bench_dir_entries));
+        return slot->path;
+}
+
+static void start_op(struct bench_slot *slot);
+
+static void op_done(struct bench_slot *slot, uint64_t bytes)
+{
+        uint64_t *l;
+
+        ops_in_flight--;
+        if (num_latencies == max_latencies) {
+                max_latencies = max_latencies ? max_latencies * 2 : 65536;
+                l = realloc(latencies, max_latencies * sizeof(uint64_t));
+                if (l == NULL) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        bench_error = 1;
+                        return;
+                }
+                latencies = l;
+        }
+        latencies[num_latencies++] = bench_now_ns() - slot->start;
+        ops_done++;
+        bytes_done += bytes;
+        start_op(slot);
+}
+
+static void op_failed(const char *op, int status)
+{
+        fprintf(stderr, "%s failed: %s (%s)\n", op, strerror(-status),
+                smb2_get_error(client));
+        bench_error = 1;
+}
+
+static void op_cb(struct smb2_context *smb2, int status,
+                  void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+
+        if (status < 0) {
+                ops_in_flight--;
+                op_failed(test->name, status);
+                return;
+        }
+        op_done(slot, test->has_data ? (uint64_t)status : 0);
+}
+
+static int issue_echo(struct bench_slot *slot)
+{
+        return smb2_echo_async(client, op_cb, slot);
+}
+
+static int issue_read(struct bench_slot *slot)
+{
+        return smb2_pread_async(client, data_fh, slot->buf, block_size,
+                                next_io_offset(), op_cb, slot);
+}
+
+static int issue_write(struct bench_slot *slot)
+{
+        return smb2_pwrite_async(client, data_fh, slot->buf, block_size,
+                                 next_io_offset(), op_cb, slot);
+}
+
+static int issue_stat(struct bench_slot *slot)
+{
+        return smb2_stat_async(client, next_entry(slot), &slot->st,
+                               op_cb, slot);
+}
+
+static void open_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+        int rc;
+
+        if (status < 0) {
+                ops_in_flight--;
+                op_failed("open", status);
+                return;
+        }
+        rc = smb2_close_async(smb2, command_data, op_cb, slot);
+        if (rc < 0) {
+                ops_in_flight--;
+                op_failed("close", rc);
+        }
+}
+
+static int issue_openclose(struct bench_slot *slot)
+{
+        return smb2_open_async(client, next_entry(slot), O_RDONLY,
+                               open_cb, slot);
+}
+
+/* The smb2dir owns its cb_data and frees it, so it gets one of these */
+struct opendir_data {
+        struct bench_slot *slot;
+};
+
+static void opendir_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *private_data)
+{
+        struct opendir_data *od = private_data;
+        struct bench_slot *slot = od->slot;
+        struct smb2dir *dir = command_data;
+        int n = 0;
+
+        if (status < 0) {
+                ops_in_flight--;
+                op_failed("opendir", status);
+                return;
+        }
+        while (smb2_readdir(smb2, dir) != NULL) {
+                n++;
+        }
+        smb2_closedir(smb2, dir);
+        if (n != bench_dir_entries) {
+                ops_in_flight--;
+                fprintf(stderr, "readdir returned %d entries, expected %d\n",
+                        n, bench_dir_entries);
+                bench_error = 1;
+                return;
+        }
+        op_done(slot, 0);
+}
+
+static int issue_readdir(struct bench_slot *slot)
+{
+        struct opendir_data *od;
+        int rc;
+
+        od = malloc(sizeof(struct opendir_data));
+        if (od == NULL) {
+                return -ENOMEM;
+        }
+        od->slot = slot;
+        rc = smb2_opendir_async(client, "dir", opendir_cb, od);
+        if (rc < 0) {
+                free(od);
+        }
+        return rc;
+}
+
+static void copy_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+
+        if (status < 0) {
+                ops_in_flight--;
+                op_failed("copy", status);
+                return;
+        }
+        op_done(slot, bench_file_size);
+}
+
+static int issue_copy(struct bench_slot *slot)
+{
+        return smb2_copy_range_async(client, data_fh, 0, data_fh, 0,
+                                     bench_file_size, copy_cb, slot);
+}
+
+static const struct bench_test tests[] = {
+        { "echo",      issue_echo,      0, 0 },
+        { "seqread",   issue_read,      1, 0 },
+        { "seqwrite",  issue_write,     1, 0 },
+        { "randread",  issue_read,      1, 1 },
+        { "randwrite", issue_write,     1, 1 },
+        { "stat",      issue_stat,      0, 0 },
+        { "openclose", issue_openclose, 0, 0 },
+        { "readdir",   issue_readdir,   0, 0 },
+        { "copy",      issue_copy,      0, 0 },
+};
+
+#define NUM_TESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+static void start_op(struct bench_slot *slot)
+{
+        int rc;
+
+        if (bench_error || bench_now_ns() >= end_time) {
+                return;
+        }
+        slot->start = bench_now_ns();
+        rc = test->issue(slot);
+        if (rc < 0) {
+                op_failed(test->name, rc);
+                return;
+        }
+        ops_in_flight++;
+}
+
+static int event_loop(void)
+{
+        struct pollfd pfd;
+
+        while (ops_in_flight > 0 && !bench_error) {
+                pfd.fd = smb2_get_fd(client);
+                pfd.events = smb2_which_events(client);
+                pfd.revents = 0;
+                if (poll(&pfd, 1, 1000) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        fprintf(stderr, "Poll failed\n");
+                        return -1;
+                }
+                if (pfd.revents == 0) {
+                        continue;
+                }
+                if (smb2_service(client, pfd.revents) < 0) {
+                        fprintf(stderr, "smb2_service failed with : %s\n",
+                                smb2_get_error(client));
+                        return -1;
+                }
+        }
+        return bench_error ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double p)
+{
+        uint64_t idx = (uint64_t)(p * (num_latencies - 1) + 0.5);
+
+        return latencies[idx] / 1000.0;
+}
+
+static int run_test(const struct bench_test *t, enum bench_mode mode,
+                    struct bench_slot *slots, int depth, double seconds,
+                    uint32_t seq_bs, uint32_t rand_bs)
+{
+        uint64_t start;
+        double secs;
+        int i;
+
+        test = t;
+        block_size = t->random ? rand_bs : seq_bs;
+        next_offset = 0;
+        ops_done = bytes_done = 0;
+        num_latencies = 0;
+
+        start = bench_now_ns();
+        end_time = start + (uint64_t)(seconds * 1e9);
+        for (i = 0; i < depth; i++) {
+                start_op(&slots[i]);
+        }
+        if (event_loop() < 0) {
+                return -1;
+        }
+        secs = (bench_now_ns() - start) / 1e9;
+        if (ops_done == 0) {
+                fprintf(stderr, "%s: no operations completed\n", t->name);
+                return -1;
+        }
+        qsort(latencies, num_latencies, sizeof(uint64_t), cmp_u64);
+
+        printf("%s,%s,%u,%d,%" PRIu64 ",%.3f,%.2f,%.0f,%.1f,%.1f,%.1f\n",
+               t->name, bench_mode_names[mode], t->has_data ? block_size : 0,
+               depth, ops_done, secs, bytes_done / secs / (1024 * 1024),
+               ops_done / secs,
+               percentile_us(0.50), percentile_us(0.99),
+               percentile_us(1.0));
+        fflush(stdout);
+        return 0;
+}
+
+static int run_mode(enum bench_mode mode, uint16_t port,
+                    const char *only, struct bench_slot *slots, int depth,
+                    double seconds, uint32_t seq_bs, uint32_t rand_bs)
+{
+        struct bench_server server;
+        pid_t pid;
+        int i, rc = 0;
+
+        memset(&server, 0, sizeof(server));
+        server.port = port;
+        server.mode = mode;
+        server.max_connections = 16;
+        server.copychunk_max_chunks = 8;
+        server.copychunk_max_chunk_size = 256 * 1024;
+        server.copychunk_max_total_size = 2 * 1024 * 1024;
+        pid = bench_start_server(&server);
+        if (pid < 0) {
+                return -1;
+        }
+
+        client = bench_connect(pid, port, mode, NULL);
+        if (client == NULL) {
+                rc = -1;
+                goto finished;
+        }
+        smb2_set_timeout(client, 60);
+        data_fh = smb2_open(client, "data", O_RDWR);
+        if (data_fh == NULL) {
+                fprintf(stderr, "open failed: %s\n", smb2_get_error(client));
+                rc = -1;
+                goto finished;
+        }
+
+        for (i = 0; i < NUM_TESTS && rc == 0; i++) {
+                if (only && !strstr(only, tests[i].name)) {
+                        continue;
+                }
+                rc = run_test(&tests[i], mode, slots, depth, seconds,
+                              seq_bs, rand_bs);
+        }
+
+ finished:
+        if (client != NULL) {
+                if (data_fh != NULL && rc == 0) {
+                        smb2_close(client, data_fh);
+                }
+                data_fh = NULL;
+                if (rc == 0) {
+                        smb2_disconnect_share(client);
+                }
+                smb2_destroy_context(client);
+                client = NULL;
+        }
+        bench_stop_server(pid);
+        return rc;
+}
+
+static int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-loopback-bench [-p port] [-q depth] [-t seconds] "
+                "[-b seq-block-size] [-r rand-block-size] [-s file-size-MiB] "
+                "[-n dir-entries] [-m plain,signed,sealed] [-T tests]\n\n"
+                "Tests: echo, seqread, seqwrite, randread, randwrite, "
+                "stat, openclose, readdir, copy\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct bench_slot *slots;
+        const char *modes = NULL, *only = NULL;
+        uint16_t port = 44540;
+        uint32_t seq_bs = 64 * 1024, rand_bs = 4096;
+        double seconds = 2;
+        int depth = 16;
+        int c, i, rc = 0;
+
+        /* large enough for the first copy to have several requests out */
+        bench_file_size = 64 * 1024 * 1024;
+
+        while ((c = getopt(argc, argv, "p:q:t:b:r:s:n:m:T:")) != -1) {
+                switch (c) {
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 'q':
+                        depth = atoi(optarg);
+                        break;
+                case 't':
+                        seconds = atof(optarg);
+                        break;
+                case 'b':
+                        seq_bs = atoi(optarg);
+                        break;
+                case 'r':
+                        rand_bs = atoi(optarg);
+                        break;
+                case 's':
+                        bench_file_size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+                        break;
+                case 'n':
+                        bench_dir_entries = atoi(optarg);
+                        break;
+                case 'm':
+                        modes = optarg;
+                        break;
+                case 'T':
+                        only = optarg;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (depth < 1 || seconds <= 0 || seq_bs < 1 || rand_bs < 1 ||
+            seq_bs > bench_file_size || rand_bs > bench_file_size ||
+            bench_dir_entries < 1 || bench_dir_entries > 99999) {
+                usage();
+        }
+
+        slots = calloc(depth, sizeof(struct bench_slot));
+        if (slots == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+        }
+        for (i = 0; i < depth; i++) {
+                slots[i].buf = malloc(seq_bs > rand_bs ? seq_bs : rand_bs);
+                if (slots[i].buf == NULL) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                }
+                memset(slots[i].buf, 0xa5, seq_bs > rand_bs ? seq_bs : rand_bs);
+        }
+
+        printf("test,mode,bs,qd,ops,seconds,MiB/s,IOPS,"
+               "p50_us,p99_us,max_us\n");
+        for (i = 0; i < BENCH_NUM_MODES && rc == 0; i++) {
+                if (modes && !strstr(modes, bench_mode_names[i])) {
+                        continue;
+                }
+                rc = run_mode(i, port, only, slots, depth, seconds,
+                              seq_bs, rand_bs);
+        }
+
+        for (i = 0; i < depth; i++) {
+                free(slots[i].buf);
+        }
+        free(slots);
+        free(latencies);
+
+        return rc < 0 ? 1 : 0;
+}
@@ -0,0 +1,296 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark for the reactor.
+ *
+ * Forks a number of servers, built on smb2_serve_port(), that serve a
+ * single file "data" of synthetic content, and connects many contexts to
+ * them. Every active context keeps small reads in flight for a while, the
+ * other contexts stay idle as most sessions of a busy client would be. This
+ * is done first with
+ * all the contexts polled by the application itself and then with the
+ * contexts in a reactor. Commands have a timeout so both also have to
+ * keep track of the deadlines. For each it prints the reads completed per
+ * second and the CPU time used by the client per read.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "bench-common.h"
+
+#define READ_SIZE 512
+
+static void reactor_error_cb(struct smb2_context *smb2, int status,
+                             void *command_data, void *private_data)
+{
+        fprintf(stderr, "context failed: %s\n", smb2_get_error(smb2));
+        bench_error = 1;
+}
+
+/* Services all the contexts with poll() like most applications do */
+static int poll_loop(struct bench_stream *clients, int num_clients,
+                     uint64_t *wakeups)
+{
+        struct pollfd *pfds;
+        int i, n;
+
+        pfds = calloc(num_clients, sizeof(struct pollfd));
+        if (pfds == NULL) {
+                return -1;
+        }
+        while (bench_reads_in_flight > 0 && !bench_error) {
+                for (i = 0; i < num_clients; i++) {
+                        pfds[i].fd = smb2_get_fd(clients[i].smb2);
+                        pfds[i].events = smb2_which_events(clients[i].smb2);
+                }
+                n = poll(pfds, num_clients, 1000);
+                if (n < 0) {
+                        fprintf(stderr, "Poll failed");
+                        free(pfds);
+                        return -1;
+                }
+                (*wakeups)++;
+                for (i = 0; i < num_clients && n > 0; i++) {
+                        if (pfds[i].revents == 0) {
+                                continue;
+                        }
+                        n--;
+                        if (smb2_service(clients[i].smb2,
+                                         pfds[i].revents) < 0) {
+                                fprintf(stderr, "smb2_service failed with : "
+                                        "%s\n",
+                                        smb2_get_error(clients[i].smb2));
+                                free(pfds);
+                                return -1;
+                        }
+                }
+        }
+        free(pfds);
+        return 0;
+}
+
+static int reactor_loop(struct bench_stream *clients, int num_clients,
+                        uint64_t *wakeups)
+{
+        struct smb2_reactor *reactor;
+        int i, rc = 0;
+
+        reactor = smb2_init_reactor();
+        if (reactor == NULL) {
+                fprintf(stderr, "Failed to create a reactor\n");
+                return -1;
+        }
+        for (i = 0; i < num_clients; i++) {
+                if (smb2_reactor_add(reactor, clients[i].smb2,
+                                     reactor_error_cb, NULL) < 0) {
+                        fprintf(stderr, "Failed to add context: %s\n",
+                                smb2_get_error(clients[i].smb2));
+                        smb2_destroy_reactor(reactor);
+                        return -1;
+                }
+        }
+        while (bench_reads_in_flight > 0 && !bench_error) {
+                if (smb2_reactor_run_once(reactor, 1000) < 0) {
+                        fprintf(stderr, "Reactor failed\n");
+                        rc = -1;
+                        break;
+                }
+                (*wakeups)++;
+        }
+        smb2_destroy_reactor(reactor);
+        return rc;
+}
+
+static int run_bench(struct bench_stream *clients, int num_clients,
+                     struct bench_read *reads, int num_reads, double seconds,
+                     int reactor)
+{
+        uint64_t wakeups = 0;
+        double t, cpu;
+        int i, rc;
+
+        bench_reads_done = 0;
+        bench_end_time = bench_now() + seconds;
+        t = bench_now();
+        cpu = bench_cpu_time();
+        for (i = 0; i < num_reads; i++) {
+                bench_issue_read(&reads[i]);
+        }
+        if (reactor) {
+                rc = reactor_loop(clients, num_clients, &wakeups);
+        } else {
+                rc = poll_loop(clients, num_clients, &wakeups);
+        }
+        t = bench_now() - t;
+        cpu = bench_cpu_time() - cpu;
+        if (rc < 0 || bench_error) {
+                return -1;
+        }
+
+        printf("%-8s : %d contexts, %d in flight, %" PRIu64 " reads in "
+               "%.2f s, %.0f reads/s, %.2f us cpu/read, %.2f reads/wakeup\n",
+               reactor ? "reactor" : "poll", num_clients, num_reads,
+               bench_reads_done, t,
+               bench_reads_done / t, cpu * 1e6 / bench_reads_done,
+               (double)bench_reads_done / wakeups);
+        return 0;
+}
+
+static int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-reactor-bench [-p port] [-n contexts] [-S servers] "
+                "[-a active-contexts] [-d reads-per-context] "
+                "[-t seconds]\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct bench_stream *clients;
+        struct bench_read *reads;
+        struct bench_server server;
+        uint16_t port = 44520;
+        int num_clients = 500;
+        int num_servers = 4;
+        int active = 0;
+        int depth = 1;
+        double seconds = 3;
+        pid_t *pids;
+        int c, i, rc = 0;
+
+        bench_file_size = 1024 * 1024;
+
+        while ((c = getopt(argc, argv, "p:n:S:a:d:t:")) != -1) {
+                switch (c) {
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 'n':
+                        num_clients = atoi(optarg);
+                        break;
+                case 'S':
+                        num_servers = atoi(optarg);
+                        break;
+                case 'a':
+                        active = atoi(optarg);
+                        break;
+                case 'd':
+                        depth = atoi(optarg);
+                        break;
+                case 't':
+                        seconds = atof(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (num_clients < 1 || num_servers < 1 || depth < 1 ||
+            seconds <= 0 || active < 0) {
+                usage();
+        }
+        if (active == 0 || active > num_clients) {
+                active = num_clients;
+        }
+
+        pids = calloc(num_servers, sizeof(pid_t));
+        clients = calloc(num_clients, sizeof(struct bench_stream));
+        reads = calloc(active * depth, sizeof(struct bench_read));
+        if (pids == NULL || clients == NULL || reads == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+        }
+        memset(&server, 0, sizeof(server));
+        server.mode = BENCH_PLAIN;
+        server.max_connections = 1024;
+        for (i = 0; i < num_servers; i++) {
+                server.port = port + i;
+                pids[i] = bench_start_server(&server);
+                if (pids[i] < 0) {
+                        exit(1);
+                }
+        }
+
+        for (i = 0; i < num_clients; i++) {
+                clients[i].smb2 = bench_connect(pids[i % num_servers],
+                                                port + i % num_servers,
+                                                BENCH_PLAIN, NULL);
+                if (clients[i].smb2 == NULL) {
+                        rc = -1;
+                        num_clients = i;
+                        goto finished;
+                }
+                smb2_set_timeout(clients[i].smb2, 60);
+                clients[i].block = READ_SIZE;
+                clients[i].fh = smb2_open(clients[i].smb2, "data", O_RDONLY);
+                if (clients[i].fh == NULL) {
+                        fprintf(stderr, "open failed: %s\n",
+                                smb2_get_error(clients[i].smb2));
+                        rc = -1;
+                        num_clients = i + 1;
+                        goto finished;
+                }
+        }
+        for (i = 0; i < active * depth; i++) {
+                reads[i].stream = &clients[i % active];
+                reads[i].buf = malloc(READ_SIZE);
+                if (reads[i].buf == NULL) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        rc = -1;
+                        goto finished;
+                }
+        }
+
+        rc = run_bench(clients, num_clients, reads, active * depth, seconds,
+                       0);
+        if (rc == 0) {
+                rc = run_bench(clients, num_clients, reads, active * depth,
+                               seconds, 1);
+        }
+
+ finished:
+        for (i = 0; i < num_clients; i++) {
+                if (clients[i].fh != NULL) {
+                        smb2_close(clients[i].smb2, clients[i].fh);
+                }
+                smb2_disconnect_share(clients[i].smb2);
+                smb2_destroy_context(clients[i].smb2);
+        }
+        for (i = 0; i < num_servers; i++) {
+                bench_stop_server(pids[i]);
+        }
+        for (i = 0; i < active * depth; i++) {
+                free(reads[i].buf);
+        }
+        free(reads);
+        free(clients);
+        free(pids);
+
+        return rc < 0 ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark for the io_uring transport.
+ *
+ * Forks a server, built on smb2_serve_port(), that serves a single file
+ * "data" of synthetic content. The file is then read over loopback, first
+ * with the socket driven directly and then through io_uring, with a number
+ * of reads in flight. For each it prints the throughput, the CPU time used
+ * by the client per GiB and how often the event loop had to wait.
+ *
+ * Run it under "strace -c -f" to also see the syscalls made per GiB.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "bench-common.h"
+
+static int use_uring(struct smb2_context *smb2)
+{
+        return smb2_set_io_uring(smb2, 1);
+}
+
+static int run_client(pid_t pid, uint16_t port, int uring, int in_flight,
+                      uint32_t block)
+{
+        struct bench_stream bs;
+        struct bench_read *reads;
+        struct pollfd pfd;
+        uint64_t polls = 0;
+        double t, cpu, gib;
+        int i, rc = 0;
+
+        memset(&bs, 0, sizeof(bs));
+        bs.smb2 = bench_connect(pid, port, BENCH_PLAIN,
+                                uring ? use_uring : NULL);
+        if (bs.smb2 == NULL) {
+                return -1;
+        }
+        bs.fh = smb2_open(bs.smb2, "data", O_RDONLY);
+        if (bs.fh == NULL) {
+                fprintf(stderr, "open failed: %s\n",
+                        smb2_get_error(bs.smb2));
+                smb2_destroy_context(bs.smb2);
+                return -1;
+        }
+        if (block == 0 || block > smb2_get_max_read_size(bs.smb2)) {
+                block = smb2_get_max_read_size(bs.smb2);
+        }
+        bs.block = block;
+
+        reads = calloc(in_flight, sizeof(struct bench_read));
+        if (reads == NULL) {
+                return -1;
+        }
+        for (i = 0; i < in_flight; i++) {
+                reads[i].stream = &bs;
+                reads[i].buf = malloc(block);
+        }
+
+        bench_bytes_done = 0;
+        t = bench_now();
+        cpu = bench_cpu_time();
+        for (i = 0; i < in_flight; i++) {
+                bench_issue_read(&reads[i]);
+        }
+        while (bs.in_flight > 0 && !bench_error) {
+                pfd.fd = smb2_get_fd(bs.smb2);
+                pfd.events = smb2_which_events(bs.smb2);
+                if (poll(&pfd, 1, 1000) < 0) {
+                        fprintf(stderr, "Poll failed");
+                        rc = -1;
+                        break;
+                }
+                polls++;
+                if (pfd.revents == 0) {
+                        continue;
+                }
+                if (smb2_service(bs.smb2, pfd.revents) < 0) {
+                        fprintf(stderr, "smb2_service failed with : "
+                                "%s\n", smb2_get_error(bs.smb2));
+                        rc = -1;
+                        break;
+                }
+        }
+        t = bench_now() - t;
+        cpu = bench_cpu_time() - cpu;
+        if (bench_error) {
+                rc = -1;
+        }
+
+        gib = bench_bytes_done / (1024.0 * 1024 * 1024);
+        printf("%-8s : %.2f GiB %.3f s %.0f MiB/s, %.3f cpu s/GiB, "
+               "%.0f polls/GiB (%d x %u in flight)\n",
+               uring ? "io_uring" : "socket", gib, t, gib * 1024 / t,
+               cpu / gib, polls / gib, in_flight, block);
+
+        /* let the last replies arrive before closing */
+        while (bs.in_flight > 0 &&
+               smb2_service(bs.smb2, POLLIN | POLLOUT) == 0) {
+                pfd.fd = smb2_get_fd(bs.smb2);
+                pfd.events = smb2_which_events(bs.smb2);
+                poll(&pfd, 1, 100);
+        }
+        smb2_close(bs.smb2, bs.fh);
+        smb2_disconnect_share(bs.smb2);
+        smb2_destroy_context(bs.smb2);
+        for (i = 0; i < in_flight; i++) {
+                free(reads[i].buf);
+        }
+        free(reads);
+
+        return rc;
+}
+
+static int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-uring-bench [-p port] [-s size-in-MiB] "
+                "[-b block-size] [-j in-flight]\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct bench_server server;
+        uint16_t port = 44510;
+        uint32_t block = 0;
+        int in_flight = 8;
+        pid_t pid;
+        int c, rc;
+
+        bench_file_size = 1024ULL * 1024 * 1024;
+
+        while ((c = getopt(argc, argv, "p:s:b:j:")) != -1) {
+                switch (c) {
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 's':
+                        bench_file_size = strtoull(optarg, NULL, 10) *
+                                1024 * 1024;
+                        break;
+                case 'b':
+                        block = atoi(optarg);
+                        break;
+                case 'j':
+                        in_flight = atoi(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (in_flight < 1 || bench_file_size == 0) {
+                usage();
+        }
+
+        memset(&server, 0, sizeof(server));
+        server.port = port;
+        server.mode = BENCH_PLAIN;
+        server.max_connections = 4;
+        server.max_read_size = 1024 * 1024;
+        pid = bench_start_server(&server);
+        if (pid < 0) {
+                exit(1);
+        }
+
+        rc = run_client(pid, port, 0, in_flight, block);
+        if (rc == 0) {
+                rc = run_client(pid, port, 1, in_flight, block);
+        }
+
+        bench_stop_server(pid);
+
+        return rc < 0 ? 1 : 0;
+}
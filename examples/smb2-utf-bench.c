@@ -0,0 +1,259 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark for the UTF-8 <-> UTF-16LE name conversion.
+ *
+ * Builds corpora of file names that look like what a directory listing
+ * returns: plain ASCII names, names with accented Latin characters,
+ * CJK names and a mix of them all with the odd emoji. Each corpus is
+ * converted in both directions, once with the allocating calls that
+ * the library uses for dirents and once into a caller buffer.
+ * For each it prints the time per name and the UTF-8 throughput.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+
+struct name {
+        char *utf8;
+        struct smb2_utf16 *utf16;
+};
+
+struct corpus {
+        const char *name;
+        /* percentage of ascii, latin, cjk names, the rest are emoji */
+        int ascii, latin, cjk;
+};
+
+static const struct corpus corpora[] = {
+        { "ascii", 100,   0,   0 },
+        { "latin",   0, 100,   0 },
+        { "cjk",     0,   0, 100 },
+        { "mixed",  80,  10,   8 },
+};
+
+static const char *ascii_fmt[] = {
+        "IMG_%04d.JPG",
+        "report_q%d_final_v2.docx",
+        "libsmb2-%d.tar.gz",
+        "backup-2023-04-17T12-34-%02d.log",
+        "Meeting notes %d.txt",
+        "node_modules_cache_%08d",
+};
+
+static const char *latin_fmt[] = {
+        "R\xc3\xa9sum\xc3\xa9_%d.pdf",
+        "\xc3\x9c" "bersicht M\xc3\xa4rz %d.xlsx",
+        "Caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9" "e %d.jpg",
+        "Se\xc3\xb1or Mu\xc3\xb1oz %d.txt",
+};
+
+static const char *cjk_fmt[] = {
+        "\xe4\xbc\x9a\xe8\xae\xae\xe8\xae\xb0\xe5\xbd\x95_%d.docx",
+        "\xe5\x86\x99\xe7\x9c\x9f_%d.jpg",
+        "\xe3\x83\x97\xe3\x83\xad\xe3\x82\xb8\xe3\x82\xa7\xe3\x82\xaf\xe3\x83\x88"
+        "\xe8\xb3\x87\xe6\x96\x99_%d.pptx",
+        "\xed\x95\x9c\xea\xb5\xad\xec\x96\xb4 \xeb\xac\xb8\xec\x84\x9c %d.hwp",
+};
+
+static const char *emoji_fmt[] = {
+        "\xf0\x9f\x93\x81 backup %d",
+        "party \xf0\x9f\x8e\x89 photos %d.zip",
+};
+
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct name *
+build_corpus(const struct corpus *c, int count, size_t *bytes)
+{
+        struct name *names;
+        char buf[256];
+        const char *fmt;
+        int i, r;
+
+        names = calloc(count, sizeof(struct name));
+        if (names == NULL) {
+                return NULL;
+        }
+        *bytes = 0;
+        for (i = 0; i < count; i++) {
+                r = rand() % 100;
+                if (r < c->ascii) {
+                        fmt = ascii_fmt[rand() % NELEM(ascii_fmt)];
+                } else if (r < c->ascii + c->latin) {
+                        fmt = latin_fmt[rand() % NELEM(latin_fmt)];
+                } else if (r < c->ascii + c->latin + c->cjk) {
+                        fmt = cjk_fmt[rand() % NELEM(cjk_fmt)];
+                } else {
+                        fmt = emoji_fmt[rand() % NELEM(emoji_fmt)];
+                }
+                snprintf(buf, sizeof(buf), fmt, i);
+                names[i].utf8 = strdup(buf);
+                names[i].utf16 = smb2_utf8_to_utf16(buf);
+                if (names[i].utf8 == NULL || names[i].utf16 == NULL) {
+                        return NULL;
+                }
+                *bytes += strlen(buf);
+        }
+        return names;
+}
+
+static void
+report(const char *corpus, const char *what, double t, int count,
+       int iterations, size_t bytes)
+{
+        printf("%-6s %-20s %7.1f ns/name %8.1f MB/s\n", corpus, what,
+               t * 1e9 / ((double)count * iterations),
+               (double)bytes * iterations / t / 1e6);
+}
+
+static void usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-utf-bench [-n <names>] [-i <iterations>] "
+                "[-c <corpus>]\n\n"
+                "Corpora are ascii, latin, cjk and mixed. "
+                "Default is all of them.\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *only = NULL;
+        int count = 100000;
+        int iterations = 20;
+        struct name *names;
+        uint16_t utf16[1024];
+        char utf8[1024];
+        uint64_t sum = 0;
+        size_t bytes, c;
+        double t;
+        int i, j, opt;
+
+        while ((opt = getopt(argc, argv, "n:i:c:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        count = atoi(optarg);
+                        break;
+                case 'i':
+                        iterations = atoi(optarg);
+                        break;
+                case 'c':
+                        only = optarg;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (count <= 0 || iterations <= 0) {
+                usage();
+        }
+
+        for (c = 0; c < NELEM(corpora); c++) {
+                if (only && strcmp(only, corpora[c].name)) {
+                        continue;
+                }
+                srand(1);
+                names = build_corpus(&corpora[c], count, &bytes);
+                if (names == NULL) {
+                        fprintf(stderr, "Failed to build corpus\n");
+                        exit(10);
+                }
+
+                t = now();
+                for (j = 0; j < iterations; j++) {
+                        for (i = 0; i < count; i++) {
+                                const char *s;
+
+                                s = smb2_utf16_to_utf8(names[i].utf16->val,
+                                                       names[i].utf16->len);
+                                sum += s[0];
+                                free((void *)s);
+                        }
+                }
+                report(corpora[c].name, "utf16->utf8 alloc", now() - t,
+                       count, iterations, bytes);
+
+                t = now();
+                for (j = 0; j < iterations; j++) {
+                        for (i = 0; i < count; i++) {
+                                sum += smb2_utf16_to_utf8_buf(names[i].utf16->val,
+                                                              names[i].utf16->len,
+                                                              utf8, sizeof(utf8));
+                        }
+                }
+                report(corpora[c].name, "utf16->utf8 buffer", now() - t,
+                       count, iterations, bytes);
+
+                t = now();
+                for (j = 0; j < iterations; j++) {
+                        for (i = 0; i < count; i++) {
+                                struct smb2_utf16 *u;
+
+                                u = smb2_utf8_to_utf16(names[i].utf8);
+                                sum += u->len;
+                                free(u);
+                        }
+                }
+                report(corpora[c].name, "utf8->utf16 alloc", now() - t,
+                       count, iterations, bytes);
+
+                t = now();
+                for (j = 0; j < iterations; j++) {
+                        for (i = 0; i < count; i++) {
+                                sum += smb2_utf8_to_utf16_buf(names[i].utf8,
+                                                              utf16,
+                                                              NELEM(utf16));
+                        }
+                }
+                report(corpora[c].name, "utf8->utf16 buffer", now() - t,
+                       count, iterations, bytes);
+
+                for (i = 0; i < count; i++) {
+                        free(names[i].utf8);
+                        free(names[i].utf16);
+                }
+                free(names);
+        }
+        /* keep the compiler from dropping the conversions */
+        if (sum == 42) {
+                printf("\n");
+        }
+
+        return 0;
+}
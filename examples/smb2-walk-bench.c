@@ -0,0 +1,432 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark for smb2_walk().
+ *
+ * Forks a server, built on smb2_serve_port(), that serves a synthetic
+ * directory tree without any backing storage. Every directory above the
+ * maximum depth holds <dirs> subdirectories "d<n>" and <files> files
+ * "f<n>". The defaults give a tree with a little over one million files.
+ *
+ * The tree is then walked twice over loopback, first one directory at a
+ * time using smb2_opendir()/smb2_readdir() and then with smb2_walk()
+ * keeping many listings in flight.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "bench-common.h"
+
+#define PAD_TO_32BIT(len) ((len + 0x03) & 0xfffffffc)
+#define PAD_TO_64BIT(len) ((len + 0x07) & 0xfffffff8)
+
+static int tree_depth = 2;
+static int tree_dirs = 100;
+static int tree_files = 100;
+
+/*
+ * Server side
+ */
+struct bench_handle {
+        int in_use;
+        int depth;
+        uint32_t cursor;
+};
+
+static struct bench_handle *handles;
+static int num_handles;
+
+/* query directory replies are encoded by the library after the handler
+ * returns, so the entries and their names are kept in scratch buffers that
+ * are reused for the next reply.
+ */
+static uint8_t *dir_buf;
+static size_t dir_buf_size;
+static char *name_buf;
+static size_t name_buf_size;
+
+static int
+alloc_handle(int depth)
+{
+        int i;
+
+        for (i = 0; i < num_handles; i++) {
+                if (!handles[i].in_use) {
+                        break;
+                }
+        }
+        if (i == num_handles) {
+                struct bench_handle *h;
+
+                h = realloc(handles, (num_handles + 64) * sizeof(*h));
+                if (h == NULL) {
+                        return -1;
+                }
+                memset(&h[num_handles], 0, 64 * sizeof(*h));
+                handles = h;
+                num_handles += 64;
+        }
+        handles[i].in_use = 1;
+        handles[i].depth = depth;
+        handles[i].cursor = 0;
+
+        return i;
+}
+
+static struct bench_handle *
+find_handle(smb2_file_id file_id)
+{
+        uint32_t idx;
+
+        memcpy(&idx, file_id, sizeof(idx));
+        if (idx >= (uint32_t)num_handles || !handles[idx].in_use) {
+                return NULL;
+        }
+        return &handles[idx];
+}
+
+/* Returns the depth of the directory name refers to, or -1 if it is not a
+ * directory in the synthetic tree.
+ */
+static int
+lookup_dir(const char *name)
+{
+        int depth = 0;
+
+        while (name && *name) {
+                char *end;
+                unsigned long n;
+
+                if (*name == '\\' || *name == '/') {
+                        name++;
+                        continue;
+                }
+                if (*name != 'd' || depth >= tree_depth) {
+                        return -1;
+                }
+                n = strtoul(name + 1, &end, 10);
+                if (end == name + 1 || n >= (unsigned long)tree_dirs ||
+                    (*end && *end != '\\' && *end != '/')) {
+                        return -1;
+                }
+                depth++;
+                name = end;
+        }
+
+        return depth;
+}
+
+static int create_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                          struct smb2_create_request *req,
+                          struct smb2_create_reply *rep)
+{
+        uint32_t idx;
+        int depth, h;
+
+        depth = lookup_dir(req->name);
+        if (depth < 0) {
+                return -1;
+        }
+        h = alloc_handle(depth);
+        if (h < 0) {
+                return -1;
+        }
+        idx = h;
+
+        rep->create_action = 1; /* FILE_OPENED */
+        rep->file_attributes = SMB2_FILE_ATTRIBUTE_DIRECTORY;
+        memset(rep->file_id, 0, SMB2_FD_SIZE);
+        memcpy(rep->file_id, &idx, sizeof(idx));
+
+        return 0;
+}
+
+static int close_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                         struct smb2_close_request *req,
+                         struct smb2_close_reply *rep)
+{
+        struct bench_handle *h = find_handle(req->file_id);
+
+        if (h) {
+                h->in_use = 0;
+        }
+        memset(rep, 0, sizeof(*rep));
+        rep->file_attributes = SMB2_FILE_ATTRIBUTE_DIRECTORY;
+
+        return 0;
+}
+
+static int query_directory_handler(struct smb2_server *srvr, struct smb2_context *smb2,
+                                   struct smb2_query_directory_request *req,
+                                   struct smb2_query_directory_reply *rep)
+{
+        struct bench_handle *h = find_handle(req->file_id);
+        struct smb2_fileidbothdirectoryinformation *fs;
+        uint32_t ndirs, total, room, used, i, stride;
+        size_t needed;
+        int len;
+
+        rep->output_buffer_length = 0;
+        rep->output_buffer = NULL;
+
+        if (h == NULL) {
+                return -1;
+        }
+        if (req->flags & SMB2_RESTART_SCANS) {
+                h->cursor = 0;
+        }
+
+        ndirs = h->depth < tree_depth ? tree_dirs : 0;
+        total = ndirs + tree_files;
+        if (h->cursor >= total) {
+                /* empty reply is sent as STATUS_NO_MORE_FILES */
+                return 0;
+        }
+
+        stride = PAD_TO_64BIT(sizeof(struct smb2_fileidbothdirectoryinformation));
+        room = req->output_buffer_length;
+
+        /* worst case every entry in the reply is the smallest one */
+        needed = (room / SMB2_FILEID_FULL_DIRECTORY_INFORMATION_SIZE + 1);
+        if (needed * stride > dir_buf_size) {
+                free(dir_buf);
+                dir_buf_size = needed * stride;
+                dir_buf = malloc(dir_buf_size);
+                free(name_buf);
+                name_buf_size = needed * 16;
+                name_buf = malloc(name_buf_size);
+                if (dir_buf == NULL || name_buf == NULL) {
+                        dir_buf_size = 0;
+                        return -1;
+                }
+        }
+
+        len = 0;
+        used = 0;
+        for (i = 0; h->cursor < total; i++) {
+                char *name = &name_buf[i * 16];
+                uint32_t esize;
+
+                if (h->cursor < ndirs) {
+                        snprintf(name, 16, "d%u", h->cursor);
+                } else {
+                        snprintf(name, 16, "f%u", h->cursor - ndirs);
+                }
+                switch (req->file_information_class) {
+                case SMB2_FILE_ID_BOTH_DIRECTORY_INFORMATION:
+                        esize = PAD_TO_32BIT(SMB2_FILEID_BOTH_DIRECTORY_INFORMATION_SIZE + 2 * strlen(name));
+                        break;
+                default:
+                        esize = PAD_TO_32BIT(SMB2_FILEID_FULL_DIRECTORY_INFORMATION_SIZE + 2 * strlen(name));
+                        break;
+                }
+                if (used + esize > room) {
+                        break;
+                }
+                used += esize;
+
+                fs = (struct smb2_fileidbothdirectoryinformation *)(dir_buf + len);
+                memset(fs, 0, sizeof(*fs));
+                fs->file_index = h->cursor;
+                fs->creation_time.tv_sec = 1700000000;
+                fs->last_access_time.tv_sec = 1700000000;
+                fs->last_write_time.tv_sec = 1700000000;
+                fs->change_time.tv_sec = 1700000000;
+                if (h->cursor < ndirs) {
+                        fs->file_attributes = SMB2_FILE_ATTRIBUTE_DIRECTORY;
+                } else {
+                        fs->file_attributes = SMB2_FILE_ATTRIBUTE_ARCHIVE;
+                        fs->end_of_file = 4096;
+                        fs->allocation_size = 4096;
+                }
+                fs->file_id = ((uint64_t)h->depth << 32) | h->cursor;
+                fs->name = name;
+                len += stride;
+                h->cursor++;
+        }
+
+        rep->output_buffer_length = len;
+        rep->output_buffer = len ? dir_buf : NULL;
+
+        return 0;
+}
+
+/*
+ * Client side
+ */
+struct walk_count {
+        uint64_t files;
+        uint64_t dirs;
+};
+
+static int walk_serial(struct smb2_context *smb2, const char *path,
+                       struct walk_count *count)
+{
+        struct smb2dir *dir;
+        struct smb2dirent *ent;
+        char child[1024];
+        int rc = 0;
+
+        dir = smb2_opendir(smb2, path);
+        if (dir == NULL) {
+                return -1;
+        }
+        while ((ent = smb2_readdir(smb2, dir))) {
+                if (!strcmp(ent->name, ".") || !strcmp(ent->name, "..")) {
+                        continue;
+                }
+                if (ent->st.smb2_type != SMB2_TYPE_DIRECTORY) {
+                        count->files++;
+                        continue;
+                }
+                count->dirs++;
+                snprintf(child, sizeof(child), "%s%s%s", path,
+                         path[0] ? "/" : "", ent->name);
+                rc = walk_serial(smb2, child, count);
+                if (rc < 0) {
+                        break;
+                }
+        }
+        smb2_closedir(smb2, dir);
+
+        return rc;
+}
+
+static int walk_entry(struct smb2_context *smb2, struct smb2_walk_entry *ent,
+                      void *cb_data)
+{
+        struct walk_count *count = cb_data;
+
+        if (ent->st->smb2_type == SMB2_TYPE_DIRECTORY) {
+                count->dirs++;
+        } else {
+                count->files++;
+        }
+        return SMB2_WALK_CONTINUE;
+}
+
+static int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-walk-bench [-p port] [-d depth] [-D dirs] [-F files] "
+                "[-j in-flight] [-s]\n\n"
+                "  -s  skip the one directory at a time walk\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct smb2_server_request_handlers handlers;
+        struct bench_server server;
+        struct smb2_context *smb2;
+        struct walk_count count;
+        uint16_t port = 44500;
+        int in_flight = 32;
+        int skip_serial = 0;
+        double t;
+        pid_t pid;
+        int c, rc;
+
+        while ((c = getopt(argc, argv, "p:d:D:F:j:s")) != -1) {
+                switch (c) {
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 'd':
+                        tree_depth = atoi(optarg);
+                        break;
+                case 'D':
+                        tree_dirs = atoi(optarg);
+                        break;
+                case 'F':
+                        tree_files = atoi(optarg);
+                        break;
+                case 'j':
+                        in_flight = atoi(optarg);
+                        break;
+                case 's':
+                        skip_serial = 1;
+                        break;
+                default:
+                        usage();
+                }
+        }
+
+        memset(&handlers, 0, sizeof(handlers));
+        bench_session_handlers(&handlers);
+        handlers.create_cmd = create_handler;
+        handlers.close_cmd = close_handler;
+        handlers.query_directory_cmd = query_directory_handler;
+
+        memset(&server, 0, sizeof(server));
+        server.port = port;
+        server.mode = BENCH_PLAIN;
+        server.max_connections = 4;
+        server.handlers = &handlers;
+        pid = bench_start_server(&server);
+        if (pid < 0) {
+                exit(1);
+        }
+
+        smb2 = bench_connect(pid, port, BENCH_PLAIN, NULL);
+        if (smb2 == NULL) {
+                bench_stop_server(pid);
+                exit(1);
+        }
+
+        if (!skip_serial) {
+                memset(&count, 0, sizeof(count));
+                t = bench_now();
+                rc = walk_serial(smb2, "", &count);
+                t = bench_now() - t;
+                if (rc < 0) {
+                        fprintf(stderr, "serial walk failed: %s\n",
+                                smb2_get_error(smb2));
+                }
+                printf("serial   : %" PRIu64 " dirs %" PRIu64 " files "
+                       "%.3f s %.0f entries/s\n", count.dirs, count.files,
+                       t, (count.dirs + count.files) / t);
+        }
+
+        memset(&count, 0, sizeof(count));
+        t = bench_now();
+        rc = smb2_walk(smb2, "", 0, in_flight, 0, walk_entry, &count);
+        t = bench_now() - t;
+        if (rc < 0) {
+                fprintf(stderr, "smb2_walk failed: %s\n", smb2_get_error(smb2));
+        }
+        printf("parallel : %" PRIu64 " dirs %" PRIu64 " files "
+               "%.3f s %.0f entries/s (%d in flight)\n", count.dirs,
+               count.files, t, (count.dirs + count.files) / t, in_flight);
+
+        smb2_disconnect_share(smb2);
+        smb2_destroy_context(smb2);
+
+        bench_stop_server(pid);
+
+        return rc < 0 ? 1 : 0;
+}
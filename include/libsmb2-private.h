@@ -42,6 +42,12 @@ extern "C" {
 
 #define SMB2_MAX_VECTORS 256
 
+/* Timeout in ms between 2 consecutive socket connection.
+ * The rfc8305 recommends a timeout of 250ms and a minimum timeout of 100ms.
+ * Since the smb is most likely used on local network, use an aggressive
+ * timeout of 100ms. */
+#define HAPPY_EYEBALLS_TIMEOUT 100
+
 struct smb2_io_vectors {
         size_t num_done;
         size_t total_size;
@@ -120,6 +126,8 @@ struct sync_cb_data {
 	int is_finished;
 	int status;
 	void *ptr;
+        /* set while a thread waits in smb2_thread_wait() */
+        struct smb2_waiter *waiter;
 };
         
 struct smb2_context {
@@ -133,7 +141,12 @@ struct smb2_context {
         struct addrinfo *addrinfos;
         const struct addrinfo *next_addrinfo;
 
+        /* Command timeout in ms, 0 for none */
         int timeout;
+        /* Min-heap of the queued PDUs that have a deadline */
+        struct smb2_pdu **timeouts;
+        int num_timeouts;
+        int max_timeouts;
 
         enum smb2_sec sec;
 
@@ -193,6 +206,9 @@ struct smb2_context {
          */
         struct smb2_pdu *outqueue;
         struct smb2_pdu *waitqueue;
+        /* last PDU on each of the queues */
+        struct smb2_pdu *outqueue_tail;
+        struct smb2_pdu *waitqueue_tail;
 
         /*
          * For receiving PDUs
@@ -206,6 +222,10 @@ struct smb2_context {
         struct smb2_header hdr;
         /* Offset into smb2->in where the payload for the current PDU starts */
         size_t payload_offset;
+        /* Data read from the socket that has not been parsed yet */
+        uint8_t *rbuf;
+        size_t rbuf_pos;
+        size_t rbuf_len;
 
         /* Pointer to the current PDU that we are receiving the reply for.
          * Only valid once the full smb2 header has been received.
@@ -251,6 +271,47 @@ struct smb2_context {
         /* Open dirhandles */
         struct smb2dir *dirs;
 
+        /* Leases held by the library caches */
+        struct smb2_lease *leases;
+        /* Lease-backed metadata cache, NULL when disabled */
+        struct smb2_mdcache *mdcache;
+        /* Per-handle read cache size in bytes, 0 when disabled */
+        uint32_t read_cache_size;
+        /* Per-handle dirty data limit in bytes, 0 when disabled */
+        uint32_t write_cache_size;
+        /* Open-handle cache, NULL when disabled */
+        struct smb2_hcache *hcache;
+
+        /* io_uring transport, NULL while the socket is used directly */
+        int use_uring;
+        struct smb2_uring *uring;
+        t_socket uring_fd;
+
+        /* Reactor the context is serviced by, NULL if none */
+        struct smb2_reactor_entry *reactor;
+
+        /* Work handed over by other threads, see submit.c */
+        struct smb2_submission *submissions;
+        t_socket submit_fd;
+        t_socket submit_wfd;
+
+        /* Service thread for the sync API, see thread.c */
+        struct smb2_thread *thread;
+
+        /* Performance counters, see stats.c */
+        struct smb2_stats stats;
+
+        /* PDU tracing, see trace.c. tracing is set while either the
+         * callback or the Chrome trace is.
+         */
+        int tracing;
+        smb2_trace_cb trace_cb;
+        void *trace_data;
+        struct smb2_chrome_trace *chrome_trace;
+
+        /* Workload capture, see capture.c */
+        struct smb2_capture *capture;
+
         /* callbacks for the eventsystem */
         int events;
         smb2_change_fd_cb change_fd;
@@ -272,8 +333,20 @@ typedef void (*smb2_free_payload)(struct smb2_context *smb2, void *payload);
 
 #define SMB2_MAX_PDU_SIZE 16*1024*1024
 
+/* The queue of the context a PDU is on */
+enum smb2_pdu_queue {
+        SMB2_QUEUE_NONE,
+        SMB2_QUEUE_OUT,
+        SMB2_QUEUE_WAIT,
+};
+
 struct smb2_pdu {
         struct smb2_pdu *next;
+        /* Only kept up to date on the outqueue and the waitqueue, so that
+         * a PDU can be taken off them without looking for it.
+         */
+        struct smb2_pdu *prev;
+        enum smb2_pdu_queue queue;
         struct smb2_header header;
 
         struct smb2_pdu *next_compound;
@@ -306,12 +379,28 @@ struct smb2_pdu {
         /* Data we need to retain between request/reply for QUERY INFO */
         uint8_t info_type;
         uint8_t file_info_class;
+        /* and for IOCTL */
+        uint32_t ctl_code;
 
         /* For encrypted PDUs */
         uint8_t seal:1;
         uint32_t crypt_len;
         unsigned char *crypt;
-        time_t timeout;
+        /* Monotonic ms after which the PDU times out, 0 for never */
+        uint64_t deadline;
+        /* Position in smb2->timeouts + 1, 0 when not in it */
+        int timeout_index;
+
+        /* Set while the io_uring backend is sending the PDU */
+        uint8_t in_flight;
+
+        /* Monotonic ns when a request was queued, or when a server
+         * received it, for the latency counters
+         */
+        uint64_t stats_start;
+
+        /* When each trace event happened, 0 if it has not */
+        uint64_t trace_ts[SMB2_TRACE_NUM_EVENTS];
 };
 
 #define smb2_is_server(ctx) ((ctx)->owning_server != NULL)
@@ -591,12 +680,316 @@ int smb2_decode_reparse_data_buffer(struct smb2_context *smb2,
                                     void *memctx,
                                     struct smb2_reparse_data_buffer *rp,
                                     struct smb2_iovec *vec);
+struct smb2fh {
+        struct smb2fh *next;
+        smb2_command_cb cb;
+        void *cb_data;
+
+        smb2_file_id file_id;
+        int64_t offset;
+        int64_t end_of_file;
+
+        /* data cache, NULL unless the handle holds a caching lease or
+         * oplock */
+        struct smb2_fcache *fcache;
+        /* NULL unless the handle may be kept open by the handle cache */
+        struct smb2_hcache_entry *hcache;
+
+        /* the id of the captured OPEN that returned the handle, or 0 */
+        uint32_t capture_id;
+};
+
+void smb2_free_fh(struct smb2_context *smb2, struct smb2fh *fh);
 void smb2_free_all_fhs(struct smb2_context *smb2);
 void smb2_free_all_dirs(struct smb2_context *smb2);
 
 int smb2_read_from_buf(struct smb2_context *smb2);
+int smb2_read_from_socket(struct smb2_context *smb2);
+struct iovec;
+int smb2_get_pdu_vectors(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                         struct iovec *iov, uint32_t *spl, size_t *len);
+void smb2_pdu_sent(struct smb2_context *smb2, struct smb2_pdu *pdu);
+/* Adds the PDU to the end of the outqueue or the waitqueue */
+void smb2_pdu_enqueue(struct smb2_context *smb2, enum smb2_pdu_queue queue,
+                      struct smb2_pdu *pdu);
+/* Takes the PDU off the queue it is on, if any */
+void smb2_pdu_dequeue(struct smb2_context *smb2, struct smb2_pdu *pdu);
 void smb2_change_events(struct smb2_context *smb2, t_socket fd, int events);
 void smb2_timeout_pdus(struct smb2_context *smb2);
+/* Adds a PDU that has just been queued to the timeouts */
+int smb2_add_timeout(struct smb2_context *smb2, struct smb2_pdu *pdu);
+/* First deadline of the queued PDUs, 0 if there is none */
+uint64_t smb2_next_deadline(struct smb2_context *smb2);
+/* Monotonic clock in ms */
+uint64_t smb2_clock_ms(void);
+/* Monotonic clock in ns, for timing rather than deadlines */
+uint64_t smb2_clock_ns(void);
+
+/*
+ * Performance counters, see stats.c
+ */
+/* The PDUs of a chain that is being queued */
+void smb2_stats_queued(struct smb2_context *smb2, struct smb2_pdu *pdu);
+/* A PDU that has been received in full, len bytes of it */
+void smb2_stats_received(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                         size_t len);
+/* A server queues the reply to req */
+void smb2_stats_replied(struct smb2_context *smb2, struct smb2_pdu *req,
+                        struct smb2_pdu *rep);
+void smb2_stats_timed_out(struct smb2_context *smb2, struct smb2_pdu *pdu);
+void smb2_stats_outqueue(struct smb2_context *smb2, int delta);
+void smb2_stats_waitqueue(struct smb2_context *smb2, int delta);
+
+/*
+ * PDU tracing, see trace.c
+ */
+#define SMB2_TRACE(smb2, pdu, event)                                    \
+        do {                                                            \
+                if ((smb2)->tracing) {                                  \
+                        smb2_trace_event((smb2), (pdu), (event));       \
+                }                                                       \
+        } while (0)
+
+void smb2_trace_event(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                      enum smb2_trace_event event);
+/* Writes out a PDU that is being freed, if there is a Chrome trace */
+void smb2_trace_pdu_done(struct smb2_context *smb2, struct smb2_pdu *pdu);
+
+/*
+ * Workload capture, see capture.c. A captured call calls itself again
+ * with smb2_capture_cb() as its callback, which is not captured.
+ */
+#define SMB2_CAPTURING(smb2, cb)                                        \
+        ((smb2) != NULL && (smb2)->capture != NULL &&                   \
+         (cb) != smb2_capture_cb)
+
+struct smb2_capture_call;
+/* Returns NULL if the call is not to be captured */
+struct smb2_capture_call *smb2_capture_begin(struct smb2_context *smb2,
+                                             enum smb2_capture_op op,
+                                             struct smb2fh *fh,
+                                             const char *path,
+                                             const char *path2,
+                                             uint64_t offset, uint32_t count,
+                                             smb2_command_cb cb,
+                                             void *cb_data);
+/* Records the failure of a call that returned rc < 0. Returns rc. */
+int smb2_capture_end(struct smb2_context *smb2,
+                     struct smb2_capture_call *call, int rc);
+void smb2_capture_cb(struct smb2_context *smb2, int status,
+                     void *command_data, void *private_data);
+/* Hands the cb_data that the smb2dir frees back to the caller of
+ * smb2_opendir_async() */
+void smb2_dir_set_cb_data(struct smb2dir *dir, void *cb_data);
+/* Credits that are left once everything in the outqueue has been sent */
+int smb2_get_available_credits(struct smb2_context *smb2);
+
+/*
+ * Leases requested by the library itself, see lease.c.
+ * The break callback returns 0 to have the break acknowledged right away
+ * or >0 if it will call smb2_lease_break_ack() itself later.
+ */
+struct smb2_lease;
+typedef int (*smb2_lease_break_fn)(struct smb2_context *smb2,
+                                   struct smb2_lease *lease,
+                                   uint32_t new_state);
+
+struct smb2_lease {
+        struct smb2_lease *next;
+        smb2_lease_key key;
+        uint32_t state;
+        uint16_t epoch;
+        smb2_lease_break_fn break_cb;
+        void *private_data;
+};
+
+void smb2_lease_init(struct smb2_context *smb2, struct smb2_lease *lease,
+                     smb2_lease_break_fn break_cb, void *private_data);
+/* Adds a lease request for state to req. req->create_context must be
+ * freed by the caller once the create pdu has been built.
+ */
+int smb2_lease_create_context(struct smb2_context *smb2,
+                              struct smb2_lease *lease, uint32_t state,
+                              struct smb2_create_request *req);
+uint32_t smb2_lease_granted(struct smb2_context *smb2,
+                            struct smb2_lease *lease,
+                            struct smb2_create_reply *rep);
+void smb2_lease_register(struct smb2_context *smb2, struct smb2_lease *lease);
+void smb2_lease_unregister(struct smb2_context *smb2,
+                           struct smb2_lease *lease);
+int smb2_lease_break_ack(struct smb2_context *smb2, struct smb2_lease *lease,
+                         uint32_t state);
+/* Returns 1 if the break was for a lease held by the library */
+int smb2_lease_break(struct smb2_context *smb2,
+                     struct smb2_lease_break_notification *notify);
+
+/*
+ * Lease-backed metadata cache, see mdcache.c.
+ * Paths are relative to the share, with or without a leading '/'.
+ */
+struct smb2_mdcache;
+void smb2_mdcache_destroy(struct smb2_context *smb2);
+/* Drops every cached directory, closing the handles if close_handles */
+void smb2_mdcache_purge(struct smb2_context *smb2, int close_handles);
+/* Returns a token identifying the current lease on directory dir, or 0
+ * if the directory is not leased. A lease is requested in the background
+ * for directories that are not cached yet.
+ */
+uint64_t smb2_mdcache_token(struct smb2_context *smb2, const char *dir);
+uint64_t smb2_mdcache_parent_token(struct smb2_context *smb2,
+                                   const char *path);
+/* Returns 1 and fills in st on a hit, -ENOENT for a cached negative
+ * entry and 0 on a miss.
+ */
+int smb2_mdcache_lookup(struct smb2_context *smb2, const char *path,
+                        struct smb2_stat_64 *st);
+/* Stores the result of a stat that was sent while token was current */
+void smb2_mdcache_store(struct smb2_context *smb2, const char *path,
+                        uint64_t token, int status,
+                        const struct smb2_stat_64 *st);
+/* Returns 1 and sets *ents and *count to the cached listing of dir, which is
+ * valid until control returns to the event loop, or 0 on a miss.
+ */
+int smb2_mdcache_get_listing(struct smb2_context *smb2, const char *dir,
+                             const struct smb2dirent **ents, int *count);
+void smb2_mdcache_store_listing(struct smb2_context *smb2, const char *dir,
+                                uint64_t token,
+                                const struct smb2dirent **ents, int count);
+/* Called before a path is modified through this context */
+void smb2_mdcache_invalidate(struct smb2_context *smb2, const char *path);
+
+/*
+ * Client side data cache for file handles, see fcache.c.
+ */
+struct smb2_fcache;
+/* Called before an open is sent. Adds a request for a caching lease or
+ * oplock to req and returns the cache for the new handle, or NULL if the
+ * handle will not be cached.
+ */
+struct smb2_fcache *smb2_fcache_create(struct smb2_context *smb2, int flags,
+                                       int want_handle,
+                                       struct smb2_create_request *req);
+/* Called once the open has completed */
+void smb2_fcache_opened(struct smb2_context *smb2, struct smb2fh *fh,
+                        struct smb2_create_reply *rep);
+void smb2_fcache_destroy(struct smb2_context *smb2, struct smb2fh *fh);
+/* Returns 1 if the read was taken by the cache, 0 if it should be sent
+ * to the server as usual or -errno.
+ */
+int smb2_fcache_pread(struct smb2_context *smb2, struct smb2fh *fh,
+                      uint8_t *buf, uint32_t count, uint64_t offset,
+                      smb2_command_cb cb, void *cb_data);
+/* Returns 1 if the write was buffered or deferred, 0 if it should be
+ * sent to the server as usual or -errno.
+ */
+int smb2_fcache_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
+                       const uint8_t *buf, uint32_t count, uint64_t offset,
+                       smb2_command_cb cb, void *cb_data);
+/* Writes all dirty data. Returns 1 if cb will be called once it has been
+ * written, 0 if there was nothing to write or -errno. cb gets status
+ * -ECANCELED if the handle is freed first.
+ */
+int smb2_fcache_flush(struct smb2_context *smb2, struct smb2fh *fh,
+                      smb2_command_cb cb, void *cb_data);
+/* Returns and clears the first error from writing dirty data */
+int smb2_fcache_write_error(struct smb2fh *fh);
+/* Drops cached data in [offset, offset + len) before it is modified
+ * through this handle. size is the new file size or -1 if unchanged.
+ */
+void smb2_fcache_invalidate(struct smb2_context *smb2, struct smb2fh *fh,
+                            uint64_t offset, uint64_t len, int64_t size);
+/* Returns 1 if the break was for a handle with a data cache */
+int smb2_fcache_oplock_break(struct smb2_context *smb2,
+                             struct smb2_oplock_break_notification *notify);
+/* Returns 1 while the handle lease allows keeping the handle open */
+int smb2_fcache_handle_cached(struct smb2fh *fh);
+/* Called when an idle handle is given back to the application */
+void smb2_fcache_reopened(struct smb2fh *fh);
+
+/*
+ * Sparse files, see sparse.c.
+ */
+/* Same as smb2_query_allocated_ranges_async() but stops asking for more
+ * once at least limit ranges are known, 0 for no limit.
+ */
+int smb2_query_allocated_ranges_limit_async(struct smb2_context *smb2,
+                                            struct smb2fh *fh,
+                                            uint64_t offset, uint64_t len,
+                                            int limit,
+                                            smb2_command_cb cb,
+                                            void *cb_data);
+
+/*
+ * io_uring transport, see uring.c.
+ */
+struct smb2_uring;
+/* Called once the socket is connected, the socket is used directly if
+ * this fails.
+ */
+int smb2_uring_start(struct smb2_context *smb2);
+/* Called before the socket is closed */
+void smb2_uring_stop(struct smb2_context *smb2);
+int smb2_uring_service(struct smb2_context *smb2, int revents);
+int smb2_uring_which_events(struct smb2_context *smb2);
+ssize_t smb2_uring_readv(struct smb2_context *smb2,
+                         const struct iovec *iov, int iovcnt);
+
+/*
+ * Reactor, see reactor.c.
+ */
+struct smb2_reactor_entry;
+/* Arms the timer of the context for the deadline of a new PDU */
+void smb2_reactor_pdu_queued(struct smb2_context *smb2, struct smb2_pdu *pdu);
+/* Called when the context is destroyed */
+void smb2_reactor_detach(struct smb2_context *smb2);
+
+/*
+ * Thread-safe submission, see submit.c.
+ */
+struct smb2_submission;
+/* Runs the work other threads have submitted */
+void smb2_submit_service(struct smb2_context *smb2);
+/* Called when the context is destroyed */
+void smb2_submit_close(struct smb2_context *smb2);
+/* Makes the submit fd readable without queueing any work */
+void smb2_submit_wakeup(struct smb2_context *smb2);
+
+/*
+ * Service thread, see thread.c.
+ */
+struct smb2_thread;
+struct smb2_waiter;
+/* Serialize the threads using the sync API, no-ops without a thread */
+void smb2_lock_context(struct smb2_context *smb2);
+void smb2_unlock_context(struct smb2_context *smb2);
+/* Returns 1 if called on the service thread of the context */
+int smb2_is_service_thread(struct smb2_context *smb2);
+/* Blocks until cb_data is finished or the service thread fails */
+int smb2_thread_wait(struct smb2_context *smb2, struct sync_cb_data *cb_data);
+/* Wakes the thread blocked in smb2_thread_wait() */
+void smb2_thread_signal(struct smb2_waiter *waiter);
+
+/*
+ * Open-handle cache, see hcache.c.
+ */
+struct smb2_hcache;
+struct smb2_hcache_entry;
+void smb2_hcache_destroy(struct smb2_context *smb2);
+/* Drops the idle handles, sending a CLOSE for them if close_handles */
+void smb2_hcache_purge(struct smb2_context *smb2, int close_handles);
+/* Called before an open is sent to mark the handle as cacheable */
+void smb2_hcache_track(struct smb2_context *smb2, struct smb2fh *fh,
+                       const char *path, int flags);
+/* Returns an idle handle for path opened with the same access mode */
+struct smb2fh *smb2_hcache_get(struct smb2_context *smb2, const char *path,
+                               int flags);
+/* Returns 1 if the handle was kept open instead of being closed */
+int smb2_hcache_release(struct smb2_context *smb2, struct smb2fh *fh);
+/* Returns 1 if the handle was idle and is now being closed */
+int smb2_hcache_break(struct smb2_context *smb2, struct smb2fh *fh);
+void smb2_hcache_forget(struct smb2_context *smb2, struct smb2fh *fh);
+/* Closes idle handles for a path that is about to be modified */
+void smb2_hcache_invalidate(struct smb2_context *smb2, const char *path);
 
 struct dcerpc_context;
 int dcerpc_set_uint8(struct dcerpc_context *ctx, struct smb2_iovec *iov,
@@ -0,0 +1,1382 @@
+/* -*-  mode:c++; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Optional header-only C++20 layer over the async API.
+ *
+ * The smb2_*_async() file and directory functions of libsmb2.h have an
+ * awaitable counterpart in the smb2 namespace that takes the same
+ * arguments minus the callback, the ones on a handle being members of
+ * smb2::file. smb2_connect_async() and the server side functions do not,
+ * use connect_share() to connect:
+ *
+ *   smb2::task<uint64_t> copy(struct smb2_context *smb2)
+ *   {
+ *           smb2::file in = co_await smb2::open(smb2, "a", O_RDONLY);
+ *           smb2::file out = co_await smb2::open(smb2, "b",
+ *                                                O_WRONLY | O_CREAT);
+ *           ...
+ *           uint32_t count = co_await in.pread(buf, sizeof(buf), offset);
+ *           co_await out.pwrite(buf, count, offset);
+ *           ...
+ *           co_await out.close();
+ *   }
+ *
+ *   smb2::sync_wait(smb2, copy(smb2));
+ *
+ * Awaiting a command issues it and suspends the coroutine until its
+ * callback is invoked. The callbacks run from smb2_service() as usual,
+ * so the coroutines run on the thread that services the context. That
+ * can be sync_wait(), which polls the context until a task is done, any
+ * existing event loop calling smb2_service(), or a reactor.
+ *
+ * Commands are lazy senders. Nothing is sent until they are awaited or
+ * connected to a receiver and started, see command::connect().
+ *
+ * Errors are thrown as smb2::error, a std::system_error holding the
+ * errno and the smb2_get_error() string.
+ *
+ * smb2::file and smb2::directory own a struct smb2fh and struct smb2dir.
+ * A file that is still open when it is destroyed is closed in the
+ * background. All tasks, files and directories must be done with before
+ * the context is destroyed, and a task must not be destroyed while it is
+ * waiting for a command.
+ *
+ * Pipelining is a matter of starting several tasks before awaiting them,
+ * see when_all().
+ */
+
+#ifndef _LIBSMB2_CORO_HPP_
+#define _LIBSMB2_CORO_HPP_
+
+#include <coroutine>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+namespace smb2 {
+
+class error : public std::system_error {
+public:
+        error(int err, const char *what)
+                : std::system_error(err, std::generic_category(),
+                                    what ? what : "") {}
+};
+
+/*
+ * Coroutine type for code that awaits commands. Tasks are lazy: a task
+ * runs when it is awaited, started by when_all(), spawn() or
+ * sync_wait().
+ */
+template <typename T = void> class task;
+
+namespace detail {
+
+struct promise_base {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr exception;
+        bool started = false;
+
+        struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+                template <typename P>
+                std::coroutine_handle<>
+                await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                        return h.promise().continuation;
+                }
+                void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() noexcept
+        {
+                exception = std::current_exception();
+        }
+};
+
+template <typename T>
+struct promise : promise_base {
+        std::optional<T> value;
+
+        task<T> get_return_object() noexcept;
+        template <typename U>
+        void return_value(U &&v)
+        {
+                value.emplace(std::forward<U>(v));
+        }
+        T result()
+        {
+                if (exception) {
+                        std::rethrow_exception(exception);
+                }
+                return std::move(*value);
+        }
+};
+
+template <>
+struct promise<void> : promise_base {
+        task<void> get_return_object() noexcept;
+        void return_void() noexcept {}
+        void result()
+        {
+                if (exception) {
+                        std::rethrow_exception(exception);
+                }
+        }
+};
+
+} /* namespace detail */
+
+template <typename T>
+class task {
+public:
+        using promise_type = detail::promise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        task() noexcept = default;
+        explicit task(handle_type h) noexcept : h_(h) {}
+        task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+        task &operator=(task &&other) noexcept
+        {
+                if (this != &other) {
+                        if (h_) {
+                                h_.destroy();
+                        }
+                        h_ = std::exchange(other.h_, {});
+                }
+                return *this;
+        }
+        task(const task &) = delete;
+        task &operator=(const task &) = delete;
+        ~task()
+        {
+                if (h_) {
+                        h_.destroy();
+                }
+        }
+
+        bool done() const noexcept { return !h_ || h_.done(); }
+
+        /*
+         * Runs the task up to its first suspension point without waiting
+         * for it. It must still be awaited, or be done, before it is
+         * destroyed.
+         */
+        void start()
+        {
+                if (!h_.promise().started) {
+                        h_.promise().started = true;
+                        h_.resume();
+                }
+        }
+
+        /* The result of a task that is done, rethrows its exception */
+        T result() { return h_.promise().result(); }
+
+        auto operator co_await() && noexcept
+        {
+                struct awaiter {
+                        handle_type h;
+
+                        bool await_ready() noexcept { return h.done(); }
+                        std::coroutine_handle<>
+                        await_suspend(std::coroutine_handle<> c) noexcept
+                        {
+                                h.promise().continuation = c;
+                                if (h.promise().started) {
+                                        /* resumes c when it finishes */
+                                        return std::noop_coroutine();
+                                }
+                                h.promise().started = true;
+                                return h;
+                        }
+                        T await_resume() { return h.promise().result(); }
+                };
+                return awaiter{h_};
+        }
+
+private:
+        handle_type h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T>
+promise<T>::get_return_object() noexcept
+{
+        return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void>
+promise<void>::get_return_object() noexcept
+{
+        return task<void>(
+                std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/*
+ * The state of one command while it is in flight. Op describes the
+ * command:
+ *   using value_type = ...;
+ *   int launch(struct smb2_context *, smb2_command_cb, void *);
+ *   value_type complete(struct smb2_context *, int status, void *data);
+ * Derived::completed() is called from the callback.
+ */
+template <typename Op, typename Derived>
+class command_state {
+public:
+        using value_type = typename Op::value_type;
+
+        command_state(struct smb2_context *smb2, Op &&op)
+                : smb2_(smb2), op_(std::move(op)) {}
+
+protected:
+        /* Returns false if the command completed before it returned */
+        bool issue()
+        {
+                int rc;
+
+                launching_ = true;
+                rc = op_.launch(smb2_, &command_state::callback, this);
+                launching_ = false;
+                if (rc < 0) {
+                        status_ = rc;
+                        return false;
+                }
+                return !done_;
+        }
+
+        value_type result()
+        {
+                if (status_ < 0) {
+                        throw error(-status_, smb2_get_error(smb2_));
+                }
+                return op_.complete(smb2_, status_, data_);
+        }
+
+        struct smb2_context *smb2_;
+        Op op_;
+
+private:
+        static void callback(struct smb2_context *, int status,
+                             void *command_data, void *private_data)
+        {
+                auto *self = static_cast<command_state *>(private_data);
+
+                self->status_ = status;
+                self->data_ = command_data;
+                self->done_ = true;
+                /* issue() returns false for commands that complete inline */
+                if (!self->launching_) {
+                        static_cast<Derived *>(self)->completed();
+                }
+        }
+
+        int status_ = 0;
+        void *data_ = nullptr;
+        bool launching_ = false;
+        bool done_ = false;
+};
+
+} /* namespace detail */
+
+/*
+ * A command started with a receiver, see command::connect(). The
+ * receiver gets set_value(value), or set_value() for commands without a
+ * value, or set_error(smb2::error). It must not be moved once started.
+ */
+template <typename Op, typename Receiver>
+class operation
+        : detail::command_state<Op, operation<Op, Receiver>> {
+        using base = detail::command_state<Op, operation<Op, Receiver>>;
+        friend base;
+
+public:
+        operation(struct smb2_context *smb2, Op &&op, Receiver &&r)
+                : base(smb2, std::move(op)), r_(std::move(r)) {}
+        operation(const operation &) = delete;
+        operation &operator=(const operation &) = delete;
+
+        void start()
+        {
+                if (!this->issue()) {
+                        completed();
+                }
+        }
+
+private:
+        void completed()
+        {
+                try {
+                        if constexpr (std::is_void_v<typename base::value_type>) {
+                                this->result();
+                                r_.set_value();
+                        } else {
+                                r_.set_value(this->result());
+                        }
+                } catch (const error &e) {
+                        r_.set_error(e);
+                }
+        }
+
+        Receiver r_;
+};
+
+/*
+ * An SMB2 command. co_await it from a task, or connect it to a receiver
+ * and start() the operation.
+ */
+template <typename Op>
+class command : detail::command_state<Op, command<Op>> {
+        using base = detail::command_state<Op, command<Op>>;
+        friend base;
+
+public:
+        using value_type = typename base::value_type;
+
+        command(struct smb2_context *smb2, Op op)
+                : base(smb2, std::move(op)) {}
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+                continuation_ = h;
+                return this->issue();
+        }
+        value_type await_resume() { return this->result(); }
+
+        template <typename Receiver>
+        operation<Op, std::decay_t<Receiver>> connect(Receiver &&r) &&
+        {
+                return operation<Op, std::decay_t<Receiver>>(
+                        this->smb2_, std::move(this->op_),
+                        std::forward<Receiver>(r));
+        }
+
+private:
+        void completed() { continuation_.resume(); }
+
+        std::coroutine_handle<> continuation_;
+};
+
+class file;
+class directory;
+
+namespace detail {
+
+inline void
+ignore_cb(struct smb2_context *, int, void *, void *)
+{
+}
+
+/* Commands that take the context and the callback */
+template <int (*Fn)(struct smb2_context *, smb2_command_cb, void *)>
+struct context_op {
+        using value_type = void;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return Fn(smb2, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+/* Commands that take a path and have no result */
+template <int (*Fn)(struct smb2_context *, const char *,
+                    smb2_command_cb, void *)>
+struct path_op {
+        using value_type = void;
+        std::string path;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return Fn(smb2, path.c_str(), cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+/* Commands that take a handle and have no result */
+template <int (*Fn)(struct smb2_context *, struct smb2fh *,
+                    smb2_command_cb, void *)>
+struct handle_op {
+        using value_type = void;
+        struct smb2fh *fh;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return Fn(smb2, fh, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct connect_share_op {
+        using value_type = void;
+        std::string server, share, user;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_connect_share_async(smb2, server.c_str(),
+                                                share.c_str(),
+                                                user.empty() ?
+                                                NULL : user.c_str(),
+                                                cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct open_op {
+        using value_type = file;
+        std::string path;
+        int flags;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_open_async(smb2, path.c_str(), flags, cb, d);
+        }
+        file complete(struct smb2_context *smb2, int, void *data);
+};
+
+struct opendir_op {
+        using value_type = directory;
+        std::string path;
+
+        /* The smb2dir frees its cb_data, so it gets one of these */
+        struct relay {
+                smb2_command_cb cb;
+                void *d;
+        };
+
+        static void relay_cb(struct smb2_context *smb2, int status,
+                             void *data, void *private_data)
+        {
+                struct relay *r = static_cast<struct relay *>(private_data);
+
+                r->cb(smb2, status, data, r->d);
+        }
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                struct relay *r;
+                int rc;
+
+                r = static_cast<struct relay *>(malloc(sizeof(struct relay)));
+                if (r == nullptr) {
+                        return -ENOMEM;
+                }
+                r->cb = cb;
+                r->d = d;
+                rc = smb2_opendir_async(smb2, path.c_str(), relay_cb, r);
+                if (rc < 0) {
+                        free(r);
+                }
+                return rc;
+        }
+        directory complete(struct smb2_context *smb2, int, void *data);
+};
+
+struct opendir_ex_op : opendir_op {
+        uint8_t info_class;
+        std::string pattern;
+        uint32_t output_buffer_length;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                struct relay *r;
+                int rc;
+
+                r = static_cast<struct relay *>(malloc(sizeof(struct relay)));
+                if (r == nullptr) {
+                        return -ENOMEM;
+                }
+                r->cb = cb;
+                r->d = d;
+                rc = smb2_opendir_ex_async(smb2, path.c_str(), info_class,
+                                           pattern.empty() ?
+                                           NULL : pattern.c_str(),
+                                           output_buffer_length,
+                                           relay_cb, r);
+                if (rc < 0) {
+                        free(r);
+                }
+                return rc;
+        }
+};
+
+/* The entries and the result of the walk share its cb_data */
+struct walk_op {
+        using value_type = void;
+        std::string path;
+        uint8_t info_class;
+        int max_in_flight;
+        int max_depth;
+        std::function<int(struct smb2_walk_entry *)> entry;
+        smb2_command_cb cb = nullptr;
+        void *d = nullptr;
+
+        static int entry_cb(struct smb2_context *, struct smb2_walk_entry *ent,
+                            void *private_data)
+        {
+                return static_cast<walk_op *>(private_data)->entry(ent);
+        }
+
+        static void relay_cb(struct smb2_context *smb2, int status,
+                             void *data, void *private_data)
+        {
+                auto *op = static_cast<walk_op *>(private_data);
+
+                op->cb(smb2, status, data, op->d);
+        }
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                this->cb = cb;
+                this->d = d;
+                return smb2_walk_async(smb2, path.c_str(), info_class,
+                                       max_in_flight, max_depth,
+                                       entry_cb, relay_cb, this);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct stat_batch_op {
+        using value_type = void;
+        struct smb2_stat_batch_entry *entries;
+        int count;
+        int window;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_stat_batch_async(smb2, entries, count, window,
+                                             cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+/*
+ * Base for commands whose result is only valid during the callback. It
+ * is copied into Derived::result before the callback of the command is
+ * passed on, as a command that completes inline is only looked at once
+ * the callback has returned.
+ */
+template <typename Derived>
+struct copy_out_op {
+        smb2_command_cb cb;
+        void *d;
+
+        static void relay_cb(struct smb2_context *smb2, int status,
+                             void *data, void *private_data)
+        {
+                auto *op = static_cast<Derived *>(private_data);
+
+                if (status == 0 && data != nullptr) {
+                        op->copy_out(data);
+                }
+                op->cb(smb2, status, nullptr, op->d);
+        }
+};
+
+struct get_file_op : copy_out_op<get_file_op> {
+        using value_type = uint64_t;
+        std::string path;
+        uint8_t *buf;
+        uint64_t count;
+        uint64_t result = 0;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                this->cb = cb;
+                this->d = d;
+                return smb2_get_file_async(smb2, path.c_str(), buf, count,
+                                           relay_cb, this);
+        }
+        void copy_out(void *data) { result = *static_cast<uint64_t *>(data); }
+        uint64_t complete(struct smb2_context *, int, void *)
+        {
+                return result;
+        }
+};
+
+struct put_file_op : copy_out_op<put_file_op> {
+        using value_type = uint64_t;
+        std::string path;
+        const uint8_t *buf;
+        uint64_t count;
+        uint64_t result = 0;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                this->cb = cb;
+                this->d = d;
+                return smb2_put_file_async(smb2, path.c_str(), buf, count,
+                                           relay_cb, this);
+        }
+        void copy_out(void *data) { result = *static_cast<uint64_t *>(data); }
+        uint64_t complete(struct smb2_context *, int, void *)
+        {
+                return result;
+        }
+};
+
+struct pread_op {
+        using value_type = uint32_t;
+        struct smb2fh *fh;
+        uint8_t *buf;
+        uint32_t count;
+        uint64_t offset;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_pread_async(smb2, fh, buf, count, offset, cb, d);
+        }
+        uint32_t complete(struct smb2_context *, int status, void *)
+        {
+                return status;
+        }
+};
+
+struct pwrite_op {
+        using value_type = uint32_t;
+        struct smb2fh *fh;
+        const uint8_t *buf;
+        uint32_t count;
+        uint64_t offset;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_pwrite_async(smb2, fh, buf, count, offset,
+                                         cb, d);
+        }
+        uint32_t complete(struct smb2_context *, int status, void *)
+        {
+                return status;
+        }
+};
+
+struct read_op {
+        using value_type = uint32_t;
+        struct smb2fh *fh;
+        uint8_t *buf;
+        uint32_t count;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_read_async(smb2, fh, buf, count, cb, d);
+        }
+        uint32_t complete(struct smb2_context *, int status, void *)
+        {
+                return status;
+        }
+};
+
+struct write_op {
+        using value_type = uint32_t;
+        struct smb2fh *fh;
+        const uint8_t *buf;
+        uint32_t count;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_write_async(smb2, fh, buf, count, cb, d);
+        }
+        uint32_t complete(struct smb2_context *, int status, void *)
+        {
+                return status;
+        }
+};
+
+struct stat_op {
+        using value_type = struct smb2_stat_64;
+        std::string path;
+        struct smb2_stat_64 st{};
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_stat_async(smb2, path.c_str(), &st, cb, d);
+        }
+        struct smb2_stat_64 complete(struct smb2_context *, int, void *)
+        {
+                return st;
+        }
+};
+
+struct fstat_op {
+        using value_type = struct smb2_stat_64;
+        struct smb2fh *fh;
+        struct smb2_stat_64 st{};
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_fstat_async(smb2, fh, &st, cb, d);
+        }
+        struct smb2_stat_64 complete(struct smb2_context *, int, void *)
+        {
+                return st;
+        }
+};
+
+struct statvfs_op {
+        using value_type = struct smb2_statvfs;
+        std::string path;
+        struct smb2_statvfs st{};
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_statvfs_async(smb2, path.c_str(), &st, cb, d);
+        }
+        struct smb2_statvfs complete(struct smb2_context *, int, void *)
+        {
+                return st;
+        }
+};
+
+struct rename_op {
+        using value_type = void;
+        std::string oldpath, newpath;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_rename_async(smb2, oldpath.c_str(),
+                                         newpath.c_str(), cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct truncate_op {
+        using value_type = void;
+        std::string path;
+        uint64_t length;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_truncate_async(smb2, path.c_str(), length, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct ftruncate_op {
+        using value_type = void;
+        struct smb2fh *fh;
+        uint64_t length;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_ftruncate_async(smb2, fh, length, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct readlink_op {
+        using value_type = std::string;
+        std::string path;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_readlink_async(smb2, path.c_str(), cb, d);
+        }
+        std::string complete(struct smb2_context *, int, void *data)
+        {
+                return data ? std::string(static_cast<const char *>(data)) :
+                        std::string();
+        }
+};
+
+struct copy_range_op {
+        using value_type = void;
+        struct smb2fh *src;
+        uint64_t src_offset;
+        struct smb2fh *dst;
+        uint64_t dst_offset;
+        uint64_t len;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_copy_range_async(smb2, src, src_offset,
+                                             dst, dst_offset, len, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct allocated_ranges_op : copy_out_op<allocated_ranges_op> {
+        using value_type = std::vector<struct smb2_allocated_range>;
+        struct smb2fh *fh;
+        uint64_t offset;
+        uint64_t len;
+        std::vector<struct smb2_allocated_range> result;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                this->cb = cb;
+                this->d = d;
+                return smb2_query_allocated_ranges_async(smb2, fh, offset,
+                                                         len, relay_cb, this);
+        }
+        void copy_out(void *data)
+        {
+                auto *r = static_cast<struct smb2_allocated_ranges *>(data);
+
+                result.assign(r->ranges, r->ranges + r->count);
+        }
+        std::vector<struct smb2_allocated_range>
+        complete(struct smb2_context *, int, void *)
+        {
+                return std::move(result);
+        }
+};
+
+struct zero_range_op {
+        using value_type = void;
+        struct smb2fh *fh;
+        uint64_t offset;
+        uint64_t len;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_zero_range_async(smb2, fh, offset, len, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+struct set_sparse_op {
+        using value_type = void;
+        struct smb2fh *fh;
+        int sparse;
+
+        int launch(struct smb2_context *smb2, smb2_command_cb cb, void *d)
+        {
+                return smb2_set_sparse_async(smb2, fh, sparse, cb, d);
+        }
+        void complete(struct smb2_context *, int, void *) {}
+};
+
+} /* namespace detail */
+
+/*
+ * An open file. Closed in the background when destroyed, co_await
+ * close() to see the result.
+ */
+class file {
+public:
+        file() noexcept = default;
+        file(struct smb2_context *smb2, struct smb2fh *fh) noexcept
+                : smb2_(smb2), fh_(fh) {}
+        file(file &&other) noexcept
+                : smb2_(other.smb2_), fh_(std::exchange(other.fh_, nullptr)) {}
+        file &operator=(file &&other) noexcept
+        {
+                if (this != &other) {
+                        reset();
+                        smb2_ = other.smb2_;
+                        fh_ = std::exchange(other.fh_, nullptr);
+                }
+                return *this;
+        }
+        file(const file &) = delete;
+        file &operator=(const file &) = delete;
+        ~file() { reset(); }
+
+        struct smb2fh *get() const noexcept { return fh_; }
+        explicit operator bool() const noexcept { return fh_ != nullptr; }
+
+        /* Gives up ownership of the handle */
+        struct smb2fh *release() noexcept
+        {
+                return std::exchange(fh_, nullptr);
+        }
+
+        void reset() noexcept
+        {
+                if (fh_) {
+                        smb2_close_async(smb2_, fh_, detail::ignore_cb,
+                                         nullptr);
+                        fh_ = nullptr;
+                }
+        }
+
+        /* The file is released when close() is called, not awaited */
+        command<detail::handle_op<smb2_close_async>> close()
+        {
+                return {smb2_, {release()}};
+        }
+
+        command<detail::pread_op>
+        pread(void *buf, uint32_t count, uint64_t offset) const
+        {
+                return {smb2_, {fh_, static_cast<uint8_t *>(buf),
+                                count, offset}};
+        }
+
+        command<detail::pwrite_op>
+        pwrite(const void *buf, uint32_t count, uint64_t offset) const
+        {
+                return {smb2_, {fh_, static_cast<const uint8_t *>(buf),
+                                count, offset}};
+        }
+
+        command<detail::read_op> read(void *buf, uint32_t count) const
+        {
+                return {smb2_, {fh_, static_cast<uint8_t *>(buf), count}};
+        }
+
+        command<detail::write_op> write(const void *buf, uint32_t count) const
+        {
+                return {smb2_, {fh_, static_cast<const uint8_t *>(buf),
+                                count}};
+        }
+
+        command<detail::fstat_op> fstat() const
+        {
+                return {smb2_, {fh_}};
+        }
+
+        command<detail::handle_op<smb2_fsync_async>> fsync() const
+        {
+                return {smb2_, {fh_}};
+        }
+
+        command<detail::ftruncate_op> ftruncate(uint64_t length) const
+        {
+                return {smb2_, {fh_, length}};
+        }
+
+        command<detail::allocated_ranges_op>
+        allocated_ranges(uint64_t offset, uint64_t len) const
+        {
+                return {smb2_, {{}, fh_, offset, len, {}}};
+        }
+
+        command<detail::zero_range_op>
+        zero_range(uint64_t offset, uint64_t len) const
+        {
+                return {smb2_, {fh_, offset, len}};
+        }
+
+        command<detail::set_sparse_op> set_sparse(bool sparse = true) const
+        {
+                return {smb2_, {fh_, sparse}};
+        }
+
+private:
+        struct smb2_context *smb2_ = nullptr;
+        struct smb2fh *fh_ = nullptr;
+};
+
+/*
+ * An open directory. smb2_opendir() reads the whole directory, so
+ * iterating over the entries does not block.
+ */
+class directory {
+public:
+        class iterator {
+        public:
+                using value_type = struct smb2dirent;
+                using difference_type = std::ptrdiff_t;
+                using pointer = struct smb2dirent *;
+                using reference = struct smb2dirent &;
+                using iterator_category = std::input_iterator_tag;
+
+                iterator() noexcept = default;
+                iterator(struct smb2_context *smb2, struct smb2dir *dir)
+                        : smb2_(smb2), dir_(dir)
+                {
+                        ++*this;
+                }
+
+                reference operator*() const noexcept { return *ent_; }
+                pointer operator->() const noexcept { return ent_; }
+                iterator &operator++()
+                {
+                        ent_ = smb2_readdir(smb2_, dir_);
+                        return *this;
+                }
+                void operator++(int) { ++*this; }
+                bool operator==(const iterator &other) const noexcept
+                {
+                        return ent_ == other.ent_;
+                }
+
+        private:
+                struct smb2_context *smb2_ = nullptr;
+                struct smb2dir *dir_ = nullptr;
+                struct smb2dirent *ent_ = nullptr;
+        };
+
+        directory() noexcept = default;
+        directory(struct smb2_context *smb2, struct smb2dir *dir) noexcept
+                : smb2_(smb2), dir_(dir) {}
+        directory(directory &&other) noexcept
+                : smb2_(other.smb2_),
+                  dir_(std::exchange(other.dir_, nullptr)) {}
+        directory &operator=(directory &&other) noexcept
+        {
+                if (this != &other) {
+                        reset();
+                        smb2_ = other.smb2_;
+                        dir_ = std::exchange(other.dir_, nullptr);
+                }
+                return *this;
+        }
+        directory(const directory &) = delete;
+        directory &operator=(const directory &) = delete;
+        ~directory() { reset(); }
+
+        struct smb2dir *get() const noexcept { return dir_; }
+        explicit operator bool() const noexcept { return dir_ != nullptr; }
+
+        struct smb2dir *release() noexcept
+        {
+                return std::exchange(dir_, nullptr);
+        }
+
+        void reset() noexcept
+        {
+                if (dir_) {
+                        smb2_closedir(smb2_, dir_);
+                        dir_ = nullptr;
+                }
+        }
+
+        /* Iterating restarts from the first entry */
+        iterator begin()
+        {
+                smb2_rewinddir(smb2_, dir_);
+                return iterator(smb2_, dir_);
+        }
+        iterator end() noexcept { return iterator(); }
+
+private:
+        struct smb2_context *smb2_ = nullptr;
+        struct smb2dir *dir_ = nullptr;
+};
+
+namespace detail {
+
+inline file
+open_op::complete(struct smb2_context *smb2, int, void *data)
+{
+        return file(smb2, static_cast<struct smb2fh *>(data));
+}
+
+inline directory
+opendir_op::complete(struct smb2_context *smb2, int, void *data)
+{
+        return directory(smb2, static_cast<struct smb2dir *>(data));
+}
+
+} /* namespace detail */
+
+inline command<detail::connect_share_op>
+connect_share(struct smb2_context *smb2, std::string server,
+              std::string share, std::string user = std::string())
+{
+        return {smb2, {std::move(server), std::move(share), std::move(user)}};
+}
+
+inline command<detail::context_op<smb2_disconnect_share_async>>
+disconnect_share(struct smb2_context *smb2)
+{
+        return {smb2, {}};
+}
+
+inline command<detail::open_op>
+open(struct smb2_context *smb2, std::string path, int flags)
+{
+        return {smb2, {std::move(path), flags}};
+}
+
+inline command<detail::opendir_op>
+opendir(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+inline command<detail::opendir_ex_op>
+opendir_ex(struct smb2_context *smb2, std::string path, uint8_t info_class,
+           std::string pattern = std::string(),
+           uint32_t output_buffer_length = 0)
+{
+        return {smb2, {{std::move(path)}, info_class, std::move(pattern),
+                       output_buffer_length}};
+}
+
+/*
+ * entry is called for every entry found, and returns SMB2_WALK_CONTINUE,
+ * SMB2_WALK_PRUNE or -errno, see smb2_walk_async().
+ */
+inline command<detail::walk_op>
+walk(struct smb2_context *smb2, std::string path, uint8_t info_class,
+     int max_in_flight, int max_depth,
+     std::function<int(struct smb2_walk_entry *)> entry)
+{
+        return {smb2, {std::move(path), info_class, max_in_flight, max_depth,
+                       std::move(entry), nullptr, nullptr}};
+}
+
+inline command<detail::stat_op>
+stat(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+inline command<detail::statvfs_op>
+statvfs(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+inline command<detail::path_op<smb2_unlink_async>>
+unlink(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+inline command<detail::path_op<smb2_mkdir_async>>
+mkdir(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+inline command<detail::path_op<smb2_rmdir_async>>
+rmdir(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+inline command<detail::rename_op>
+rename(struct smb2_context *smb2, std::string oldpath, std::string newpath)
+{
+        return {smb2, {std::move(oldpath), std::move(newpath)}};
+}
+
+inline command<detail::truncate_op>
+truncate(struct smb2_context *smb2, std::string path, uint64_t length)
+{
+        return {smb2, {std::move(path), length}};
+}
+
+inline command<detail::readlink_op>
+readlink(struct smb2_context *smb2, std::string path)
+{
+        return {smb2, {std::move(path)}};
+}
+
+/* The result of each path is in the status field of its entry */
+inline command<detail::stat_batch_op>
+stat_batch(struct smb2_context *smb2, struct smb2_stat_batch_entry *entries,
+           int count, int window)
+{
+        return {smb2, {entries, count, window}};
+}
+
+inline command<detail::get_file_op>
+get_file(struct smb2_context *smb2, std::string path, void *buf,
+         uint64_t count)
+{
+        return {smb2, {{}, std::move(path), static_cast<uint8_t *>(buf),
+                       count, 0}};
+}
+
+inline command<detail::put_file_op>
+put_file(struct smb2_context *smb2, std::string path, const void *buf,
+         uint64_t count)
+{
+        return {smb2, {{}, std::move(path),
+                       static_cast<const uint8_t *>(buf), count, 0}};
+}
+
+inline command<detail::copy_range_op>
+copy_range(struct smb2_context *smb2, const file &src, uint64_t src_offset,
+           const file &dst, uint64_t dst_offset, uint64_t len)
+{
+        return {smb2, {src.get(), src_offset, dst.get(), dst_offset, len}};
+}
+
+inline command<detail::context_op<smb2_echo_async>>
+echo(struct smb2_context *smb2)
+{
+        return {smb2, {}};
+}
+
+/*
+ * Runs all the tasks concurrently and returns their results in order.
+ * Waits for all of them even if one fails, then rethrows the first
+ * exception.
+ */
+template <typename T>
+task<std::vector<T>>
+when_all(std::vector<task<T>> tasks)
+{
+        std::exception_ptr first;
+        std::vector<T> results;
+
+        results.reserve(tasks.size());
+        for (auto &t : tasks) {
+                t.start();
+        }
+        for (auto &t : tasks) {
+                try {
+                        results.push_back(co_await std::move(t));
+                } catch (...) {
+                        if (!first) {
+                                first = std::current_exception();
+                        }
+                }
+        }
+        if (first) {
+                std::rethrow_exception(first);
+        }
+        co_return results;
+}
+
+inline task<void>
+when_all(std::vector<task<void>> tasks)
+{
+        std::exception_ptr first;
+
+        for (auto &t : tasks) {
+                t.start();
+        }
+        for (auto &t : tasks) {
+                try {
+                        co_await std::move(t);
+                } catch (...) {
+                        if (!first) {
+                                first = std::current_exception();
+                        }
+                }
+        }
+        if (first) {
+                std::rethrow_exception(first);
+        }
+}
+
+namespace detail {
+
+struct detached {
+        struct promise_type {
+                detached get_return_object() noexcept { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() noexcept {}
+                void unhandled_exception() noexcept { std::terminate(); }
+        };
+};
+
+inline detached
+run_detached(task<void> t)
+{
+        co_await std::move(t);
+}
+
+} /* namespace detail */
+
+/*
+ * Starts a task that nobody waits for. It runs as the context is
+ * serviced and frees itself when done. An exception escaping it
+ * terminates the program.
+ */
+inline void
+spawn(task<void> t)
+{
+        detail::run_detached(std::move(t));
+}
+
+#ifndef _WIN32
+/*
+ * Waits at most timeout ms for the context to become ready and services
+ * it, including the work submitted from other threads.
+ */
+inline void
+service(struct smb2_context *smb2, int timeout)
+{
+        struct pollfd pfd[2] = {};
+        int next, nfds = 1;
+
+        pfd[0].fd = smb2_get_fd(smb2);
+        pfd[0].events = smb2_which_events(smb2);
+        pfd[1].fd = smb2_get_submit_fd(smb2);
+        pfd[1].events = POLLIN;
+        if (pfd[1].fd >= 0) {
+                nfds = 2;
+        }
+
+        next = smb2_get_next_timeout(smb2);
+        if (next >= 0 && (timeout < 0 || next < timeout)) {
+                timeout = next;
+        }
+        if (poll(pfd, nfds, timeout) < 0 && errno != EINTR) {
+                throw error(errno, "poll failed");
+        }
+        if (pfd[1].revents) {
+                smb2_service_fd(smb2, pfd[1].fd, pfd[1].revents);
+        }
+        /* also times out the commands that have passed their deadline */
+        if (smb2_service(smb2, pfd[0].revents) < 0) {
+                throw error(EIO, smb2_get_error(smb2));
+        }
+}
+
+/* Services the context until the task is done and returns its result */
+template <typename T>
+T
+sync_wait(struct smb2_context *smb2, task<T> t)
+{
+        t.start();
+        while (!t.done()) {
+                service(smb2, 1000);
+        }
+        return t.result();
+}
+#endif
+
+/* Same as above for a context that is serviced by a reactor */
+template <typename T>
+T
+sync_wait(struct smb2_reactor *reactor, task<T> t)
+{
+        t.start();
+        while (!t.done()) {
+                if (smb2_reactor_run_once(reactor, 1000) < 0) {
+                        throw error(EIO, "smb2_reactor_run_once failed");
+                }
+        }
+        return t.result();
+}
+
+} /* namespace smb2 */
+
+#endif /* !_LIBSMB2_CORO_HPP_ */
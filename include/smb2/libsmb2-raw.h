@@ -36,6 +36,50 @@ extern const smb2_file_id compound_file_id;
  */
 void smb2_free_data(struct smb2_context *smb2, void *ptr);
 
+/*
+ * Compound requests.
+ *
+ * A compound is a chain of commands that is signed, sealed and sent to
+ * the server as one unit and so completes in a single round trip.
+ * Every command in the chain still has its own callback which is invoked
+ * when its reply arrives.
+ *
+ * Commands added with SMB2_COMPOUND_RELATED operate on the file handle
+ * of the previous command in the chain. For these commands pass
+ * compound_file_id as the file id and the server will substitute the
+ * file id that was opened, or used, by the preceding command.
+ * Commands added without the flag are unrelated and are processed
+ * independently by the server. The first command in a chain can not
+ * be related.
+ *
+ * Example, open a file, read from it and close it in one round trip:
+ *   c = smb2_compound_init(smb2);
+ *   smb2_compound_add(smb2, c, smb2_cmd_create_async(...), 0);
+ *   smb2_compound_add(smb2, c, smb2_cmd_read_async(...),
+ *                     SMB2_COMPOUND_RELATED);
+ *   smb2_compound_add(smb2, c, smb2_cmd_close_async(...),
+ *                     SMB2_COMPOUND_RELATED);
+ *   smb2_compound_queue(smb2, c);
+ *
+ * smb2_compound_add() returns 0 on success or -errno on failure, in
+ * which case the pdu is not part of the compound and is still owned by
+ * the caller.
+ * smb2_compound_queue() sends the chain and frees the builder. It returns
+ * 0 on success or -errno on failure, the builder is freed in either case.
+ * smb2_compound_free() discards a compound that was never queued together
+ * with all the pdus that were added to it.
+ */
+#define SMB2_COMPOUND_RELATED   0x00000001
+
+struct smb2_compound;
+
+struct smb2_compound *smb2_compound_init(struct smb2_context *smb2);
+int smb2_compound_add(struct smb2_context *smb2, struct smb2_compound *c,
+                      struct smb2_pdu *pdu, uint32_t flags);
+int smb2_compound_count(struct smb2_compound *c);
+int smb2_compound_queue(struct smb2_context *smb2, struct smb2_compound *c);
+void smb2_compound_free(struct smb2_context *smb2, struct smb2_compound *c);
+
 /*
  * Asynchronous SMB2 Negotiate
  * pdu  : If the call was initiated and a connection will be attempted.
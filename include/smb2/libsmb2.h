@@ -259,12 +259,31 @@ int smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents);
  * Set the timeout in seconds after which a command will be aborted with
  * SMB2_STATUS_IO_TIMEOUT.
  * If you use timeouts with the async API you must make sure to call
- * smb2_service() at least once every second.
+ * smb2_service() at least once every second, or when the time returned
+ * by smb2_get_next_timeout() has passed.
+ *
+ * The timeout applies to the commands issued after it has been set, so
+ * it can be changed around the commands that need a different one.
  *
  * Default is 0: No timeout.
  */
 void smb2_set_timeout(struct smb2_context *smb2, int seconds);
 
+/*
+ * Same as smb2_set_timeout() but in ms, for timeouts shorter than a
+ * second.
+ */
+void smb2_set_timeout_ms(struct smb2_context *smb2, int ms);
+
+/*
+ * Returns the number of ms until the first command times out, 0 if a
+ * command has already timed out and -1 if no command has a timeout.
+ *
+ * Event loops can use this as the timeout of poll() and call
+ * smb2_service() once it has passed to abort the commands that timed out.
+ */
+int smb2_get_next_timeout(struct smb2_context *smb2);
+
 /*
  * Set passthrough-enable.  Passthrough allows command packers
  * and unpackers to keep the extra data on complex commands
@@ -398,6 +417,8 @@ void smb2_register_error_callback(struct smb2_context *smb,
 
 /*
  * register for oplock or lease break callbacks
+ * Leasing is only offered to the server if this is set, or a cache that
+ * uses leases is enabled, before connecting.
  */
 void smb2_set_oplock_or_lease_break_callback(struct smb2_context *smb2,
                     smb2_oplock_or_lease_break_cb cb);
@@ -601,6 +622,14 @@ void smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
 void smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
 int smb2_pdu_is_compound(struct smb2_context *smb2);
 
+/*
+ * Overrides the timeout of a pdu, and of the pdus chained to it, with
+ * one of ms from now. 0 means the pdu never times out.
+ * Can be called before or after the pdu has been queued.
+ */
+void smb2_set_pdu_timeout(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                          int ms);
+
 /*
  * OPENDIR
  */
@@ -630,6 +659,42 @@ int smb2_opendir_async(struct smb2_context *smb2, const char *path,
  */
 struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path);
 
+/*
+ * Async opendir() with control over the directory enumeration.
+ *
+ * info_class : The file information class used for the QUERY_DIRECTORY
+ *              requests. One of :
+ *   SMB2_FILE_NAMES_INFORMATION             : Only the name of each entry
+ *                                             is returned. All fields in
+ *                                             dirent->st are zero.
+ *   SMB2_FILE_BOTH_DIRECTORY_INFORMATION    : Name, times, size and type.
+ *                                             smb2_ino is zero.
+ *   SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION : Same as smb2_opendir_async().
+ * pattern    : Wildcard pattern that is evaluated by the server, for example
+ *              "*.txt". NULL means "*".
+ * output_buffer_length : Size of the buffer requested for each
+ *              QUERY_DIRECTORY reply. 0 means the default size.
+ *              The value is clamped to the max_transact_size negotiated
+ *              with the server, and to 64kb if the server does not support
+ *              multi-credit requests.
+ *
+ * Returns and callback semantics are the same as for smb2_opendir_async().
+ */
+int smb2_opendir_ex_async(struct smb2_context *smb2, const char *path,
+                          uint8_t info_class, const char *pattern,
+                          uint32_t output_buffer_length,
+                          smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync opendir() with control over the directory enumeration.
+ * See smb2_opendir_ex_async() for the arguments.
+ *
+ * Returns NULL on failure.
+ */
+struct smb2dir *smb2_opendir_ex(struct smb2_context *smb2, const char *path,
+                                uint8_t info_class, const char *pattern,
+                                uint32_t output_buffer_length);
+
 /*
  * closedir()
  */
@@ -672,6 +737,81 @@ long smb2_telldir(struct smb2_context *smb2, struct smb2dir *smb2dir);
 void smb2_seekdir(struct smb2_context *smb2, struct smb2dir *smb2dir,
                   long loc);
 
+/*
+ * WALK
+ */
+/*
+ * Return values for the walk entry callback.
+ * SMB2_WALK_CONTINUE : Continue the walk. If the entry is a directory it
+ *                      will be descended into.
+ * SMB2_WALK_PRUNE    : Continue the walk but do not descend into this
+ *                      directory.
+ * <0                 : Abort the walk. The value is reported as the
+ *                      status of the walk.
+ */
+#define SMB2_WALK_CONTINUE 0
+#define SMB2_WALK_PRUNE    1
+
+struct smb2_walk_entry {
+        const char *path;       /* path of the entry relative to the share */
+        const char *name;       /* name of the entry */
+        const char *parent;     /* path of the directory holding the entry */
+        int depth;              /* 1 for entries in the starting directory */
+        struct smb2_stat_64 *st;
+};
+
+/*
+ * Called once for every entry found during the walk. The entry and all
+ * the strings it points to are only valid during the callback.
+ */
+typedef int (*smb2_walk_entry_cb)(struct smb2_context *smb2,
+                                  struct smb2_walk_entry *ent,
+                                  void *cb_data);
+
+/*
+ * Async recursive walk of a directory tree.
+ *
+ * Enumerates path and all directories below it, keeping up to
+ * max_in_flight directory listings outstanding at the same time. No more
+ * listings are started than there are credits available.
+ * Entries are reported through entry_cb in no particular order, except
+ * that the entries of a directory are always reported after the entry for
+ * the directory itself.
+ *
+ * info_class : SMB2_FILE_BOTH_DIRECTORY_INFORMATION,
+ *              SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION or 0 for the default.
+ *              See smb2_opendir_ex_async().
+ * max_depth  : Do not descend more than this many levels. 0 means no limit.
+ *
+ * Returns
+ *  0 : The walk was started. Result of the walk will be reported
+ *      through the callback function.
+ * <0 : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : The whole tree was walked.
+ * -errno : The walk was aborted by entry_cb, or one or more directories
+ *          could not be listed. Status is the first error that was seen.
+ *          Listing failures do not stop the rest of the walk.
+ * Command_data is always NULL.
+ */
+int smb2_walk_async(struct smb2_context *smb2, const char *path,
+                    uint8_t info_class, int max_in_flight, int max_depth,
+                    smb2_walk_entry_cb entry_cb,
+                    smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync recursive walk of a directory tree.
+ * See smb2_walk_async() for the arguments.
+ *
+ * Returns:
+ * 0      : The whole tree was walked.
+ * -errno : Failure.
+ */
+int smb2_walk(struct smb2_context *smb2, const char *path,
+              uint8_t info_class, int max_in_flight, int max_depth,
+              smb2_walk_entry_cb entry_cb, void *cb_data);
+
 /*
  * OPEN
  */
@@ -785,6 +925,485 @@ struct smb2_write_cb_data {
         uint64_t offset;
 };
 
+/*
+ * Read cache
+ *
+ * When enabled, files that are opened for reading with smb2_open_async()
+ * ask the server for a read lease, or a level II oplock on servers that
+ * do not support leasing. While it is held, data read through the handle
+ * is cached in blocks of 64kb, up to max_bytes per handle, and
+ * sequential reads trigger read-ahead of the following blocks.
+ * The cached data is dropped as soon as the server breaks the lease.
+ *
+ * Reads that are served from the cache invoke their callback before
+ * smb2_pread_async() returns.
+ *
+ * Only affects files opened after the call, and leases are only
+ * negotiated if the cache is enabled before connecting. max_bytes 0
+ * disables the cache, which is the default.
+ */
+void smb2_set_read_cache(struct smb2_context *smb2, uint32_t max_bytes);
+
+/*
+ * Write cache
+ *
+ * When enabled, files that are opened for writing with smb2_open_async()
+ * ask the server for a read/write lease, or an exclusive oplock on servers
+ * that do not support leasing. While it is held, writes smaller than 64kb
+ * are buffered and complete before smb2_pwrite_async() returns. Adjacent
+ * writes are combined and sent as WRITEs of up to max_write_size.
+ *
+ * Buffered data is written once more than max_dirty_bytes are dirty, by
+ * smb2_fsync_async() and smb2_close_async(), and before a break of the
+ * lease is acknowledged. Errors from these writes are returned by the
+ * following fsync or close. smb2_fstat_async() reports the size known to
+ * the server, which does not include data that is still buffered.
+ *
+ * Only affects files opened after the call, and leases are only
+ * negotiated if the cache is enabled before connecting. max_dirty_bytes
+ * 0 disables the cache, which is the default.
+ */
+void smb2_set_write_cache(struct smb2_context *smb2,
+                          uint32_t max_dirty_bytes);
+
+/*
+ * Open-handle cache
+ *
+ * When enabled, files opened with smb2_open_async() ask the server for a
+ * lease with handle caching. If the lease is still held when the handle
+ * is closed, the CLOSE is not sent and the handle is kept for up to
+ * max_handles idle handles. A later open of the same path, with the same
+ * access mode and without O_TRUNC, O_EXCL or O_SYNC, gets the idle handle
+ * back before smb2_open_async() returns and without a round trip.
+ *
+ * Idle handles are closed when the server breaks the handle lease, when
+ * there are too many of them, and before the path is unlinked, renamed or
+ * truncated through this context or the share is disconnected.
+ * Requires a server that supports leasing, and the cache to be enabled
+ * before connecting.
+ *
+ * max_handles 0 closes all idle handles and disables the cache, which is
+ * the default.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_set_handle_cache(struct smb2_context *smb2, int max_handles);
+
+/*
+ * io_uring transport (Linux only)
+ *
+ * When enabled, the connection is driven through an io_uring once the
+ * socket has connected. smb2_get_fd() and smb2_get_fds() then return the
+ * ring fd instead of the socket and smb2_which_events() the events to
+ * wait for on it, so event loops need no changes. Replies are received
+ * with a multishot recv into a ring of provided buffers and queued
+ * requests are sent with one io_uring_enter() per batch.
+ *
+ * Applications that cache the fd must use the smb2_fd_event_callbacks()
+ * to learn about the switch.
+ *
+ * Must be called before connecting. If the ring can not be set up when
+ * the connection is made, the socket is used directly as usual.
+ *
+ * Returns 0 on success or -ENOTSUP if the library was built without
+ * io_uring support or the running kernel does not provide it.
+ */
+int smb2_set_io_uring(struct smb2_context *smb2, int enable);
+
+/*
+ * Reactor (Linux only)
+ *
+ * A reactor services any number of contexts from one thread. It keeps
+ * the fds of all its contexts in a single epoll set, so waiting costs the
+ * same for ten contexts as for ten thousand and only the contexts that
+ * have events are serviced. Command timeouts, see smb2_set_timeout(), are
+ * tracked in a timer wheel shared by all the contexts instead of by
+ * walking the queues of every context each time it is serviced.
+ *
+ * The reactor installs its own smb2_fd_event_callbacks() on the contexts
+ * added to it. Do not install other callbacks, or call smb2_service() or
+ * smb2_service_fd() yourself, on a context while it is in a reactor.
+ * Contexts can be added before or after they are connected.
+ *
+ * smb2_init_reactor() returns NULL if the library was built without epoll
+ * support or the reactor could not be created.
+ *
+ * smb2_destroy_reactor() removes all contexts from the reactor. The
+ * contexts themselves are not destroyed. A context that is destroyed is
+ * removed from its reactor first.
+ */
+struct smb2_reactor;
+struct smb2_reactor *smb2_init_reactor(void);
+void smb2_destroy_reactor(struct smb2_reactor *reactor);
+
+/*
+ * Adds a context to the reactor.
+ *
+ * Returns
+ *  0     : The context is serviced by the reactor from now on.
+ * -errno : The context could not be added.
+ *
+ * The callback is invoked if servicing the context fails. The context has
+ * already been removed from the reactor at that point and can no longer be
+ * used, but must be freed by calling smb2_destroy_context().
+ * Status is -errno, the reason is available through smb2_get_error().
+ * Command_data is always NULL.
+ */
+int smb2_reactor_add(struct smb2_reactor *reactor, struct smb2_context *smb2,
+                     smb2_command_cb cb, void *cb_data);
+
+/*
+ * Removes a context from the reactor. Its fds are no longer watched and
+ * its commands no longer time out until it is driven by the application
+ * again or added to another reactor.
+ */
+void smb2_reactor_remove(struct smb2_reactor *reactor,
+                         struct smb2_context *smb2);
+
+/*
+ * Waits for events on the contexts in the reactor for at most timeout ms,
+ * -1 to wait until there are events, and services the contexts that have
+ * them. Commands whose timeout has expired are completed with
+ * SMB2_STATUS_IO_TIMEOUT.
+ *
+ * Returns the number of events that were serviced or -errno.
+ */
+int smb2_reactor_run_once(struct smb2_reactor *reactor, int timeout);
+
+/*
+ * Thread-safe submission
+ *
+ * A context is not thread-safe and is serviced by a single thread, the
+ * I/O thread. Other threads can hand work to that thread with
+ * smb2_submit(), which is safe to call from any thread at any time. This
+ * lets any number of threads share one connection and session without
+ * locking the context.
+ *
+ * The work is a function that is run on the I/O thread, where it can
+ * use the whole async API. It is passed a callback and callback data,
+ * which it must hand to the one async call it starts, and returns what
+ * that call returned. When the call completes the callback given to
+ * smb2_submit() is invoked:
+ *  - on the I/O thread, if cq is NULL, or
+ *  - on the thread that runs the completion queue cq.
+ * If the function fails, the callback is invoked with its -errno and
+ * command_data NULL.
+ *
+ * With a completion queue the callback is invoked after the command has
+ * completed, so command_data must stay valid after the completion. This
+ * is the case for the high level calls such as smb2_open_async(),
+ * smb2_pread_async() and smb2_stat_async(), but not for the replies of
+ * the raw smb2_cmd_*_async() commands, which are freed when their
+ * callback returns. Use a NULL cq for those.
+ */
+typedef int (*smb2_submit_fn)(struct smb2_context *smb2,
+                              smb2_command_cb cb, void *cb_data,
+                              void *arg);
+
+/*
+ * Completion queues deliver completions to the thread that owns the
+ * queue. The fd polls readable when there are completions waiting.
+ *
+ * smb2_completion_queue_run() waits at most timeout ms, -1 to wait
+ * forever and 0 not to wait, for completions and invokes their
+ * callbacks. Returns the number of callbacks invoked or -errno.
+ *
+ * A completion queue must outlive the commands submitted with it.
+ */
+struct smb2_completion_queue;
+struct smb2_completion_queue *smb2_init_completion_queue(void);
+void smb2_destroy_completion_queue(struct smb2_completion_queue *cq);
+t_socket smb2_completion_queue_get_fd(struct smb2_completion_queue *cq);
+int smb2_completion_queue_run(struct smb2_completion_queue *cq, int timeout);
+
+/*
+ * Enables smb2_submit() on a context. Must be called before other threads
+ * submit work.
+ *
+ * Submitted work is run when the I/O thread calls smb2_service_fd() for
+ * the fd returned by smb2_get_submit_fd(), which polls readable when there
+ * is work waiting. The fd is also announced through the
+ * smb2_fd_event_callbacks(). The sync API and the reactor watch it by
+ * themselves.
+ *
+ * Pending work is failed with -ECANCELED when the context is destroyed.
+ * Threads must stop submitting before the context is destroyed.
+ *
+ * Returns 0 on success or -errno. -ENOTSUP if the platform is not
+ * supported.
+ */
+int smb2_enable_submit(struct smb2_context *smb2);
+t_socket smb2_get_submit_fd(struct smb2_context *smb2);
+
+/*
+ * Hands fn to the I/O thread of the context, see above.
+ * Can be called from any thread.
+ *
+ * Returns 0 if the work was queued, -EINVAL if submission is not enabled
+ * on the context or -ENOMEM.
+ */
+int smb2_submit(struct smb2_context *smb2, struct smb2_completion_queue *cq,
+                smb2_submit_fn fn, void *arg,
+                smb2_command_cb cb, void *cb_data);
+
+/*
+ * Service thread.
+ *
+ * Starts a thread that services the context, so that any number of
+ * threads can call the sync functions, smb2_pread(), smb2_stat(),
+ * smb2_open() etc., on the same context at the same time. Each call sends
+ * its command and then sleeps until the reply has arrived, so calls from
+ * different threads are in flight together over the one connection.
+ *
+ * The context can be connected before the thread is started, or by
+ * calling smb2_connect_share() afterwards.
+ * While the thread is running, the only functions that may be called
+ * on the context from other threads are the sync functions and
+ * smb2_submit(), which is enabled by starting the thread. The async
+ * functions must only be called from submitted work or from callbacks,
+ * which run on the service thread. A context serviced by a reactor can
+ * not have a service thread.
+ *
+ * smb2_get_error() returns the error of whichever call failed last, so
+ * use the return values to tell which call failed.
+ *
+ * If the connection fails all blocked calls return an error and the
+ * thread exits.
+ *
+ * Returns 0 on success or -errno. -ENOTSUP if the platform does not
+ * have pthreads.
+ */
+int smb2_start_service_thread(struct smb2_context *smb2);
+
+/*
+ * Stops the service thread and waits for it to exit. No calls may be
+ * blocked on the context. smb2_destroy_context() stops the thread if it is
+ * still running.
+ */
+void smb2_stop_service_thread(struct smb2_context *smb2);
+
+/*
+ * Performance counters.
+ *
+ * Every context keeps counters of what it has sent and received, per
+ * SMB2 command, and of the time it has spent signing and sealing. They
+ * are always on and cost a few additions and a clock read per PDU.
+ *
+ * Latencies are the time from queueing a request until its reply has
+ * been received for a client, and from receiving a request until its
+ * reply is queued for a server. They are kept in a histogram where
+ * latency[0] counts those below 1us, latency[i] those from 2^(i-1)us
+ * up to 2^i us and the last bucket everything above.
+ *
+ * The readv()/writev() counts are of the calls on the socket, they are
+ * not kept when the context uses io_uring.
+ */
+#define SMB2_STATS_NUM_COMMANDS 19
+#define SMB2_STATS_NUM_BUCKETS  32
+
+struct smb2_command_stats {
+        /* PDUs queued for sending: requests, or replies for a server */
+        uint64_t sent;
+        /* PDUs received: replies, or requests for a server */
+        uint64_t received;
+        /* replies with an error status, or that timed out */
+        uint64_t errors;
+        uint64_t bytes_sent;
+        uint64_t bytes_received;
+        uint64_t latency_total_us;
+        uint64_t latency_max_us;
+        uint64_t latency[SMB2_STATS_NUM_BUCKETS];
+};
+
+struct smb2_stats {
+        /* indexed by enum smb2_command */
+        struct smb2_command_stats commands[SMB2_STATS_NUM_COMMANDS];
+
+        /* times sending stopped because the server had not granted
+         * enough credits for the next PDU
+         */
+        uint64_t credit_stalls;
+
+        /* compound chains waiting to be sent, and PDUs waiting for
+         * their reply, now and at most
+         */
+        uint32_t outqueue_depth;
+        uint32_t outqueue_max;
+        uint32_t waitqueue_depth;
+        uint32_t waitqueue_max;
+
+        uint64_t read_calls;
+        uint64_t write_calls;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+
+        /* signatures calculated, both to sign and to check them */
+        uint64_t signed_bytes;
+        uint64_t sign_time_ns;
+        uint64_t encrypted_bytes;
+        uint64_t encrypt_time_ns;
+        uint64_t decrypted_bytes;
+        uint64_t decrypt_time_ns;
+};
+
+/*
+ * Copies the counters of the context into *stats.
+ */
+void smb2_get_stats(struct smb2_context *smb2, struct smb2_stats *stats);
+
+/*
+ * Sets all the counters back to 0, apart from the current queue depths.
+ */
+void smb2_reset_stats(struct smb2_context *smb2);
+
+/*
+ * PDU tracing.
+ *
+ * A trace callback is invoked at each step in the life of a PDU, with
+ * a timestamp from a monotonic clock:
+ *
+ * SMB2_TRACE_ALLOCATE   : the PDU has been allocated. The message id is
+ *                         not known yet and is 0.
+ * SMB2_TRACE_ENQUEUE    : it has been signed or encrypted and added to
+ *                         the outqueue.
+ * SMB2_TRACE_SEND_START : the first byte of its compound chain is written
+ *                         to the socket. Until then it waited in the
+ *                         outqueue, for the socket or for credits.
+ * SMB2_TRACE_SENT       : the last byte of its chain has been written.
+ * SMB2_TRACE_HEADER     : the header of the reply, or for a server of the
+ *                         request, has been received. For a sealed
+ *                         connection this is after the whole message has
+ *                         been received and decrypted.
+ * SMB2_TRACE_PAYLOAD    : the rest of it has been received, and the
+ *                         signature checked.
+ * SMB2_TRACE_CALLBACK   : the callback of the request has returned.
+ *                         Clients only.
+ *
+ * Interim STATUS_PENDING replies are not traced. A server sees its
+ * requests from HEADER on and its replies from ALLOCATE to SENT.
+ * The callback runs in the thread that services the context and must
+ * not call back into it.
+ */
+enum smb2_trace_event {
+        SMB2_TRACE_ALLOCATE,
+        SMB2_TRACE_ENQUEUE,
+        SMB2_TRACE_SEND_START,
+        SMB2_TRACE_SENT,
+        SMB2_TRACE_HEADER,
+        SMB2_TRACE_PAYLOAD,
+        SMB2_TRACE_CALLBACK,
+        SMB2_TRACE_NUM_EVENTS
+};
+
+struct smb2_trace_record {
+        enum smb2_trace_event event;
+        uint64_t time_ns;
+        uint64_t message_id;
+        uint16_t command;
+        /* of the reply from SMB2_TRACE_HEADER on, else of the PDU */
+        uint32_t status;
+        struct smb2_pdu *pdu;
+};
+
+typedef void (*smb2_trace_cb)(struct smb2_context *smb2,
+                              const struct smb2_trace_record *record,
+                              void *private_data);
+
+/*
+ * Sets the trace callback, or removes it if cb is NULL.
+ */
+void smb2_set_trace_cb(struct smb2_context *smb2, smb2_trace_cb cb,
+                       void *private_data);
+
+/*
+ * Writes every PDU of the context to a file in the Chrome trace event
+ * JSON format, that chrome://tracing and https://ui.perfetto.dev can
+ * load. Each PDU is an async slice named after its command, with the
+ * message id as its id, split into the phases between the trace events
+ * above: build, queued, send, wait, receive and callback.
+ *
+ * A PDU is written out when it is freed. This works alongside a trace
+ * callback.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_start_chrome_trace(struct smb2_context *smb2, const char *path);
+
+/*
+ * Finishes the JSON and closes the file. smb2_destroy_context() does
+ * this if the trace is still running.
+ */
+void smb2_stop_chrome_trace(struct smb2_context *smb2);
+
+/*
+ * Workload capture.
+ *
+ * While a capture runs, every file and directory call made on the
+ * context, async or sync, is written to a file together with its
+ * completion, so that smb2-replay can issue the same workload again.
+ * Data is not captured, only the sizes.
+ *
+ * The file starts with the 8 bytes "SMB2CAP1". Each record is then
+ * SMB2_CAPTURE_RECORD_SIZE bytes, all little endian, followed by
+ * path_len bytes of path without a terminating NUL:
+ *
+ *  0 uint8   op        enum smb2_capture_op
+ *  1 uint8             0
+ *  2 uint16  path_len
+ *  4 uint32  id        calls are numbered from 1, a DONE record has
+ *                      the id of the call it completes
+ *  8 uint64  time_ns   since the capture was started
+ * 16 uint64  offset    PREAD, PWRITE: the offset
+ *                      TRUNCATE, FTRUNCATE: the length
+ * 24 uint32  count     PREAD, PWRITE: the count
+ *                      OPEN: the O_* flags of the platform
+ * 28 uint32  fh        the id of the OPEN that returned the handle
+ * 32 int32   status    DONE: the status given to the callback
+ *
+ * The path of a RENAME is the old and the new path separated by a NUL.
+ *
+ * Only the calls on handles that were opened during the capture are
+ * recorded.
+ */
+#define SMB2_CAPTURE_MAGIC "SMB2CAP1"
+#define SMB2_CAPTURE_RECORD_SIZE 36
+
+enum smb2_capture_op {
+        SMB2_CAPTURE_DONE,
+        SMB2_CAPTURE_OPEN,
+        SMB2_CAPTURE_CLOSE,
+        SMB2_CAPTURE_PREAD,
+        SMB2_CAPTURE_PWRITE,
+        SMB2_CAPTURE_FSYNC,
+        SMB2_CAPTURE_FSTAT,
+        SMB2_CAPTURE_STAT,
+        SMB2_CAPTURE_STATVFS,
+        SMB2_CAPTURE_OPENDIR,
+        SMB2_CAPTURE_MKDIR,
+        SMB2_CAPTURE_RMDIR,
+        SMB2_CAPTURE_UNLINK,
+        SMB2_CAPTURE_RENAME,
+        SMB2_CAPTURE_TRUNCATE,
+        SMB2_CAPTURE_FTRUNCATE,
+        SMB2_CAPTURE_READLINK,
+        SMB2_CAPTURE_ECHO,
+        SMB2_CAPTURE_NUM_OPS
+};
+
+/*
+ * Starts writing the calls made on the context to a capture file.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_start_capture(struct smb2_context *smb2, const char *path);
+
+/*
+ * Stops the capture and closes the file. Calls that are still in flight
+ * have no DONE record. smb2_destroy_context() does this if the capture
+ * is still running.
+ */
+void smb2_stop_capture(struct smb2_context *smb2);
+
 /*
  * PREAD
  */
@@ -1056,6 +1675,9 @@ int smb2_fstat(struct smb2_context *smb2, struct smb2fh *fh,
  * When the callback is invoked, status indicates the result:
  *      0 : Success. Command_data is struct smb2_stat_64
  * -errno : An error occurred.
+ *
+ * With the metadata cache enabled the callback may be invoked before
+ * smb2_stat_async() returns, see smb2_set_metadata_cache().
  */
 int smb2_stat_async(struct smb2_context *smb2, const char *path,
                     struct smb2_stat_64 *st,
@@ -1066,6 +1688,68 @@ int smb2_stat_async(struct smb2_context *smb2, const char *path,
 int smb2_stat(struct smb2_context *smb2, const char *path,
               struct smb2_stat_64 *st);
 
+/*
+ * Batch stat()
+ *
+ * Stats many paths at once. Each path is looked up using the same
+ * create/query-info/close compound as smb2_stat_async() but up to
+ * window of them are kept in flight at the same time, as long as the
+ * server has granted enough credits.
+ */
+struct smb2_stat_batch_entry {
+        const char *path;          /* in : path to stat */
+        struct smb2_stat_64 st;    /* out: valid if status is 0 */
+        int status;                /* out: 0 or -errno for this path */
+};
+
+/*
+ * Async batch stat()
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status is 0 and command_data is the
+ * entries array. Check the status field of every entry for the result
+ * of that individual path.
+ */
+int smb2_stat_batch_async(struct smb2_context *smb2,
+                          struct smb2_stat_batch_entry *entries, int count,
+                          int window,
+                          smb2_command_cb cb, void *cb_data);
+/*
+ * Sync batch stat()
+ *
+ * Returns 0 once all entries have been processed, or -errno if the batch
+ * could not be run. Per-path results are in entries[i].status.
+ */
+int smb2_stat_batch(struct smb2_context *smb2,
+                    struct smb2_stat_batch_entry *entries, int count,
+                    int window);
+
+/*
+ * Metadata cache
+ *
+ * When enabled, stat() results, "does not exist" results and complete
+ * directory listings from smb2_opendir() are cached for up to max_dirs
+ * directories. A directory is only cached while the server has granted
+ * us a read lease on it so the cache is invalidated by the server through
+ * a lease break before the directory contents change. This requires an
+ * SMB 3.x dialect and a server that supports directory leasing, and the
+ * cache to be enabled before connecting; otherwise enabling the cache has
+ * no effect. Names are compared without regard to case, the same as the
+ * server does.
+ *
+ * Requests that are served from the cache invoke their callback before
+ * the *_async() function returns.
+ *
+ * max_dirs <= 0 disables the cache. It is disabled by default.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_set_metadata_cache(struct smb2_context *smb2, int max_dirs);
+
 /*
  * Async rename()
  *
@@ -1110,6 +1794,222 @@ int smb2_truncate_async(struct smb2_context *smb2, const char *path,
 int smb2_truncate(struct smb2_context *smb2, const char *path,
                   uint64_t length);
 
+/*
+ * Async get_file()
+ * Reads up to count bytes from the start of the file at path into buf.
+ * The file is opened, read and closed with a single compound so files
+ * that fit in one READ complete in a single round trip. Larger files are
+ * read in further READs on the same handle at increasing offsets until
+ * the buffer is full or the end of file is reached, the last of which is
+ * compounded with the CLOSE.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ * -errno : An error occurred.
+ *
+ * Command_data is a uint64_t * holding the number of bytes read on
+ * success and NULL otherwise.
+ */
+int smb2_get_file_async(struct smb2_context *smb2, const char *path,
+                        uint8_t *buf, uint64_t count,
+                        smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync get_file()
+ * Function returns
+ *      0 : Success. The number of bytes read is stored in *read_count
+ *          unless it is NULL.
+ * -errno : An error occurred.
+ */
+int smb2_get_file(struct smb2_context *smb2, const char *path,
+                  uint8_t *buf, uint64_t count, uint64_t *read_count);
+
+/*
+ * Async put_file()
+ * Creates, or replaces, the file at path with count bytes from buf using
+ * a create/write/close compound. Data that does not fit in one WRITE is
+ * written in further WRITEs on the same handle at increasing offsets,
+ * the last of which is compounded with the CLOSE.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ * -errno : An error occurred.
+ *
+ * Command_data is a uint64_t * holding the number of bytes written on
+ * success and NULL otherwise.
+ */
+int smb2_put_file_async(struct smb2_context *smb2, const char *path,
+                        const uint8_t *buf, uint64_t count,
+                        smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync put_file()
+ * Function returns
+ *      0 : Success. The number of bytes written is stored in
+ *          *write_count unless it is NULL.
+ * -errno : An error occurred.
+ */
+int smb2_put_file(struct smb2_context *smb2, const char *path,
+                  const uint8_t *buf, uint64_t count, uint64_t *write_count);
+
+/*
+ * Async copy_range()
+ * Copies len bytes from src at src_offset to dst at dst_offset without
+ * the data passing through the client. Both handles must have been
+ * opened through this context, src with read access and dst with write
+ * access. The server is asked for a resume key for src and then copies
+ * the range in FSCTL_SRV_COPYCHUNK_WRITE requests on dst, several at a
+ * time, within the chunk limits of the server.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success. The whole range was copied.
+ * -errno : An error occurred, for example because the server does not
+ *          support server side copy. Part of the range may have been
+ *          copied.
+ *
+ * Command_data is always NULL.
+ */
+int smb2_copy_range_async(struct smb2_context *smb2,
+                          struct smb2fh *src, uint64_t src_offset,
+                          struct smb2fh *dst, uint64_t dst_offset,
+                          uint64_t len, smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync copy_range()
+ * Function returns
+ *      0 : Success
+ * -errno : An error occurred.
+ */
+int smb2_copy_range(struct smb2_context *smb2,
+                    struct smb2fh *src, uint64_t src_offset,
+                    struct smb2fh *dst, uint64_t dst_offset,
+                    uint64_t len);
+
+struct smb2_allocated_range {
+        uint64_t offset;
+        uint64_t length;
+};
+
+struct smb2_allocated_ranges {
+        int count;
+        struct smb2_allocated_range *ranges;
+};
+
+/*
+ * Async query_allocated_ranges()
+ * Finds the parts of [offset, offset + len) that are backed by storage
+ * on the server. Everything outside of the returned ranges is a hole and
+ * reads back as zeroes. Files that are not sparse are reported as a
+ * single range.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ *          Command_data is a struct smb2_allocated_ranges with the ranges
+ *          in ascending order. It is only valid for the duration of the
+ *          callback.
+ * -errno : An error occurred.
+ *          Command_data is NULL.
+ */
+int smb2_query_allocated_ranges_async(struct smb2_context *smb2,
+                                      struct smb2fh *fh,
+                                      uint64_t offset, uint64_t len,
+                                      smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync query_allocated_ranges()
+ * Stores up to max_ranges ranges in ranges.
+ *
+ * Function returns
+ *  >=0   : The number of allocated ranges. This can be larger than
+ *          max_ranges in which case the query can be repeated from the end
+ *          of the last returned range.
+ * -errno : An error occurred.
+ */
+int smb2_query_allocated_ranges(struct smb2_context *smb2,
+                                struct smb2fh *fh,
+                                uint64_t offset, uint64_t len,
+                                struct smb2_allocated_range *ranges,
+                                int max_ranges);
+
+/*
+ * Async zero_range()
+ * Zeroes [offset, offset + len) without sending the zeroes. On a sparse
+ * file the server also deallocates the range. The file size does not
+ * change.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ * -errno : An error occurred.
+ *
+ * Command_data is always NULL.
+ */
+int smb2_zero_range_async(struct smb2_context *smb2, struct smb2fh *fh,
+                          uint64_t offset, uint64_t len,
+                          smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync zero_range()
+ * Function returns
+ *      0 : Success
+ * -errno : An error occurred.
+ */
+int smb2_zero_range(struct smb2_context *smb2, struct smb2fh *fh,
+                    uint64_t offset, uint64_t len);
+
+/*
+ * Async set_sparse()
+ * Marks the file as sparse, or not sparse if sparse is 0. Ranges that are
+ * zeroed or never written in a sparse file do not take up storage.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ * -errno : An error occurred, for example because the file system on the
+ *          server does not support sparse files.
+ *
+ * Command_data is always NULL.
+ */
+int smb2_set_sparse_async(struct smb2_context *smb2, struct smb2fh *fh,
+                          int sparse, smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync set_sparse()
+ * Function returns
+ *      0 : Success
+ * -errno : An error occurred.
+ */
+int smb2_set_sparse(struct smb2_context *smb2, struct smb2fh *fh,
+                    int sparse);
+
 /*
  * Async ftruncate()
  *
@@ -1200,6 +2100,26 @@ struct smb2_utf16 *smb2_utf8_to_utf16(const char *utf8);
  */
 const char *smb2_utf16_to_utf8(const uint16_t *str, size_t len);
 
+/* Converts a UTF8 string into UTF-16LE in the caller's buffer, writing
+ * at most size code units. No terminating nul is written.
+ *
+ * Returns the number of UTF-16 code units the whole string needs.
+ * If this is more than size the content of utf16 is undefined.
+ * -EINVAL if the string is not valid UTF8.
+ */
+int smb2_utf8_to_utf16_buf(const char *utf8, uint16_t *utf16, size_t size);
+
+/* Converts len code units of UTF-16LE into a nul terminated UTF8 string
+ * in the caller's buffer, writing at most size bytes.
+ *
+ * Returns the length of the UTF8 string, not counting the nul.
+ * If this is size or more the content of utf8 is undefined and the
+ * call should be repeated with a buffer of at least the returned
+ * length + 1.
+ */
+int smb2_utf16_to_utf8_buf(const uint16_t *utf16, size_t len,
+                           char *utf8, size_t size);
+
 /************* Server-side API **********************************************/
 struct smb2_server;
 
@@ -1274,6 +2194,12 @@ struct smb2_server {
         uint32_t max_transact_size;
         uint32_t max_read_size;
         uint32_t max_write_size;
+        /* limits for the built-in copychunk, 0 for 256 chunks,
+         * 1 MiB per chunk and 16 MiB per request
+         */
+        uint32_t copychunk_max_chunks;
+        uint32_t copychunk_max_chunk_size;
+        uint32_t copychunk_max_total_size;
         int signing_enabled;
         int allow_anonymous;
         /* saved from negotiate to be used in validate negotiate info */
@@ -37,6 +37,7 @@
 #define SMB2_STATUS_ABORTED                            0xffffffff
 #define SMB2_STATUS_PENDING                            0x00000103
 #define SMB2_STATUS_SMB_BAD_FID                        0x00060001
+#define SMB2_STATUS_BUFFER_OVERFLOW                    0x80000005
 #define SMB2_STATUS_NO_MORE_FILES                      0x80000006
 #define SMB2_STATUS_UNSUCCESSFUL                       0xC0000001
 #define SMB2_STATUS_NOT_IMPLEMENTED                    0xC0000002
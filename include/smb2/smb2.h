@@ -475,11 +475,51 @@ struct smb2_fileidbothdirectoryinformation {
         const char *name; /* or "reserved" for replys */
 };
 
+#define SMB2_FILE_BOTH_DIRECTORY_INFORMATION_SIZE  94
+
+/* Structure for SMB2_FILE_BOTH_DIRECTORY_INFORMATION.
+ */
+struct smb2_filebothdirectoryinformation {
+        uint32_t next_entry_offset;
+        uint32_t file_index;
+        struct smb2_timeval creation_time;
+        struct smb2_timeval last_access_time;
+        struct smb2_timeval last_write_time;
+        struct smb2_timeval change_time;
+        uint64_t end_of_file;
+        uint64_t allocation_size;
+        uint32_t file_attributes;
+        uint32_t file_name_length;
+        uint32_t ea_size;
+        uint8_t short_name_length;
+        uint8_t short_name[24];
+        const char *name;
+};
+
+#define SMB2_FILE_NAMES_INFORMATION_SIZE  12
+
+/* Structure for SMB2_FILE_NAMES_INFORMATION.
+ */
+struct smb2_filenamesinformation {
+        uint32_t next_entry_offset;
+        uint32_t file_index;
+        uint32_t file_name_length;
+        const char *name;
+};
+
 struct smb2_iovec;
 int smb2_decode_fileidfulldirectoryinformation(
         struct smb2_context *smb2,
         struct smb2_fileidfulldirectoryinformation *fs,
         struct smb2_iovec *vec);
+int smb2_decode_filebothdirectoryinformation(
+        struct smb2_context *smb2,
+        struct smb2_filebothdirectoryinformation *fs,
+        struct smb2_iovec *vec);
+int smb2_decode_filenamesinformation(
+        struct smb2_context *smb2,
+        struct smb2_filenamesinformation *fs,
+        struct smb2_iovec *vec);
 
 struct smb2_query_directory_request {
         uint8_t file_information_class;
@@ -955,6 +995,9 @@ struct smb2_query_info_reply {
 #define SMB2_FSCTL_GET_REPARSE_POINT            0X000900A8
 #define SMB2_FSCTL_DFS_GET_REFERRALS_EX         0x000601B0
 #define SMB2_FSCTL_FILE_LEVEL_TRIM              0x00098208
+#define SMB2_FSCTL_SET_SPARSE                   0x000900C4
+#define SMB2_FSCTL_SET_ZERO_DATA                0x000980C8
+#define SMB2_FSCTL_QUERY_ALLOCATED_RANGES       0x000940CF
 #define SMB2_FSCTL_VALIDATE_NEGOTIATE_INFO      0x00140204
 
 /* Flags */
@@ -1086,6 +1129,8 @@ struct smb2_oplock_break_reply {
 
 #define SMB2_LEASE_BREAK_NOTIFICATION_SIZE 44
 
+#define SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED 0x01
+
 struct smb2_lease_break_notification {
         uint16_t new_epoch;
         uint32_t flags;
@@ -0,0 +1,289 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Workload capture.
+ *
+ * The public calls check SMB2_CAPTURING() first. If a capture runs they
+ * write the call out and issue themselves again, with the caller's
+ * callback swapped for smb2_capture_cb(), which writes out the DONE
+ * record before it hands the result on. The file format is described
+ * in libsmb2.h.
+ */
+
+struct smb2_capture {
+        FILE *fp;
+        uint64_t start;
+        uint32_t next_id;
+};
+
+struct smb2_capture_call {
+        struct smb2_capture *capture;
+        enum smb2_capture_op op;
+        uint32_t id;
+        smb2_command_cb cb;
+        void *cb_data;
+};
+
+static void
+put_le(uint8_t *buf, uint64_t val, int len)
+{
+        int i;
+
+        for (i = 0; i < len; i++) {
+                buf[i] = (uint8_t)(val >> (8 * i));
+        }
+}
+
+static int
+takes_handle(enum smb2_capture_op op)
+{
+        switch (op) {
+        case SMB2_CAPTURE_CLOSE:
+        case SMB2_CAPTURE_PREAD:
+        case SMB2_CAPTURE_PWRITE:
+        case SMB2_CAPTURE_FSYNC:
+        case SMB2_CAPTURE_FSTAT:
+        case SMB2_CAPTURE_FTRUNCATE:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+/* Called with the context locked */
+static void
+write_record(struct smb2_context *smb2, enum smb2_capture_op op,
+             uint32_t id, uint32_t fh_id, const char *path,
+             const char *path2, uint64_t offset, uint32_t count,
+             int32_t status)
+{
+        struct smb2_capture *cap = smb2->capture;
+        uint8_t buf[SMB2_CAPTURE_RECORD_SIZE];
+        size_t len = 0, len2 = 0;
+
+        if (path) {
+                len = strlen(path);
+        }
+        if (path2) {
+                len2 = strlen(path2) + 1;
+        }
+        if (len + len2 > 0xffff) {
+                len = len2 = 0;
+        }
+
+        memset(buf, 0, sizeof(buf));
+        buf[0] = op;
+        put_le(&buf[2], len + len2, 2);
+        put_le(&buf[4], id, 4);
+        put_le(&buf[8], smb2_clock_ns() - cap->start, 8);
+        put_le(&buf[16], offset, 8);
+        put_le(&buf[24], count, 4);
+        put_le(&buf[28], fh_id, 4);
+        put_le(&buf[32], (uint32_t)status, 4);
+        fwrite(buf, sizeof(buf), 1, cap->fp);
+        if (len) {
+                fwrite(path, len, 1, cap->fp);
+        }
+        if (len2) {
+                fputc(0, cap->fp);
+                fwrite(path2, len2 - 1, 1, cap->fp);
+        }
+}
+
+struct smb2_capture_call *
+smb2_capture_begin(struct smb2_context *smb2, enum smb2_capture_op op,
+                   struct smb2fh *fh, const char *path, const char *path2,
+                   uint64_t offset, uint32_t count,
+                   smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_capture_call *call;
+        uint32_t fh_id = 0;
+
+        /* a handle from before the capture could not be replayed */
+        if (takes_handle(op)) {
+                if (fh == NULL || fh->capture_id == 0) {
+                        return NULL;
+                }
+                fh_id = fh->capture_id;
+        }
+
+        call = calloc(1, sizeof(struct smb2_capture_call));
+        if (call == NULL) {
+                return NULL;
+        }
+        call->op = op;
+        call->cb = cb;
+        call->cb_data = cb_data;
+
+        smb2_lock_context(smb2);
+        if (smb2->capture == NULL) {
+                smb2_unlock_context(smb2);
+                free(call);
+                return NULL;
+        }
+        call->capture = smb2->capture;
+        call->id = smb2->capture->next_id++;
+        write_record(smb2, op, call->id, fh_id, path, path2, offset, count, 0);
+        /* the handle cache may close it later, which is not the caller's */
+        if (op == SMB2_CAPTURE_CLOSE) {
+                fh->capture_id = 0;
+        }
+        smb2_unlock_context(smb2);
+
+        return call;
+}
+
+int
+smb2_capture_end(struct smb2_context *smb2, struct smb2_capture_call *call,
+                 int rc)
+{
+        /* the callback has not been and will not be invoked */
+        if (rc < 0) {
+                smb2_lock_context(smb2);
+                if (smb2->capture == call->capture) {
+                        write_record(smb2, SMB2_CAPTURE_DONE, call->id, 0,
+                                     NULL, NULL, 0, 0, rc);
+                }
+                smb2_unlock_context(smb2);
+                free(call);
+        }
+        return rc;
+}
+
+void
+smb2_capture_cb(struct smb2_context *smb2, int status,
+                void *command_data, void *private_data)
+{
+        struct smb2_capture_call *call = private_data;
+        smb2_command_cb cb = call->cb;
+        void *cb_data = call->cb_data;
+
+        smb2_lock_context(smb2);
+        if (smb2->capture == call->capture) {
+                write_record(smb2, SMB2_CAPTURE_DONE, call->id, 0,
+                             NULL, NULL, 0, 0, status);
+                if (call->op == SMB2_CAPTURE_OPEN && status == 0) {
+                        ((struct smb2fh *)command_data)->capture_id =
+                                call->id;
+                }
+        }
+        smb2_unlock_context(smb2);
+
+        if (call->op != SMB2_CAPTURE_OPENDIR) {
+                free(call);
+                cb(smb2, status, command_data, cb_data);
+                return;
+        }
+
+        /* The smb2dir frees its cb_data, which is the call. It has to be
+         * the caller's from now on, as it would have been. If the opendir
+         * failed it frees the call as soon as we return.
+         */
+        if (status == 0) {
+                smb2_dir_set_cb_data(command_data, cb_data);
+                free(call);
+        }
+        cb(smb2, status, command_data, cb_data);
+        if (status != 0) {
+                free(cb_data);
+        }
+}
+
+int
+smb2_start_capture(struct smb2_context *smb2, const char *path)
+{
+        struct smb2_capture *cap;
+
+        if (smb2->capture != NULL) {
+                smb2_set_error(smb2, "A capture is already running");
+                return -EINVAL;
+        }
+        cap = calloc(1, sizeof(struct smb2_capture));
+        if (cap == NULL) {
+                smb2_set_error(smb2, "Failed to allocate capture");
+                return -ENOMEM;
+        }
+        cap->fp = fopen(path, "wb");
+        if (cap->fp == NULL) {
+                int err = errno;
+
+                smb2_set_error(smb2, "Failed to open %s, errno:%d",
+                               path, err);
+                free(cap);
+                return -err;
+        }
+        fwrite(SMB2_CAPTURE_MAGIC, 8, 1, cap->fp);
+        cap->start = smb2_clock_ns();
+        cap->next_id = 1;
+
+        smb2_lock_context(smb2);
+        smb2->capture = cap;
+        smb2_unlock_context(smb2);
+
+        return 0;
+}
+
+void
+smb2_stop_capture(struct smb2_context *smb2)
+{
+        struct smb2_capture *cap;
+
+        smb2_lock_context(smb2);
+        cap = smb2->capture;
+        smb2->capture = NULL;
+        smb2_unlock_context(smb2);
+
+        if (cap == NULL) {
+                return;
+        }
+        fclose(cap->fp);
+        free(cap);
+}
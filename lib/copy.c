@@ -0,0 +1,472 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Server side copy.
+ *
+ * The source handle is asked for a resume key which is then passed, with
+ * a list of chunks, in FSCTL_SRV_COPYCHUNK_WRITE ioctls sent on the
+ * destination handle. The data never leaves the server.
+ *
+ * We start out with the limits that Windows and Samba use. A server
+ * with smaller limits fails the ioctl with STATUS_INVALID_PARAMETER and
+ * returns its own limits, the range is then queued to be sent again
+ * within those. Several ioctls are kept in flight to keep the server
+ * busy, so the other ioctls that were built with the old limits fail the
+ * same way and are queued again too.
+ */
+
+#define COPY_RESUME_KEY_SIZE    24
+#define COPY_HDR_SIZE           32
+#define COPY_CHUNK_SIZE         24
+
+#define COPY_MAX_CHUNKS         16
+#define COPY_MAX_CHUNK_BYTES    (1024 * 1024)
+#define COPY_MAX_TOTAL_BYTES    (16 * 1024 * 1024)
+#define COPY_MAX_IN_FLIGHT      4
+
+struct copy_data;
+
+/* One FSCTL_SRV_COPYCHUNK_WRITE covering [offset, offset + len) */
+struct copy_ioctl {
+        struct copy_data *cd;
+        uint64_t offset;
+        uint32_t len;
+        /* what the ioctl asks of the server's limits */
+        uint32_t chunks;
+        uint32_t chunk_bytes;
+        uint8_t *input;
+};
+
+/* Part of the range that has to be sent again */
+struct copy_retry {
+        struct copy_retry *next;
+        uint64_t offset;
+        uint64_t len;
+};
+
+struct copy_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        struct smb2fh *src;
+        struct smb2fh *dst;
+        uint64_t src_offset;
+        uint64_t dst_offset;
+        uint64_t len;
+
+        uint8_t resume_key[COPY_RESUME_KEY_SIZE];
+        uint32_t max_chunks;
+        uint32_t max_chunk_bytes;
+        uint32_t max_total_bytes;
+
+        /* offset relative to the start of the range */
+        uint64_t next;
+        /* sent before the rest of the range, in order */
+        struct copy_retry *retries;
+        int in_flight;
+        int status;
+};
+
+static void
+copy_done(struct smb2_context *smb2, struct copy_data *cd)
+{
+        struct copy_retry *r;
+
+        while ((r = cd->retries) != NULL) {
+                cd->retries = r->next;
+                free(r);
+        }
+        cd->cb(smb2, cd->status, NULL, cd->cb_data);
+        free(cd);
+}
+
+static int
+copy_retry(struct smb2_context *smb2, struct copy_data *cd,
+           uint64_t offset, uint64_t len)
+{
+        struct copy_retry *r;
+
+        r = calloc(1, sizeof(struct copy_retry));
+        if (r == NULL) {
+                smb2_set_error(smb2, "Failed to allocate copy_retry");
+                return -ENOMEM;
+        }
+        r->offset = offset;
+        r->len = len;
+        SMB2_LIST_ADD_END(&cd->retries, r);
+
+        return 0;
+}
+
+static void copy_ioctl_cb(struct smb2_context *smb2, int status,
+                          void *command_data, void *private_data);
+
+static int
+copy_send(struct smb2_context *smb2, struct copy_data *cd,
+          uint64_t offset, uint64_t *lenp)
+{
+        struct smb2_ioctl_request req;
+        struct copy_ioctl *ci;
+        struct smb2_iovec iov;
+        struct smb2_pdu *pdu;
+        uint64_t len = *lenp;
+        uint32_t count, i;
+
+        if (len > cd->max_total_bytes) {
+                len = cd->max_total_bytes;
+        }
+        count = (uint32_t)((len + cd->max_chunk_bytes - 1) /
+                           cd->max_chunk_bytes);
+        if (count > cd->max_chunks) {
+                count = cd->max_chunks;
+                len = (uint64_t)count * cd->max_chunk_bytes;
+        }
+
+        ci = calloc(1, sizeof(struct copy_ioctl));
+        if (ci == NULL) {
+                smb2_set_error(smb2, "Failed to allocate copy_ioctl");
+                return -ENOMEM;
+        }
+        ci->cd = cd;
+        ci->offset = offset;
+        ci->len = (uint32_t)len;
+        ci->chunks = count;
+        ci->chunk_bytes = len < cd->max_chunk_bytes ?
+                (uint32_t)len : cd->max_chunk_bytes;
+
+        iov.len = COPY_HDR_SIZE + count * COPY_CHUNK_SIZE;
+        iov.buf = calloc(1, iov.len);
+        if (iov.buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate copychunk input");
+                free(ci);
+                return -ENOMEM;
+        }
+        ci->input = iov.buf;
+
+        memcpy(iov.buf, cd->resume_key, COPY_RESUME_KEY_SIZE);
+        smb2_set_uint32(&iov, 24, count);
+        for (i = 0; i < count; i++) {
+                uint32_t c = cd->max_chunk_bytes;
+                uint64_t o = (uint64_t)i * cd->max_chunk_bytes;
+
+                if (c > len - o) {
+                        c = (uint32_t)(len - o);
+                }
+                smb2_set_uint64(&iov, COPY_HDR_SIZE + i * COPY_CHUNK_SIZE,
+                                cd->src_offset + offset + o);
+                smb2_set_uint64(&iov, COPY_HDR_SIZE + i * COPY_CHUNK_SIZE + 8,
+                                cd->dst_offset + offset + o);
+                smb2_set_uint32(&iov, COPY_HDR_SIZE + i * COPY_CHUNK_SIZE + 16,
+                                c);
+        }
+
+        memset(&req, 0, sizeof(struct smb2_ioctl_request));
+        req.ctl_code = SMB2_FSCTL_SRV_COPYCHUNK_WRITE;
+        memcpy(req.file_id, cd->dst->file_id, SMB2_FD_SIZE);
+        req.input_count = (uint32_t)iov.len;
+        req.input = iov.buf;
+        req.flags = SMB2_0_IOCTL_IS_FSCTL;
+
+        pdu = smb2_cmd_ioctl_async(smb2, &req, copy_ioctl_cb, ci);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create copychunk ioctl");
+                free(ci->input);
+                free(ci);
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+        cd->in_flight++;
+        *lenp = len;
+
+        return 0;
+}
+
+/* Keeps up to COPY_MAX_IN_FLIGHT ioctls going for what is left of the
+ * range, the parts that have to be sent again first.
+ */
+static void
+copy_fill(struct smb2_context *smb2, struct copy_data *cd)
+{
+        struct copy_retry *r;
+        uint64_t len;
+        int rc;
+
+        while (cd->status == 0 && cd->in_flight < COPY_MAX_IN_FLIGHT) {
+                r = cd->retries;
+                if (r != NULL) {
+                        len = r->len;
+                        rc = copy_send(smb2, cd, r->offset, &len);
+                        if (rc < 0) {
+                                cd->status = rc;
+                                break;
+                        }
+                        r->offset += len;
+                        r->len -= len;
+                        if (r->len == 0) {
+                                cd->retries = r->next;
+                                free(r);
+                        }
+                        continue;
+                }
+                if (cd->next >= cd->len) {
+                        break;
+                }
+                len = cd->len - cd->next;
+                rc = copy_send(smb2, cd, cd->next, &len);
+                if (rc < 0) {
+                        cd->status = rc;
+                        break;
+                }
+                cd->next += len;
+        }
+
+        if (cd->in_flight == 0) {
+                copy_done(smb2, cd);
+        }
+}
+
+static void
+copy_ioctl_cb(struct smb2_context *smb2, int status,
+              void *command_data, void *private_data)
+{
+        struct copy_ioctl *ci = private_data;
+        struct copy_data *cd = ci->cd;
+        struct smb2_ioctl_reply *rep = command_data;
+        struct smb2_iovec iov;
+        uint32_t chunks = 0, chunk_bytes = 0, total = 0;
+        uint64_t offset = ci->offset;
+        uint32_t len = ci->len;
+        uint32_t sent_chunks = ci->chunks;
+        uint32_t sent_chunk_bytes = ci->chunk_bytes;
+        int rc;
+
+        cd->in_flight--;
+        free(ci->input);
+        free(ci);
+
+        if ((status == SMB2_STATUS_SUCCESS ||
+             status == SMB2_STATUS_INVALID_PARAMETER) &&
+            rep != NULL && rep->output_count >= 12) {
+                iov.buf = rep->output;
+                iov.len = rep->output_count;
+                smb2_get_uint32(&iov, 0, &chunks);
+                smb2_get_uint32(&iov, 4, &chunk_bytes);
+                smb2_get_uint32(&iov, 8, &total);
+        }
+        if ((status == SMB2_STATUS_SUCCESS ||
+             status == SMB2_STATUS_INVALID_PARAMETER) && rep != NULL) {
+                smb2_free_data(smb2, rep->output);
+        }
+
+        if (cd->status) {
+                /* an earlier ioctl failed, just wait for the others */
+        } else if (status == SMB2_STATUS_INVALID_PARAMETER && chunks &&
+                   chunk_bytes && total &&
+                   (chunks < sent_chunks ||
+                    chunk_bytes < sent_chunk_bytes ||
+                    total < len)) {
+                /* The reply carries the limits of the server, which
+                 * another reply may already have lowered ours to.
+                 */
+                if (chunks < cd->max_chunks) {
+                        cd->max_chunks = chunks;
+                }
+                if (chunk_bytes < cd->max_chunk_bytes) {
+                        cd->max_chunk_bytes = chunk_bytes;
+                }
+                if (total < cd->max_total_bytes) {
+                        cd->max_total_bytes = total;
+                }
+                rc = copy_retry(smb2, cd, offset, len);
+                if (rc < 0) {
+                        cd->status = rc;
+                }
+        } else if (status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, status, "Copychunk failed with "
+                                 "(0x%08x) %s", status,
+                                 nterror_to_str(status));
+                cd->status = -nterror_to_errno(status);
+        } else if (total < len) {
+                /* the server copied less than asked, send the rest */
+                if (total == 0) {
+                        smb2_set_error(smb2, "Copychunk made no progress");
+                        cd->status = -EIO;
+                } else {
+                        rc = copy_retry(smb2, cd, offset + total,
+                                        len - total);
+                        if (rc < 0) {
+                                cd->status = rc;
+                        }
+                }
+        }
+
+        copy_fill(smb2, cd);
+}
+
+static void
+copy_resume_key_cb(struct smb2_context *smb2, int status,
+                   void *command_data, void *private_data)
+{
+        struct copy_data *cd = private_data;
+        struct smb2_ioctl_reply *rep = command_data;
+
+        if (status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, status, "Request resume key failed "
+                                 "with (0x%08x) %s", status,
+                                 nterror_to_str(status));
+                cd->status = -nterror_to_errno(status);
+                copy_done(smb2, cd);
+                return;
+        }
+        if (rep->output_count < COPY_RESUME_KEY_SIZE) {
+                smb2_free_data(smb2, rep->output);
+                smb2_set_error(smb2, "Resume key reply is too short");
+                cd->status = -EINVAL;
+                copy_done(smb2, cd);
+                return;
+        }
+        memcpy(cd->resume_key, rep->output, COPY_RESUME_KEY_SIZE);
+        smb2_free_data(smb2, rep->output);
+
+        copy_fill(smb2, cd);
+}
+
+static void copy_flushed_cb(struct smb2_context *smb2, int status,
+                            void *command_data, void *private_data);
+
+static int
+copy_start(struct smb2_context *smb2, struct copy_data *cd)
+{
+        struct smb2_ioctl_request req;
+        struct smb2_pdu *pdu;
+        int rc;
+
+        /* the server copies what it has, dirty data goes first */
+        rc = smb2_fcache_flush(smb2, cd->src, copy_flushed_cb, cd);
+        if (rc == 0) {
+                rc = smb2_fcache_flush(smb2, cd->dst, copy_flushed_cb, cd);
+        }
+        if (rc != 0) {
+                return rc < 0 ? rc : 0;
+        }
+
+        memset(&req, 0, sizeof(struct smb2_ioctl_request));
+        req.ctl_code = SMB2_FSCTL_SRV_REQUEST_RESUME_KEY;
+        memcpy(req.file_id, cd->src->file_id, SMB2_FD_SIZE);
+        req.flags = SMB2_0_IOCTL_IS_FSCTL;
+
+        pdu = smb2_cmd_ioctl_async(smb2, &req, copy_resume_key_cb, cd);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create resume key ioctl");
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+static void
+copy_flushed_cb(struct smb2_context *smb2, int status,
+                void *command_data, void *private_data)
+{
+        struct copy_data *cd = private_data;
+        int rc;
+
+        rc = status;
+        if (rc == 0) {
+                rc = copy_start(smb2, cd);
+        }
+        if (rc < 0) {
+                cd->status = rc;
+                copy_done(smb2, cd);
+        }
+}
+
+int
+smb2_copy_range_async(struct smb2_context *smb2,
+                      struct smb2fh *src, uint64_t src_offset,
+                      struct smb2fh *dst, uint64_t dst_offset,
+                      uint64_t len, smb2_command_cb cb, void *cb_data)
+{
+        struct copy_data *cd;
+        int rc;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (src == NULL || dst == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+
+        cd = calloc(1, sizeof(struct copy_data));
+        if (cd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate copy_data");
+                return -ENOMEM;
+        }
+        cd->cb = cb;
+        cd->cb_data = cb_data;
+        cd->src = src;
+        cd->dst = dst;
+        cd->src_offset = src_offset;
+        cd->dst_offset = dst_offset;
+        cd->len = len;
+        cd->max_chunks = COPY_MAX_CHUNKS;
+        cd->max_chunk_bytes = COPY_MAX_CHUNK_BYTES;
+        cd->max_total_bytes = COPY_MAX_TOTAL_BYTES;
+
+        smb2_fcache_invalidate(smb2, dst, dst_offset, len, -1);
+
+        rc = copy_start(smb2, cd);
+        if (rc < 0) {
+                free(cd);
+                return rc;
+        }
+
+        return 0;
+}
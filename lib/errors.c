@@ -50,6 +50,8 @@ const char *nterror_to_str(uint32_t status) {
                 return "STATUS_ABORTED";
         case SMB2_STATUS_PENDING:
                 return "STATUS_PENDING";
+        case SMB2_STATUS_BUFFER_OVERFLOW:
+                return "STATUS_BUFFER_OVERFLOW";
         case SMB2_STATUS_NO_MORE_FILES:
                 return "STATUS_NO_MORE_FILES";
         case SMB2_STATUS_UNSUCCESSFUL:
@@ -0,0 +1,1286 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_FCNTL_H
+#include <sys/fcntl.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Client side data cache.
+ *
+ * When enabled with smb2_set_read_cache(), files opened through
+ * smb2_open_async() ask for a read lease, or a level II oplock on servers
+ * without leasing. While it is held nobody else can modify the file so
+ * data that has been read once can be served from memory.
+ *
+ * The cache is made of fixed size blocks that are read from the server
+ * on demand. A pread that is not fully cached reads the missing blocks
+ * and waits for them, and for blocks that are already being read, before
+ * it completes. Sequential reads are detected and the following blocks
+ * are read ahead, with a window that doubles with every sequential read.
+ *
+ * Blocks are kept in LRU order and the least recently used ones are
+ * dropped once the cache is larger than its limit. Everything is dropped
+ * when the lease or oplock is broken.
+ *
+ * When enabled with smb2_set_write_cache(), files opened for writing ask
+ * for a read/write lease, or an exclusive oplock. While it is held small
+ * writes are copied into dirty extents and complete immediately. Adjacent
+ * and overlapping writes are merged into the same extent, which is written
+ * to the server once it reaches max_write_size. All dirty extents are
+ * written when the dirty bytes exceed the limit, before the handle is
+ * flushed or closed and before a break of the lease or oplock is
+ * acknowledged. Reads and large writes that touch dirty data wait until
+ * it has been written.
+ *
+ * With the handle cache enabled the lease also asks for handle caching,
+ * which hcache.c needs to keep the handle open after it is closed.
+ */
+
+#define FCACHE_BLOCK_SIZE       65536
+
+/* Largest extent we build on servers that support multi-credit writes */
+#define FCACHE_MAX_EXTENT       (1024 * 1024)
+
+/* Credits that read-ahead leaves for the requests of the application */
+#define FCACHE_RA_RESERVE       8
+
+struct fc_block;
+
+/* A pread that is waiting for blocks */
+struct fc_read {
+        struct fc_read *next;
+        smb2_command_cb cb;
+        void *cb_data;
+        struct smb2_read_cb_data read_cb_data;
+
+        uint64_t end;
+        int pending;
+        int status;
+};
+
+struct fc_waiter {
+        struct fc_waiter *next;
+        struct fc_read *rd;
+};
+
+struct fc_block {
+        struct fc_block *next;
+        struct smb2_fcache *fc;
+        uint64_t offset;
+        uint32_t len;
+        int pending;
+        /* the data is out of date once the read completes */
+        int stale;
+        uint32_t gen;
+        struct fc_waiter *waiters;
+        uint8_t *data;
+};
+
+/* Dirty data, not yet written or being written to the server */
+struct fc_extent {
+        struct fc_extent *next;
+        struct smb2_fcache *fc;
+        uint64_t offset;
+        uint32_t len;
+        uint32_t alloc;
+        int flushing;
+        uint8_t *data;
+};
+
+/* Called once all dirty data has been written */
+struct fc_flush_waiter {
+        struct fc_flush_waiter *next;
+        smb2_command_cb cb;
+        void *cb_data;
+};
+
+/* A read or write that waits for dirty data to be written */
+struct fc_deferred {
+        struct smb2fh *fh;
+        int is_write;
+        uint8_t *buf;
+        uint32_t count;
+        uint64_t offset;
+        smb2_command_cb cb;
+        void *cb_data;
+};
+
+struct smb2_fcache {
+        /* NULL once the handle has been closed */
+        struct smb2fh *fh;
+        struct smb2_lease lease;
+        int use_lease;
+        int registered;
+        uint8_t oplock_level;
+
+        /* set while we hold a lease or oplock that allows read caching */
+        int valid;
+        uint32_t gen;
+
+        /* set while we hold a lease or oplock that allows write caching */
+        int write_valid;
+        struct fc_extent *extents;
+        uint32_t max_extent;
+        uint32_t dirty_bytes;
+        uint32_t max_dirty;
+        int writes_in_flight;
+        int write_error;
+        struct fc_flush_waiter *flush_waiters;
+        /* set while we hold a lease that allows handle caching */
+        int handle_valid;
+        int want_handle;
+
+        /* state or level to acknowledge once the dirty data is written */
+        uint32_t break_state;
+        uint8_t break_oplock_level;
+
+        /* most recently used first */
+        struct fc_block *blocks;
+        int num_blocks;
+        int max_blocks;
+        int reads_in_flight;
+
+        uint64_t eof;
+
+        /* sequential read detection */
+        uint64_t next_offset;
+        int ra_blocks;
+};
+
+static void
+fc_free_block(struct smb2_fcache *fc, struct fc_block *b)
+{
+        SMB2_LIST_REMOVE(&fc->blocks, b);
+        fc->num_blocks--;
+        free(b->data);
+        free(b);
+}
+
+static void
+fc_free_extent(struct smb2_fcache *fc, struct fc_extent *ext)
+{
+        SMB2_LIST_REMOVE(&fc->extents, ext);
+        fc->dirty_bytes -= ext->len;
+        free(ext->data);
+        free(ext);
+}
+
+static void
+fc_free(struct smb2_fcache *fc)
+{
+        struct fc_flush_waiter *w;
+
+        while (fc->blocks) {
+                fc_free_block(fc, fc->blocks);
+        }
+        while (fc->extents) {
+                fc_free_extent(fc, fc->extents);
+        }
+        while ((w = fc->flush_waiters) != NULL) {
+                fc->flush_waiters = w->next;
+                free(w);
+        }
+        free(fc);
+}
+
+/* Frees the cache of a closed handle once nothing refers to it */
+static void
+fc_release(struct smb2_fcache *fc)
+{
+        if (fc->fh == NULL && fc->reads_in_flight == 0 &&
+            fc->writes_in_flight == 0) {
+                fc_free(fc);
+        }
+}
+
+static struct fc_block *
+fc_find_block(struct smb2_fcache *fc, uint64_t offset)
+{
+        struct fc_block *b;
+
+        for (b = fc->blocks; b; b = b->next) {
+                if (b->offset == offset && !b->stale) {
+                        return b;
+                }
+        }
+        return NULL;
+}
+
+static void
+fc_touch_block(struct smb2_fcache *fc, struct fc_block *b)
+{
+        if (fc->blocks != b) {
+                SMB2_LIST_REMOVE(&fc->blocks, b);
+                SMB2_LIST_ADD(&fc->blocks, b);
+        }
+}
+
+static void
+fc_evict(struct smb2_fcache *fc)
+{
+        struct fc_block *b, *victim;
+
+        while (fc->num_blocks > fc->max_blocks) {
+                victim = NULL;
+                for (b = fc->blocks; b; b = b->next) {
+                        if (!b->pending) {
+                                victim = b;
+                        }
+                }
+                if (victim == NULL) {
+                        break;
+                }
+                fc_free_block(fc, victim);
+        }
+}
+
+/* Drops every block that is not being read and marks the others stale */
+static void
+fc_drop_range(struct smb2_fcache *fc, uint64_t offset, uint64_t len)
+{
+        struct fc_block *b, *next;
+
+        for (b = fc->blocks; b; b = next) {
+                next = b->next;
+                if (len && (b->offset + FCACHE_BLOCK_SIZE <= offset ||
+                            b->offset >= offset + len)) {
+                        continue;
+                }
+                if (b->pending) {
+                        b->stale = 1;
+                        continue;
+                }
+                fc_free_block(fc, b);
+        }
+}
+
+static void
+fc_read_done(struct smb2_context *smb2, struct fc_read *rd, int closed)
+{
+        struct smb2fh *fh = closed ? NULL : rd->read_cb_data.fh;
+        int count = 0;
+
+        if (rd->status < 0) {
+                rd->cb(smb2, rd->status, &rd->read_cb_data, rd->cb_data);
+                free(rd);
+                return;
+        }
+        if (rd->end > rd->read_cb_data.offset) {
+                count = (int)(rd->end - rd->read_cb_data.offset);
+        }
+        if (fh != NULL) {
+                fh->offset = rd->read_cb_data.offset + count;
+        }
+        rd->cb(smb2, count, &rd->read_cb_data, rd->cb_data);
+        free(rd);
+}
+
+/* Copies the part of block b that rd asked for */
+static void
+fc_copy_block(struct fc_read *rd, struct fc_block *b)
+{
+        uint64_t start, end;
+
+        if (b->len < FCACHE_BLOCK_SIZE &&
+            rd->end > b->offset + b->len) {
+                /* short block, the file ends here */
+                rd->end = b->offset + b->len;
+        }
+        start = b->offset;
+        if (start < rd->read_cb_data.offset) {
+                start = rd->read_cb_data.offset;
+        }
+        end = b->offset + b->len;
+        if (end > rd->end) {
+                end = rd->end;
+        }
+        if (end > start) {
+                memcpy(rd->read_cb_data.buf + (start - rd->read_cb_data.offset),
+                       b->data + (start - b->offset), end - start);
+        }
+}
+
+static void
+fc_block_cb(struct smb2_context *smb2, int status,
+            void *command_data, void *private_data)
+{
+        struct fc_block *b = private_data;
+        struct smb2_fcache *fc = b->fc;
+        struct smb2_read_reply *rep = command_data;
+        struct fc_waiter *w;
+        struct fc_read *done = NULL;
+        int closed = fc->fh == NULL;
+        int err = 0;
+
+        fc->reads_in_flight--;
+        b->pending = 0;
+
+        if (status == SMB2_STATUS_SUCCESS) {
+                b->len = rep->data_length;
+        } else if (status == SMB2_STATUS_END_OF_FILE) {
+                b->len = 0;
+        } else {
+                err = -nterror_to_errno(status);
+        }
+
+        if (err == 0 && !b->stale && b->gen == fc->gen &&
+            b->len < FCACHE_BLOCK_SIZE && b->offset + b->len < fc->eof) {
+                fc->eof = b->offset + b->len;
+        }
+
+        /* Fill in all waiters before calling back into the application,
+         * which may well issue more reads on this handle.
+         */
+        while ((w = b->waiters) != NULL) {
+                struct fc_read *rd = w->rd;
+
+                b->waiters = w->next;
+                free(w);
+                if (err < 0) {
+                        if (rd->status == 0) {
+                                rd->status = err;
+                        }
+                } else {
+                        fc_copy_block(rd, b);
+                }
+                if (--rd->pending == 0) {
+                        rd->next = done;
+                        done = rd;
+                }
+        }
+
+        if (err < 0 || b->stale || b->gen != fc->gen || !fc->valid ||
+            fc->fh == NULL) {
+                fc_free_block(fc, b);
+        } else {
+                fc_evict(fc);
+        }
+
+        fc_release(fc);
+
+        while (done) {
+                struct fc_read *rd = done;
+
+                done = rd->next;
+                fc_read_done(smb2, rd, closed);
+        }
+}
+
+static struct fc_block *
+fc_read_block(struct smb2_context *smb2, struct smb2_fcache *fc,
+              uint64_t offset)
+{
+        struct smb2_read_request req;
+        struct fc_block *b;
+        struct smb2_pdu *pdu;
+
+        b = calloc(1, sizeof(struct fc_block));
+        if (b == NULL) {
+                return NULL;
+        }
+        b->data = malloc(FCACHE_BLOCK_SIZE);
+        if (b->data == NULL) {
+                free(b);
+                return NULL;
+        }
+        b->fc = fc;
+        b->offset = offset;
+        b->gen = fc->gen;
+        b->pending = 1;
+
+        memset(&req, 0, sizeof(struct smb2_read_request));
+        req.length = FCACHE_BLOCK_SIZE;
+        req.offset = offset;
+        req.buf = b->data;
+        memcpy(req.file_id, fc->fh->file_id, SMB2_FD_SIZE);
+        req.channel = SMB2_CHANNEL_NONE;
+
+        pdu = smb2_cmd_read_async(smb2, &req, fc_block_cb, b);
+        if (pdu == NULL) {
+                free(b->data);
+                free(b);
+                return NULL;
+        }
+        SMB2_LIST_ADD(&fc->blocks, b);
+        fc->num_blocks++;
+        fc->reads_in_flight++;
+        smb2_queue_pdu(smb2, pdu);
+
+        return b;
+}
+
+static void
+fc_read_ahead(struct smb2_context *smb2, struct smb2_fcache *fc,
+              uint64_t offset)
+{
+        uint64_t boff;
+        int i;
+
+        boff = offset - offset % FCACHE_BLOCK_SIZE;
+        for (i = 0; i < fc->ra_blocks; i++, boff += FCACHE_BLOCK_SIZE) {
+                if (boff >= fc->eof) {
+                        break;
+                }
+                if (fc->reads_in_flight >= fc->max_blocks / 2 ||
+                    smb2_get_available_credits(smb2) <= FCACHE_RA_RESERVE) {
+                        break;
+                }
+                if (fc_find_block(fc, boff) != NULL) {
+                        continue;
+                }
+                if (fc_read_block(smb2, fc, boff) == NULL) {
+                        break;
+                }
+        }
+}
+
+static int
+fc_extent_overlaps(struct fc_extent *ext, uint64_t offset, uint64_t len)
+{
+        return ext->offset < offset + len && ext->offset + ext->len > offset;
+}
+
+static void fc_flush_extents(struct smb2_context *smb2,
+                             struct smb2_fcache *fc, int all);
+
+static void
+fc_flushed(struct smb2_context *smb2, struct smb2_fcache *fc)
+{
+        struct fc_flush_waiter *waiters, *w;
+
+        if (fc->extents != NULL) {
+                return;
+        }
+
+        /* Waiters may issue new writes, or close the handle, so take the
+         * whole list before calling any of them.
+         */
+        waiters = fc->flush_waiters;
+        fc->flush_waiters = NULL;
+        while ((w = waiters) != NULL) {
+                waiters = w->next;
+                w->cb(smb2, 0, NULL, w->cb_data);
+                free(w);
+        }
+}
+
+static void
+fc_extent_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *private_data)
+{
+        struct fc_extent *ext = private_data;
+        struct smb2_fcache *fc = ext->fc;
+
+        fc->writes_in_flight--;
+        if (status != SMB2_STATUS_SUCCESS && fc->write_error == 0) {
+                smb2_set_nterror(smb2, status, "Write-behind failed with "
+                                 "(0x%08x) %s", status,
+                                 nterror_to_str(status));
+                fc->write_error = -nterror_to_errno(status);
+        }
+        /* the blocks may have been read before the write reached the
+         * server
+         */
+        fc_drop_range(fc, ext->offset, ext->len);
+        fc_free_extent(fc, ext);
+
+        if (fc->fh == NULL) {
+                fc_release(fc);
+                return;
+        }
+        /* extents may have been held back by this one */
+        fc_flush_extents(smb2, fc, fc->flush_waiters != NULL ||
+                         !fc->write_valid ||
+                         fc->dirty_bytes > fc->max_dirty);
+        fc_flushed(smb2, fc);
+}
+
+static int
+fc_write_extent(struct smb2_context *smb2, struct smb2_fcache *fc,
+                struct fc_extent *ext)
+{
+        struct smb2_write_request req;
+        struct smb2_pdu *pdu;
+
+        memset(&req, 0, sizeof(struct smb2_write_request));
+        req.length = ext->len;
+        req.offset = ext->offset;
+        req.buf = ext->data;
+        memcpy(req.file_id, fc->fh->file_id, SMB2_FD_SIZE);
+        req.channel = SMB2_CHANNEL_NONE;
+
+        pdu = smb2_cmd_write_async(smb2, &req, 0, fc_extent_cb, ext);
+        if (pdu == NULL) {
+                return -ENOMEM;
+        }
+        ext->flushing = 1;
+        fc->writes_in_flight++;
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+/* Writes every dirty extent, or only the full ones, to the server */
+static void
+fc_flush_extents(struct smb2_context *smb2, struct smb2_fcache *fc, int all)
+{
+        struct fc_extent *ext, *e, *next;
+
+        for (ext = fc->extents; ext; ext = next) {
+                next = ext->next;
+                if (ext->flushing) {
+                        continue;
+                }
+                if (!all && ext->len < fc->max_extent) {
+                        continue;
+                }
+                /* Two writes to the same range can complete in any order
+                 * so wait until the older one is done.
+                 */
+                for (e = fc->extents; e; e = e->next) {
+                        if (e->flushing &&
+                            fc_extent_overlaps(e, ext->offset, ext->len)) {
+                                break;
+                        }
+                }
+                if (e != NULL) {
+                        continue;
+                }
+                if (fc_write_extent(smb2, fc, ext) < 0) {
+                        smb2_set_error(smb2, "Failed to create write "
+                                       "command");
+                        if (fc->write_error == 0) {
+                                fc->write_error = -ENOMEM;
+                        }
+                        fc_free_extent(fc, ext);
+                }
+        }
+}
+
+int
+smb2_fcache_flush(struct smb2_context *smb2, struct smb2fh *fh,
+                  smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_fcache *fc = fh->fcache;
+        struct fc_flush_waiter *w;
+
+        if (fc == NULL || fc->extents == NULL) {
+                return 0;
+        }
+
+        w = calloc(1, sizeof(struct fc_flush_waiter));
+        if (w == NULL) {
+                smb2_set_error(smb2, "Failed to allocate fc_flush_waiter");
+                return -ENOMEM;
+        }
+        w->cb = cb;
+        w->cb_data = cb_data;
+        /* keep them in order, a deferred write must go out before the
+         * close that was issued after it
+         */
+        SMB2_LIST_ADD_END(&fc->flush_waiters, w);
+
+        fc_flush_extents(smb2, fc, 1);
+        if (fc->extents == NULL) {
+                /* nothing could be sent */
+                SMB2_LIST_REMOVE(&fc->flush_waiters, w);
+                free(w);
+                return 0;
+        }
+
+        return 1;
+}
+
+int
+smb2_fcache_write_error(struct smb2fh *fh)
+{
+        struct smb2_fcache *fc = fh->fcache;
+        int err;
+
+        if (fc == NULL) {
+                return 0;
+        }
+        err = fc->write_error;
+        fc->write_error = 0;
+
+        return err;
+}
+
+static void
+fc_deferred_cb(struct smb2_context *smb2, int status,
+               void *command_data, void *private_data)
+{
+        struct fc_deferred *d = private_data;
+        int rc;
+
+        if (d->is_write) {
+                rc = status;
+                if (rc == 0) {
+                        rc = smb2_pwrite_async(smb2, d->fh, d->buf, d->count,
+                                               d->offset, d->cb, d->cb_data);
+                }
+                if (rc < 0) {
+                        struct smb2_write_cb_data wcd;
+
+                        wcd.fh = d->fh;
+                        wcd.buf = d->buf;
+                        wcd.count = d->count;
+                        wcd.offset = d->offset;
+                        d->cb(smb2, rc, &wcd, d->cb_data);
+                }
+        } else {
+                rc = status;
+                if (rc == 0) {
+                        rc = smb2_pread_async(smb2, d->fh, d->buf, d->count,
+                                              d->offset, d->cb, d->cb_data);
+                }
+                if (rc < 0) {
+                        struct smb2_read_cb_data rcd;
+
+                        rcd.fh = d->fh;
+                        rcd.buf = d->buf;
+                        rcd.count = d->count;
+                        rcd.offset = d->offset;
+                        d->cb(smb2, rc, &rcd, d->cb_data);
+                }
+        }
+        free(d);
+}
+
+/* Reissues the read or write once the dirty data has been written */
+static int
+fc_defer(struct smb2_context *smb2, struct smb2fh *fh, int is_write,
+         uint8_t *buf, uint32_t count, uint64_t offset,
+         smb2_command_cb cb, void *cb_data)
+{
+        struct fc_deferred *d;
+        int rc;
+
+        d = calloc(1, sizeof(struct fc_deferred));
+        if (d == NULL) {
+                smb2_set_error(smb2, "Failed to allocate fc_deferred");
+                return -ENOMEM;
+        }
+        d->fh = fh;
+        d->is_write = is_write;
+        d->buf = buf;
+        d->count = count;
+        d->offset = offset;
+        d->cb = cb;
+        d->cb_data = cb_data;
+
+        rc = smb2_fcache_flush(smb2, fh, fc_deferred_cb, d);
+        if (rc <= 0) {
+                free(d);
+        }
+
+        return rc;
+}
+
+/* Copies the write into a dirty extent. Returns 0 on success or -1 if
+ * it has to be sent to the server.
+ */
+static int
+fc_buffer_write(struct smb2_fcache *fc, const uint8_t *buf,
+                uint32_t count, uint64_t offset)
+{
+        struct fc_extent *ext, *match = NULL;
+        uint64_t start, end;
+        uint32_t len;
+        uint8_t *data;
+
+        for (ext = fc->extents; ext; ext = ext->next) {
+                if (ext->flushing) {
+                        continue;
+                }
+                if (ext->offset > offset + count ||
+                    ext->offset + ext->len < offset) {
+                        continue;
+                }
+                if (match != NULL) {
+                        /* would join two extents */
+                        return -1;
+                }
+                match = ext;
+        }
+
+        if (match == NULL) {
+                ext = calloc(1, sizeof(struct fc_extent));
+                if (ext == NULL) {
+                        return -1;
+                }
+                ext->alloc = count < 4096 ? 4096 : count;
+                ext->data = malloc(ext->alloc);
+                if (ext->data == NULL) {
+                        free(ext);
+                        return -1;
+                }
+                ext->fc = fc;
+                ext->offset = offset;
+                ext->len = count;
+                memcpy(ext->data, buf, count);
+                SMB2_LIST_ADD_END(&fc->extents, ext);
+                fc->dirty_bytes += count;
+                return 0;
+        }
+
+        start = match->offset < offset ? match->offset : offset;
+        end = match->offset + match->len;
+        if (end < offset + count) {
+                end = offset + count;
+        }
+        if (end - start > fc->max_extent) {
+                return -1;
+        }
+        len = (uint32_t)(end - start);
+        if (len > match->alloc) {
+                uint32_t alloc = match->alloc;
+
+                while (alloc < len) {
+                        alloc *= 2;
+                }
+                if (alloc > fc->max_extent) {
+                        alloc = fc->max_extent;
+                }
+                data = realloc(match->data, alloc);
+                if (data == NULL) {
+                        return -1;
+                }
+                match->data = data;
+                match->alloc = alloc;
+        }
+        if (start < match->offset) {
+                memmove(match->data + (match->offset - start), match->data,
+                        match->len);
+        }
+        memcpy(match->data + (offset - start), buf, count);
+        fc->dirty_bytes += len - match->len;
+        match->offset = start;
+        match->len = len;
+
+        return 0;
+}
+
+int
+smb2_fcache_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
+                   const uint8_t *buf, uint32_t count, uint64_t offset,
+                   smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_fcache *fc = fh->fcache;
+        struct smb2_write_cb_data write_cb_data;
+        struct fc_extent *ext;
+
+        if (fc == NULL || count == 0) {
+                return 0;
+        }
+
+        if (fc->write_valid && count < FCACHE_BLOCK_SIZE &&
+            fc_buffer_write(fc, buf, count, offset) == 0) {
+                fc_drop_range(fc, offset, count);
+                if (offset + count > fc->eof) {
+                        fc->eof = offset + count;
+                }
+                fc_flush_extents(smb2, fc, fc->dirty_bytes > fc->max_dirty);
+
+                fh->offset = offset + count;
+                write_cb_data.fh = fh;
+                write_cb_data.buf = buf;
+                write_cb_data.count = count;
+                write_cb_data.offset = offset;
+                cb(smb2, count, &write_cb_data, cb_data);
+                return 1;
+        }
+
+        for (ext = fc->extents; ext; ext = ext->next) {
+                if (fc_extent_overlaps(ext, offset, count)) {
+                        return fc_defer(smb2, fh, 1, discard_const(buf),
+                                        count, offset, cb, cb_data);
+                }
+        }
+
+        return 0;
+}
+
+int
+smb2_fcache_pread(struct smb2_context *smb2, struct smb2fh *fh,
+                  uint8_t *buf, uint32_t count, uint64_t offset,
+                  smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_fcache *fc = fh->fcache;
+        struct fc_extent *ext;
+        struct fc_read *rd;
+        uint64_t boff;
+
+        if (fc == NULL || count == 0) {
+                return 0;
+        }
+        /* Wait for dirty data in or after the range, it may have moved
+         * the end of file and the server would return a short read for
+         * what is now a hole.
+         */
+        for (ext = fc->extents; ext; ext = ext->next) {
+                if (ext->offset + ext->len > offset) {
+                        return fc_defer(smb2, fh, 0, buf, count, offset,
+                                        cb, cb_data);
+                }
+        }
+        if (!fc->valid) {
+                return 0;
+        }
+        /* large reads gain nothing from going through the cache */
+        if (count > (uint32_t)(fc->max_blocks / 2) * FCACHE_BLOCK_SIZE ||
+            count > smb2->max_read_size) {
+                return 0;
+        }
+
+        rd = calloc(1, sizeof(struct fc_read));
+        if (rd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate fc_read");
+                return -ENOMEM;
+        }
+        rd->cb = cb;
+        rd->cb_data = cb_data;
+        rd->read_cb_data.fh = fh;
+        rd->read_cb_data.buf = buf;
+        rd->read_cb_data.count = count;
+        rd->read_cb_data.offset = offset;
+        rd->end = offset + count;
+        if (rd->end > fc->eof) {
+                rd->end = fc->eof;
+        }
+
+        /* Hold a reference for the loop so a block that is copied in
+         * does not complete the read before all blocks are looked at.
+         */
+        rd->pending = 1;
+        for (boff = offset - offset % FCACHE_BLOCK_SIZE; boff < rd->end;
+             boff += FCACHE_BLOCK_SIZE) {
+                struct fc_block *b = fc_find_block(fc, boff);
+                struct fc_waiter *w;
+
+                if (b != NULL && !b->pending) {
+                        fc_touch_block(fc, b);
+                        fc_copy_block(rd, b);
+                        continue;
+                }
+                if (b == NULL) {
+                        b = fc_read_block(smb2, fc, boff);
+                        if (b == NULL) {
+                                smb2_set_error(smb2, "Failed to read "
+                                               "block into cache");
+                                rd->status = -ENOMEM;
+                                break;
+                        }
+                }
+                w = calloc(1, sizeof(struct fc_waiter));
+                if (w == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "fc_waiter");
+                        rd->status = -ENOMEM;
+                        break;
+                }
+                w->rd = rd;
+                w->next = b->waiters;
+                b->waiters = w;
+                rd->pending++;
+        }
+
+        if (offset == fc->next_offset) {
+                if (fc->ra_blocks < fc->max_blocks / 2) {
+                        fc->ra_blocks = fc->ra_blocks ?
+                                fc->ra_blocks * 2 : 1;
+                }
+                fc_read_ahead(smb2, fc, offset + count);
+        } else {
+                fc->ra_blocks = 0;
+        }
+        fc->next_offset = offset + count;
+        fc_evict(fc);
+
+        if (--rd->pending == 0) {
+                fc_read_done(smb2, rd, 0);
+        }
+
+        return 1;
+}
+
+static void
+fc_lease_flushed_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct smb2_fcache *fc = private_data;
+
+        /* the handle was freed before the data was written */
+        if (status < 0) {
+                return;
+        }
+        smb2_lease_break_ack(smb2, &fc->lease, fc->break_state);
+}
+
+static int
+fc_lease_break(struct smb2_context *smb2, struct smb2_lease *lease,
+               uint32_t new_state)
+{
+        struct smb2_fcache *fc = lease->private_data;
+
+        if (!(new_state & SMB2_LEASE_WRITE_CACHING)) {
+                fc->write_valid = 0;
+        }
+        if (!(new_state & SMB2_LEASE_READ_CACHING)) {
+                fc->valid = 0;
+                fc->gen++;
+                fc_drop_range(fc, 0, 0);
+        }
+        if (!(new_state & SMB2_LEASE_HANDLE_CACHING)) {
+                fc->handle_valid = 0;
+                /* closing an idle handle completes the break */
+                if (fc->fh != NULL && smb2_hcache_break(smb2, fc->fh)) {
+                        return 1;
+                }
+        }
+
+        /* dirty data has to reach the server before the break is
+         * acknowledged
+         */
+        if (!fc->write_valid && fc->fh != NULL) {
+                fc->break_state = new_state;
+                if (smb2_fcache_flush(smb2, fc->fh, fc_lease_flushed_cb,
+                                      fc) > 0) {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+static void
+fc_oplock_ack_cb(struct smb2_context *smb2, int status,
+                 void *command_data, void *private_data)
+{
+}
+
+static void
+fc_oplock_ack(struct smb2_context *smb2, struct smb2fh *fh,
+              uint8_t oplock_level)
+{
+        struct smb2_oplock_break_acknowledgement ack;
+        struct smb2_pdu *pdu;
+
+        memset(&ack, 0, sizeof(ack));
+        ack.oplock_level = oplock_level;
+        memcpy(ack.file_id, fh->file_id, SMB2_FD_SIZE);
+        pdu = smb2_cmd_oplock_break_async(smb2, &ack,
+                                          fc_oplock_ack_cb, NULL);
+        if (pdu != NULL) {
+                smb2_queue_pdu(smb2, pdu);
+        }
+}
+
+static void
+fc_oplock_flushed_cb(struct smb2_context *smb2, int status,
+                     void *command_data, void *private_data)
+{
+        struct smb2_fcache *fc = private_data;
+
+        if (status < 0) {
+                return;
+        }
+        fc_oplock_ack(smb2, fc->fh, fc->break_oplock_level);
+}
+
+int
+smb2_fcache_oplock_break(struct smb2_context *smb2,
+                         struct smb2_oplock_break_notification *notify)
+{
+        struct smb2_fcache *fc;
+        struct smb2fh *fh;
+        uint8_t old_level;
+
+        for (fh = smb2->fhs; fh; fh = fh->next) {
+                if (fh->fcache && !fh->fcache->use_lease &&
+                    !memcmp(fh->file_id, notify->file_id, SMB2_FD_SIZE)) {
+                        break;
+                }
+        }
+        if (fh == NULL) {
+                return 0;
+        }
+        fc = fh->fcache;
+        old_level = fc->oplock_level;
+        fc->oplock_level = notify->oplock_level;
+
+        /* only exclusive and batch oplocks allow write caching */
+        fc->write_valid = 0;
+        if (notify->oplock_level == SMB2_OPLOCK_LEVEL_NONE) {
+                fc->valid = 0;
+                fc->gen++;
+                fc_drop_range(fc, 0, 0);
+        }
+
+        /* Breaks from level II are not acknowledged */
+        if (old_level == SMB2_OPLOCK_LEVEL_EXCLUSIVE ||
+            old_level == SMB2_OPLOCK_LEVEL_BATCH) {
+                fc->break_oplock_level = notify->oplock_level;
+                if (smb2_fcache_flush(smb2, fh, fc_oplock_flushed_cb,
+                                      fc) <= 0) {
+                        fc_oplock_ack(smb2, fh, notify->oplock_level);
+                }
+        }
+
+        return 1;
+}
+
+struct smb2_fcache *
+smb2_fcache_create(struct smb2_context *smb2, int flags, int want_handle,
+                   struct smb2_create_request *req)
+{
+        struct smb2_fcache *fc;
+        uint32_t state = SMB2_LEASE_READ_CACHING;
+        int leasing, want_read, want_write;
+
+        leasing = smb2->dialect > SMB2_VERSION_0202 &&
+                (smb2->capabilities & SMB2_GLOBAL_CAP_LEASING);
+        want_read = smb2->read_cache_size &&
+                (flags & O_ACCMODE) != O_WRONLY;
+        want_write = smb2->write_cache_size &&
+                (flags & O_ACCMODE) != O_RDONLY;
+        /* handles can only be cached under a lease */
+        want_handle = want_handle && leasing;
+        if ((!want_read && !want_write && !want_handle) ||
+            (flags & O_SYNC)) {
+                return NULL;
+        }
+
+        fc = calloc(1, sizeof(struct smb2_fcache));
+        if (fc == NULL) {
+                return NULL;
+        }
+        if (want_read) {
+                fc->max_blocks = smb2->read_cache_size / FCACHE_BLOCK_SIZE;
+                if (fc->max_blocks < 2) {
+                        fc->max_blocks = 2;
+                }
+        }
+        if (want_write) {
+                fc->max_dirty = smb2->write_cache_size;
+                fc->max_extent = smb2->max_write_size;
+                if (fc->max_extent > FCACHE_MAX_EXTENT) {
+                        fc->max_extent = FCACHE_MAX_EXTENT;
+                }
+                if (!smb2->supports_multi_credit &&
+                    fc->max_extent > FCACHE_BLOCK_SIZE) {
+                        fc->max_extent = FCACHE_BLOCK_SIZE;
+                }
+                state |= SMB2_LEASE_WRITE_CACHING;
+        }
+        if (want_handle) {
+                fc->want_handle = 1;
+                state |= SMB2_LEASE_HANDLE_CACHING;
+        }
+
+        if (leasing) {
+                fc->use_lease = 1;
+                smb2_lease_init(smb2, &fc->lease, fc_lease_break, fc);
+                if (smb2_lease_create_context(smb2, &fc->lease, state,
+                                              req) < 0) {
+                        free(fc);
+                        return NULL;
+                }
+        } else if (want_write) {
+                req->requested_oplock_level = SMB2_OPLOCK_LEVEL_EXCLUSIVE;
+        } else {
+                req->requested_oplock_level = SMB2_OPLOCK_LEVEL_II;
+        }
+
+        return fc;
+}
+
+void
+smb2_fcache_opened(struct smb2_context *smb2, struct smb2fh *fh,
+                   struct smb2_create_reply *rep)
+{
+        struct smb2_fcache *fc = fh->fcache;
+        int can_read = 0, can_write = 0, can_handle = 0;
+
+        fc->fh = fh;
+        fc->eof = rep->end_of_file;
+
+        if (fc->use_lease) {
+                smb2_lease_granted(smb2, &fc->lease, rep);
+                can_read = fc->lease.state & SMB2_LEASE_READ_CACHING;
+                can_write = fc->lease.state & SMB2_LEASE_WRITE_CACHING;
+                can_handle = fc->lease.state & SMB2_LEASE_HANDLE_CACHING;
+        } else {
+                fc->oplock_level = rep->oplock_level;
+                switch (rep->oplock_level) {
+                case SMB2_OPLOCK_LEVEL_EXCLUSIVE:
+                case SMB2_OPLOCK_LEVEL_BATCH:
+                        can_write = 1;
+                        /* fallthrough */
+                case SMB2_OPLOCK_LEVEL_II:
+                        can_read = 1;
+                        break;
+                }
+        }
+        fc->valid = can_read && fc->max_blocks;
+        fc->write_valid = can_write && fc->max_extent;
+        fc->handle_valid = can_handle && fc->want_handle;
+
+        if (!fc->valid && !fc->write_valid && !fc->handle_valid) {
+                /* nothing was granted, do not bother with this handle */
+                fc_free(fc);
+                fh->fcache = NULL;
+                return;
+        }
+        if (fc->use_lease) {
+                fc->registered = 1;
+                smb2_lease_register(smb2, &fc->lease);
+        }
+}
+
+int
+smb2_fcache_handle_cached(struct smb2fh *fh)
+{
+        return fh->fcache != NULL && fh->fcache->handle_valid;
+}
+
+void
+smb2_fcache_reopened(struct smb2fh *fh)
+{
+        struct smb2_fcache *fc = fh->fcache;
+
+        /* the read lease that comes with the handle lease kept the size
+         * up to date
+         */
+        fh->offset = 0;
+        fh->end_of_file = fc->eof;
+        fc->next_offset = 0;
+        fc->ra_blocks = 0;
+}
+
+void
+smb2_fcache_invalidate(struct smb2_context *smb2, struct smb2fh *fh,
+                       uint64_t offset, uint64_t len, int64_t size)
+{
+        struct smb2_fcache *fc = fh->fcache;
+
+        if (fc == NULL) {
+                return;
+        }
+        if (size >= 0) {
+                /* truncate or extend, everything past the old and the
+                 * new end of file is affected
+                 */
+                struct fc_extent *ext, *next;
+
+                fc_drop_range(fc, 0, 0);
+                fc->eof = size;
+
+                /* dirty data past the new end of file is gone */
+                for (ext = fc->extents; ext; ext = next) {
+                        next = ext->next;
+                        if (ext->flushing || ext->offset + ext->len <=
+                            (uint64_t)size) {
+                                continue;
+                        }
+                        if (ext->offset >= (uint64_t)size) {
+                                fc_free_extent(fc, ext);
+                                continue;
+                        }
+                        fc->dirty_bytes -= ext->len;
+                        ext->len = (uint32_t)(size - ext->offset);
+                        fc->dirty_bytes += ext->len;
+                }
+                return;
+        }
+        fc_drop_range(fc, offset, len);
+        if (offset + len > fc->eof) {
+                fc->eof = offset + len;
+        }
+}
+
+void
+smb2_fcache_destroy(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_fcache *fc = fh->fcache;
+        struct fc_flush_waiter *w;
+        struct fc_extent *ext, *next;
+
+        if (fc == NULL) {
+                return;
+        }
+        fh->fcache = NULL;
+
+        if (fc->registered) {
+                smb2_lease_unregister(smb2, &fc->lease);
+                fc->registered = 0;
+        }
+        fc->valid = 0;
+        fc->write_valid = 0;
+        fc->fh = NULL;
+        fc_drop_range(fc, 0, 0);
+
+        /* whatever is still dirty can no longer be written */
+        for (ext = fc->extents; ext; ext = next) {
+                next = ext->next;
+                if (!ext->flushing) {
+                        fc_free_extent(fc, ext);
+                }
+        }
+        /* the flush they wait for will never complete */
+        while ((w = fc->flush_waiters) != NULL) {
+                fc->flush_waiters = w->next;
+                w->cb(smb2, -ECANCELED, NULL, w->cb_data);
+                free(w);
+        }
+        fc_release(fc);
+}
@@ -0,0 +1,301 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_FCNTL_H
+#include <sys/fcntl.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Open-handle cache.
+ *
+ * Files opened while the cache is enabled ask for a lease with handle
+ * caching, through the data cache of the handle, see fcache.c. When such
+ * a handle is closed while the lease is still held the CLOSE is not sent.
+ * The handle is kept idle instead and given back to the next open of the
+ * same path with the same access mode.
+ *
+ * Idle handles are kept in LRU order and closed once there are more of
+ * them than the limit, when the server breaks the handle lease, and
+ * before the path is unlinked, renamed or truncated through this context.
+ */
+
+struct smb2_hcache_entry {
+        struct smb2_hcache_entry *next;
+        struct smb2fh *fh;
+        char *path;
+        int accmode;
+        int idle;
+};
+
+struct smb2_hcache {
+        /* idle handles, most recently used first */
+        struct smb2_hcache_entry *idle;
+        int num_idle;
+        int max_idle;
+};
+
+static void
+hc_free_entry(struct smb2_context *smb2, struct smb2_hcache_entry *e)
+{
+        struct smb2_hcache *hc = smb2->hcache;
+
+        if (e->idle) {
+                SMB2_LIST_REMOVE(&hc->idle, e);
+                hc->num_idle--;
+        }
+        e->fh->hcache = NULL;
+        free(e->path);
+        free(e);
+}
+
+static void
+hc_close_cb(struct smb2_context *smb2, int status,
+            void *command_data, void *private_data)
+{
+}
+
+/* Stops caching the handle of e and sends the CLOSE for it */
+static void
+hc_close(struct smb2_context *smb2, struct smb2_hcache_entry *e)
+{
+        struct smb2fh *fh = e->fh;
+
+        hc_free_entry(smb2, e);
+        smb2_close_async(smb2, fh, hc_close_cb, NULL);
+}
+
+static void
+hc_evict(struct smb2_context *smb2, struct smb2_hcache *hc)
+{
+        struct smb2_hcache_entry *e, *victim;
+
+        while (hc->num_idle > hc->max_idle) {
+                victim = NULL;
+                for (e = hc->idle; e; e = e->next) {
+                        victim = e;
+                }
+                hc_close(smb2, victim);
+        }
+}
+
+void
+smb2_hcache_track(struct smb2_context *smb2, struct smb2fh *fh,
+                  const char *path, int flags)
+{
+        struct smb2_hcache_entry *e;
+
+        if (smb2->hcache == NULL || (flags & O_SYNC)) {
+                return;
+        }
+
+        e = calloc(1, sizeof(struct smb2_hcache_entry));
+        if (e == NULL) {
+                return;
+        }
+        e->path = strdup(path);
+        if (e->path == NULL) {
+                free(e);
+                return;
+        }
+        e->fh = fh;
+        e->accmode = flags & O_ACCMODE;
+        fh->hcache = e;
+}
+
+struct smb2fh *
+smb2_hcache_get(struct smb2_context *smb2, const char *path, int flags)
+{
+        struct smb2_hcache *hc = smb2->hcache;
+        struct smb2_hcache_entry *e;
+
+        if (hc == NULL || (flags & (O_TRUNC | O_EXCL | O_SYNC))) {
+                return NULL;
+        }
+
+        for (e = hc->idle; e; e = e->next) {
+                if (e->accmode == (flags & O_ACCMODE) &&
+                    !strcmp(e->path, path)) {
+                        break;
+                }
+        }
+        if (e == NULL) {
+                return NULL;
+        }
+
+        SMB2_LIST_REMOVE(&hc->idle, e);
+        hc->num_idle--;
+        e->idle = 0;
+        smb2_fcache_reopened(e->fh);
+
+        return e->fh;
+}
+
+int
+smb2_hcache_release(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_hcache *hc = smb2->hcache;
+        struct smb2_hcache_entry *e = fh->hcache;
+
+        if (e == NULL) {
+                return 0;
+        }
+        if (hc == NULL || !smb2_fcache_handle_cached(fh)) {
+                hc_free_entry(smb2, e);
+                return 0;
+        }
+
+        e->idle = 1;
+        SMB2_LIST_ADD(&hc->idle, e);
+        hc->num_idle++;
+        hc_evict(smb2, hc);
+
+        /* the handle may just have been evicted, it is closed either way
+         * as far as the caller is concerned
+         */
+        return 1;
+}
+
+int
+smb2_hcache_break(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_hcache_entry *e = fh->hcache;
+
+        if (e == NULL || !e->idle) {
+                return 0;
+        }
+        hc_close(smb2, e);
+
+        return 1;
+}
+
+void
+smb2_hcache_forget(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        if (fh->hcache != NULL) {
+                hc_free_entry(smb2, fh->hcache);
+        }
+}
+
+void
+smb2_hcache_invalidate(struct smb2_context *smb2, const char *path)
+{
+        struct smb2_hcache *hc = smb2->hcache;
+        struct smb2_hcache_entry *e, *next;
+
+        if (hc == NULL) {
+                return;
+        }
+        for (e = hc->idle; e; e = next) {
+                next = e->next;
+                if (!strcmp(e->path, path)) {
+                        hc_close(smb2, e);
+                }
+        }
+}
+
+void
+smb2_hcache_purge(struct smb2_context *smb2, int close_handles)
+{
+        struct smb2_hcache *hc = smb2->hcache;
+        struct smb2fh *fh;
+
+        if (hc == NULL) {
+                return;
+        }
+        while (hc->idle) {
+                if (close_handles) {
+                        hc_close(smb2, hc->idle);
+                        continue;
+                }
+                /* the connection is gone and the handle with it */
+                fh = hc->idle->fh;
+                hc_free_entry(smb2, hc->idle);
+                smb2_free_fh(smb2, fh);
+        }
+}
+
+void
+smb2_hcache_destroy(struct smb2_context *smb2)
+{
+        if (smb2->hcache == NULL) {
+                return;
+        }
+        smb2_hcache_purge(smb2, 0);
+        free(smb2->hcache);
+        smb2->hcache = NULL;
+}
+
+int
+smb2_set_handle_cache(struct smb2_context *smb2, int max_handles)
+{
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+
+        if (max_handles <= 0) {
+                smb2_hcache_purge(smb2, 1);
+                smb2_hcache_destroy(smb2);
+                return 0;
+        }
+
+        if (smb2->hcache == NULL) {
+                smb2->hcache = calloc(1, sizeof(struct smb2_hcache));
+                if (smb2->hcache == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "handle cache");
+                        return -ENOMEM;
+                }
+        }
+        smb2->hcache->max_idle = max_handles;
+        hc_evict(smb2, smb2->hcache);
+
+        return 0;
+}
@@ -148,7 +148,7 @@ smb2_parse_args(struct smb2_context *smb2, const char *args)
                                 return -1;
                         }
                 } else if (!strcmp(args, "timeout")) {
-                        smb2->timeout = (int)strtol(value, NULL, 10);
+                        smb2->timeout = (int)strtol(value, NULL, 10) * 1000;
                 } else {
                         smb2_set_error(smb2, "Unknown argument: %s", args);
                         return -1;
@@ -283,6 +283,9 @@ struct smb2_context *smb2_init_context(void)
         ret = getlogin_r(buf, sizeof(buf));
         smb2_set_user(smb2, ret == 0 ? buf : "Guest");
         smb2->fd = SMB2_INVALID_SOCKET;
+        smb2->uring_fd = SMB2_INVALID_SOCKET;
+        smb2->submit_fd = SMB2_INVALID_SOCKET;
+        smb2->submit_wfd = SMB2_INVALID_SOCKET;
         smb2->connecting_fds = NULL;
         smb2->connecting_fds_count = 0;
         smb2->addrinfos = NULL;
@@ -313,7 +316,11 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 return;
         }
 
+        smb2_stop_service_thread(smb2);
+        smb2_reactor_detach(smb2);
+        smb2_submit_close(smb2);
         if (SMB2_VALID_SOCKET(smb2->fd)) {
+                smb2_uring_stop(smb2);
                 if (smb2->change_fd) {
                         smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
                 }
@@ -327,7 +334,7 @@ void smb2_destroy_context(struct smb2_context *smb2)
         while (smb2->outqueue) {
                 struct smb2_pdu *pdu = smb2->outqueue;
 
-                smb2->outqueue = pdu->next;
+                smb2_pdu_dequeue(smb2, pdu);
                 if (pdu->cb) {
                         pdu->cb(smb2, SMB2_STATUS_CANCELLED, NULL, pdu->cb_data);
                 }
@@ -344,7 +351,7 @@ void smb2_destroy_context(struct smb2_context *smb2)
         while (smb2->waitqueue) {
                 struct smb2_pdu *pdu = smb2->waitqueue;
 
-                smb2->waitqueue = pdu->next;
+                smb2_pdu_dequeue(smb2, pdu);
                 if (pdu->cb) {
                         pdu->cb(smb2, SMB2_STATUS_CANCELLED, NULL, pdu->cb_data);
                 }
@@ -353,6 +360,8 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 }
                 smb2_free_pdu(smb2, pdu);
         }
+        smb2->stats.outqueue_depth = 0;
+        smb2->stats.waitqueue_depth = 0;
         smb2_free_iovector(smb2, &smb2->in);
 
         if (smb2->fhs) {
@@ -362,6 +371,8 @@ void smb2_destroy_context(struct smb2_context *smb2)
         if (smb2->dirs) {
                 smb2_free_all_dirs(smb2);
         }
+        smb2_mdcache_destroy(smb2);
+        smb2_hcache_destroy(smb2);
         if (smb2->connect_cb) {
            smb2->connect_cb(smb2, SMB2_STATUS_CANCELLED,
                          NULL, smb2->connect_data);
@@ -377,11 +388,16 @@ void smb2_destroy_context(struct smb2_context *smb2)
         free(discard_const(smb2->domain));
         free(discard_const(smb2->workstation));
         free(smb2->enc);
+        free(smb2->rbuf);
+        free(smb2->timeouts);
 
         if (smb2->connect_data) {
             free_c_data(smb2, smb2->connect_data);  /* sets smb2->connect_data to NULL */
         }
 
+        smb2_stop_chrome_trace(smb2);
+        smb2_stop_capture(smb2);
+
         SMB2_LIST_REMOVE(&active_contexts, smb2);
         free(smb2);
 }
@@ -669,7 +685,22 @@ void smb2_set_authentication(struct smb2_context *smb2, int val)
 
 void smb2_set_timeout(struct smb2_context *smb2, int seconds)
 {
-        smb2->timeout = seconds;
+        smb2->timeout = seconds * 1000;
+}
+
+void smb2_set_timeout_ms(struct smb2_context *smb2, int ms)
+{
+        smb2->timeout = ms;
+}
+
+void smb2_set_read_cache(struct smb2_context *smb2, uint32_t max_bytes)
+{
+        smb2->read_cache_size = max_bytes;
+}
+
+void smb2_set_write_cache(struct smb2_context *smb2, uint32_t max_dirty_bytes)
+{
+        smb2->write_cache_size = max_dirty_bytes;
 }
 
 void smb2_set_version(struct smb2_context *smb2,
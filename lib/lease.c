@@ -0,0 +1,249 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "compat.h"
+
+#include "portable-endian.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Leases held by the library itself.
+ *
+ * The caches keep a struct smb2_lease for every lease they request.
+ * Registered leases are looked up by lease key when the server sends a
+ * lease break so the owning cache can drop its state before the break is
+ * acknowledged. Breaks for lease keys that are not registered here are
+ * passed on to the application callback as before.
+ */
+
+#define LEASE_CONTEXT_HDR_SIZE          24
+#define LEASE_V1_DATA_SIZE              SMB2_CREATE_REQUEST_LEASE_SIZE
+#define LEASE_V2_DATA_SIZE              52
+
+void
+smb2_lease_init(struct smb2_context *smb2, struct smb2_lease *lease,
+                smb2_lease_break_fn break_cb, void *private_data)
+{
+        int i;
+
+        memset(lease, 0, sizeof(struct smb2_lease));
+        for (i = 0; i < SMB2_LEASE_KEY_SIZE; i++) {
+                lease->key[i] = random() & 0xff;
+        }
+        lease->break_cb = break_cb;
+        lease->private_data = private_data;
+}
+
+int
+smb2_lease_create_context(struct smb2_context *smb2,
+                          struct smb2_lease *lease, uint32_t state,
+                          struct smb2_create_request *req)
+{
+        struct smb2_iovec iov;
+        uint32_t data_len;
+
+        /* directory leases and epochs only exist in the v2 context */
+        if (smb2->dialect >= SMB2_VERSION_0300) {
+                data_len = LEASE_V2_DATA_SIZE;
+        } else {
+                data_len = LEASE_V1_DATA_SIZE;
+        }
+
+        iov.len = LEASE_CONTEXT_HDR_SIZE + data_len;
+        iov.buf = calloc(1, iov.len);
+        if (iov.buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate lease context");
+                return -ENOMEM;
+        }
+
+        smb2_set_uint32(&iov, 0, 0);    /* chain offset */
+        smb2_set_uint16(&iov, 4, 16);   /* tag offset */
+        smb2_set_uint16(&iov, 6, 4);    /* tag length */
+        smb2_set_uint16(&iov, 10, LEASE_CONTEXT_HDR_SIZE); /* data offset */
+        smb2_set_uint32(&iov, 12, data_len);
+        smb2_set_uint32(&iov, 16, htobe32(0x52714c73)); /* "RqLs" */
+        memcpy(iov.buf + 24, lease->key, SMB2_LEASE_KEY_SIZE);
+        smb2_set_uint32(&iov, 40, state);
+        if (data_len == LEASE_V2_DATA_SIZE) {
+                smb2_set_uint16(&iov, 72, lease->epoch);
+        }
+
+        req->requested_oplock_level = SMB2_OPLOCK_LEVEL_LEASE;
+        req->create_context = iov.buf;
+        req->create_context_length = (uint32_t)iov.len;
+
+        return 0;
+}
+
+uint32_t
+smb2_lease_granted(struct smb2_context *smb2, struct smb2_lease *lease,
+                   struct smb2_create_reply *rep)
+{
+        struct smb2_iovec iov;
+        uint32_t offset = 0;
+
+        lease->state = SMB2_LEASE_NONE;
+        if (rep->oplock_level != SMB2_OPLOCK_LEVEL_LEASE ||
+            rep->create_context == NULL) {
+                return lease->state;
+        }
+
+        iov.buf = rep->create_context;
+        iov.len = rep->create_context_length;
+
+        while (offset + LEASE_CONTEXT_HDR_SIZE <= iov.len) {
+                struct smb2_iovec ctx;
+                uint32_t next, data_len;
+                uint16_t name_offset, name_len, data_offset;
+
+                ctx.buf = iov.buf + offset;
+                ctx.len = iov.len - offset;
+                smb2_get_uint32(&ctx, 0, &next);
+                smb2_get_uint16(&ctx, 4, &name_offset);
+                smb2_get_uint16(&ctx, 6, &name_len);
+                smb2_get_uint16(&ctx, 10, &data_offset);
+                smb2_get_uint32(&ctx, 12, &data_len);
+
+                if (name_len == 4 && name_offset + 4 <= ctx.len &&
+                    !memcmp(ctx.buf + name_offset, "RqLs", 4) &&
+                    data_len >= LEASE_V1_DATA_SIZE &&
+                    data_offset + data_len <= ctx.len &&
+                    !memcmp(ctx.buf + data_offset, lease->key,
+                            SMB2_LEASE_KEY_SIZE)) {
+                        smb2_get_uint32(&ctx, data_offset + 16,
+                                        &lease->state);
+                        if (data_len >= LEASE_V2_DATA_SIZE) {
+                                smb2_get_uint16(&ctx, data_offset + 48,
+                                                &lease->epoch);
+                        }
+                        break;
+                }
+                if (next == 0) {
+                        break;
+                }
+                offset += next;
+        }
+
+        return lease->state;
+}
+
+void
+smb2_lease_register(struct smb2_context *smb2, struct smb2_lease *lease)
+{
+        SMB2_LIST_ADD(&smb2->leases, lease);
+}
+
+void
+smb2_lease_unregister(struct smb2_context *smb2, struct smb2_lease *lease)
+{
+        SMB2_LIST_REMOVE(&smb2->leases, lease);
+}
+
+static void
+lease_break_ack_cb(struct smb2_context *smb2, int status,
+                   void *command_data, void *private_data)
+{
+}
+
+int
+smb2_lease_break_ack(struct smb2_context *smb2, struct smb2_lease *lease,
+                     uint32_t state)
+{
+        struct smb2_lease_break_reply ack;
+        struct smb2_pdu *pdu;
+
+        memset(&ack, 0, sizeof(ack));
+        memcpy(ack.lease_key, lease->key, SMB2_LEASE_KEY_SIZE);
+        ack.lease_state = state;
+
+        pdu = smb2_cmd_lease_break_reply_async(smb2, &ack,
+                                               lease_break_ack_cb, NULL);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create lease break "
+                               "acknowledgement");
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+int
+smb2_lease_break(struct smb2_context *smb2,
+                 struct smb2_lease_break_notification *notify)
+{
+        struct smb2_lease *lease;
+        uint32_t new_state = notify->new_lease_state;
+
+        for (lease = smb2->leases; lease; lease = lease->next) {
+                if (!memcmp(lease->key, notify->lease_key,
+                            SMB2_LEASE_KEY_SIZE)) {
+                        break;
+                }
+        }
+        if (lease == NULL) {
+                return 0;
+        }
+
+        lease->state = new_state;
+        lease->epoch = notify->new_epoch;
+
+        /* The owner can defer the acknowledgement, for example to flush
+         * cached writes first, by returning >0 from the callback and
+         * calling smb2_lease_break_ack() itself later. Closing the last
+         * handle for the lease also completes the break.
+         * The owner may free the lease from within the callback.
+         */
+        if (notify->flags & SMB2_NOTIFY_BREAK_LEASE_FLAG_ACK_REQUIRED) {
+                struct smb2_lease copy = *lease;
+
+                if (lease->break_cb(smb2, lease, new_state) == 0) {
+                        smb2_lease_break_ack(smb2, &copy, new_state);
+                }
+        } else {
+                lease->break_cb(smb2, lease, new_state);
+        }
+
+        return 1;
+}
@@ -155,6 +155,9 @@ struct connect_data {
 
         /* if context is being served by our server */
         struct smb2_server *server_context;
+
+        /* capabilities we sent in the NEGOTIATE request */
+        uint32_t capabilities;
 };
 
 struct smb2_dirent_internal {
@@ -168,19 +171,18 @@ struct smb2dir {
         void *cb_data;
         smb2_file_id file_id;
 
+        /* parameters for the QUERY_DIRECTORY requests */
+        uint8_t info_class;
+        char *pattern;
+        uint32_t output_buffer_length;
+
         struct smb2_dirent_internal *entries;
         struct smb2_dirent_internal *current_entry;
         int index;
-};
-
-struct smb2fh {
-        struct smb2fh *next;
-        smb2_command_cb cb;
-        void *cb_data;
 
-        smb2_file_id file_id;
-        int64_t offset;
-        int64_t end_of_file;
+        /* set when the listing can be stored in the metadata cache */
+        char *mdc_path;
+        uint64_t mdc_token;
 };
 
 void
@@ -190,12 +192,18 @@ smb2_close_context(struct smb2_context *smb2)
                 return;
         }
 
+        /* handles and leases do not survive the connection */
+        smb2_mdcache_purge(smb2, 0);
+        smb2_hcache_purge(smb2, 0);
+
         if (SMB2_VALID_SOCKET(smb2->fd)) {
+                smb2_uring_stop(smb2);
                 if (smb2->change_fd) {
                         smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
                 }
                 close(smb2->fd);
                 smb2->fd = SMB2_INVALID_SOCKET;
+                smb2->rbuf_pos = smb2->rbuf_len = 0;
         }
 
         smb2->message_id = 0;
@@ -227,10 +235,18 @@ free_smb2dir(struct smb2_context *smb2, struct smb2dir *dir)
                 free(dir->entries);
                 dir->entries = e;
         }
+        free(dir->pattern);
+        free(dir->mdc_path);
         free(dir->cb_data);
         free(dir);
 }
 
+void
+smb2_dir_set_cb_data(struct smb2dir *dir, void *cb_data)
+{
+        dir->cb_data = cb_data;
+}
+
 void smb2_free_all_dirs(struct smb2_context *smb2)
 {
         while (smb2->dirs) {
@@ -299,13 +315,93 @@ smb2_closedir(struct smb2_context *smb2, struct smb2dir *dir)
         free_smb2dir(smb2, dir);
 }
 
+static void
+dirent_set_type(struct smb2dirent *dirent, uint32_t file_attributes)
+{
+        dirent->st.smb2_type = SMB2_TYPE_FILE;
+        if (file_attributes & SMB2_FILE_ATTRIBUTE_DIRECTORY) {
+                dirent->st.smb2_type = SMB2_TYPE_DIRECTORY;
+        }
+        if (file_attributes & SMB2_FILE_ATTRIBUTE_REPARSE_POINT) {
+                dirent->st.smb2_type = SMB2_TYPE_LINK;
+        }
+}
+
+static int
+decode_dirent(struct smb2_context *smb2, struct smb2dir *dir,
+              struct smb2dirent *dirent, struct smb2_iovec *vec,
+              uint32_t *next_entry_offset)
+{
+        switch (dir->info_class) {
+        case SMB2_FILE_NAMES_INFORMATION: {
+                struct smb2_filenamesinformation fs;
+
+                if (smb2_decode_filenamesinformation(smb2, &fs, vec) < 0) {
+                        return -1;
+                }
+                /* steal the name */
+                dirent->name = fs.name;
+                *next_entry_offset = fs.next_entry_offset;
+                break;
+        }
+        case SMB2_FILE_BOTH_DIRECTORY_INFORMATION: {
+                struct smb2_filebothdirectoryinformation fs;
+
+                if (smb2_decode_filebothdirectoryinformation(smb2, &fs,
+                                                             vec) < 0) {
+                        return -1;
+                }
+                /* steal the name */
+                dirent->name = fs.name;
+                dirent_set_type(dirent, fs.file_attributes);
+                dirent->st.smb2_size = fs.end_of_file;
+                dirent->st.smb2_atime = fs.last_access_time.tv_sec;
+                dirent->st.smb2_atime_nsec = fs.last_access_time.tv_usec * 1000;
+                dirent->st.smb2_mtime = fs.last_write_time.tv_sec;
+                dirent->st.smb2_mtime_nsec = fs.last_write_time.tv_usec * 1000;
+                dirent->st.smb2_ctime = fs.change_time.tv_sec;
+                dirent->st.smb2_ctime_nsec = fs.change_time.tv_usec * 1000;
+                dirent->st.smb2_btime = fs.creation_time.tv_sec;
+                dirent->st.smb2_btime_nsec = fs.creation_time.tv_usec * 1000;
+                *next_entry_offset = fs.next_entry_offset;
+                break;
+        }
+        default: {
+                struct smb2_fileidfulldirectoryinformation fs;
+
+                if (smb2_decode_fileidfulldirectoryinformation(smb2, &fs,
+                                                               vec) < 0) {
+                        return -1;
+                }
+                /* steal the name */
+                dirent->name = fs.name;
+                dirent_set_type(dirent, fs.file_attributes);
+                dirent->st.smb2_nlink = 0;
+                dirent->st.smb2_ino = fs.file_id;
+                dirent->st.smb2_size = fs.end_of_file;
+                dirent->st.smb2_atime = fs.last_access_time.tv_sec;
+                dirent->st.smb2_atime_nsec = fs.last_access_time.tv_usec * 1000;
+                dirent->st.smb2_mtime = fs.last_write_time.tv_sec;
+                dirent->st.smb2_mtime_nsec = fs.last_write_time.tv_usec * 1000;
+                dirent->st.smb2_ctime = fs.change_time.tv_sec;
+                dirent->st.smb2_ctime_nsec = fs.change_time.tv_usec * 1000;
+                dirent->st.smb2_btime = fs.creation_time.tv_sec;
+                dirent->st.smb2_btime_nsec = fs.creation_time.tv_usec * 1000;
+                *next_entry_offset = fs.next_entry_offset;
+                break;
+        }
+        }
+
+        return 0;
+}
+
 static int
 decode_dirents(struct smb2_context *smb2, struct smb2dir *dir,
                struct smb2_iovec *vec)
 {
         struct smb2_dirent_internal *ent;
-        struct smb2_fileidfulldirectoryinformation fs;
         uint32_t offset = 0;
+        uint32_t next_entry_offset;
 
         do {
                 struct smb2_iovec tmp_vec _U_;
@@ -328,31 +424,81 @@ decode_dirents(struct smb2_context *smb2, struct smb2dir *dir,
                 tmp_vec.buf = &vec->buf[offset];
                 tmp_vec.len = vec->len - offset;
 
-                smb2_decode_fileidfulldirectoryinformation(smb2, &fs,
-                                                           &tmp_vec);
-                /* steal the name */
-                ent->dirent.name = fs.name;
-                ent->dirent.st.smb2_type = SMB2_TYPE_FILE;
-                if (fs.file_attributes & SMB2_FILE_ATTRIBUTE_DIRECTORY) {
-                        ent->dirent.st.smb2_type = SMB2_TYPE_DIRECTORY;
-                }
-                if (fs.file_attributes & SMB2_FILE_ATTRIBUTE_REPARSE_POINT) {
-                        ent->dirent.st.smb2_type = SMB2_TYPE_LINK;
-                }
-                ent->dirent.st.smb2_nlink = 0;
-                ent->dirent.st.smb2_ino = fs.file_id;
-                ent->dirent.st.smb2_size = fs.end_of_file;
-                ent->dirent.st.smb2_atime = fs.last_access_time.tv_sec;
-                ent->dirent.st.smb2_atime_nsec = fs.last_access_time.tv_usec * 1000;
-                ent->dirent.st.smb2_mtime = fs.last_write_time.tv_sec;
-                ent->dirent.st.smb2_mtime_nsec = fs.last_write_time.tv_usec * 1000;
-                ent->dirent.st.smb2_ctime = fs.change_time.tv_sec;
-                ent->dirent.st.smb2_ctime_nsec = fs.change_time.tv_usec * 1000;
-                ent->dirent.st.smb2_btime = fs.creation_time.tv_sec;
-                ent->dirent.st.smb2_btime_nsec = fs.creation_time.tv_usec * 1000;
-
-                offset += fs.next_entry_offset;
-        } while (fs.next_entry_offset);
+                if (decode_dirent(smb2, dir, &ent->dirent, &tmp_vec,
+                                  &next_entry_offset) < 0) {
+                        return -1;
+                }
+
+                offset += next_entry_offset;
+        } while (next_entry_offset);
+
+        return 0;
+}
+
+static void
+query_cb(struct smb2_context *smb2, int status,
+         void *command_data, void *private_data);
+
+static struct smb2_pdu *
+smb2_dir_query_pdu(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        struct smb2_query_directory_request req;
+
+        memset(&req, 0, sizeof(struct smb2_query_directory_request));
+        req.file_information_class = dir->info_class;
+        req.flags = 0;
+        memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
+        req.output_buffer_length = dir->output_buffer_length;
+        req.name = dir->pattern ? dir->pattern : "*";
+
+        return smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
+}
+
+static void
+od_store_listing(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        struct smb2_dirent_internal *e;
+        const struct smb2dirent **ents;
+        int count = 0;
+
+        for (e = dir->entries; e; e = e->next) {
+                count++;
+        }
+        ents = malloc((count ? count : 1) * sizeof(struct smb2dirent *));
+        if (ents == NULL) {
+                return;
+        }
+        count = 0;
+        for (e = dir->entries; e; e = e->next) {
+                ents[count++] = &e->dirent;
+        }
+        smb2_mdcache_store_listing(smb2, dir->mdc_path, dir->mdc_token,
+                                   ents, count);
+        free(ents);
+}
+
+/* Builds the entries of dir from a listing in the metadata cache */
+static int
+od_cached_listing(struct smb2_context *smb2, struct smb2dir *dir,
+                  const struct smb2dirent *ents, int count)
+{
+        struct smb2_dirent_internal *ent;
+
+        /* SMB2_LIST_ADD prepends so add them in reverse to keep the
+         * order of the original listing
+         */
+        while (count--) {
+                ent = calloc(1, sizeof(struct smb2_dirent_internal));
+                if (ent == NULL) {
+                        return -ENOMEM;
+                }
+                SMB2_LIST_ADD(&dir->entries, ent);
+                ent->dirent.st = ents[count].st;
+                ent->dirent.name = strdup(ents[count].name);
+                if (ent->dirent.name == NULL) {
+                        return -ENOMEM;
+                }
+        }
 
         return 0;
 }
@@ -369,6 +515,10 @@ od_close_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
+        if (dir->mdc_path) {
+                od_store_listing(smb2, dir);
+        }
+
         dir->current_entry = dir->entries;
         dir->index = 0;
 
@@ -385,7 +535,6 @@ query_cb(struct smb2_context *smb2, int status,
 
         if (status == SMB2_STATUS_SUCCESS) {
                 struct smb2_iovec vec _U_;
-                struct smb2_query_directory_request req;
                 struct smb2_pdu *pdu;
 
                 vec.buf = rep->output_buffer;
@@ -398,14 +547,7 @@ query_cb(struct smb2_context *smb2, int status,
                 }
 
                 /* We need to get more data */
-                memset(&req, 0, sizeof(struct smb2_query_directory_request));
-                req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
-                req.flags = 0;
-                memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
-                req.output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
-                req.name = "*";
-
-                pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
+                pdu = smb2_dir_query_pdu(smb2, dir);
                 if (pdu == NULL) {
                         dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
                         free_smb2dir(smb2, dir);
@@ -449,7 +591,6 @@ opendir_cb(struct smb2_context *smb2, int status,
 {
         struct smb2dir *dir = private_data;
         struct smb2_create_reply *rep = command_data;
-        struct smb2_query_directory_request req;
         struct smb2_pdu *pdu;
 
         if (status != SMB2_STATUS_SUCCESS) {
@@ -462,14 +603,7 @@ opendir_cb(struct smb2_context *smb2, int status,
 
         memcpy(dir->file_id, rep->file_id, SMB2_FD_SIZE);
 
-        memset(&req, 0, sizeof(struct smb2_query_directory_request));
-        req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
-        req.flags = 0;
-        memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
-        req.output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
-        req.name = "*";
-
-        pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
+        pdu = smb2_dir_query_pdu(smb2, dir);
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create query command.");
                 dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
@@ -480,21 +614,59 @@ opendir_cb(struct smb2_context *smb2, int status,
 }
 
 int
-smb2_opendir_async(struct smb2_context *smb2, const char *path,
-                   smb2_command_cb cb, void *cb_data)
+smb2_opendir_ex_async(struct smb2_context *smb2, const char *path,
+                      uint8_t info_class, const char *pattern,
+                      uint32_t output_buffer_length,
+                      smb2_command_cb cb, void *cb_data)
 {
         struct smb2_create_request req;
         struct smb2dir *dir;
         struct smb2_pdu *pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_OPENDIR,
+                                          NULL, path, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_opendir_ex_async(smb2, path, info_class,
+                                                      pattern,
+                                                      output_buffer_length,
+                                                      smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        switch (info_class) {
+        case SMB2_FILE_NAMES_INFORMATION:
+        case SMB2_FILE_BOTH_DIRECTORY_INFORMATION:
+        case SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION:
+                break;
+        default:
+                smb2_set_error(smb2, "Unsupported directory information "
+                               "class 0x%02x.", info_class);
+                return -EINVAL;
+        }
+
         if (path == NULL) {
                 path = "";
         }
 
+        if (output_buffer_length == 0) {
+                output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
+        }
+        if (smb2->max_transact_size &&
+            output_buffer_length > smb2->max_transact_size) {
+                output_buffer_length = smb2->max_transact_size;
+        }
+        if (!smb2->supports_multi_credit &&
+            output_buffer_length > 0xffff) {
+                output_buffer_length = 0xffff;
+        }
+
         dir = calloc(1, sizeof(struct smb2dir));
         if (dir == NULL) {
                 smb2_set_error(smb2, "Failed to allocate smb2dir.");
@@ -503,6 +675,43 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
         SMB2_LIST_ADD(&smb2->dirs, dir);
         dir->cb = cb;
         dir->cb_data = cb_data;
+        dir->info_class = info_class;
+        dir->output_buffer_length = output_buffer_length;
+        if (pattern && pattern[0]) {
+                dir->pattern = strdup(pattern);
+                if (dir->pattern == NULL) {
+                        /* cb_data is still owned by the caller */
+                        dir->cb_data = NULL;
+                        free_smb2dir(smb2, dir);
+                        smb2_set_error(smb2, "Failed to allocate pattern.");
+                        return -ENOMEM;
+                }
+        }
+
+        /* Only complete listings in the default format are cached */
+        if (info_class == SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION &&
+            dir->pattern == NULL) {
+                const struct smb2dirent *ents;
+                int count;
+
+                if (smb2_mdcache_get_listing(smb2, path, &ents, &count)) {
+                        if (od_cached_listing(smb2, dir, ents, count) < 0) {
+                                dir->cb_data = NULL;
+                                free_smb2dir(smb2, dir);
+                                smb2_set_error(smb2, "Failed to allocate "
+                                               "dirent_internal");
+                                return -ENOMEM;
+                        }
+                        dir->current_entry = dir->entries;
+                        dir->index = 0;
+                        cb(smb2, 0, dir, cb_data);
+                        return 0;
+                }
+                dir->mdc_token = smb2_mdcache_token(smb2, path);
+                if (dir->mdc_token) {
+                        dir->mdc_path = strdup(path);
+                }
+        }
 
         memset(&req, 0, sizeof(struct smb2_create_request));
         req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
@@ -516,6 +725,7 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
 
         pdu = smb2_cmd_create_async(smb2, &req, opendir_cb, dir);
         if (pdu == NULL) {
+                dir->cb_data = NULL;
                 free_smb2dir(smb2, dir);
                 smb2_set_error(smb2, "Failed to create opendir command.");
                 return -EINVAL;
@@ -525,6 +735,16 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
         return 0;
 }
 
+int
+smb2_opendir_async(struct smb2_context *smb2, const char *path,
+                   smb2_command_cb cb, void *cb_data)
+{
+        return smb2_opendir_ex_async(smb2, path,
+                                     SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION,
+                                     NULL, DEFAULT_OUTPUT_BUFFER_LENGTH,
+                                     cb, cb_data);
+}
+
 extern void
 free_c_data(struct smb2_context *smb2, struct connect_data *c_data)
 {
@@ -899,6 +1119,11 @@ negotiate_cb(struct smb2_context *smb2, int status,
         smb2->max_write_size    = rep->max_write_size;
         smb2->dialect           = rep->dialect_revision;
         smb2->cypher            = rep->cypher;
+        smb2->capabilities      = rep->capabilities;
+        /* leases are only used if we asked for them */
+        smb2->capabilities &= ~((SMB2_GLOBAL_CAP_LEASING |
+                                 SMB2_GLOBAL_CAP_DIRECTORY_LEASING) &
+                                ~c_data->capabilities);
 
         if (smb2->seal && (smb2->dialect == SMB2_VERSION_0300 ||
                            smb2->dialect == SMB2_VERSION_0302)) {
@@ -985,7 +1210,17 @@ connect_cb(struct smb2_context *smb2, int status,
             smb2->version == SMB2_VERSION_0302 ||
             smb2->version == SMB2_VERSION_0311) {
                 req.capabilities |= SMB2_GLOBAL_CAP_ENCRYPTION;
+                /* only offer leasing if something is going to use it */
+                if (smb2->read_cache_size || smb2->write_cache_size ||
+                    smb2->hcache || smb2->oplock_or_lease_break_cb) {
+                        req.capabilities |= SMB2_GLOBAL_CAP_LEASING;
+                }
+                if (smb2->mdcache) {
+                        req.capabilities |= SMB2_GLOBAL_CAP_LEASING |
+                                SMB2_GLOBAL_CAP_DIRECTORY_LEASING;
+                }
         }
+        c_data->capabilities = req.capabilities;
         req.security_mode = smb2->security_mode;
         switch (smb2->version) {
         case SMB2_VERSION_ANY:
@@ -1118,17 +1353,19 @@ smb2_connect_share_async(struct smb2_context *smb2,
         return 0;
 }
 
-static void
-free_smb2fh(struct smb2_context *smb2, struct smb2fh *fh)
+void
+smb2_free_fh(struct smb2_context *smb2, struct smb2fh *fh)
 {
         SMB2_LIST_REMOVE(&smb2->fhs, fh);
+        smb2_hcache_forget(smb2, fh);
+        smb2_fcache_destroy(smb2, fh);
         free(fh);
 }
 
 void smb2_free_all_fhs(struct smb2_context *smb2)
 {
         while (smb2->fhs) {
-                free_smb2fh(smb2, smb2->fhs);
+                smb2_free_fh(smb2, smb2->fhs);
         }
 }
 
@@ -1143,12 +1380,18 @@ open_cb(struct smb2_context *smb2, int status,
                 smb2_set_nterror(smb2, status, "Open failed with (0x%08x) %s.",
                                status, nterror_to_str(status));
                 fh->cb(smb2, -nterror_to_errno(status), NULL, fh->cb_data);
-                free_smb2fh(smb2, fh);
+                smb2_free_fh(smb2, fh);
                 return;
         }
 
         memcpy(fh->file_id, rep->file_id, SMB2_FD_SIZE);
         fh->end_of_file = rep->end_of_file;
+        if (fh->fcache) {
+                smb2_fcache_opened(smb2, fh, rep);
+        }
+        if (fh->hcache && !smb2_fcache_handle_cached(fh)) {
+                smb2_hcache_forget(smb2, fh);
+        }
         fh->cb(smb2, 0, fh, fh->cb_data);
 }
 
@@ -1165,11 +1408,41 @@ smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *path
         uint32_t create_disposition = 0;
         uint32_t create_options = 0;
         uint32_t file_attributes = 0;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_OPEN,
+                                          NULL, path, NULL, 0, flags,
+                                          cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_open_async_with_oplock_or_lease(smb2,
+                                        path, flags, oplock_level,
+                                        lease_state, lease_key,
+                                        smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        /* the file may be created, truncated or written to */
+        if (flags & (O_CREAT | O_TRUNC) || (flags & O_ACCMODE) != O_RDONLY) {
+                smb2_mdcache_invalidate(smb2, path);
+        }
+
+        if (oplock_level == SMB2_OPLOCK_LEVEL_NONE && !lease_state) {
+                if (flags & O_TRUNC) {
+                        smb2_hcache_invalidate(smb2, path);
+                }
+                fh = smb2_hcache_get(smb2, path, flags);
+                if (fh != NULL) {
+                        cb(smb2, 0, fh, cb_data);
+                        return 0;
+                }
+        }
+
         fh = calloc(1, sizeof(struct smb2fh));
         if (fh == NULL) {
                 smb2_set_error(smb2, "Failed to allocate smbfh");
@@ -1246,12 +1519,16 @@ smb2_open_async_with_oplock_or_lease(struct smb2_context *smb2, const char *path
                 smb2_set_uint32(&iov, 16, htobe32(0x52714c73));
                 memcpy(iov.buf + 24, lease_key, SMB2_LEASE_KEY_SIZE);
                 smb2_set_uint32(&iov, 40, lease_state);
+        } else if (oplock_level == SMB2_OPLOCK_LEVEL_NONE) {
+                smb2_hcache_track(smb2, fh, path, flags);
+                fh->fcache = smb2_fcache_create(smb2, flags,
+                                                fh->hcache != NULL, &req);
         }
 
         pdu = smb2_cmd_create_async(smb2, &req, open_cb, fh);
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create create command");
-                free_smb2fh(smb2, fh);
+                smb2_free_fh(smb2, fh);
                 return -ENOMEM;
         }
         if (req.create_context && req.create_context_length) {
@@ -1276,37 +1553,28 @@ close_cb(struct smb2_context *smb2, int status,
          void *command_data, void *private_data)
 {
         struct smb2fh *fh = private_data;
+        int err;
 
         if (status != SMB2_STATUS_SUCCESS) {
                 smb2_set_nterror(smb2, status, "Close failed with (0x%08x) %s",
                                status, nterror_to_str(status));
                 fh->cb(smb2, -nterror_to_errno(status), NULL, fh->cb_data);
-                free_smb2fh(smb2, fh);
+                smb2_free_fh(smb2, fh);
                 return;
         }
 
-        fh->cb(smb2, 0, NULL, fh->cb_data);
-        free_smb2fh(smb2, fh);
+        /* report data that the write cache failed to write */
+        err = smb2_fcache_write_error(fh);
+        fh->cb(smb2, err, NULL, fh->cb_data);
+        smb2_free_fh(smb2, fh);
 }
 
-int
-smb2_close_async(struct smb2_context *smb2, struct smb2fh *fh,
-                 smb2_command_cb cb, void *cb_data)
+static int
+send_close(struct smb2_context *smb2, struct smb2fh *fh)
 {
         struct smb2_close_request req;
         struct smb2_pdu *pdu;
 
-        if (smb2 == NULL) {
-            return -EINVAL;
-        }
-        if (fh == NULL) {
-            smb2_set_error(smb2, "File handle was NULL");
-            return -EINVAL;
-        }
-
-        fh->cb = cb;
-        fh->cb_data = cb_data;
-
         memset(&req, 0, sizeof(struct smb2_close_request));
         req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
         memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
@@ -1321,28 +1589,57 @@ smb2_close_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+/* Keeps the handle open if the handle cache wants it */
+static int
+close_or_release(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        if (smb2_hcache_release(smb2, fh)) {
+                fh->cb(smb2, smb2_fcache_write_error(fh), NULL, fh->cb_data);
+                return 0;
+        }
+
+        return send_close(smb2, fh);
+}
+
 static void
-fsync_cb(struct smb2_context *smb2, int status,
-         void *command_data, void *private_data)
+close_flushed_cb(struct smb2_context *smb2, int status,
+                 void *command_data, void *private_data)
 {
         struct smb2fh *fh = private_data;
+        int rc;
 
-        if (status != SMB2_STATUS_SUCCESS) {
-                smb2_set_nterror(smb2, status, "Flush failed with (0x%08x) %s",
-                               status, nterror_to_str(status));
-                fh->cb(smb2, -nterror_to_errno(status), NULL, fh->cb_data);
+        /* the handle is being freed */
+        if (status < 0) {
+                fh->cb(smb2, status, NULL, fh->cb_data);
                 return;
         }
 
-        fh->cb(smb2, 0, NULL, fh->cb_data);
+        /* writes that were waiting for the flush may have added more */
+        rc = smb2_fcache_flush(smb2, fh, close_flushed_cb, fh);
+        if (rc == 0) {
+                rc = close_or_release(smb2, fh);
+        }
+        if (rc < 0) {
+                fh->cb(smb2, rc, NULL, fh->cb_data);
+        }
 }
 
 int
-smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
+smb2_close_async(struct smb2_context *smb2, struct smb2fh *fh,
                  smb2_command_cb cb, void *cb_data)
 {
-        struct smb2_flush_request req;
-        struct smb2_pdu *pdu;
+        int rc;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_CLOSE,
+                                          fh, NULL, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_close_async(smb2, fh, smb2_capture_cb,
+                                                 call));
+                }
+        }
 
         if (smb2 == NULL) {
             return -EINVAL;
@@ -1355,6 +1652,40 @@ smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
         fh->cb = cb;
         fh->cb_data = cb_data;
 
+        /* dirty data is written before the handle is closed */
+        rc = smb2_fcache_flush(smb2, fh, close_flushed_cb, fh);
+        if (rc < 0) {
+                return rc;
+        }
+        if (rc > 0) {
+                return 0;
+        }
+
+        return close_or_release(smb2, fh);
+}
+
+static void
+fsync_cb(struct smb2_context *smb2, int status,
+         void *command_data, void *private_data)
+{
+        struct smb2fh *fh = private_data;
+
+        if (status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, status, "Flush failed with (0x%08x) %s",
+                               status, nterror_to_str(status));
+                fh->cb(smb2, -nterror_to_errno(status), NULL, fh->cb_data);
+                return;
+        }
+
+        fh->cb(smb2, smb2_fcache_write_error(fh), NULL, fh->cb_data);
+}
+
+static int
+send_flush(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_flush_request req;
+        struct smb2_pdu *pdu;
+
         memset(&req, 0, sizeof(struct smb2_flush_request));
         memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
 
@@ -1368,6 +1699,67 @@ smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+static void
+fsync_flushed_cb(struct smb2_context *smb2, int status,
+                 void *command_data, void *private_data)
+{
+        struct smb2fh *fh = private_data;
+        int rc;
+
+        if (status < 0) {
+                fh->cb(smb2, status, NULL, fh->cb_data);
+                return;
+        }
+
+        rc = smb2_fcache_flush(smb2, fh, fsync_flushed_cb, fh);
+        if (rc == 0) {
+                rc = send_flush(smb2, fh);
+        }
+        if (rc < 0) {
+                fh->cb(smb2, rc, NULL, fh->cb_data);
+        }
+}
+
+int
+smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
+                 smb2_command_cb cb, void *cb_data)
+{
+        int rc;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_FSYNC,
+                                          fh, NULL, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_fsync_async(smb2, fh, smb2_capture_cb,
+                                                 call));
+                }
+        }
+
+        if (smb2 == NULL) {
+            return -EINVAL;
+        }
+        if (fh == NULL) {
+            smb2_set_error(smb2, "File handle was NULL");
+            return -EINVAL;
+        }
+
+        fh->cb = cb;
+        fh->cb_data = cb_data;
+
+        /* dirty data is written before the flush is sent */
+        rc = smb2_fcache_flush(smb2, fh, fsync_flushed_cb, fh);
+        if (rc < 0) {
+                return rc;
+        }
+        if (rc > 0) {
+                return 0;
+        }
+
+        return send_flush(smb2, fh);
+}
+
 struct read_data {
         smb2_command_cb cb;
         void *cb_data;
@@ -1407,6 +1799,18 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct read_data *rd;
         struct smb2_pdu *pdu;
         int needed_credits;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_PREAD,
+                                          fh, NULL, NULL, offset, count,
+                                          cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_pread_async(smb2, fh, buf, count, offset,
+                                                 smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -1416,6 +1820,14 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
                 return -EINVAL;
         }
 
+        if (fh->fcache) {
+                int rc = smb2_fcache_pread(smb2, fh, buf, count, offset,
+                                           cb, cb_data);
+                if (rc) {
+                        return rc < 0 ? rc : 0;
+                }
+        }
+
         rd = calloc(1, sizeof(struct read_data));
         if (rd == NULL) {
                 smb2_set_error(smb2, "Failed to allocate read_data");
@@ -1526,6 +1938,18 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct write_data *wr;
         struct smb2_pdu *pdu;
         int needed_credits;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_PWRITE,
+                                          fh, NULL, NULL, offset, count,
+                                          cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_pwrite_async(smb2, fh, buf, count, offset,
+                                                  smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -1535,12 +1959,22 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
                 return -EINVAL;
         }
 
+        if (fh->fcache) {
+                int rc = smb2_fcache_pwrite(smb2, fh, buf, count, offset,
+                                            cb, cb_data);
+                if (rc) {
+                        return rc < 0 ? rc : 0;
+                }
+        }
+
         wr = calloc(1, sizeof(struct write_data));
         if (wr == NULL) {
                 smb2_set_error(smb2, "Failed to allocate write_data");
                 return -ENOMEM;
         }
 
+        smb2_fcache_invalidate(smb2, fh, offset, count, -1);
+
         wr->cb = cb;
         wr->cb_data = cb_data;
         wr->write_cb_data.fh = fh;
@@ -1696,11 +2130,26 @@ smb2_unlink_internal(struct smb2_context *smb2, const char *path,
         struct smb2_create_request cr_req;
         struct smb2_close_request cl_req;
         struct smb2_pdu *pdu, *next_pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, is_dir ? SMB2_CAPTURE_RMDIR :
+                                          SMB2_CAPTURE_UNLINK,
+                                          NULL, path, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_unlink_internal(smb2, path, is_dir,
+                                                     smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        smb2_mdcache_invalidate(smb2, path);
+        smb2_hcache_invalidate(smb2, path);
+
         create_data = calloc(1, sizeof(struct create_cb_data));
         if (create_data == NULL) {
                 smb2_set_error(smb2, "Failed to allocate create_data");
@@ -1772,11 +2221,24 @@ smb2_mkdir_async(struct smb2_context *smb2, const char *path,
         struct smb2_create_request cr_req;
         struct smb2_close_request cl_req;
         struct smb2_pdu *pdu, *next_pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_MKDIR,
+                                          NULL, path, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_mkdir_async(smb2, path, smb2_capture_cb,
+                                                 call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        smb2_mdcache_invalidate(smb2, path);
+
         create_data = calloc(1, sizeof(struct create_cb_data));
         if (create_data == NULL) {
                 smb2_set_error(smb2, "Failed to allocate create_data");
@@ -1828,6 +2290,10 @@ struct stat_cb_data {
         uint8_t info_type;
         uint8_t file_info_class;
         void *st;
+
+        /* set when the result can be stored in the metadata cache */
+        char *mdc_path;
+        uint64_t mdc_token;
 };
 
 static void
@@ -1883,6 +2349,17 @@ smb2_fstat_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct stat_cb_data *stat_data;
         struct smb2_query_info_request req;
         struct smb2_pdu *pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_FSTAT,
+                                          fh, NULL, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_fstat_async(smb2, fh, st, smb2_capture_cb,
+                                                 call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -1931,6 +2408,14 @@ getinfo_cb_3(struct smb2_context *smb2, int status,
                 stat_data->status = status;
         }
 
+        if (stat_data->mdc_path) {
+                smb2_mdcache_store(smb2, stat_data->mdc_path,
+                                   stat_data->mdc_token,
+                                   -nterror_to_errno(stat_data->status),
+                                   stat_data->st);
+                free(stat_data->mdc_path);
+        }
+
         stat_data->cb(smb2, -nterror_to_errno(stat_data->status),
                       stat_data->st, stat_data->cb_data);
         free(stat_data);
@@ -2032,6 +2517,14 @@ smb2_getinfo_async(struct smb2_context *smb2, const char *path,
         stat_data->file_info_class = file_info_class;
         stat_data->st = st;
 
+        if (info_type == SMB2_0_INFO_FILE &&
+            file_info_class == SMB2_FILE_ALL_INFORMATION) {
+                stat_data->mdc_token = smb2_mdcache_parent_token(smb2, path);
+                if (stat_data->mdc_token) {
+                        stat_data->mdc_path = strdup(path);
+                }
+        }
+
         /* CREATE command */
         memset(&cr_req, 0, sizeof(struct smb2_create_request));
         cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
@@ -2046,6 +2539,7 @@ smb2_getinfo_async(struct smb2_context *smb2, const char *path,
         pdu = smb2_cmd_create_async(smb2, &cr_req, getinfo_cb_1, stat_data);
         if (pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create create command");
+                free(stat_data->mdc_path);
                 free(stat_data);
                 return -1;
         }
@@ -2063,6 +2557,7 @@ smb2_getinfo_async(struct smb2_context *smb2, const char *path,
                                              getinfo_cb_2, stat_data);
         if (next_pdu == NULL) {
                 smb2_set_error(smb2, "Failed to create query command");
+                free(stat_data->mdc_path);
                 free(stat_data);
                 smb2_free_pdu(smb2, pdu);
                 return -1;
@@ -2077,6 +2572,7 @@ smb2_getinfo_async(struct smb2_context *smb2, const char *path,
         next_pdu = smb2_cmd_close_async(smb2, &cl_req, getinfo_cb_3, stat_data);
         if (next_pdu == NULL) {
                 stat_data->cb(smb2, -ENOMEM, NULL, stat_data->cb_data);
+                free(stat_data->mdc_path);
                 free(stat_data);
                 smb2_free_pdu(smb2, pdu);
                 return -1;
@@ -2093,6 +2589,30 @@ smb2_stat_async(struct smb2_context *smb2, const char *path,
                 struct smb2_stat_64 *st,
                 smb2_command_cb cb, void *cb_data)
 {
+        int rc;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_STAT,
+                                          NULL, path, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_stat_async(smb2, path, st, smb2_capture_cb,
+                                                call));
+                }
+        }
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+
+        rc = smb2_mdcache_lookup(smb2, path, st);
+        if (rc) {
+                /* served from the metadata cache */
+                cb(smb2, rc < 0 ? rc : 0, st, cb_data);
+                return 0;
+        }
+
         return smb2_getinfo_async(smb2, path,
                                   SMB2_0_INFO_FILE,
                                   SMB2_FILE_ALL_INFORMATION,
@@ -2104,12 +2624,157 @@ smb2_statvfs_async(struct smb2_context *smb2, const char *path,
                    struct smb2_statvfs *statvfs,
                    smb2_command_cb cb, void *cb_data)
 {
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_STATVFS,
+                                          NULL, path, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_statvfs_async(smb2, path, statvfs,
+                                                   smb2_capture_cb, call));
+                }
+        }
+
         return smb2_getinfo_async(smb2, path,
                                   SMB2_0_INFO_FILESYSTEM,
                                   SMB2_FILE_FS_FULL_SIZE_INFORMATION,
                                   statvfs, cb, cb_data);
 }
 
+struct stat_batch_data;
+
+struct stat_batch_item {
+        struct stat_batch_data *batch;
+        int idx;
+};
+
+struct stat_batch_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        struct smb2_stat_batch_entry *entries;
+        int count;
+        int window;
+        int next;
+        int in_flight;
+        /* cache hits complete from within stat_batch_issue() */
+        int issuing;
+        int started;
+        struct stat_batch_item *items;
+};
+
+static void
+stat_batch_issue(struct smb2_context *smb2, struct stat_batch_data *batch);
+
+static void
+stat_batch_cb(struct smb2_context *smb2, int status,
+              void *command_data _U_, void *private_data)
+{
+        struct stat_batch_item *item = private_data;
+        struct stat_batch_data *batch = item->batch;
+
+        batch->entries[item->idx].status = status;
+        batch->in_flight--;
+
+        if (batch->issuing) {
+                return;
+        }
+        stat_batch_issue(smb2, batch);
+        if (batch->in_flight == 0 && batch->next == batch->count) {
+                batch->cb(smb2, 0, batch->entries, batch->cb_data);
+                free(batch->items);
+                free(batch);
+        }
+}
+
+static void
+stat_batch_issue(struct smb2_context *smb2, struct stat_batch_data *batch)
+{
+        batch->issuing = 1;
+        while (batch->next < batch->count &&
+               batch->in_flight < batch->window) {
+                struct stat_batch_item *item = &batch->items[batch->next];
+                struct smb2_stat_batch_entry *ent = &batch->entries[batch->next];
+                int rc;
+
+                /* Each stat is a create/query-info/close compound that
+                 * needs three credits. Do not queue more than the server
+                 * has granted us.
+                 */
+                if (batch->in_flight &&
+                    smb2_get_available_credits(smb2) < 3) {
+                        break;
+                }
+
+                item->batch = batch;
+                item->idx = batch->next++;
+                batch->in_flight++;
+                rc = smb2_stat_async(smb2, ent->path, &ent->st,
+                                     stat_batch_cb, item);
+                if (rc < 0) {
+                        batch->in_flight--;
+                        ent->status = rc;
+                        continue;
+                }
+                batch->started = 1;
+        }
+        batch->issuing = 0;
+}
+
+int
+smb2_stat_batch_async(struct smb2_context *smb2,
+                      struct smb2_stat_batch_entry *entries, int count,
+                      int window,
+                      smb2_command_cb cb, void *cb_data)
+{
+        struct stat_batch_data *batch;
+        int i;
+
+        if (smb2 == NULL || entries == NULL || count <= 0) {
+                return -EINVAL;
+        }
+
+        batch = calloc(1, sizeof(struct stat_batch_data));
+        if (batch == NULL) {
+                smb2_set_error(smb2, "Failed to allocate stat_batch_data");
+                return -ENOMEM;
+        }
+        batch->items = calloc(count, sizeof(struct stat_batch_item));
+        if (batch->items == NULL) {
+                smb2_set_error(smb2, "Failed to allocate stat_batch_item");
+                free(batch);
+                return -ENOMEM;
+        }
+        batch->cb = cb;
+        batch->cb_data = cb_data;
+        batch->entries = entries;
+        batch->count = count;
+        batch->window = window > 0 ? window : 1;
+
+        for (i = 0; i < count; i++) {
+                entries[i].status = -EINPROGRESS;
+        }
+
+        stat_batch_issue(smb2, batch);
+        if (batch->in_flight == 0 && !batch->started) {
+                /* Nothing could be queued */
+                int rc = entries[0].status;
+
+                free(batch->items);
+                free(batch);
+                return rc;
+        }
+        if (batch->in_flight == 0) {
+                /* every stat was served from the cache */
+                batch->cb(smb2, 0, entries, batch->cb_data);
+                free(batch->items);
+                free(batch);
+        }
+
+        return 0;
+}
+
 struct trunc_cb_data {
         smb2_command_cb cb;
         void *cb_data;
@@ -2165,11 +2830,26 @@ smb2_truncate_async(struct smb2_context *smb2, const char *path,
         struct smb2_close_request cl_req;
         struct smb2_pdu *pdu, *next_pdu;
         struct smb2_file_end_of_file_info eofi _U_;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_TRUNCATE,
+                                          NULL, path, NULL, length, 0,
+                                          cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_truncate_async(smb2, path, length,
+                                                    smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        smb2_mdcache_invalidate(smb2, path);
+        smb2_hcache_invalidate(smb2, path);
+
         trunc_data = calloc(1, sizeof(struct trunc_cb_data));
         if (trunc_data == NULL) {
                 smb2_set_error(smb2, "Failed to allocate trunc_data");
@@ -2238,6 +2918,407 @@ smb2_truncate_async(struct smb2_context *smb2, const char *path,
         return 0;
 }
 
+/*
+ * Small file fetch and store.
+ *
+ * The first round is a CREATE/READ or CREATE/WRITE compound that uses
+ * compound_file_id for the related READ/WRITE, with the CLOSE compounded
+ * too when that READ/WRITE covers the whole transfer, so a file that fits
+ * in a single chunk costs exactly one round trip. Files larger than what
+ * one READ/WRITE can carry keep the handle open and are transferred in
+ * further READs/WRITEs at increasing offsets, the last of which carries
+ * the CLOSE.
+ */
+struct xfer_file_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        char *path;
+        uint8_t *buf;
+        uint64_t count;
+        int is_write;
+
+        smb2_file_id file_id;
+        int is_open;
+        uint64_t done;
+        uint32_t chunk;
+        /* the CLOSE was sent along with the current READ/WRITE */
+        int is_last;
+        uint32_t xfer_len;
+        uint64_t end_of_file;
+        uint32_t status;
+        int error;
+};
+
+static int xfer_file_round(struct smb2_context *smb2,
+                           struct xfer_file_data *xd);
+
+static void
+free_xfer_file_data(struct xfer_file_data *xd)
+{
+        free(xd->path);
+        free(xd);
+}
+
+static void
+xfer_file_finish(struct smb2_context *smb2, struct xfer_file_data *xd)
+{
+        if (xd->error) {
+                xd->cb(smb2, xd->error, NULL, xd->cb_data);
+        } else if (xd->status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, xd->status, "%s failed with "
+                                 "(0x%08x) %s",
+                                 xd->is_write ? "Put file" : "Get file",
+                                 xd->status, nterror_to_str(xd->status));
+                xd->cb(smb2, -nterror_to_errno(xd->status), NULL,
+                       xd->cb_data);
+        } else {
+                xd->cb(smb2, 0, &xd->done, xd->cb_data);
+        }
+        free_xfer_file_data(xd);
+}
+
+/* Bytes that are left to transfer */
+static uint64_t
+xfer_file_left(struct xfer_file_data *xd)
+{
+        uint64_t end = xd->count;
+
+        /* the size of the file is not known until it has been opened */
+        if (!xd->is_write && xd->is_open && xd->end_of_file < end) {
+                end = xd->end_of_file;
+        }
+        return end > xd->done ? end - xd->done : 0;
+}
+
+static void
+xfer_file_close_cb(struct smb2_context *smb2, int status,
+                   void *command_data _U_, void *private_data)
+{
+        struct xfer_file_data *xd = private_data;
+
+        xd->is_open = 0;
+        if (xd->status == SMB2_STATUS_SUCCESS) {
+                xd->status = status;
+        }
+        if (xd->is_last && xd->status == SMB2_STATUS_SUCCESS) {
+                xd->done += xd->xfer_len;
+        }
+        xfer_file_finish(smb2, xd);
+}
+
+/* Closes the handle on its own, when the transfer ends before the
+ * READ/WRITE that was meant to carry the CLOSE.
+ */
+static void
+xfer_file_close(struct smb2_context *smb2, struct xfer_file_data *xd)
+{
+        struct smb2_close_request cl_req;
+        struct smb2_pdu *pdu;
+
+        if (!xd->is_open) {
+                xfer_file_finish(smb2, xd);
+                return;
+        }
+
+        memset(&cl_req, 0, sizeof(struct smb2_close_request));
+        cl_req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
+        memcpy(cl_req.file_id, xd->file_id, SMB2_FD_SIZE);
+
+        xd->is_last = 0;
+        pdu = smb2_cmd_close_async(smb2, &cl_req, xfer_file_close_cb, xd);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create close command");
+                if (xd->error == 0) {
+                        xd->error = -ENOMEM;
+                }
+                xfer_file_finish(smb2, xd);
+                return;
+        }
+        smb2_queue_pdu(smb2, pdu);
+}
+
+/* A READ/WRITE that did not carry the CLOSE has completed */
+static void
+xfer_file_next(struct smb2_context *smb2, struct xfer_file_data *xd)
+{
+        int rc;
+
+        if (xd->status != SMB2_STATUS_SUCCESS) {
+                xfer_file_close(smb2, xd);
+                return;
+        }
+
+        xd->done += xd->xfer_len;
+
+        if (xd->xfer_len == xd->chunk && xfer_file_left(xd) > 0) {
+                rc = xfer_file_round(smb2, xd);
+                if (rc < 0) {
+                        xd->error = rc;
+                        xfer_file_close(smb2, xd);
+                }
+                return;
+        }
+
+        xfer_file_close(smb2, xd);
+}
+
+static void
+xfer_file_cb_2(struct smb2_context *smb2, int status,
+               void *command_data, void *private_data)
+{
+        struct xfer_file_data *xd = private_data;
+
+        if (xd->status == SMB2_STATUS_SUCCESS) {
+                if (xd->is_write) {
+                        struct smb2_write_reply *rep = command_data;
+
+                        if (status == SMB2_STATUS_SUCCESS) {
+                                xd->xfer_len = rep->count;
+                        }
+                } else {
+                        struct smb2_read_reply *rep = command_data;
+
+                        if (status == SMB2_STATUS_SUCCESS) {
+                                xd->xfer_len = rep->data_length;
+                        }
+                        /* reading at or past the end of file is not an
+                         * error
+                         */
+                        if (status == SMB2_STATUS_END_OF_FILE) {
+                                status = SMB2_STATUS_SUCCESS;
+                        }
+                }
+                xd->status = status;
+        }
+
+        if (!xd->is_last) {
+                xfer_file_next(smb2, xd);
+        }
+}
+
+static void
+xfer_file_cb_1(struct smb2_context *smb2, int status,
+               void *command_data, void *private_data)
+{
+        struct xfer_file_data *xd = private_data;
+        struct smb2_create_reply *rep = command_data;
+
+        if (xd->status == SMB2_STATUS_SUCCESS) {
+                xd->status = status;
+        }
+        if (status == SMB2_STATUS_SUCCESS) {
+                memcpy(xd->file_id, rep->file_id, SMB2_FD_SIZE);
+                xd->is_open = 1;
+                xd->end_of_file = rep->end_of_file;
+        }
+}
+
+/* Size of the next READ/WRITE, limited the same way
+ * smb2_pread_async()/smb2_pwrite_async() limit a single command.
+ */
+static uint32_t
+xfer_file_chunk(struct smb2_context *smb2, struct xfer_file_data *xd)
+{
+        uint64_t left = xfer_file_left(xd);
+        uint32_t count;
+        uint32_t max = xd->is_write ? smb2->max_write_size :
+                smb2->max_read_size;
+        int credits;
+
+        count = left > 0xffffffff ? 0xffffffff : (uint32_t)left;
+        if (max && count > max) {
+                count = max;
+        }
+        if (smb2->dialect > SMB2_VERSION_0202) {
+                if (count > (MAX_CREDITS - 16) * 65536) {
+                        count = (MAX_CREDITS - 16) * 65536;
+                }
+                /* leave room for the CREATE and the CLOSE */
+                credits = smb2_get_available_credits(smb2) - 2;
+                if (credits < 1) {
+                        credits = 1;
+                }
+                if (count > (uint32_t)credits * 65536) {
+                        count = credits * 65536;
+                }
+        } else {
+                if (count > 65536) {
+                        count = 65536;
+                }
+        }
+
+        return count;
+}
+
+static int
+xfer_file_round(struct smb2_context *smb2, struct xfer_file_data *xd)
+{
+        struct smb2_create_request cr_req;
+        struct smb2_read_request rd_req;
+        struct smb2_write_request wr_req;
+        struct smb2_close_request cl_req;
+        struct smb2_pdu *pdu = NULL, *next_pdu;
+        const uint8_t *file_id;
+
+        xd->status = SMB2_STATUS_SUCCESS;
+        xd->xfer_len = 0;
+        xd->chunk = xfer_file_chunk(smb2, xd);
+        xd->is_last = xfer_file_left(xd) <= xd->chunk;
+
+        /* CREATE command, in the first round only */
+        if (!xd->is_open) {
+                memset(&cr_req, 0, sizeof(struct smb2_create_request));
+                cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+                cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+                cr_req.file_attributes = SMB2_FILE_ATTRIBUTE_NORMAL;
+                cr_req.share_access = SMB2_FILE_SHARE_READ |
+                        SMB2_FILE_SHARE_WRITE;
+                if (xd->is_write) {
+                        cr_req.desired_access = SMB2_FILE_WRITE_DATA |
+                                SMB2_FILE_WRITE_ATTRIBUTES |
+                                SMB2_FILE_READ_ATTRIBUTES;
+                        cr_req.create_disposition = SMB2_FILE_OVERWRITE_IF;
+                } else {
+                        cr_req.desired_access = SMB2_FILE_READ_DATA |
+                                SMB2_FILE_READ_ATTRIBUTES;
+                        cr_req.create_disposition = SMB2_FILE_OPEN;
+                }
+                cr_req.create_options = SMB2_FILE_NON_DIRECTORY_FILE;
+                cr_req.name = xd->path;
+
+                pdu = smb2_cmd_create_async(smb2, &cr_req, xfer_file_cb_1,
+                                            xd);
+                if (pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to create create "
+                                       "command");
+                        return -ENOMEM;
+                }
+        }
+        file_id = pdu ? compound_file_id : xd->file_id;
+
+        /* READ or WRITE command */
+        if (xd->chunk) {
+                if (xd->is_write) {
+                        memset(&wr_req, 0, sizeof(struct smb2_write_request));
+                        wr_req.length = xd->chunk;
+                        wr_req.offset = xd->done;
+                        wr_req.buf = xd->buf + xd->done;
+                        memcpy(wr_req.file_id, file_id, SMB2_FD_SIZE);
+                        wr_req.channel = SMB2_CHANNEL_NONE;
+
+                        next_pdu = smb2_cmd_write_async(smb2, &wr_req, 0,
+                                                        xfer_file_cb_2, xd);
+                } else {
+                        memset(&rd_req, 0, sizeof(struct smb2_read_request));
+                        rd_req.length = xd->chunk;
+                        rd_req.offset = xd->done;
+                        rd_req.buf = xd->buf + xd->done;
+                        memcpy(rd_req.file_id, file_id, SMB2_FD_SIZE);
+                        rd_req.channel = SMB2_CHANNEL_NONE;
+
+                        next_pdu = smb2_cmd_read_async(smb2, &rd_req,
+                                                       xfer_file_cb_2, xd);
+                }
+                if (next_pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to create %s command",
+                                       xd->is_write ? "write" : "read");
+                        if (pdu) {
+                                smb2_free_pdu(smb2, pdu);
+                        }
+                        return -ENOMEM;
+                }
+                if (pdu) {
+                        smb2_add_compound_pdu(smb2, pdu, next_pdu);
+                } else {
+                        pdu = next_pdu;
+                }
+        }
+
+        /* CLOSE command, with the READ/WRITE that completes the transfer */
+        if (xd->is_last) {
+                memset(&cl_req, 0, sizeof(struct smb2_close_request));
+                cl_req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
+                memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+                next_pdu = smb2_cmd_close_async(smb2, &cl_req,
+                                                xfer_file_close_cb, xd);
+                if (next_pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to create close command");
+                        smb2_free_pdu(smb2, pdu);
+                        return -ENOMEM;
+                }
+                smb2_add_compound_pdu(smb2, pdu, next_pdu);
+        }
+
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+static int
+smb2_xfer_file_async(struct smb2_context *smb2, const char *path,
+                     uint8_t *buf, uint64_t count, int is_write,
+                     smb2_command_cb cb, void *cb_data)
+{
+        struct xfer_file_data *xd;
+        int rc;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (path == NULL || (buf == NULL && count)) {
+                smb2_set_error(smb2, "Invalid path or buffer");
+                return -EINVAL;
+        }
+        if (is_write) {
+                smb2_mdcache_invalidate(smb2, path);
+                smb2_hcache_invalidate(smb2, path);
+        }
+
+        xd = calloc(1, sizeof(struct xfer_file_data));
+        if (xd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate xfer_file_data");
+                return -ENOMEM;
+        }
+        xd->path = strdup(path);
+        if (xd->path == NULL) {
+                free(xd);
+                smb2_set_error(smb2, "Failed to allocate path");
+                return -ENOMEM;
+        }
+        xd->cb = cb;
+        xd->cb_data = cb_data;
+        xd->buf = buf;
+        xd->count = count;
+        xd->is_write = is_write;
+
+        rc = xfer_file_round(smb2, xd);
+        if (rc < 0) {
+                free_xfer_file_data(xd);
+                return rc;
+        }
+
+        return 0;
+}
+
+int
+smb2_get_file_async(struct smb2_context *smb2, const char *path,
+                    uint8_t *buf, uint64_t count,
+                    smb2_command_cb cb, void *cb_data)
+{
+        return smb2_xfer_file_async(smb2, path, buf, count, 0, cb, cb_data);
+}
+
+int
+smb2_put_file_async(struct smb2_context *smb2, const char *path,
+                    const uint8_t *buf, uint64_t count,
+                    smb2_command_cb cb, void *cb_data)
+{
+        return smb2_xfer_file_async(smb2, path, discard_const(buf), count, 1,
+                                    cb, cb_data);
+}
+
 struct rename_cb_data {
         uint8_t *newpath;
         smb2_command_cb cb;
@@ -2299,11 +3380,28 @@ smb2_rename_async(struct smb2_context *smb2, const char *oldpath,
         struct smb2_pdu *pdu, *next_pdu;
         struct smb2_file_rename_info rn_info _U_;
         uint8_t *ptr;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_RENAME,
+                                          NULL, oldpath, newpath, 0, 0,
+                                          cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_rename_async(smb2, oldpath, newpath,
+                                                  smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        smb2_mdcache_invalidate(smb2, oldpath);
+        smb2_mdcache_invalidate(smb2, newpath);
+        smb2_hcache_invalidate(smb2, oldpath);
+        smb2_hcache_invalidate(smb2, newpath);
+
         rename_data = calloc(1, sizeof(struct rename_cb_data));
         if (rename_data == NULL) {
                 smb2_set_error(smb2, "Failed to allocate rename_data");
@@ -2402,6 +3500,18 @@ smb2_ftruncate_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct smb2_set_info_request req;
         struct smb2_file_end_of_file_info eofi _U_;
         struct smb2_pdu *pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_FTRUNCATE,
+                                          fh, NULL, NULL, length, 0,
+                                          cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_ftruncate_async(smb2, fh, length,
+                                                     smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -2422,6 +3532,8 @@ smb2_ftruncate_async(struct smb2_context *smb2, struct smb2fh *fh,
 
         eofi.end_of_file = length;
 
+        smb2_fcache_invalidate(smb2, fh, 0, 0, length);
+
         memset(&req, 0, sizeof(struct smb2_set_info_request));
         req.info_type = SMB2_0_INFO_FILE;
         req.file_info_class = SMB2_FILE_END_OF_FILE_INFORMATION;
@@ -2506,6 +3618,17 @@ smb2_readlink_async(struct smb2_context *smb2, const char *path,
         struct smb2_ioctl_request io_req;
         struct smb2_close_request cl_req;
         struct smb2_pdu *pdu, *next_pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_READLINK,
+                                          NULL, path, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_readlink_async(smb2, path,
+                                                    smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -2588,11 +3711,13 @@ disconnect_cb_2(struct smb2_context *smb2, int status,
 
         dc_data->cb(smb2, 0, NULL, dc_data->cb_data);
         free(dc_data);
+        smb2_uring_stop(smb2);
         if (smb2->change_fd) {
                 smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
         }
         close(smb2->fd);
         smb2->fd = SMB2_INVALID_SOCKET;
+        smb2->rbuf_pos = smb2->rbuf_len = 0;
 }
 
 static void
@@ -2642,6 +3767,10 @@ smb2_disconnect_share_async(struct smb2_context *smb2,
         dc_data->cb = cb;
         dc_data->cb_data = cb_data;
 
+        /* close the cached handles before the tree goes away */
+        smb2_mdcache_purge(smb2, 1);
+        smb2_hcache_purge(smb2, 1);
+
         pdu = smb2_cmd_tree_disconnect_async(smb2, disconnect_cb_1, dc_data);
         if (pdu == NULL) {
                 free(dc_data);
@@ -2674,6 +3803,16 @@ smb2_echo_async(struct smb2_context *smb2,
 {
         struct echo_data *echo_data;
         struct smb2_pdu *pdu;
+        struct smb2_capture_call *call;
+
+        if (SMB2_CAPTURING(smb2, cb)) {
+                call = smb2_capture_begin(smb2, SMB2_CAPTURE_ECHO,
+                                          NULL, NULL, NULL, 0, 0, cb, cb_data);
+                if (call != NULL) {
+                        return smb2_capture_end(smb2, call,
+                                smb2_echo_async(smb2, smb2_capture_cb, call));
+                }
+        }
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -2752,6 +3891,26 @@ smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_da
 
         rep= command_data;
 
+        if (status == SMB2_STATUS_SUCCESS &&
+            rep->break_type == SMB2_BREAK_TYPE_LEASE_NOTIFICATION &&
+            smb2_lease_break(smb2, &rep->lock.lease)) {
+                /* a lease held by one of the library caches */
+                return;
+        }
+        if (status == SMB2_STATUS_SUCCESS &&
+            rep->break_type == SMB2_BREAK_TYPE_OPLOCK_NOTIFICATION &&
+            smb2_fcache_oplock_break(smb2, &rep->lock.oplock)) {
+                /* an oplock held by the data cache of a handle */
+                return;
+        }
+
+        if (status == SMB2_STATUS_SUCCESS) {
+                new_oplock_level = rep->lock.oplock.oplock_level;
+                new_lease_state = rep->lock.lease.new_lease_state;
+        } else {
+                new_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+                new_lease_state = SMB2_LEASE_NONE;
+        }
 
         if (smb2->oplock_or_lease_break_cb) {
                 smb2->oplock_or_lease_break_cb(smb2,
@@ -2881,6 +4040,10 @@ smb2_create_request_cb(struct smb2_server *server, struct smb2_context *smb2, vo
                 ret = server->handlers->create_cmd(server, smb2, req, &rep);
         }
         if (!ret) {
+                /* related commands that follow in the same compound
+                 * refer to this handle through compound_file_id
+                 */
+                memcpy(smb2->last_file_id, rep.file_id, SMB2_FD_SIZE);
                 pdu = smb2_cmd_create_reply_async(smb2, &rep, NULL, cb_data);
         }
         else if (ret < 0) {
@@ -3065,6 +4228,121 @@ smb2_lock_request_cb(struct smb2_server *server, struct smb2_context *smb2, void
         }
 }
 
+/* Server-side copychunk for servers that implement read_cmd and
+ * write_cmd but do not handle the copy ioctls themselves.
+ * The resume key is the source file id. Requests over the server's
+ * copychunk limits fail with STATUS_INVALID_PARAMETER and the limits
+ * in the output, which the client uses to retry with smaller chunks.
+ *
+ * Returns 0 with *status and rep->output (in out) set, or < 0 if the
+ * request could not be decoded. A *status other than SUCCESS or
+ * INVALID_PARAMETER is sent as an error reply.
+ */
+static int
+smb2_copychunk_cmd(struct smb2_server *server, struct smb2_context *smb2,
+                   struct smb2_ioctl_request *req,
+                   struct smb2_ioctl_reply *rep,
+                   uint8_t *out, uint32_t *status)
+{
+        struct smb2_iovec in, vec;
+        struct smb2_read_request rreq;
+        struct smb2_read_reply rrep;
+        struct smb2_write_request wreq;
+        struct smb2_write_reply wrep;
+        uint32_t count, chunk_len, i;
+        uint32_t written = 0;
+        uint64_t src_off, dst_off, total = 0;
+        int ret;
+
+        *status = SMB2_STATUS_SUCCESS;
+        vec.buf = out;
+        vec.len = 32;
+        memset(out, 0, 32);
+        rep->output = out;
+
+        if (req->ctl_code == SMB2_FSCTL_SRV_REQUEST_RESUME_KEY) {
+                memcpy(out, req->file_id, SMB2_FD_SIZE);
+                rep->output_count = 32;
+                return 0;
+        }
+
+        if (req->input == NULL || req->input_count < 32) {
+                return -EINVAL;
+        }
+        in.buf = req->input;
+        in.len = req->input_count;
+        smb2_get_uint32(&in, 24, &count);
+        if (count > (in.len - 32) / 24) {
+                return -EINVAL;
+        }
+
+        rep->output_count = 12;
+        if (count > server->copychunk_max_chunks) {
+                goto limits;
+        }
+        for (i = 0; i < count; i++) {
+                smb2_get_uint32(&in, 32 + i * 24 + 16, &chunk_len);
+                if (chunk_len == 0 ||
+                    chunk_len > server->copychunk_max_chunk_size) {
+                        goto limits;
+                }
+                total += chunk_len;
+        }
+        if (total > server->copychunk_max_total_size) {
+                goto limits;
+        }
+
+        total = 0;
+        for (i = 0; i < count; i++) {
+                smb2_get_uint64(&in, 32 + i * 24, &src_off);
+                smb2_get_uint64(&in, 32 + i * 24 + 8, &dst_off);
+                smb2_get_uint32(&in, 32 + i * 24 + 16, &chunk_len);
+
+                memset(&rreq, 0, sizeof(rreq));
+                memset(&rrep, 0, sizeof(rrep));
+                memcpy(rreq.file_id, req->input, SMB2_FD_SIZE);
+                rreq.length = chunk_len;
+                rreq.offset = src_off;
+                ret = server->handlers->read_cmd(server, smb2, &rreq, &rrep);
+                if (ret || rrep.data_length == 0) {
+                        free(rrep.data);
+                        break;
+                }
+
+                memset(&wreq, 0, sizeof(wreq));
+                memset(&wrep, 0, sizeof(wrep));
+                memcpy(wreq.file_id, req->file_id, SMB2_FD_SIZE);
+                wreq.length = rrep.data_length;
+                wreq.offset = dst_off;
+                wreq.buf = rrep.data;
+                ret = server->handlers->write_cmd(server, smb2, &wreq, &wrep);
+                free(rrep.data);
+                if (ret) {
+                        break;
+                }
+                total += wrep.count;
+                written++;
+                if (wrep.count < chunk_len) {
+                        break;
+                }
+        }
+        if (written == 0 && count) {
+                *status = SMB2_STATUS_UNEXPECTED_IO_ERROR;
+                return 0;
+        }
+        smb2_set_uint32(&vec, 0, written);
+        smb2_set_uint32(&vec, 4, 0);
+        smb2_set_uint32(&vec, 8, (uint32_t)total);
+        return 0;
+
+ limits:
+        *status = SMB2_STATUS_INVALID_PARAMETER;
+        smb2_set_uint32(&vec, 0, server->copychunk_max_chunks);
+        smb2_set_uint32(&vec, 4, server->copychunk_max_chunk_size);
+        smb2_set_uint32(&vec, 8, server->copychunk_max_total_size);
+        return 0;
+}
+
 static void
 smb2_ioctl_request_cb(struct smb2_server *server, struct smb2_context *smb2, void *command_data, void *cb_data)
 {
@@ -3073,6 +4351,8 @@ smb2_ioctl_request_cb(struct smb2_server *server, struct smb2_context *smb2, voi
         struct smb2_error_reply err;
         struct smb2_pdu *pdu = NULL;
         struct smb2_ioctl_validate_negotiate_info out_info;
+        uint8_t copy_out[32];
+        uint32_t status = SMB2_STATUS_SUCCESS;
         int ret = -1;
 
         memset(&rep, 0, sizeof(rep));
@@ -3094,8 +4374,30 @@ smb2_ioctl_request_cb(struct smb2_server *server, struct smb2_context *smb2, voi
                 if (server->handlers && server->handlers->ioctl_cmd) {
                         ret = server->handlers->ioctl_cmd(server, smb2, req, &rep);
                 }
-                if (!ret) {
+                if (ret < 0 && server->handlers &&
+                    server->handlers->read_cmd &&
+                    server->handlers->write_cmd &&
+                    (req->ctl_code == SMB2_FSCTL_SRV_REQUEST_RESUME_KEY ||
+                     req->ctl_code == SMB2_FSCTL_SRV_COPYCHUNK ||
+                     req->ctl_code == SMB2_FSCTL_SRV_COPYCHUNK_WRITE)) {
+                        memset(&rep, 0, sizeof(rep));
+                        rep.ctl_code = req->ctl_code;
+                        memcpy(rep.file_id, req->file_id, SMB2_FD_SIZE);
+                        ret = smb2_copychunk_cmd(server, smb2, req, &rep,
+                                                 copy_out, &status);
+                }
+                if (!ret && status != SMB2_STATUS_SUCCESS &&
+                    status != SMB2_STATUS_INVALID_PARAMETER) {
+                        memset(&err, 0, sizeof(err));
+                        pdu = smb2_cmd_error_reply_async(smb2,
+                                        &err, SMB2_IOCTL, status, NULL, cb_data);
+                }
+                else if (!ret) {
                         pdu = smb2_cmd_ioctl_reply_async(smb2, &rep, NULL, cb_data);
+                        if (pdu != NULL) {
+                                /* the copychunk limits go out as an ioctl reply */
+                                pdu->header.status = status;
+                        }
                 }
                 else if (ret < 0) {
                         memset(&err, 0, sizeof(err));
@@ -3280,6 +4582,57 @@ smb2_set_info_request_cb(struct smb2_server *server, struct smb2_context *smb2,
         }
 }
 
+static smb2_file_id *
+smb2_request_file_id(int command, void *command_data)
+{
+        switch (command) {
+        case SMB2_CLOSE:
+                return &((struct smb2_close_request *)command_data)->file_id;
+        case SMB2_FLUSH:
+                return &((struct smb2_flush_request *)command_data)->file_id;
+        case SMB2_READ:
+                return &((struct smb2_read_request *)command_data)->file_id;
+        case SMB2_WRITE:
+                return &((struct smb2_write_request *)command_data)->file_id;
+        case SMB2_LOCK:
+                return &((struct smb2_lock_request *)command_data)->file_id;
+        case SMB2_IOCTL:
+                return &((struct smb2_ioctl_request *)command_data)->file_id;
+        case SMB2_QUERY_DIRECTORY:
+                return &((struct smb2_query_directory_request *)command_data)->file_id;
+        case SMB2_CHANGE_NOTIFY:
+                return &((struct smb2_change_notify_request *)command_data)->file_id;
+        case SMB2_QUERY_INFO:
+                return &((struct smb2_query_info_request *)command_data)->file_id;
+        case SMB2_SET_INFO:
+                return &((struct smb2_set_info_request *)command_data)->file_id;
+        default:
+                return NULL;
+        }
+}
+
+/* [MS-SMB2] 3.3.5.2.7.2 A related command in a compound that carries the
+ * all-ones file id operates on the handle of the previous command.
+ */
+static void
+smb2_fixup_related_file_id(struct smb2_context *smb2, void *command_data)
+{
+        smb2_file_id *file_id;
+
+        if (command_data == NULL) {
+                return;
+        }
+        file_id = smb2_request_file_id(smb2->pdu->header.command, command_data);
+        if (file_id == NULL) {
+                return;
+        }
+        if ((smb2->hdr.flags & SMB2_FLAGS_RELATED_OPERATIONS) &&
+            !memcmp(*file_id, compound_file_id, SMB2_FD_SIZE)) {
+                memcpy(*file_id, smb2->last_file_id, SMB2_FD_SIZE);
+        }
+        memcpy(smb2->last_file_id, *file_id, SMB2_FD_SIZE);
+}
+
 static void
 smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data);
 
@@ -3298,6 +4651,8 @@ smb2_general_client_request_cb(struct smb2_context *smb2, int status, void *comm
                 return;
         }
 
+        smb2_fixup_related_file_id(smb2, command_data);
+
         switch (smb2->pdu->header.command) {
         case SMB2_LOGOFF:
                 smb2_logoff_request_cb(server, smb2, command_data, cb_data);
@@ -3485,7 +4840,7 @@ smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *comma
                 have_valid_session_key = 0;
         }
 #endif
-        if (smb2->sign && have_valid_session_key == 0) {
+        if ((smb2->sign || smb2->seal) && have_valid_session_key == 0) {
                 smb2_close_context(smb2);
                 smb2_set_error(smb2, "Signing required by server. Session "
                                "Key is not available %s",
@@ -3493,8 +4848,8 @@ smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *comma
                 return;
         }
 
-        if (smb2->sign)  {
-                /* Derive the signing key from session key
+        if (smb2->sign || smb2->seal)  {
+                /* Derive the signing and encryption keys from session key
                 * This is based on negotiated protocol
                 */
                 smb2_create_signing_key(smb2);
@@ -3505,6 +4860,9 @@ smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *comma
                          (smb2->password == NULL || smb2->password[0] == '\0'))) {
                 rep.session_flags |= SMB2_SESSION_FLAG_IS_GUEST;
         }
+        else if (smb2->seal) {
+                rep.session_flags |= SMB2_SESSION_FLAG_IS_ENCRYPT_DATA;
+        }
 
         if (!pdu) {
                 pdu = smb2_cmd_session_setup_reply_async(smb2, &rep, NULL, cb_data);
@@ -3814,6 +5172,15 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                 server->max_read_size = 0x100000;
                 server->max_write_size = 0x100000;
         }
+        if (!server->copychunk_max_chunks) {
+                server->copychunk_max_chunks = 256;
+        }
+        if (!server->copychunk_max_chunk_size) {
+                server->copychunk_max_chunk_size = 0x100000;
+        }
+        if (!server->copychunk_max_total_size) {
+                server->copychunk_max_total_size = 0x1000000;
+        }
         if (!server->guid[0]) {
                 memcpy(server->guid, "libsmb2-srvrguid", 16);
         }
@@ -3889,14 +5256,12 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                                                 smb2_close_context(smb2);
                                         }
                                 }
-                                if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - t) > (smb2->timeout)))
+                                if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - t) > (smb2->timeout / 1000)))
                                 {
                                         smb2_set_error(smb2, "Timeout expired and no connection exists\n");
                                         smb2_close_context(smb2);
                                 }
-                                if (smb2->timeout) {
-                                        smb2_timeout_pdus(smb2);
-                                }
+                                smb2_timeout_pdus(smb2);
                         }
 
                         if (FD_ISSET(server->fd, &rfds)) {
@@ -0,0 +1,767 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Lease-backed metadata cache.
+ *
+ * For every directory that is cached we keep an open handle with a
+ * read+handle directory lease. While the lease is held the server will
+ * notify us before the contents of the directory change, so the
+ * attributes of its children, "does not exist" results for names in it
+ * and its full listing can be served from memory.
+ *
+ * Only results of requests that were sent while the lease was held are
+ * stored. Every lease that is granted gets a new token and requests
+ * remember the token that was current when they were sent, so a result
+ * that raced with a lease break is never cached.
+ *
+ * Directories are kept in LRU order and the least recently used one is
+ * closed when more than max_dirs directories are cached.
+ */
+
+#define MDC_HASH_SIZE           64
+#define MDC_MAX_ENTRIES         4096
+
+enum mdc_dir_state {
+        MDC_DIR_OPENING = 0,
+        MDC_DIR_LEASED,
+        MDC_DIR_NOLEASE,
+};
+
+struct mdc_entry {
+        struct mdc_entry *next;
+        char *name;
+        int status;
+        struct smb2_stat_64 st;
+};
+
+struct mdc_dir {
+        struct mdc_dir *next;
+        /* NULL once the directory has been dropped while its create was
+         * still in flight */
+        struct smb2_mdcache *mdc;
+        char *path;
+        enum mdc_dir_state state;
+        struct smb2_lease lease;
+        smb2_file_id file_id;
+        uint64_t token;
+
+        struct mdc_entry *entries[MDC_HASH_SIZE];
+        int num_entries;
+
+        int has_listing;
+        int listing_count;
+        struct smb2dirent *listing;
+};
+
+struct smb2_mdcache {
+        int max_dirs;
+        int num_dirs;
+        /* most recently used first */
+        struct mdc_dir *dirs;
+        uint64_t next_token;
+};
+
+/* Names on the server are case insensitive, so are the keys of the
+ * cache. Only ASCII letters are folded.
+ */
+static int
+mdc_fold(unsigned char c)
+{
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* Compares up to len characters of a and b, stopping at the end of a */
+static int
+mdc_casecmp(const char *a, const char *b, size_t len)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                if (mdc_fold(a[i]) != mdc_fold(b[i])) {
+                        return 1;
+                }
+                if (a[i] == 0) {
+                        break;
+                }
+        }
+        return 0;
+}
+
+static unsigned int
+mdc_hash(const char *name)
+{
+        unsigned int h = 5381;
+
+        while (*name) {
+                h = h * 33 + mdc_fold(*name++);
+        }
+        return h % MDC_HASH_SIZE;
+}
+
+/* Strips leading and trailing separators. Returns the length of the
+ * normalised path and sets *start to its first character.
+ */
+static size_t
+mdc_normalise(const char *path, const char **start)
+{
+        size_t len;
+
+        if (path == NULL) {
+                path = "";
+        }
+        while (*path == '/') {
+                path++;
+        }
+        len = strlen(path);
+        while (len && path[len - 1] == '/') {
+                len--;
+        }
+        *start = path;
+        return len;
+}
+
+/* Splits path into its parent directory and the final component.
+ * Returns -1 for the root of the share, which has no parent.
+ */
+static int
+mdc_split(const char *path, const char **dir, size_t *dir_len,
+          const char **name, size_t *name_len)
+{
+        const char *p;
+        size_t len;
+
+        len = mdc_normalise(path, &p);
+        if (len == 0) {
+                return -1;
+        }
+        *name_len = len;
+        while (*name_len && p[*name_len - 1] != '/') {
+                (*name_len)--;
+        }
+        *name = p + *name_len;
+        *dir = p;
+        *dir_len = *name_len ? *name_len - 1 : 0;
+        *name_len = len - *name_len;
+
+        return 0;
+}
+
+static struct mdc_dir *
+mdc_find_dir(struct smb2_mdcache *mdc, const char *dir, size_t len)
+{
+        struct mdc_dir *d;
+
+        for (d = mdc->dirs; d; d = d->next) {
+                if (strlen(d->path) == len &&
+                    !mdc_casecmp(d->path, dir, len)) {
+                        /* move to the front of the LRU */
+                        if (d != mdc->dirs) {
+                                SMB2_LIST_REMOVE(&mdc->dirs, d);
+                                SMB2_LIST_ADD(&mdc->dirs, d);
+                        }
+                        return d;
+                }
+        }
+        return NULL;
+}
+
+static struct mdc_entry *
+mdc_find_entry(struct mdc_dir *d, const char *name, size_t len)
+{
+        struct mdc_entry *e;
+        char tmp[256];
+
+        if (len >= sizeof(tmp)) {
+                return NULL;
+        }
+        memcpy(tmp, name, len);
+        tmp[len] = 0;
+
+        for (e = d->entries[mdc_hash(tmp)]; e; e = e->next) {
+                if (!mdc_casecmp(e->name, tmp, len + 1)) {
+                        return e;
+                }
+        }
+        return NULL;
+}
+
+static void
+mdc_free_listing(struct mdc_dir *d)
+{
+        int i;
+
+        for (i = 0; i < d->listing_count; i++) {
+                free(discard_const(d->listing[i].name));
+        }
+        free(d->listing);
+        d->listing = NULL;
+        d->listing_count = 0;
+        d->has_listing = 0;
+}
+
+static void
+mdc_free_entries(struct mdc_dir *d)
+{
+        int i;
+
+        for (i = 0; i < MDC_HASH_SIZE; i++) {
+                while (d->entries[i]) {
+                        struct mdc_entry *e = d->entries[i];
+
+                        d->entries[i] = e->next;
+                        free(e->name);
+                        free(e);
+                }
+        }
+        d->num_entries = 0;
+        mdc_free_listing(d);
+}
+
+static void
+mdc_free_dir(struct mdc_dir *d)
+{
+        mdc_free_entries(d);
+        free(d->path);
+        free(d);
+}
+
+static void
+mdc_close_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *private_data)
+{
+}
+
+static void
+mdc_close_handle(struct smb2_context *smb2, struct mdc_dir *d)
+{
+        struct smb2_close_request req;
+        struct smb2_pdu *pdu;
+
+        if (!SMB2_VALID_SOCKET(smb2->fd)) {
+                return;
+        }
+        memset(&req, 0, sizeof(struct smb2_close_request));
+        memcpy(req.file_id, d->file_id, SMB2_FD_SIZE);
+
+        pdu = smb2_cmd_close_async(smb2, &req, mdc_close_cb, NULL);
+        if (pdu != NULL) {
+                smb2_queue_pdu(smb2, pdu);
+        }
+}
+
+/* Removes d from the cache. Closing the handle releases the lease. */
+static void
+mdc_drop_dir(struct smb2_context *smb2, struct mdc_dir *d, int close_handle)
+{
+        struct smb2_mdcache *mdc = d->mdc;
+
+        SMB2_LIST_REMOVE(&mdc->dirs, d);
+        mdc->num_dirs--;
+
+        if (d->state == MDC_DIR_OPENING) {
+                /* freed from mdc_open_cb once the create completes */
+                d->mdc = NULL;
+                mdc_free_entries(d);
+                return;
+        }
+        if (d->state == MDC_DIR_LEASED) {
+                smb2_lease_unregister(smb2, &d->lease);
+                if (close_handle) {
+                        mdc_close_handle(smb2, d);
+                }
+        }
+        mdc_free_dir(d);
+}
+
+static int
+mdc_lease_break(struct smb2_context *smb2, struct smb2_lease *lease,
+                uint32_t new_state)
+{
+        struct mdc_dir *d = lease->private_data;
+
+        /* Any break means the directory may be about to change. Closing
+         * our handle releases the lease which also completes the break,
+         * so there is nothing to acknowledge.
+         */
+        mdc_drop_dir(smb2, d, 1);
+
+        return 1;
+}
+
+static void
+mdc_open_cb(struct smb2_context *smb2, int status,
+            void *command_data, void *private_data)
+{
+        struct mdc_dir *d = private_data;
+        struct smb2_create_reply *rep = command_data;
+
+        if (status != SMB2_STATUS_SUCCESS) {
+                if (d->mdc == NULL) {
+                        mdc_free_dir(d);
+                        return;
+                }
+                d->state = MDC_DIR_NOLEASE;
+                return;
+        }
+
+        memcpy(d->file_id, rep->file_id, SMB2_FD_SIZE);
+        smb2_lease_granted(smb2, &d->lease, rep);
+
+        if (d->mdc == NULL ||
+            !(d->lease.state & SMB2_LEASE_READ_CACHING)) {
+                mdc_close_handle(smb2, d);
+                if (d->mdc == NULL) {
+                        mdc_free_dir(d);
+                        return;
+                }
+                /* the server does not lease this directory, remember
+                 * that so we do not ask again for every miss */
+                d->state = MDC_DIR_NOLEASE;
+                return;
+        }
+
+        d->state = MDC_DIR_LEASED;
+        d->token = ++d->mdc->next_token;
+        smb2_lease_register(smb2, &d->lease);
+}
+
+static int
+mdc_open_dir(struct smb2_context *smb2, struct mdc_dir *d)
+{
+        struct smb2_create_request req;
+        struct smb2_pdu *pdu;
+
+        memset(&req, 0, sizeof(struct smb2_create_request));
+        req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+        req.desired_access = SMB2_FILE_READ_ATTRIBUTES;
+        req.file_attributes = SMB2_FILE_ATTRIBUTE_DIRECTORY;
+        req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE |
+                SMB2_FILE_SHARE_DELETE;
+        req.create_disposition = SMB2_FILE_OPEN;
+        req.create_options = SMB2_FILE_DIRECTORY_FILE;
+        req.name = d->path;
+
+        if (smb2_lease_create_context(smb2, &d->lease,
+                                      SMB2_LEASE_READ_CACHING |
+                                      SMB2_LEASE_HANDLE_CACHING,
+                                      &req) < 0) {
+                return -ENOMEM;
+        }
+
+        pdu = smb2_cmd_create_async(smb2, &req, mdc_open_cb, d);
+        free(req.create_context);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create create command");
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+static void
+mdc_evict(struct smb2_context *smb2, struct smb2_mdcache *mdc)
+{
+        struct mdc_dir *d, *victim;
+
+        while (mdc->num_dirs >= mdc->max_dirs) {
+                victim = NULL;
+                for (d = mdc->dirs; d; d = d->next) {
+                        if (d->state != MDC_DIR_OPENING) {
+                                victim = d;
+                        }
+                }
+                if (victim == NULL) {
+                        break;
+                }
+                mdc_drop_dir(smb2, victim, 1);
+        }
+}
+
+static struct mdc_dir *
+mdc_add_dir(struct smb2_context *smb2, struct smb2_mdcache *mdc,
+            const char *dir, size_t len)
+{
+        struct mdc_dir *d;
+
+        if (smb2->dialect < SMB2_VERSION_0300 ||
+            !(smb2->capabilities & SMB2_GLOBAL_CAP_DIRECTORY_LEASING)) {
+                return NULL;
+        }
+
+        mdc_evict(smb2, mdc);
+        if (mdc->num_dirs >= mdc->max_dirs) {
+                return NULL;
+        }
+
+        d = calloc(1, sizeof(struct mdc_dir));
+        if (d == NULL) {
+                return NULL;
+        }
+        d->path = malloc(len + 1);
+        if (d->path == NULL) {
+                free(d);
+                return NULL;
+        }
+        memcpy(d->path, dir, len);
+        d->path[len] = 0;
+        d->mdc = mdc;
+        d->state = MDC_DIR_OPENING;
+        smb2_lease_init(smb2, &d->lease, mdc_lease_break, d);
+
+        if (mdc_open_dir(smb2, d) < 0) {
+                mdc_free_dir(d);
+                return NULL;
+        }
+        SMB2_LIST_ADD(&mdc->dirs, d);
+        mdc->num_dirs++;
+
+        return d;
+}
+
+static uint64_t
+mdc_token(struct smb2_context *smb2, const char *dir, size_t len)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+        struct mdc_dir *d;
+
+        if (mdc == NULL) {
+                return 0;
+        }
+        d = mdc_find_dir(mdc, dir, len);
+        if (d == NULL) {
+                mdc_add_dir(smb2, mdc, dir, len);
+                return 0;
+        }
+        return d->state == MDC_DIR_LEASED ? d->token : 0;
+}
+
+uint64_t
+smb2_mdcache_token(struct smb2_context *smb2, const char *dir)
+{
+        const char *p;
+        size_t len;
+
+        len = mdc_normalise(dir, &p);
+        return mdc_token(smb2, p, len);
+}
+
+uint64_t
+smb2_mdcache_parent_token(struct smb2_context *smb2, const char *path)
+{
+        const char *dir, *name;
+        size_t dir_len, name_len;
+
+        if (mdc_split(path, &dir, &dir_len, &name, &name_len) < 0) {
+                return 0;
+        }
+        return mdc_token(smb2, dir, dir_len);
+}
+
+int
+smb2_mdcache_lookup(struct smb2_context *smb2, const char *path,
+                    struct smb2_stat_64 *st)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+        const char *dir, *name;
+        size_t dir_len, name_len;
+        struct mdc_dir *d;
+        struct mdc_entry *e;
+
+        if (mdc == NULL) {
+                return 0;
+        }
+        if (mdc_split(path, &dir, &dir_len, &name, &name_len) < 0) {
+                return 0;
+        }
+        d = mdc_find_dir(mdc, dir, dir_len);
+        if (d == NULL || d->state != MDC_DIR_LEASED) {
+                return 0;
+        }
+        e = mdc_find_entry(d, name, name_len);
+        if (e == NULL) {
+                return 0;
+        }
+        if (e->status < 0) {
+                return e->status;
+        }
+        *st = e->st;
+
+        return 1;
+}
+
+static void
+mdc_store_entry(struct mdc_dir *d, const char *name, size_t len,
+                int status, const struct smb2_stat_64 *st)
+{
+        struct mdc_entry *e;
+        unsigned int h;
+
+        e = mdc_find_entry(d, name, len);
+        if (e == NULL) {
+                if (d->num_entries >= MDC_MAX_ENTRIES || len >= 256) {
+                        return;
+                }
+                e = calloc(1, sizeof(struct mdc_entry));
+                if (e == NULL) {
+                        return;
+                }
+                e->name = malloc(len + 1);
+                if (e->name == NULL) {
+                        free(e);
+                        return;
+                }
+                memcpy(e->name, name, len);
+                e->name[len] = 0;
+                h = mdc_hash(e->name);
+                e->next = d->entries[h];
+                d->entries[h] = e;
+                d->num_entries++;
+        }
+        e->status = status;
+        if (status == 0) {
+                e->st = *st;
+        }
+}
+
+void
+smb2_mdcache_store(struct smb2_context *smb2, const char *path,
+                   uint64_t token, int status,
+                   const struct smb2_stat_64 *st)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+        const char *dir, *name;
+        size_t dir_len, name_len;
+        struct mdc_dir *d;
+
+        if (mdc == NULL || token == 0) {
+                return;
+        }
+        /* only successes and "does not exist" are worth remembering */
+        if (status != 0 && status != -ENOENT) {
+                return;
+        }
+        if (mdc_split(path, &dir, &dir_len, &name, &name_len) < 0) {
+                return;
+        }
+        d = mdc_find_dir(mdc, dir, dir_len);
+        if (d == NULL || d->state != MDC_DIR_LEASED || d->token != token) {
+                return;
+        }
+        mdc_store_entry(d, name, name_len, status, st);
+}
+
+int
+smb2_mdcache_get_listing(struct smb2_context *smb2, const char *dir,
+                         const struct smb2dirent **ents, int *count)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+        struct mdc_dir *d;
+        const char *p;
+        size_t len;
+
+        if (mdc == NULL) {
+                return 0;
+        }
+        len = mdc_normalise(dir, &p);
+        d = mdc_find_dir(mdc, p, len);
+        if (d == NULL || d->state != MDC_DIR_LEASED || !d->has_listing) {
+                return 0;
+        }
+        *ents = d->listing;
+        *count = d->listing_count;
+
+        return 1;
+}
+
+void
+smb2_mdcache_store_listing(struct smb2_context *smb2, const char *dir,
+                           uint64_t token,
+                           const struct smb2dirent **ents, int count)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+        struct mdc_dir *d;
+        const char *p;
+        size_t len;
+        int i;
+
+        if (mdc == NULL || token == 0 || count > MDC_MAX_ENTRIES) {
+                return;
+        }
+        len = mdc_normalise(dir, &p);
+        d = mdc_find_dir(mdc, p, len);
+        if (d == NULL || d->state != MDC_DIR_LEASED || d->token != token) {
+                return;
+        }
+
+        mdc_free_listing(d);
+        d->listing = calloc(count ? count : 1, sizeof(struct smb2dirent));
+        if (d->listing == NULL) {
+                return;
+        }
+        for (i = 0; i < count; i++) {
+                const char *name = ents[i]->name;
+
+                d->listing[i].st = ents[i]->st;
+                d->listing[i].name = strdup(name ? name : "");
+                if (d->listing[i].name == NULL) {
+                        d->listing_count = i;
+                        mdc_free_listing(d);
+                        return;
+                }
+                d->listing_count++;
+
+                if (name && strcmp(name, ".") && strcmp(name, "..")) {
+                        mdc_store_entry(d, name, strlen(name), 0,
+                                        &ents[i]->st);
+                }
+        }
+        d->has_listing = 1;
+}
+
+void
+smb2_mdcache_invalidate(struct smb2_context *smb2, const char *path)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+        const char *dir, *name, *p;
+        size_t dir_len, name_len, len;
+        struct mdc_dir *d, *next;
+        struct mdc_entry **pe;
+
+        if (mdc == NULL) {
+                return;
+        }
+
+        /* the entry in the parent and the parent's listing */
+        if (mdc_split(path, &dir, &dir_len, &name, &name_len) == 0) {
+                d = mdc_find_dir(mdc, dir, dir_len);
+                if (d != NULL) {
+                        struct mdc_entry *e = mdc_find_entry(d, name,
+                                                             name_len);
+
+                        if (e != NULL) {
+                                pe = &d->entries[mdc_hash(e->name)];
+                                while (*pe != e) {
+                                        pe = &(*pe)->next;
+                                }
+                                *pe = e->next;
+                                free(e->name);
+                                free(e);
+                                d->num_entries--;
+                        }
+                        mdc_free_listing(d);
+                }
+        }
+
+        /* the path itself and everything below it, in case it is a
+         * directory that is being removed or renamed. Our handle would
+         * otherwise keep it open on the server.
+         */
+        len = mdc_normalise(path, &p);
+        for (d = mdc->dirs; d; d = next) {
+                next = d->next;
+                if (mdc_casecmp(d->path, p, len)) {
+                        continue;
+                }
+                if (len && d->path[len] != 0 && d->path[len] != '/') {
+                        continue;
+                }
+                mdc_drop_dir(smb2, d, 1);
+        }
+}
+
+void
+smb2_mdcache_purge(struct smb2_context *smb2, int close_handles)
+{
+        struct smb2_mdcache *mdc = smb2->mdcache;
+
+        if (mdc == NULL) {
+                return;
+        }
+        while (mdc->dirs) {
+                mdc_drop_dir(smb2, mdc->dirs, close_handles);
+        }
+}
+
+void
+smb2_mdcache_destroy(struct smb2_context *smb2)
+{
+        if (smb2->mdcache == NULL) {
+                return;
+        }
+        smb2_mdcache_purge(smb2, 0);
+        free(smb2->mdcache);
+        smb2->mdcache = NULL;
+}
+
+int
+smb2_set_metadata_cache(struct smb2_context *smb2, int max_dirs)
+{
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+
+        if (max_dirs <= 0) {
+                smb2_mdcache_purge(smb2, 1);
+                smb2_mdcache_destroy(smb2);
+                return 0;
+        }
+
+        if (smb2->mdcache == NULL) {
+                smb2->mdcache = calloc(1, sizeof(struct smb2_mdcache));
+                if (smb2->mdcache == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "metadata cache");
+                        return -ENOMEM;
+                }
+        }
+        smb2->mdcache->max_dirs = max_dirs;
+        mdc_evict(smb2, smb2->mdcache);
+
+        return 0;
+}
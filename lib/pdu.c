@@ -35,6 +35,8 @@
 #include <stdio.h>
 #endif
 
+#include <errno.h>
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -54,6 +56,7 @@
 #include "slist.h"
 #include "smb2.h"
 #include "libsmb2.h"
+#include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 #include "smb3-seal.h"
 #include "smb2-signing.h"
@@ -166,9 +169,11 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
         }
 
         if (smb2->timeout) {
-                pdu->timeout = time(NULL) + smb2->timeout;
+                pdu->deadline = smb2_clock_ms() + smb2->timeout;
         }
 
+        SMB2_TRACE(smb2, pdu, SMB2_TRACE_ALLOCATE);
+
         return pdu;
 }
 
@@ -302,9 +307,9 @@ smb2_pdu_is_compound(struct smb2_context *smb2)
                 (smb2->hdr.next_command != 0) : 0;
 }
 
-void
-smb2_add_compound_pdu(struct smb2_context *smb2,
-                      struct smb2_pdu *pdu, struct smb2_pdu *next_pdu)
+static void
+smb2_chain_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu,
+               struct smb2_pdu *next_pdu, int related)
 {
         int i, offset;
 
@@ -324,10 +329,119 @@ smb2_add_compound_pdu(struct smb2_context *smb2,
         smb2_set_uint32(&pdu->out.iov[0], 20, pdu->header.next_command);
 
         /* Fixup flags */
-        next_pdu->header.flags |= SMB2_FLAGS_RELATED_OPERATIONS;
+        if (related) {
+                next_pdu->header.flags |= SMB2_FLAGS_RELATED_OPERATIONS;
+        } else {
+                next_pdu->header.flags &= ~SMB2_FLAGS_RELATED_OPERATIONS;
+        }
         smb2_set_uint32(&next_pdu->out.iov[0], 16, next_pdu->header.flags);
 }
 
+void
+smb2_add_compound_pdu(struct smb2_context *smb2,
+                      struct smb2_pdu *pdu, struct smb2_pdu *next_pdu)
+{
+        smb2_chain_pdu(smb2, pdu, next_pdu, 1);
+}
+
+struct smb2_compound {
+        struct smb2_pdu *head;
+        int count;
+};
+
+struct smb2_compound *
+smb2_compound_init(struct smb2_context *smb2)
+{
+        struct smb2_compound *c;
+
+        c = calloc(1, sizeof(struct smb2_compound));
+        if (c == NULL) {
+                smb2_set_error(smb2, "Failed to allocate smb2_compound");
+                return NULL;
+        }
+        return c;
+}
+
+int
+smb2_compound_add(struct smb2_context *smb2, struct smb2_compound *c,
+                  struct smb2_pdu *pdu, uint32_t flags)
+{
+        if (c == NULL || pdu == NULL) {
+                return -EINVAL;
+        }
+        if (pdu->next_compound != NULL || pdu->header.next_command) {
+                smb2_set_error(smb2, "PDU is already part of a compound");
+                return -EINVAL;
+        }
+        if (pdu->header.command == SMB2_NEGOTIATE ||
+            pdu->header.command == SMB2_SESSION_SETUP ||
+            pdu->header.command == SMB2_CANCEL) {
+                smb2_set_error(smb2, "Command %d can not be compounded",
+                               pdu->header.command);
+                return -EINVAL;
+        }
+
+        if (c->head == NULL) {
+                /* The first command in a chain is never related to
+                 * anything, it establishes the file id the related
+                 * commands that follow will refer to.
+                 */
+                if (flags & SMB2_COMPOUND_RELATED) {
+                        smb2_set_error(smb2, "First command in a compound "
+                                       "can not be related");
+                        return -EINVAL;
+                }
+                pdu->header.flags &= ~SMB2_FLAGS_RELATED_OPERATIONS;
+                c->head = pdu;
+        } else {
+                smb2_chain_pdu(smb2, c->head, pdu,
+                               !!(flags & SMB2_COMPOUND_RELATED));
+        }
+        c->count++;
+
+        return 0;
+}
+
+int
+smb2_compound_count(struct smb2_compound *c)
+{
+        return c ? c->count : 0;
+}
+
+int
+smb2_compound_queue(struct smb2_context *smb2, struct smb2_compound *c)
+{
+        if (c == NULL) {
+                return -EINVAL;
+        }
+        if (c->head == NULL) {
+                smb2_set_error(smb2, "Can not queue an empty compound");
+                free(c);
+                return -EINVAL;
+        }
+
+        /* The whole chain is signed, sealed and sent as one unit */
+        smb2_queue_pdu(smb2, c->head);
+        free(c);
+
+        return 0;
+}
+
+void
+smb2_compound_free(struct smb2_context *smb2, struct smb2_compound *c)
+{
+        if (c == NULL) {
+                return;
+        }
+        if (c->head) {
+                smb2_free_pdu(smb2, c->head);
+        }
+        free(c);
+}
+
+static void smb2_remove_timeout(struct smb2_context *smb2,
+                                struct smb2_pdu *pdu);
+
 void
 smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
@@ -335,6 +449,14 @@ smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
                 smb2_free_pdu(smb2, pdu->next_compound);
         }
 
+        if (pdu->timeout_index) {
+                smb2_remove_timeout(smb2, pdu);
+        }
+
+        if (smb2->tracing) {
+                smb2_trace_pdu_done(smb2, pdu);
+        }
+
         smb2_free_iovector(smb2, &pdu->out);
         smb2_free_iovector(smb2, &pdu->in);
 
@@ -551,10 +673,74 @@ smb2_decode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
         return 0;
 }
 
+void
+smb2_pdu_enqueue(struct smb2_context *smb2, enum smb2_pdu_queue queue,
+                 struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **head, **tail;
+
+        if (queue == SMB2_QUEUE_OUT) {
+                head = &smb2->outqueue;
+                tail = &smb2->outqueue_tail;
+                smb2_stats_outqueue(smb2, 1);
+        } else {
+                head = &smb2->waitqueue;
+                tail = &smb2->waitqueue_tail;
+                smb2_stats_waitqueue(smb2, 1);
+        }
+        pdu->queue = queue;
+        pdu->prev = *tail;
+        pdu->next = NULL;
+        if (*tail) {
+                (*tail)->next = pdu;
+        } else {
+                *head = pdu;
+        }
+        *tail = pdu;
+}
+
+void
+smb2_pdu_dequeue(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **head, **tail;
+
+        switch (pdu->queue) {
+        case SMB2_QUEUE_OUT:
+                head = &smb2->outqueue;
+                tail = &smb2->outqueue_tail;
+                smb2_stats_outqueue(smb2, -1);
+                break;
+        case SMB2_QUEUE_WAIT:
+                head = &smb2->waitqueue;
+                tail = &smb2->waitqueue_tail;
+                smb2_stats_waitqueue(smb2, -1);
+                break;
+        default:
+                return;
+        }
+        if (pdu->prev) {
+                pdu->prev->next = pdu->next;
+        } else {
+                *head = pdu->next;
+        }
+        if (pdu->next) {
+                pdu->next->prev = pdu->prev;
+        } else {
+                *tail = pdu->prev;
+        }
+        pdu->next = NULL;
+        pdu->prev = NULL;
+        pdu->queue = SMB2_QUEUE_NONE;
+}
+
 static void
 smb2_add_to_outqueue(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
-        SMB2_LIST_ADD_END(&smb2->outqueue, pdu);
+        smb2_pdu_enqueue(smb2, SMB2_QUEUE_OUT, pdu);
+        smb2_add_timeout(smb2, pdu);
+        if (smb2->reactor != NULL) {
+                smb2_reactor_pdu_queued(smb2, pdu);
+        }
         smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
 }
 
@@ -594,7 +780,7 @@ smb2_correlate_reply(struct smb2_context *smb2, struct smb2_pdu *pdu)
                         pdu->header.session_id = 0;
                 }
         }  else {
-                SMB2_LIST_REMOVE(&smb2->waitqueue, req_pdu);
+                smb2_pdu_dequeue(smb2, req_pdu);
 
                 pdu->header.credit_request_response =
                                         64 + req_pdu->header.credit_charge;
@@ -608,6 +794,7 @@ smb2_correlate_reply(struct smb2_context *smb2, struct smb2_pdu *pdu)
                 if (pdu->header.command != SMB2_TREE_CONNECT) {
                         pdu->header.sync.tree_id = req_pdu->header.sync.tree_id;
                 }
+                smb2_stats_replied(smb2, req_pdu, pdu);
                 smb2_free_pdu(smb2, req_pdu);
         }
         return ret;
@@ -637,8 +824,12 @@ smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
                 }
         }
 
+        smb2_stats_queued(smb2, pdu);
         smb3_encrypt_pdu(smb2, pdu);
 
+        for (p = pdu; p; p = p->next_compound) {
+                SMB2_TRACE(smb2, p, SMB2_TRACE_ENQUEUE);
+        }
         smb2_add_to_outqueue(smb2, pdu);
 }
 
@@ -663,6 +854,17 @@ smb2_is_error_response(struct smb2_context *smb2,
                 switch (smb2->hdr.status) {
                 case SMB2_STATUS_MORE_PROCESSING_REQUIRED:
                         return 0;
+                case SMB2_STATUS_INVALID_PARAMETER:
+                        /* copychunk returns the server limits in a
+                         * normal ioctl reply
+                         */
+                        if (pdu->header.command == SMB2_IOCTL &&
+                            (pdu->ctl_code == SMB2_FSCTL_SRV_COPYCHUNK ||
+                             pdu->ctl_code ==
+                             SMB2_FSCTL_SRV_COPYCHUNK_WRITE)) {
+                                return 0;
+                        }
+                        return 1;
                 default:
                         return 1;
                 }
@@ -1006,33 +1208,193 @@ smb2_process_payload_variable(struct smb2_context *smb2, struct smb2_pdu *pdu)
         }
 }
 
-void smb2_timeout_pdus(struct smb2_context *smb2)
+/*
+ * Deadlines of the queued PDUs are kept in a min-heap so that finding
+ * the PDUs that have timed out, and when the next one will, does not
+ * require walking the queues.
+ *
+ * A PDU is added when it is queued, or for the PDUs of a compound chain
+ * other than the first one, when they are sent. It stays in the heap
+ * until it is freed, so when its deadline passes it may no longer be in
+ * any queue, for example while its reply is being read. Such PDUs are
+ * left alone.
+ */
+static void
+smb2_timeout_swap(struct smb2_context *smb2, int a, int b)
+{
+        struct smb2_pdu *pdu = smb2->timeouts[a];
+
+        smb2->timeouts[a] = smb2->timeouts[b];
+        smb2->timeouts[b] = pdu;
+        smb2->timeouts[a]->timeout_index = a + 1;
+        smb2->timeouts[b]->timeout_index = b + 1;
+}
+
+static void
+smb2_timeout_up(struct smb2_context *smb2, int i)
+{
+        while (i > 0 && smb2->timeouts[(i - 1) / 2]->deadline >
+               smb2->timeouts[i]->deadline) {
+                smb2_timeout_swap(smb2, i, (i - 1) / 2);
+                i = (i - 1) / 2;
+        }
+}
+
+static void
+smb2_timeout_down(struct smb2_context *smb2, int i)
+{
+        int first;
+
+        for (;;) {
+                first = i;
+                if (2 * i + 1 < smb2->num_timeouts &&
+                    smb2->timeouts[2 * i + 1]->deadline <
+                    smb2->timeouts[first]->deadline) {
+                        first = 2 * i + 1;
+                }
+                if (2 * i + 2 < smb2->num_timeouts &&
+                    smb2->timeouts[2 * i + 2]->deadline <
+                    smb2->timeouts[first]->deadline) {
+                        first = 2 * i + 2;
+                }
+                if (first == i) {
+                        return;
+                }
+                smb2_timeout_swap(smb2, i, first);
+                i = first;
+        }
+}
+
+int
+smb2_add_timeout(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **timeouts;
+        int max;
+
+        if (pdu->deadline == 0 || pdu->timeout_index) {
+                return 0;
+        }
+        if (smb2->num_timeouts == smb2->max_timeouts) {
+                max = smb2->max_timeouts ? smb2->max_timeouts * 2 : 64;
+                timeouts = realloc(smb2->timeouts,
+                                   max * sizeof(struct smb2_pdu *));
+                if (timeouts == NULL) {
+                        /* the PDU will not time out */
+                        return -ENOMEM;
+                }
+                smb2->timeouts = timeouts;
+                smb2->max_timeouts = max;
+        }
+        smb2->timeouts[smb2->num_timeouts++] = pdu;
+        pdu->timeout_index = smb2->num_timeouts;
+        smb2_timeout_up(smb2, smb2->num_timeouts - 1);
+
+        return 0;
+}
+
+static void
+smb2_remove_timeout(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
-        struct smb2_pdu *pdu, *next;
-        time_t t = time(NULL);
-
-        pdu = smb2->outqueue;
-        while (pdu) {
-                next = pdu->next;
-                if (pdu->timeout && pdu->timeout < t) {
-                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
-                        smb2_free_pdu(smb2, pdu);
+        int i = pdu->timeout_index - 1;
+
+        pdu->timeout_index = 0;
+        smb2->num_timeouts--;
+        if (i == smb2->num_timeouts) {
+                return;
+        }
+        smb2->timeouts[i] = smb2->timeouts[smb2->num_timeouts];
+        smb2->timeouts[i]->timeout_index = i + 1;
+        smb2_timeout_up(smb2, i);
+        smb2_timeout_down(smb2, i);
+}
+
+uint64_t
+smb2_next_deadline(struct smb2_context *smb2)
+{
+        if (smb2->num_timeouts == 0) {
+                return 0;
+        }
+        return smb2->timeouts[0]->deadline;
+}
+
+int
+smb2_get_next_timeout(struct smb2_context *smb2)
+{
+        uint64_t deadline = smb2_next_deadline(smb2);
+        uint64_t now;
+
+        if (deadline == 0) {
+                return -1;
+        }
+        now = smb2_clock_ms();
+        if (deadline <= now) {
+                return 0;
+        }
+        if (deadline - now > INT32_MAX) {
+                return INT32_MAX;
+        }
+        return (int)(deadline - now);
+}
+
+void
+smb2_set_pdu_timeout(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                     int ms)
+{
+        uint64_t deadline = ms > 0 ? smb2_clock_ms() + ms : 0;
+
+        for (; pdu; pdu = pdu->next_compound) {
+                pdu->deadline = deadline;
+                if (pdu->timeout_index == 0) {
+                        /* A queued pdu had no deadline when it was added.
+                         * The chained pdus that are not queued yet get
+                         * theirs once they have been sent.
+                         */
+                        if (deadline == 0 ||
+                            pdu->queue == SMB2_QUEUE_NONE) {
+                                continue;
+                        }
+                        smb2_add_timeout(smb2, pdu);
+                } else if (deadline == 0) {
+                        smb2_remove_timeout(smb2, pdu);
+                } else {
+                        smb2_timeout_up(smb2, pdu->timeout_index - 1);
+                        smb2_timeout_down(smb2, pdu->timeout_index - 1);
+                }
+                if (smb2->reactor != NULL) {
+                        smb2_reactor_pdu_queued(smb2, pdu);
                 }
-                pdu = next;
         }
+}
 
-        pdu = smb2->waitqueue;
-        while (pdu) {
-                next = pdu->next;
-                if (pdu->timeout && pdu->timeout < t) {
-                        SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
-                        smb2_free_pdu(smb2, pdu);
+void smb2_timeout_pdus(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+        uint64_t now;
+
+        if (smb2->num_timeouts == 0) {
+                return;
+        }
+        now = smb2_clock_ms();
+
+        while (smb2->num_timeouts &&
+               (pdu = smb2->timeouts[0])->deadline <= now) {
+                if (pdu->in_flight) {
+                        /* the kernel is still reading from it, look
+                         * again once it has been sent
+                         */
+                        pdu->deadline = now + 1;
+                        smb2_timeout_down(smb2, 0);
+                        continue;
+                }
+                smb2_remove_timeout(smb2, pdu);
+                if (pdu->queue == SMB2_QUEUE_NONE) {
+                        continue;
                 }
-                pdu = next;
+                smb2_pdu_dequeue(smb2, pdu);
+                smb2_stats_timed_out(smb2, pdu);
+                pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL, pdu->cb_data);
+                SMB2_TRACE(smb2, pdu, SMB2_TRACE_CALLBACK);
+                smb2_free_pdu(smb2, pdu);
         }
 }
 
@@ -0,0 +1,813 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Reactor.
+ *
+ * The fds of all the contexts in a reactor are kept in one epoll set. The
+ * reactor installs its own fd event callbacks on every context so the set
+ * follows the contexts as they connect, switch to io_uring and disconnect,
+ * and a wakeup only services the contexts that have events.
+ *
+ * Timeouts are kept in a hierarchical timer wheel with one timer per
+ * context, armed for the earliest deadline of the PDUs the context has
+ * outstanding or for the next address to try while connecting. The
+ * timeouts of a context are only looked at when its timer fires, instead
+ * of on every smb2_service() as when contexts are driven on their own.
+ *
+ * Requests are written to the socket as soon as the event callbacks that
+ * queued them return, without waiting for the socket to poll writable
+ * first. The socket is only watched for POLLOUT when the write could not
+ * complete, so the epoll set does not need to be updated for every
+ * request.
+ *
+ * The wheel has 4 levels of 64 slots. Level 0 has 1ms slots and every
+ * level above covers 64 times the range of the one below it. When the
+ * slots of a level have gone round once, the next slot of the level above
+ * is cascaded into the levels below.
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+/* timers further out are parked at the end and re-added when they fire */
+#define WHEEL_MAX       ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define WHEEL_NEVER     UINT64_MAX
+
+#define REACTOR_MAX_EVENTS 256
+
+struct reactor_fd {
+        struct reactor_fd *next;
+        /* NULL once the fd has been removed */
+        struct smb2_reactor_entry *entry;
+        t_socket fd;
+        /* events libsmb2 asked for and events in the epoll set */
+        int wanted;
+        uint32_t registered;
+};
+
+struct smb2_reactor_entry {
+        struct smb2_reactor_entry *next;
+        struct smb2_reactor_entry *prev;
+        struct smb2_reactor *reactor;
+        struct smb2_context *smb2;
+        smb2_command_cb cb;
+        void *cb_data;
+
+        struct reactor_fd *fds;
+        /* the events wanted have changed */
+        int pending;
+        struct smb2_reactor_entry *pnext;
+        /* when to try the next address, 0 when not connecting */
+        uint64_t connect_at;
+
+        /* timer wheel slot */
+        struct smb2_reactor_entry *tnext;
+        struct smb2_reactor_entry *tprev;
+        struct smb2_reactor_entry **slot;
+        uint64_t expires;
+};
+
+struct smb2_reactor {
+        int epfd;
+        struct smb2_reactor_entry *entries;
+        struct smb2_reactor_entry *pending;
+
+        /* the events being dispatched may still point to these */
+        int dispatching;
+        struct reactor_fd *dead_fds;
+
+        uint64_t now;
+        int num_timers;
+        struct smb2_reactor_entry *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+
+        struct epoll_event events[REACTOR_MAX_EVENTS];
+};
+
+static void
+wheel_del(struct smb2_reactor *reactor, struct smb2_reactor_entry *e)
+{
+        if (e->slot == NULL) {
+                return;
+        }
+        if (e->tprev) {
+                e->tprev->tnext = e->tnext;
+        } else {
+                *e->slot = e->tnext;
+        }
+        if (e->tnext) {
+                e->tnext->tprev = e->tprev;
+        }
+        e->slot = NULL;
+        reactor->num_timers--;
+}
+
+static void
+wheel_add(struct smb2_reactor *reactor, struct smb2_reactor_entry *e,
+          uint64_t expires)
+{
+        uint64_t t, delta;
+        int level;
+
+        wheel_del(reactor, e);
+        e->expires = expires;
+
+        /* never in the slot that is being fired */
+        t = expires > reactor->now ? expires : reactor->now + 1;
+        delta = t - reactor->now;
+        if (delta > WHEEL_MAX) {
+                delta = WHEEL_MAX;
+                t = reactor->now + delta;
+        }
+        for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+                if (delta < (1ULL << (WHEEL_BITS * (level + 1)))) {
+                        break;
+                }
+        }
+
+        e->slot = &reactor->wheel[level][(t >> (WHEEL_BITS * level)) &
+                                         WHEEL_MASK];
+        e->tprev = NULL;
+        e->tnext = *e->slot;
+        if (e->tnext) {
+                e->tnext->tprev = e;
+        }
+        *e->slot = e;
+        reactor->num_timers++;
+}
+
+/*
+ * Returns the first time after now at which a timer can fire or a slot
+ * has to be cascaded. Nothing happens on the wheel before that.
+ */
+static uint64_t
+wheel_next(struct smb2_reactor *reactor)
+{
+        uint64_t next = WHEEL_NEVER;
+        uint64_t base;
+        int level, i, shift;
+
+        if (reactor->num_timers == 0) {
+                return next;
+        }
+        for (level = 0; level < WHEEL_LEVELS; level++) {
+                shift = WHEEL_BITS * level;
+                base = reactor->now >> shift;
+                for (i = 1; i <= WHEEL_SIZE; i++) {
+                        if (reactor->wheel[level][(base + i) & WHEEL_MASK]) {
+                                if (((base + i) << shift) < next) {
+                                        next = (base + i) << shift;
+                                }
+                                break;
+                        }
+                }
+        }
+        return next;
+}
+
+static void
+wheel_cascade(struct smb2_reactor *reactor, int level)
+{
+        struct smb2_reactor_entry **slot, *e;
+
+        slot = &reactor->wheel[level][(reactor->now >>
+                                       (WHEEL_BITS * level)) & WHEEL_MASK];
+        while ((e = *slot) != NULL) {
+                wheel_add(reactor, e, e->expires);
+        }
+}
+
+static void reactor_timeout(struct smb2_reactor_entry *e);
+
+/* Moves the wheel forward one ms and fires the timers that are due */
+static void
+wheel_tick(struct smb2_reactor *reactor)
+{
+        struct smb2_reactor_entry **slot, *e;
+        int level;
+
+        reactor->now++;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+                if (reactor->now & ((1ULL << (WHEEL_BITS * level)) - 1)) {
+                        break;
+                }
+                wheel_cascade(reactor, level);
+        }
+
+        slot = &reactor->wheel[0][reactor->now & WHEEL_MASK];
+        while ((e = *slot) != NULL) {
+                wheel_del(reactor, e);
+                if (e->expires > reactor->now) {
+                        /* was parked at the end of the wheel */
+                        wheel_add(reactor, e, e->expires);
+                        continue;
+                }
+                reactor_timeout(e);
+        }
+}
+
+static void
+wheel_advance(struct smb2_reactor *reactor, uint64_t to)
+{
+        uint64_t next;
+
+        while (reactor->now < to) {
+                next = wheel_next(reactor);
+                if (next > to) {
+                        reactor->now = to;
+                        break;
+                }
+                reactor->now = next - 1;
+                wheel_tick(reactor);
+        }
+}
+
+/* Arms the timer of a context for the first thing that can time out */
+static void
+reactor_arm(struct smb2_reactor_entry *e)
+{
+        struct smb2_context *smb2 = e->smb2;
+        uint64_t next = WHEEL_NEVER;
+        uint64_t deadline;
+
+        if (e->connect_at) {
+                if (!SMB2_VALID_SOCKET(smb2->fd) &&
+                    smb2->next_addrinfo != NULL) {
+                        next = e->connect_at;
+                } else {
+                        e->connect_at = 0;
+                }
+        }
+
+        deadline = smb2_next_deadline(smb2);
+        if (deadline && deadline < next) {
+                next = deadline;
+        }
+
+        if (next == WHEEL_NEVER) {
+                wheel_del(e->reactor, e);
+        } else {
+                wheel_add(e->reactor, e, next);
+        }
+}
+
+static void reactor_failed(struct smb2_reactor_entry *e);
+
+static void
+reactor_timeout(struct smb2_reactor_entry *e)
+{
+        struct smb2_context *smb2 = e->smb2;
+
+        if (e->connect_at && e->connect_at <= e->reactor->now &&
+            !SMB2_VALID_SOCKET(smb2->fd) && smb2->next_addrinfo != NULL) {
+                e->connect_at = 0;
+                if (smb2_service_fd(smb2, SMB2_INVALID_SOCKET, 0) < 0) {
+                        reactor_failed(e);
+                        return;
+                }
+        }
+        smb2_timeout_pdus(smb2);
+        /* the callbacks may have removed the context */
+        if (smb2->reactor == e) {
+                reactor_arm(e);
+        }
+}
+
+static struct reactor_fd *
+reactor_find_fd(struct smb2_reactor_entry *e, t_socket fd)
+{
+        struct reactor_fd *rfd;
+
+        for (rfd = e->fds; rfd; rfd = rfd->next) {
+                if (rfd->fd == fd) {
+                        return rfd;
+                }
+        }
+        return NULL;
+}
+
+static uint32_t
+poll_to_epoll(int events)
+{
+        return ((events & POLLIN) ? EPOLLIN : 0) |
+                ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+static int
+epoll_to_poll(uint32_t events)
+{
+        return ((events & EPOLLIN) ? POLLIN : 0) |
+                ((events & EPOLLOUT) ? POLLOUT : 0) |
+                ((events & EPOLLERR) ? POLLERR : 0) |
+                ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+static int
+reactor_add_fd(struct smb2_reactor_entry *e, t_socket fd, int events)
+{
+        struct epoll_event ev;
+        struct reactor_fd *rfd;
+
+        rfd = reactor_find_fd(e, fd);
+        if (rfd != NULL) {
+                return 0;
+        }
+        rfd = calloc(1, sizeof(struct reactor_fd));
+        if (rfd == NULL) {
+                smb2_set_error(e->smb2, "Failed to allocate reactor fd");
+                return -ENOMEM;
+        }
+        rfd->entry = e;
+        rfd->fd = fd;
+        rfd->wanted = events;
+        rfd->registered = poll_to_epoll(events);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = rfd->registered;
+        ev.data.ptr = rfd;
+        if (epoll_ctl(e->reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                int err = errno;
+
+                smb2_set_error(e->smb2, "epoll_ctl failed, errno:%d", err);
+                free(rfd);
+                return -err;
+        }
+        rfd->next = e->fds;
+        e->fds = rfd;
+
+        return 0;
+}
+
+static void
+reactor_free_fd(struct smb2_reactor *reactor, struct reactor_fd *rfd)
+{
+        rfd->entry = NULL;
+        if (reactor->dispatching) {
+                rfd->next = reactor->dead_fds;
+                reactor->dead_fds = rfd;
+                return;
+        }
+        free(rfd);
+}
+
+static void
+reactor_del_fd(struct smb2_reactor_entry *e, t_socket fd)
+{
+        struct reactor_fd **prfd, *rfd;
+
+        for (prfd = &e->fds; *prfd; prfd = &(*prfd)->next) {
+                if ((*prfd)->fd == fd) {
+                        break;
+                }
+        }
+        rfd = *prfd;
+        if (rfd == NULL) {
+                return;
+        }
+        *prfd = rfd->next;
+        epoll_ctl(e->reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+        reactor_free_fd(e->reactor, rfd);
+}
+
+static void
+reactor_change_fd(struct smb2_context *smb2, t_socket fd, int cmd)
+{
+        struct smb2_reactor_entry *e = smb2->reactor;
+
+        if (e == NULL) {
+                return;
+        }
+        if (cmd == SMB2_DEL_FD) {
+                reactor_del_fd(e, fd);
+                return;
+        }
+
+        if (fd == smb2->submit_fd) {
+                reactor_add_fd(e, fd, POLLIN);
+                return;
+        }
+        if (SMB2_VALID_SOCKET(smb2->fd) || smb2->uring != NULL) {
+                /* smb2_change_events() follows with the events */
+                reactor_add_fd(e, fd, 0);
+                return;
+        }
+        /* a new connection attempt */
+        if (reactor_add_fd(e, fd, POLLOUT) < 0) {
+                return;
+        }
+        e->connect_at = e->reactor->now + HAPPY_EYEBALLS_TIMEOUT;
+        if (e->slot == NULL || e->connect_at < e->expires) {
+                wheel_add(e->reactor, e, e->connect_at);
+        }
+}
+
+static void
+reactor_change_events(struct smb2_context *smb2, t_socket fd, int events)
+{
+        struct smb2_reactor_entry *e = smb2->reactor;
+        struct reactor_fd *rfd;
+
+        if (e == NULL) {
+                return;
+        }
+        rfd = reactor_find_fd(e, fd);
+        if (rfd == NULL) {
+                return;
+        }
+        rfd->wanted = events;
+        /* applied by reactor_flush() */
+        if (!e->pending) {
+                e->pending = 1;
+                e->pnext = e->reactor->pending;
+                e->reactor->pending = e;
+        }
+}
+
+/* Writes what a context has queued and updates its fds in the epoll set */
+static void
+reactor_sync(struct smb2_reactor_entry *e)
+{
+        struct smb2_context *smb2 = e->smb2;
+        struct epoll_event ev;
+        struct reactor_fd *rfd;
+
+        rfd = reactor_find_fd(e, smb2->fd);
+        if (rfd != NULL && smb2->uring == NULL &&
+            (rfd->wanted & POLLOUT) && !(rfd->registered & EPOLLOUT)) {
+                /* the socket is almost always writable, try it first */
+                if (smb2_service_fd(smb2, smb2->fd, POLLOUT) < 0) {
+                        reactor_failed(e);
+                        return;
+                }
+                if (smb2->reactor != e) {
+                        return;
+                }
+        }
+
+        for (rfd = e->fds; rfd; rfd = rfd->next) {
+                if (poll_to_epoll(rfd->wanted) == rfd->registered) {
+                        continue;
+                }
+                rfd->registered = poll_to_epoll(rfd->wanted);
+                memset(&ev, 0, sizeof(ev));
+                ev.events = rfd->registered;
+                ev.data.ptr = rfd;
+                epoll_ctl(e->reactor->epfd, EPOLL_CTL_MOD, rfd->fd, &ev);
+        }
+}
+
+static void
+reactor_flush(struct smb2_reactor *reactor)
+{
+        struct smb2_reactor_entry *e;
+
+        while ((e = reactor->pending) != NULL) {
+                reactor->pending = e->pnext;
+                e->pending = 0;
+                reactor_sync(e);
+        }
+}
+
+static void
+reactor_failed(struct smb2_reactor_entry *e)
+{
+        struct smb2_context *smb2 = e->smb2;
+        smb2_command_cb cb = e->cb;
+        void *cb_data = e->cb_data;
+
+        smb2_reactor_remove(e->reactor, smb2);
+        if (cb) {
+                cb(smb2, -EIO, NULL, cb_data);
+        }
+}
+
+void
+smb2_reactor_pdu_queued(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_reactor_entry *e = smb2->reactor;
+
+        if (pdu->deadline == 0) {
+                return;
+        }
+        /* a deadline later than the one armed is found when that fires */
+        if (e->slot == NULL || pdu->deadline < e->expires) {
+                wheel_add(e->reactor, e, pdu->deadline);
+        }
+}
+
+void
+smb2_reactor_detach(struct smb2_context *smb2)
+{
+        if (smb2->reactor != NULL) {
+                smb2_reactor_remove(smb2->reactor->reactor, smb2);
+        }
+}
+
+struct smb2_reactor *
+smb2_init_reactor(void)
+{
+        struct smb2_reactor *reactor;
+
+        reactor = calloc(1, sizeof(struct smb2_reactor));
+        if (reactor == NULL) {
+                return NULL;
+        }
+        reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epfd < 0) {
+                free(reactor);
+                return NULL;
+        }
+        reactor->now = smb2_clock_ms();
+
+        return reactor;
+}
+
+void
+smb2_destroy_reactor(struct smb2_reactor *reactor)
+{
+        struct reactor_fd *rfd;
+
+        if (reactor == NULL) {
+                return;
+        }
+        while (reactor->entries) {
+                smb2_reactor_remove(reactor, reactor->entries->smb2);
+        }
+        while ((rfd = reactor->dead_fds) != NULL) {
+                reactor->dead_fds = rfd->next;
+                free(rfd);
+        }
+        close(reactor->epfd);
+        free(reactor);
+}
+
+int
+smb2_reactor_add(struct smb2_reactor *reactor, struct smb2_context *smb2,
+                 smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_reactor_entry *e;
+        const t_socket *fds;
+        size_t i, fd_count;
+        int events, timeout;
+        int rc;
+
+        if (reactor == NULL || smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (smb2->reactor != NULL) {
+                smb2_set_error(smb2, "Context is already in a reactor");
+                return -EBUSY;
+        }
+
+        e = calloc(1, sizeof(struct smb2_reactor_entry));
+        if (e == NULL) {
+                smb2_set_error(smb2, "Failed to allocate reactor entry");
+                return -ENOMEM;
+        }
+        e->reactor = reactor;
+        e->smb2 = smb2;
+        e->cb = cb;
+        e->cb_data = cb_data;
+        smb2->reactor = e;
+
+        e->next = reactor->entries;
+        if (e->next) {
+                e->next->prev = e;
+        }
+        reactor->entries = e;
+
+        /* pick up the fds the context already has */
+        fds = smb2_get_fds(smb2, &fd_count, &timeout);
+        events = smb2_which_events(smb2);
+        for (i = 0; i < fd_count; i++) {
+                if (!SMB2_VALID_SOCKET(fds[i])) {
+                        continue;
+                }
+                rc = reactor_add_fd(e, fds[i], events);
+                if (rc < 0) {
+                        smb2_reactor_remove(reactor, smb2);
+                        return rc;
+                }
+        }
+        if (SMB2_VALID_SOCKET(smb2->submit_fd)) {
+                rc = reactor_add_fd(e, smb2->submit_fd, POLLIN);
+                if (rc < 0) {
+                        smb2_reactor_remove(reactor, smb2);
+                        return rc;
+                }
+        }
+        smb2->events = events;
+        if (timeout >= 0) {
+                e->connect_at = reactor->now + timeout;
+        }
+        smb2_fd_event_callbacks(smb2, reactor_change_fd,
+                                reactor_change_events);
+        reactor_arm(e);
+
+        return 0;
+}
+
+void
+smb2_reactor_remove(struct smb2_reactor *reactor, struct smb2_context *smb2)
+{
+        struct smb2_reactor_entry *e;
+        struct reactor_fd *rfd;
+
+        if (reactor == NULL || smb2 == NULL) {
+                return;
+        }
+        e = smb2->reactor;
+        if (e == NULL || e->reactor != reactor) {
+                return;
+        }
+
+        while ((rfd = e->fds) != NULL) {
+                e->fds = rfd->next;
+                epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, rfd->fd, NULL);
+                reactor_free_fd(reactor, rfd);
+        }
+        wheel_del(reactor, e);
+        if (e->pending) {
+                struct smb2_reactor_entry **pe;
+
+                for (pe = &reactor->pending; *pe != e; pe = &(*pe)->pnext)
+                        ;
+                *pe = e->pnext;
+        }
+
+        if (e->prev) {
+                e->prev->next = e->next;
+        } else {
+                reactor->entries = e->next;
+        }
+        if (e->next) {
+                e->next->prev = e->prev;
+        }
+
+        smb2_fd_event_callbacks(smb2, NULL, NULL);
+        smb2->reactor = NULL;
+        smb2->events = 0;
+        free(e);
+}
+
+int
+smb2_reactor_run_once(struct smb2_reactor *reactor, int timeout)
+{
+        struct reactor_fd *rfd;
+        uint64_t now, next;
+        int i, n;
+
+        if (reactor == NULL) {
+                return -EINVAL;
+        }
+
+        now = smb2_clock_ms();
+        wheel_advance(reactor, now);
+        reactor_flush(reactor);
+
+        next = wheel_next(reactor);
+        if (next != WHEEL_NEVER &&
+            (timeout < 0 || next - now < (uint64_t)timeout)) {
+                timeout = (int)(next - now);
+        }
+
+        n = epoll_wait(reactor->epfd, reactor->events, REACTOR_MAX_EVENTS,
+                       timeout);
+        if (n < 0) {
+                if (errno != EINTR) {
+                        return -errno;
+                }
+                n = 0;
+        }
+
+        reactor->dispatching = 1;
+        for (i = 0; i < n; i++) {
+                rfd = reactor->events[i].data.ptr;
+                if (rfd->entry == NULL) {
+                        continue;
+                }
+                if (smb2_service_fd(rfd->entry->smb2, rfd->fd,
+                                    epoll_to_poll(reactor->events[i].events)) < 0 &&
+                    rfd->entry != NULL) {
+                        reactor_failed(rfd->entry);
+                }
+        }
+        reactor->dispatching = 0;
+        while ((rfd = reactor->dead_fds) != NULL) {
+                reactor->dead_fds = rfd->next;
+                free(rfd);
+        }
+
+        reactor_flush(reactor);
+        wheel_advance(reactor, smb2_clock_ms());
+        reactor_flush(reactor);
+
+        return n;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+void
+smb2_reactor_pdu_queued(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+}
+
+void
+smb2_reactor_detach(struct smb2_context *smb2)
+{
+}
+
+struct smb2_reactor *
+smb2_init_reactor(void)
+{
+        errno = ENOTSUP;
+        return NULL;
+}
+
+void
+smb2_destroy_reactor(struct smb2_reactor *reactor)
+{
+}
+
+int
+smb2_reactor_add(struct smb2_reactor *reactor, struct smb2_context *smb2,
+                 smb2_command_cb cb, void *cb_data)
+{
+        return -ENOTSUP;
+}
+
+void
+smb2_reactor_remove(struct smb2_reactor *reactor, struct smb2_context *smb2)
+{
+}
+
+int
+smb2_reactor_run_once(struct smb2_reactor *reactor, int timeout)
+{
+        return -ENOTSUP;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
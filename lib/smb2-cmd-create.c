@@ -49,6 +49,8 @@
 
 #include "compat.h"
 
+#include "portable-endian.h"
+
 #include "smb2.h"
 #include "libsmb2.h"
 #include "libsmb2-private.h"
@@ -62,10 +64,9 @@ smb2_encode_create_request(struct smb2_context *smb2,
                            struct smb2_pdu *pdu,
                            struct smb2_create_request *req)
 {
-        int i, len;
+        int i, len, name_len = 0;
         uint8_t *buf;
-        uint16_t ch;
-        struct smb2_utf16 *name = NULL;
+        uint16_t *name = NULL;
         uint32_t name_byte_len = 0;
         struct smb2_iovec *iov;
 
@@ -80,12 +81,22 @@ smb2_encode_create_request(struct smb2_context *smb2,
 
         /* Name */
         if (req->name && req->name[0]) {
-                name = smb2_utf8_to_utf16(req->name);
+                /* Convert straight into the buffer that goes on the
+                 * wire. Each byte of UTF8 is at most one code unit.
+                 */
+                len = PAD_TO_64BIT(2 * strlen(req->name));
+                name = malloc(len);
                 if (name == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate create name");
+                        return -1;
+                }
+                name_len = smb2_utf8_to_utf16_buf(req->name, name, len / 2);
+                if (name_len < 0) {
                         smb2_set_error(smb2, "Could not convert name into UTF-16");
+                        free(name);
                         return -1;
                 }
-                name_byte_len = 2 * name->len;
+                name_byte_len = 2 * name_len;
                 /* name length */
                 req->name_length = name_byte_len;
                 smb2_set_uint16(iov, 46, req->name_length);
@@ -122,26 +133,17 @@ smb2_encode_create_request(struct smb2_context *smb2,
         /* Name */
         if (name) {
                 len = PAD_TO_64BIT(name_byte_len);
-                buf = malloc(len);
-                if (buf == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate create name");
-                        free(name);
-                        return -1;
+                memset((uint8_t *)name + name_byte_len, 0, len - name_byte_len);
+                /* Convert '/' to '\' */
+                for (i = 0; i < name_len; i++) {
+                        if (name[i] == htole16(0x002f)) {
+                                name[i] = htole16(0x005c);
+                        }
                 }
-                memcpy(buf, &name->val[0], name_byte_len);
-                memset(buf + name_byte_len, 0, len - name_byte_len);
                 iov = smb2_add_iovector(smb2, &pdu->out,
-                                        buf,
+                                        (uint8_t *)name,
                                         len,
                                         free);
-                /* Convert '/' to '\' */
-                for (i = 0; i < name->len; i++) {
-                        smb2_get_uint16(iov, i * 2, &ch);
-                        if (ch == 0x002f) {
-                                smb2_set_uint16(iov, i * 2, 0x005c);
-                        }
-                }
-                free(name);
         }
         else {
                 /* have to have at least one byte for name even if len is 0
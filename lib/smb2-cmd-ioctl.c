@@ -102,6 +102,7 @@ smb2_cmd_ioctl_async(struct smb2_context *smb2,
         if (pdu == NULL) {
                 return NULL;
         }
+        pdu->ctl_code = req->ctl_code;
 
         if (smb2_encode_ioctl_request(smb2, pdu, req)) {
                 smb2_free_pdu(smb2, pdu);
@@ -142,6 +143,12 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
                         */
                         len = SMB2_IOCTL_VALIDIATE_NEGOTIATE_INFO_SIZE;
                         break;
+                case SMB2_FSCTL_SRV_REQUEST_RESUME_KEY:
+                case SMB2_FSCTL_SRV_COPYCHUNK:
+                case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                        /* built by the server, see smb2_copychunk_cmd() */
+                        len = rep->output_count;
+                        break;
                 default:
                         if (smb2->passthrough) {
                                 /* assume the replys output is already coded */
@@ -175,6 +182,11 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
                         smb2_set_uint16(ioctlv, 22, info->dialect);
                         break;
                 }
+                case SMB2_FSCTL_SRV_REQUEST_RESUME_KEY:
+                case SMB2_FSCTL_SRV_COPYCHUNK:
+                case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                        memcpy(buf, rep->output, rep->output_count);
+                        break;
                 default:
                         if (smb2->passthrough) {
                                 memcpy(buf, rep->output, rep->output_count);
@@ -408,6 +420,11 @@ smb2_process_ioctl_request_variable(struct smb2_context *smb2,
                 smb2_get_uint16(&vec, 22, &info->dialect);
                 req->input_count = sizeof(struct smb2_ioctl_validate_negotiate_info);
                 break;
+        case SMB2_FSCTL_SRV_COPYCHUNK:
+        case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                /* the server decodes the chunks, see smb2_copychunk_cmd() */
+                ptr = vec.buf;
+                break;
         default:
                 if (smb2->passthrough) {
                         /* dont know how to handle this, let user decode it */
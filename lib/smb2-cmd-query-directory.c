@@ -99,14 +99,89 @@ smb2_decode_fileidfulldirectoryinformation(
         return 0;
 }
 
+int
+smb2_decode_filebothdirectoryinformation(
+    struct smb2_context *smb2,
+    struct smb2_filebothdirectoryinformation *fs,
+    struct smb2_iovec *vec)
+{
+        uint32_t name_len;
+        uint64_t t;
+
+        if (vec->len < SMB2_FILE_BOTH_DIRECTORY_INFORMATION_SIZE) {
+                smb2_set_error(smb2, "Malformed entry in query.\n");
+                return -1;
+        }
+        smb2_get_uint32(vec, 60, &name_len);
+        if (name_len > 94 + name_len ||
+            94 + name_len > vec->len) {
+                smb2_set_error(smb2, "Malformed name in query.\n");
+                return -1;
+        }
+
+        smb2_get_uint32(vec, 0, &fs->next_entry_offset);
+        smb2_get_uint32(vec, 4, &fs->file_index);
+        smb2_get_uint64(vec, 40, &fs->end_of_file);
+        smb2_get_uint64(vec, 48, &fs->allocation_size);
+        smb2_get_uint32(vec, 56, &fs->file_attributes);
+        fs->file_name_length = name_len;
+        smb2_get_uint32(vec, 64, &fs->ea_size);
+        smb2_get_uint8(vec, 68, &fs->short_name_length);
+        memcpy(fs->short_name, &vec->buf[70], 24);
+
+        fs->name = smb2_utf16_to_utf8((uint16_t *)&vec->buf[94], name_len / 2);
+
+        smb2_get_uint64(vec, 8, &t);
+        smb2_win_to_timeval(t, &fs->creation_time);
+
+        smb2_get_uint64(vec, 16, &t);
+        smb2_win_to_timeval(t, &fs->last_access_time);
+
+        smb2_get_uint64(vec, 24, &t);
+        smb2_win_to_timeval(t, &fs->last_write_time);
+
+        smb2_get_uint64(vec, 32, &t);
+        smb2_win_to_timeval(t, &fs->change_time);
+
+        return 0;
+}
+
+int
+smb2_decode_filenamesinformation(
+    struct smb2_context *smb2,
+    struct smb2_filenamesinformation *fs,
+    struct smb2_iovec *vec)
+{
+        uint32_t name_len;
+
+        if (vec->len < SMB2_FILE_NAMES_INFORMATION_SIZE) {
+                smb2_set_error(smb2, "Malformed entry in query.\n");
+                return -1;
+        }
+        smb2_get_uint32(vec, 8, &name_len);
+        if (name_len > 12 + name_len ||
+            12 + name_len > vec->len) {
+                smb2_set_error(smb2, "Malformed name in query.\n");
+                return -1;
+        }
+
+        smb2_get_uint32(vec, 0, &fs->next_entry_offset);
+        smb2_get_uint32(vec, 4, &fs->file_index);
+        fs->file_name_length = name_len;
+
+        fs->name = smb2_utf16_to_utf8((uint16_t *)&vec->buf[12], name_len / 2);
+
+        return 0;
+}
+
 static int
 smb2_encode_query_directory_request(struct smb2_context *smb2,
                                     struct smb2_pdu *pdu,
                                     struct smb2_query_directory_request *req)
 {
-        int len;
+        int len, name_len = 0;
         uint8_t *buf;
-        struct smb2_utf16 *name = NULL;
+        uint16_t *name = NULL;
         struct smb2_iovec *iov;
 
         len = SMB2_QUERY_DIRECTORY_REQUEST_SIZE & 0xfffffffe;
@@ -120,12 +195,19 @@ smb2_encode_query_directory_request(struct smb2_context *smb2,
 
         /* Name */
         if (req->name && req->name[0]) {
-                name = smb2_utf8_to_utf16(req->name);
+                len = strlen(req->name);
+                name = malloc(2 * len);
                 if (name == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate qdir name");
+                        return -1;
+                }
+                name_len = smb2_utf8_to_utf16_buf(req->name, name, len);
+                if (name_len < 0) {
                         smb2_set_error(smb2, "Could not convert name into UTF-16");
+                        free(name);
                         return -1;
                 }
-                smb2_set_uint16(iov, 26, 2 * name->len);
+                smb2_set_uint16(iov, 26, 2 * name_len);
         }
 
         smb2_set_uint16(iov, 0, SMB2_QUERY_DIRECTORY_REQUEST_SIZE);
@@ -138,19 +220,11 @@ smb2_encode_query_directory_request(struct smb2_context *smb2,
 
         /* Name */
         if (name) {
-                buf = malloc(2 * name->len);
-                if (buf == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate qdir name");
-                        free(name);
-                        return -1;
-                }
-                memcpy(buf, &name->val[0], 2 * name->len);
                 iov = smb2_add_iovector(smb2, &pdu->out,
-                                        buf,
-                                        2 * name->len,
+                                        (uint8_t *)name,
+                                        2 * name_len,
                                         free);
         }
-        free(name);
 
         return 0;
 }
@@ -315,7 +389,7 @@ smb2_encode_query_directory_reply(struct smb2_context *smb2,
                         in_offset += PAD_TO_64BIT(sizeof(struct smb2_fileidbothdirectoryinformation));
                         in_remain -= PAD_TO_64BIT(sizeof(struct smb2_fileidbothdirectoryinformation));
                         if (in_remain >= SMB2_FILEID_BOTH_DIRECTORY_INFORMATION_SIZE) {
-                                smb2_set_uint32(iov, offset + 0, offset + fs_size);
+                                smb2_set_uint32(iov, offset + 0, fs_size);
                         }
                         else {
                                 smb2_set_uint32(iov, offset + 0, 0);
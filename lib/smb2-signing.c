@@ -168,6 +168,9 @@ smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
                     struct smb2_iovec *iov, size_t niov)
 
 {
+        uint64_t start = smb2_clock_ns();
+        size_t n;
+
         /* Clear the smb2 header signature field field */
         memset(iov[0].buf + 48, 0, 16);
 
@@ -208,6 +211,11 @@ smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
                 memcpy(&signature[0], digest, SMB2_SIGNATURE_SIZE);
         }
 
+        for (n = 0; n < niov; n++) {
+                smb2->stats.signed_bytes += iov[n].len;
+        }
+        smb2->stats.sign_time_ns += smb2_clock_ns() - start;
+
         return 0;
 }
 
@@ -73,6 +73,7 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
 {
         struct smb2_pdu *tmp_pdu;
         uint32_t spl, u32;
+        uint64_t start;
         int i;
         uint16_t u16;
 
@@ -83,6 +84,7 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
                 return 0;
         }
 
+        start = smb2_clock_ns();
         spl = 52;  /* transform header */
         for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
                 for (i = 0; i < tmp_pdu->out.niov; i++) {
@@ -114,22 +116,29 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
                 }
         }
 
-        aes128ccm_encrypt(smb2->serverin_key,
+        /* a server encrypts with the key that its clients decrypt with */
+        aes128ccm_encrypt(smb2_is_server(smb2) ? smb2->serverout_key :
+                          smb2->serverin_key,
                           &pdu->crypt[20], 11,
                           &pdu->crypt[20], 32,
                           &pdu->crypt[52], spl - 52,
                           &pdu->crypt[4], 16);
         pdu->crypt_len = spl;
 
+        smb2->stats.encrypted_bytes += spl - 52;
+        smb2->stats.encrypt_time_ns += smb2_clock_ns() - start;
+
         return 0;
 }
 
 int
 smb3_decrypt_pdu(struct smb2_context *smb2)
 {
+        uint64_t start = smb2_clock_ns();
         int rc;
 
-        if (aes128ccm_decrypt(smb2->serverout_key,
+        if (aes128ccm_decrypt(smb2_is_server(smb2) ? smb2->serverin_key :
+                              smb2->serverout_key,
                               &smb2->in.iov[smb2->in.niov - 2].buf[20], 11,
                               &smb2->in.iov[smb2->in.niov - 2].buf[20], 32,
                               &smb2->in.iov[smb2->in.niov - 1].buf[0],
@@ -138,6 +147,8 @@ smb3_decrypt_pdu(struct smb2_context *smb2)
                 smb2_set_error(smb2, "Failed to decrypt PDU");
                 return -1;
         }
+        smb2->stats.decrypted_bytes += smb2->in.iov[smb2->in.niov - 1].len;
+        smb2->stats.decrypt_time_ns += smb2_clock_ns() - start;
 
         if (smb2->in.num_done == 0) {
                 smb2->enc = smb2->in.iov[smb2->in.niov - 1].buf;
@@ -111,11 +111,6 @@
 
 #define MAX_URL_SIZE 1024
 
-/* Timeout in ms between 2 consecutive socket connection.
- * The rfc8305 recommends a timeout of 250ms and a minimum timeout of 100ms.
- * Since the smb is most likely used on local network, use an aggressive
- * timeout of 100ms. */
-#define HAPPY_EYEBALLS_TIMEOUT 100
 #if !defined(HAVE_LINGER)
 struct linger
 {
@@ -166,11 +161,28 @@ smb2_get_credit_charge(struct smb2_context *smb2, struct smb2_pdu *pdu)
         return credits;
 }
 
+int
+smb2_get_available_credits(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+        int credits = smb2->credits;
+
+        /* PDUs in the outqueue have not been charged yet */
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                credits -= smb2_get_credit_charge(smb2, pdu);
+        }
+
+        return credits;
+}
+
 int
 smb2_which_events(struct smb2_context *smb2)
 {
         int events = SMB2_VALID_SOCKET(smb2->fd) ? POLLIN : POLLOUT;
 
+        if (smb2->uring != NULL) {
+                return smb2_uring_which_events(smb2);
+        }
         if (smb2->outqueue != NULL &&
             smb2_get_credit_charge(smb2, smb2->outqueue) <= smb2->credits) {
                 events |= POLLOUT;
@@ -181,7 +193,9 @@ smb2_which_events(struct smb2_context *smb2)
 
 t_socket smb2_get_fd(struct smb2_context *smb2)
 {
-        if (SMB2_VALID_SOCKET(smb2->fd)) {
+        if (smb2->uring != NULL) {
+                return smb2->uring_fd;
+        } else if (SMB2_VALID_SOCKET(smb2->fd)) {
                 return smb2->fd;
         } else if (smb2->connecting_fds_count > 0) {
                 return smb2->connecting_fds[0];
@@ -193,7 +207,11 @@ t_socket smb2_get_fd(struct smb2_context *smb2)
 const t_socket *
 smb2_get_fds(struct smb2_context *smb2, size_t *fd_count, int *timeout)
 {
-        if (SMB2_VALID_SOCKET(smb2->fd)) {
+        if (smb2->uring != NULL) {
+                *fd_count = 1;
+                *timeout = -1;
+                return &smb2->uring_fd;
+        } else if (SMB2_VALID_SOCKET(smb2->fd)) {
                 *fd_count = 1;
                 *timeout = -1;
                 return &smb2->fd;
@@ -204,6 +222,87 @@ smb2_get_fds(struct smb2_context *smb2, size_t *fd_count, int *timeout)
         }
 }
 
+/*
+ * Fills in the vectors for sending pdu, and the rest of its compound
+ * chain, starting with the SPL which is stored in *spl. Returns the
+ * number of vectors and the number of bytes in *len.
+ */
+int
+smb2_get_pdu_vectors(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                     struct iovec *iov, uint32_t *spl, size_t *len)
+{
+        struct smb2_pdu *tmp_pdu;
+        uint32_t count = 0;
+        int i, niov = 1;
+
+        if (pdu->seal) {
+                niov = 2;
+                count = pdu->crypt_len;
+                iov[1].iov_base = pdu->crypt;
+                iov[1].iov_len  = pdu->crypt_len;
+        } else {
+                /* Copy all the vectors from all PDUs in the
+                 * compound set.
+                 */
+                for (tmp_pdu = pdu; tmp_pdu;
+                     tmp_pdu = tmp_pdu->next_compound) {
+                        for (i = 0; i < tmp_pdu->out.niov;
+                             i++, niov++) {
+                                iov[niov].iov_base = tmp_pdu->out.iov[i].buf;
+#if defined(_WIN32) || defined(_XBOX)
+                                iov[niov].iov_len = (unsigned long)tmp_pdu->out.iov[i].len;
+#else
+                                iov[niov].iov_len = (size_t)tmp_pdu->out.iov[i].len;
+#endif
+                                count += (uint32_t)tmp_pdu->out.iov[i].len;
+                        }
+                }
+        }
+
+        /* Add the SPL vector as the first vector */
+        *spl = htobe32(count);
+        iov[0].iov_base = spl;
+        iov[0].iov_len = SMB2_SPL_SIZE;
+
+        *len = SMB2_SPL_SIZE + count;
+
+        return niov;
+}
+
+/* Called once all of pdu, and its compound chain, has been written */
+void
+smb2_pdu_sent(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *tmp_pdu;
+
+        smb2_pdu_dequeue(smb2, pdu);
+        smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
+        while (pdu) {
+                tmp_pdu = pdu->next_compound;
+
+                /* As we have now sent all the PDUs we
+                 * can remove the chaining.
+                 * On the receive side we will treat all
+                 * PDUs as individual PDUs.
+                 */
+                pdu->next_compound = NULL;
+                smb2->credits -= pdu->header.credit_charge;
+                SMB2_TRACE(smb2, pdu, SMB2_TRACE_SENT);
+
+                if (!smb2_is_server(smb2)) {
+                        /* queue requests we send to correlate replies with */
+                        smb2_pdu_enqueue(smb2, SMB2_QUEUE_WAIT, pdu);
+                        smb2_add_timeout(smb2, pdu);
+                }
+                else {
+                        smb2->credits += pdu->header.credit_request_response;
+                        /* no longer need this reply we've sent */
+                        smb2_free_pdu(smb2, pdu);
+                }
+                pdu = tmp_pdu;
+        }
+}
+
 static int
 smb2_write_to_socket(struct smb2_context *smb2)
 {
@@ -218,47 +317,22 @@ smb2_write_to_socket(struct smb2_context *smb2)
                 struct iovec *tmpiov;
                 struct smb2_pdu *tmp_pdu;
                 size_t num_done = pdu->out.num_done;
-                int i, niov = 1;
+                size_t len;
+                int niov;
                 ssize_t count;
-                uint32_t spl = 0, tmp_spl, credit_charge = 0;
+                uint32_t tmp_spl, credit_charge = 0;
 
                 for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
                         credit_charge += pdu->header.credit_charge;
                 }
                 if (smb2->dialect > SMB2_VERSION_0202) {
                         if (credit_charge > (uint32_t)smb2->credits) {
+                                smb2->stats.credit_stalls++;
                                 return 0;
                         }
                 }
 
-                if (pdu->seal) {
-                        niov = 2;
-                        spl = pdu->crypt_len;
-                        iov[1].iov_base = pdu->crypt;
-                        iov[1].iov_len  = pdu->crypt_len;
-                } else {
-                        /* Copy all the vectors from all PDUs in the
-                         * compound set.
-                         */
-                        for (tmp_pdu = pdu; tmp_pdu;
-                             tmp_pdu = tmp_pdu->next_compound) {
-                                for (i = 0; i < tmp_pdu->out.niov;
-                                     i++, niov++) {
-                                        iov[niov].iov_base = tmp_pdu->out.iov[i].buf;
-#if defined(_WIN32) || defined(_XBOX)
-                                        iov[niov].iov_len = (unsigned long)tmp_pdu->out.iov[i].len;
-#else
-                                        iov[niov].iov_len = (size_t)tmp_pdu->out.iov[i].len;
-#endif
-                                        spl += (uint32_t)tmp_pdu->out.iov[i].len;
-                                }
-                        }
-                }
-
-                /* Add the SPL vector as the first vector */
-                tmp_spl = htobe32(spl);
-                iov[0].iov_base = &tmp_spl;
-                iov[0].iov_len = SMB2_SPL_SIZE;
+                niov = smb2_get_pdu_vectors(smb2, pdu, iov, &tmp_spl, &len);
 
                 tmpiov = iov;
 
@@ -276,7 +350,15 @@ smb2_write_to_socket(struct smb2_context *smb2)
 #else
                 tmpiov->iov_len -= (size_t)num_done;
 #endif
+                if (pdu->out.num_done == 0) {
+                        for (tmp_pdu = pdu; tmp_pdu;
+                             tmp_pdu = tmp_pdu->next_compound) {
+                                SMB2_TRACE(smb2, tmp_pdu,
+                                           SMB2_TRACE_SEND_START);
+                        }
+                }
                 count = writev(smb2->fd, tmpiov, niov);
+                smb2->stats.write_calls++;
 
                 if (count == -1) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -288,33 +370,11 @@ smb2_write_to_socket(struct smb2_context *smb2)
                         return -1;
                 }
 
+                smb2->stats.bytes_written += count;
                 pdu->out.num_done += (size_t)count;
 
-                if (pdu->out.num_done == SMB2_SPL_SIZE + spl) {
-                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-                        smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
-                        while (pdu) {
-                                tmp_pdu = pdu->next_compound;
-
-                                /* As we have now sent all the PDUs we
-                                 * can remove the chaining.
-                                 * On the receive side we will treat all
-                                 * PDUs as individual PDUs.
-                                 */
-                                pdu->next_compound = NULL;
-                                smb2->credits -= pdu->header.credit_charge;
-
-                                if (!smb2_is_server(smb2)) {
-                                        /* queue requests we send to correlate replies with */
-                                        SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
-                                }
-                                else {
-                                        smb2->credits += pdu->header.credit_request_response;
-                                        /* no longer need this reply we've sent */
-                                        smb2_free_pdu(smb2, pdu);
-                                }
-                                pdu = tmp_pdu;
-                        }
+                if (pdu->out.num_done == len) {
+                        smb2_pdu_sent(smb2, pdu);
                 }
         }
         return 0;
@@ -444,7 +504,8 @@ read_more_data:
                         while (count > 0);
 
                         /* put on wait queue so queue_pdu doesn't complain */
-                        SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                        smb2_pdu_enqueue(smb2, SMB2_QUEUE_WAIT, pdu);
+                        smb2_add_timeout(smb2, pdu);
 
                         smb2->in.num_done = 0;
                         pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
@@ -513,7 +574,12 @@ read_more_data:
                         }
                 }
                 else {
-                        if (smb2->hdr.command != SMB2_OPLOCK_BREAK) {
+                        /* break notifications from the server use the
+                         * reserved message id, responses to our
+                         * acknowledgements are matched like any reply
+                         */
+                        if (smb2->hdr.command != SMB2_OPLOCK_BREAK ||
+                            smb2->hdr.message_id != 0xffffffffffffffffULL) {
                                 if (smb2->pdu) {
                                         smb2_free_pdu(smb2, smb2->pdu);
                                         smb2->pdu = NULL;
@@ -523,7 +589,7 @@ read_more_data:
                                         smb2_set_error(smb2, "no matching PDU found");
                                         return -1;
                                 }
-                                SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
+                                smb2_pdu_dequeue(smb2, pdu);
                         } else {
                                 /* oplock and lease break notifications won't have a pdu */
                                 pdu = smb2->pdu;
@@ -538,6 +604,8 @@ read_more_data:
                         }
                 }
 
+                SMB2_TRACE(smb2, pdu, SMB2_TRACE_HEADER);
+
                 len = smb2_get_fixed_size(smb2, pdu);
                 if (((int)len) < 0) {
                         smb2_set_error(smb2, "can not determine fixed size");
@@ -727,15 +795,21 @@ read_more_data:
 
         is_chained = smb2->hdr.next_command;
 
+        smb2_stats_received(smb2, pdu, SMB2_HEADER_SIZE +
+                            smb2->in.num_done - smb2->payload_offset);
+        SMB2_TRACE(smb2, pdu, SMB2_TRACE_PAYLOAD);
+
         if (smb2_is_server(smb2)) {
                 /* queue requests to correlate our replies we send back later */
-                SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                smb2_pdu_enqueue(smb2, SMB2_QUEUE_WAIT, pdu);
+                smb2_add_timeout(smb2, pdu);
                 pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
                 smb2->pdu = smb2->next_pdu;
                 smb2->next_pdu = NULL;
         }
         else {
                 pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
+                SMB2_TRACE(smb2, pdu, SMB2_TRACE_CALLBACK);
                 smb2_free_pdu(smb2, pdu);
                 smb2->pdu = NULL;
         }
@@ -757,31 +831,114 @@ read_more_data:
         return 0;
 }
 
+/*
+ * Reads from the socket go through a receive buffer so that the SPL,
+ * header and body of a small reply, and any replies after it, come in
+ * with a single read. Reads of at least SMB2_RECV_DIRECT bytes, the
+ * payload of a READ, go straight into the buffer of the caller and only
+ * what follows them ends up in the receive buffer.
+ */
+#define SMB2_RECV_BUF_SIZE      (64 * 1024)
+#define SMB2_RECV_DIRECT        (16 * 1024)
+
 static ssize_t smb2_readv_from_socket(struct smb2_context *smb2,
                                       const struct iovec *iov, int iovcnt)
 {
-        ssize_t rc = readv(smb2->fd, (struct iovec*) iov, iovcnt);
-        return rc;
+        struct iovec tmpiov[SMB2_MAX_VECTORS + 1];
+        size_t i, len, want = 0;
+        ssize_t count = 0;
+        ssize_t rc;
+
+        if (smb2->rbuf == NULL) {
+                smb2->rbuf = malloc(SMB2_RECV_BUF_SIZE);
+                if (smb2->rbuf == NULL) {
+                        smb2->stats.read_calls++;
+                        rc = readv(smb2->fd, (struct iovec*) iov, iovcnt);
+                        if (rc > 0) {
+                                smb2->stats.bytes_read += rc;
+                        }
+                        return rc;
+                }
+        }
+
+        if (smb2->rbuf_pos == smb2->rbuf_len) {
+                smb2->rbuf_pos = smb2->rbuf_len = 0;
+                for (i = 0; (int)i < iovcnt; i++) {
+                        want += iov[i].iov_len;
+                }
+                if (want >= SMB2_RECV_DIRECT) {
+                        memcpy(tmpiov, iov, iovcnt * sizeof(struct iovec));
+                        tmpiov[iovcnt].iov_base = smb2->rbuf;
+                        tmpiov[iovcnt].iov_len = SMB2_RECV_BUF_SIZE;
+                        rc = readv(smb2->fd, tmpiov, iovcnt + 1);
+                        smb2->stats.read_calls++;
+                        if (rc > 0) {
+                                smb2->stats.bytes_read += rc;
+                        }
+                        if (rc > (ssize_t)want) {
+                                smb2->rbuf_len = rc - want;
+                                rc = want;
+                        }
+                        return rc;
+                }
+                tmpiov[0].iov_base = smb2->rbuf;
+                tmpiov[0].iov_len = SMB2_RECV_BUF_SIZE;
+                rc = readv(smb2->fd, tmpiov, 1);
+                smb2->stats.read_calls++;
+                if (rc <= 0) {
+                        return rc;
+                }
+                smb2->stats.bytes_read += rc;
+                smb2->rbuf_len = rc;
+        }
+
+        for (i = 0; (int)i < iovcnt; i++) {
+                len = iov[i].iov_len;
+                if (len > smb2->rbuf_len - smb2->rbuf_pos) {
+                        len = smb2->rbuf_len - smb2->rbuf_pos;
+                }
+                memcpy(iov[i].iov_base, &smb2->rbuf[smb2->rbuf_pos], len);
+                smb2->rbuf_pos += len;
+                count += len;
+        }
+        return count;
 }
 
-static int
+int
 smb2_read_from_socket(struct smb2_context *smb2)
 {
-        /* initialize the input vectors to the spl and the header
-         * which are both static data in the smb2 context.
-         * additional vectors will be added when we can map this to
-         * the corresponding pdu.
-         */
-        if (smb2->in.num_done == 0) {
-                smb2->recv_state = SMB2_RECV_SPL;
-                smb2->spl = 0;
+        int rc;
 
-                smb2_free_iovector(smb2, &smb2->in);
-                smb2_add_iovector(smb2, &smb2->in, (uint8_t *)&smb2->spl,
-                                  SMB2_SPL_SIZE, NULL);
-        }
+        do {
+                /* initialize the input vectors to the spl and the header
+                 * which are both static data in the smb2 context.
+                 * additional vectors will be added when we can map this
+                 * to the corresponding pdu.
+                 */
+                if (smb2->in.num_done == 0) {
+                        smb2->recv_state = SMB2_RECV_SPL;
+                        smb2->spl = 0;
+
+                        smb2_free_iovector(smb2, &smb2->in);
+                        smb2_add_iovector(smb2, &smb2->in,
+                                          (uint8_t *)&smb2->spl,
+                                          SMB2_SPL_SIZE, NULL);
+                }
 
-        return smb2_read_data(smb2, smb2_readv_from_socket, 0);
+                if (smb2->uring != NULL) {
+                        return smb2_read_data(smb2, smb2_uring_readv, 0);
+                }
+                rc = smb2_read_data(smb2, smb2_readv_from_socket, 0);
+                if (rc != 0) {
+                        return rc;
+                }
+                /* the socket will not poll readable for replies that are
+                 * already in the receive buffer
+                 */
+        } while (SMB2_VALID_SOCKET(smb2->fd) &&
+                 smb2->rbuf_pos < smb2->rbuf_len);
+
+        return 0;
 }
 
 static ssize_t smb2_readv_from_buf(struct smb2_context *smb2,
@@ -831,6 +988,14 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
 {
         int ret = 0;
 
+        if (SMB2_VALID_SOCKET(fd) && fd == smb2->submit_fd) {
+                smb2_submit_service(smb2);
+                goto out;
+        }
+        if (smb2->uring != NULL && fd == smb2->uring_fd) {
+                ret = smb2_uring_service(smb2, revents);
+                goto out;
+        }
         if (!SMB2_VALID_SOCKET(fd)) {
                 /* Connect to a new addr in parallel */
                 if (smb2->next_addrinfo != NULL) {
@@ -932,6 +1097,13 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
 
                 smb2_close_connecting_fds(smb2);
 
+                if (smb2->use_uring) {
+                        /* keeps using the socket directly if the ring
+                         * can not be set up
+                         */
+                        smb2_uring_start(smb2);
+                }
+
                 smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
                 if (smb2->connect_cb) {
                         smb2->connect_cb(smb2, 0, NULL,        smb2->connect_data);
@@ -955,7 +1127,8 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
         }
 
  out:
-        if (smb2->timeout) {
+        /* the reactor keeps track of the deadlines itself */
+        if (smb2->reactor == NULL) {
                 smb2_timeout_pdus(smb2);
         }
         return ret;
@@ -966,6 +1139,8 @@ smb2_service(struct smb2_context *smb2, int revents)
 {
         if (smb2->connecting_fds_count > 0) {
                 return smb2_service_fd(smb2, smb2->connecting_fds[0], revents);
+        } else if (smb2->uring != NULL) {
+                return smb2_service_fd(smb2, smb2->uring_fd, revents);
         } else {
                 return smb2_service_fd(smb2, smb2->fd, revents);
         }
@@ -1360,6 +1535,10 @@ int smb2_accept_connection_async(const int fd, const int to_msec, smb2_accepted_
 
 void smb2_change_events(struct smb2_context *smb2, t_socket fd, int events)
 {
+        if (smb2->uring != NULL) {
+                /* the application waits on the ring, not the socket */
+                fd = smb2->uring_fd;
+        }
         if (smb2->events == events) {
                 return;
         }
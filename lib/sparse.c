@@ -0,0 +1,352 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Sparse files.
+ *
+ * FSCTL_QUERY_ALLOCATED_RANGES returns the ranges of a file that are
+ * backed by storage, FSCTL_SET_ZERO_DATA zeroes a range and, once the
+ * file has been marked sparse with FSCTL_SET_SPARSE, gives the storage
+ * back. Together they let whole-file transfers skip the holes.
+ *
+ * Dirty data in the write-behind cache is flushed before any of these
+ * ioctls is sent so that the server sees the same file as the
+ * application does.
+ */
+
+#define SPARSE_RANGE_SIZE       16
+
+struct sparse_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        struct smb2fh *fh;
+        uint32_t ctl_code;
+        uint8_t input[16];
+        uint32_t input_count;
+
+        /* range still to be queried */
+        uint64_t offset;
+        uint64_t end;
+        struct smb2_allocated_ranges ranges;
+        int max_ranges;
+        /* no more queries once this many ranges are known, 0 for all */
+        int limit;
+};
+
+static void
+sparse_done(struct smb2_context *smb2, struct sparse_data *sd, int status)
+{
+        if (status == 0 &&
+            sd->ctl_code == SMB2_FSCTL_QUERY_ALLOCATED_RANGES) {
+                sd->cb(smb2, 0, &sd->ranges, sd->cb_data);
+        } else {
+                sd->cb(smb2, status, NULL, sd->cb_data);
+        }
+        free(sd->ranges.ranges);
+        free(sd);
+}
+
+static int sparse_send(struct smb2_context *smb2, struct sparse_data *sd);
+
+/* Adds the ranges in the reply, returns the number of ranges added */
+static int
+sparse_add_ranges(struct smb2_context *smb2, struct sparse_data *sd,
+                  struct smb2_ioctl_reply *rep)
+{
+        struct smb2_allocated_range *r;
+        struct smb2_iovec iov;
+        int i, count;
+
+        count = rep->output_count / SPARSE_RANGE_SIZE;
+        if (count == 0) {
+                return 0;
+        }
+        if (sd->ranges.count + count > sd->max_ranges) {
+                int max = sd->max_ranges ? sd->max_ranges : 16;
+
+                while (max < sd->ranges.count + count) {
+                        max *= 2;
+                }
+                r = realloc(sd->ranges.ranges,
+                            max * sizeof(struct smb2_allocated_range));
+                if (r == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate ranges");
+                        return -ENOMEM;
+                }
+                sd->ranges.ranges = r;
+                sd->max_ranges = max;
+        }
+
+        iov.buf = rep->output;
+        iov.len = rep->output_count;
+        for (i = 0; i < count; i++) {
+                r = &sd->ranges.ranges[sd->ranges.count++];
+                smb2_get_uint64(&iov, i * SPARSE_RANGE_SIZE, &r->offset);
+                smb2_get_uint64(&iov, i * SPARSE_RANGE_SIZE + 8,
+                                &r->length);
+        }
+
+        return count;
+}
+
+static void
+sparse_ioctl_cb(struct smb2_context *smb2, int status,
+                void *command_data, void *private_data)
+{
+        struct sparse_data *sd = private_data;
+        struct smb2_ioctl_reply *rep = command_data;
+        struct smb2_allocated_range *last;
+        int rc;
+
+        if (status != SMB2_STATUS_SUCCESS &&
+            !(status == SMB2_STATUS_BUFFER_OVERFLOW &&
+              sd->ctl_code == SMB2_FSCTL_QUERY_ALLOCATED_RANGES)) {
+                smb2_set_nterror(smb2, status, "Ioctl 0x%08x failed with "
+                                 "(0x%08x) %s", sd->ctl_code, status,
+                                 nterror_to_str(status));
+                sparse_done(smb2, sd, -nterror_to_errno(status));
+                return;
+        }
+        if (sd->ctl_code != SMB2_FSCTL_QUERY_ALLOCATED_RANGES) {
+                smb2_free_data(smb2, rep->output);
+                sparse_done(smb2, sd, 0);
+                return;
+        }
+
+        rc = sparse_add_ranges(smb2, sd, rep);
+        smb2_free_data(smb2, rep->output);
+        if (rc < 0) {
+                sparse_done(smb2, sd, rc);
+                return;
+        }
+        if (status == SMB2_STATUS_SUCCESS) {
+                sparse_done(smb2, sd, 0);
+                return;
+        }
+
+        /* the reply was full, ask again for what follows the last range */
+        if (rc == 0) {
+                smb2_set_error(smb2, "Allocated ranges reply was empty");
+                sparse_done(smb2, sd, -EIO);
+                return;
+        }
+        last = &sd->ranges.ranges[sd->ranges.count - 1];
+        sd->offset = last->offset + last->length;
+        if (sd->offset >= sd->end ||
+            (sd->limit && sd->ranges.count >= sd->limit)) {
+                sparse_done(smb2, sd, 0);
+                return;
+        }
+        rc = sparse_send(smb2, sd);
+        if (rc < 0) {
+                sparse_done(smb2, sd, rc);
+        }
+}
+
+static void sparse_flushed_cb(struct smb2_context *smb2, int status,
+                              void *command_data, void *private_data);
+
+static int
+sparse_send(struct smb2_context *smb2, struct sparse_data *sd)
+{
+        struct smb2_ioctl_request req;
+        struct smb2_iovec iov;
+        struct smb2_pdu *pdu;
+        int rc;
+
+        rc = smb2_fcache_flush(smb2, sd->fh, sparse_flushed_cb, sd);
+        if (rc != 0) {
+                return rc < 0 ? rc : 0;
+        }
+
+        if (sd->ctl_code == SMB2_FSCTL_QUERY_ALLOCATED_RANGES) {
+                iov.buf = sd->input;
+                iov.len = sizeof(sd->input);
+                smb2_set_uint64(&iov, 0, sd->offset);
+                smb2_set_uint64(&iov, 8, sd->end - sd->offset);
+        } else if (sd->ctl_code == SMB2_FSCTL_SET_ZERO_DATA) {
+                /* the old data must not be read back from the cache */
+                smb2_fcache_invalidate(smb2, sd->fh, 0, 0, -1);
+        }
+
+        memset(&req, 0, sizeof(struct smb2_ioctl_request));
+        req.ctl_code = sd->ctl_code;
+        memcpy(req.file_id, sd->fh->file_id, SMB2_FD_SIZE);
+        req.input_count = sd->input_count;
+        req.input = sd->input;
+        req.flags = SMB2_0_IOCTL_IS_FSCTL;
+
+        pdu = smb2_cmd_ioctl_async(smb2, &req, sparse_ioctl_cb, sd);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create ioctl 0x%08x",
+                               sd->ctl_code);
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+static void
+sparse_flushed_cb(struct smb2_context *smb2, int status,
+                  void *command_data, void *private_data)
+{
+        struct sparse_data *sd = private_data;
+        int rc;
+
+        if (status < 0) {
+                sparse_done(smb2, sd, status);
+                return;
+        }
+
+        rc = sparse_send(smb2, sd);
+        if (rc < 0) {
+                sparse_done(smb2, sd, rc);
+        }
+}
+
+static int
+sparse_ioctl_async(struct smb2_context *smb2, struct smb2fh *fh,
+                   uint32_t ctl_code, uint64_t offset, uint64_t len,
+                   int limit, smb2_command_cb cb, void *cb_data)
+{
+        struct sparse_data *sd;
+        struct smb2_iovec iov;
+        int rc;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+        if (offset + len < offset) {
+                smb2_set_error(smb2, "Range wraps around");
+                return -EINVAL;
+        }
+
+        sd = calloc(1, sizeof(struct sparse_data));
+        if (sd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sparse_data");
+                return -ENOMEM;
+        }
+        sd->cb = cb;
+        sd->cb_data = cb_data;
+        sd->fh = fh;
+        sd->ctl_code = ctl_code;
+        sd->offset = offset;
+        sd->end = offset + len;
+        sd->limit = limit;
+
+        iov.buf = sd->input;
+        iov.len = sizeof(sd->input);
+        switch (ctl_code) {
+        case SMB2_FSCTL_SET_SPARSE:
+                sd->input[0] = len ? 1 : 0;
+                sd->input_count = 1;
+                break;
+        case SMB2_FSCTL_SET_ZERO_DATA:
+                smb2_set_uint64(&iov, 0, offset);
+                smb2_set_uint64(&iov, 8, offset + len);
+                sd->input_count = 16;
+                break;
+        case SMB2_FSCTL_QUERY_ALLOCATED_RANGES:
+                /* filled in by sparse_send() */
+                sd->input_count = 16;
+                break;
+        }
+
+        rc = sparse_send(smb2, sd);
+        if (rc < 0) {
+                free(sd);
+                return rc;
+        }
+
+        return 0;
+}
+
+int
+smb2_query_allocated_ranges_async(struct smb2_context *smb2,
+                                  struct smb2fh *fh,
+                                  uint64_t offset, uint64_t len,
+                                  smb2_command_cb cb, void *cb_data)
+{
+        return sparse_ioctl_async(smb2, fh,
+                                  SMB2_FSCTL_QUERY_ALLOCATED_RANGES,
+                                  offset, len, 0, cb, cb_data);
+}
+
+int
+smb2_query_allocated_ranges_limit_async(struct smb2_context *smb2,
+                                        struct smb2fh *fh,
+                                        uint64_t offset, uint64_t len,
+                                        int limit,
+                                        smb2_command_cb cb, void *cb_data)
+{
+        return sparse_ioctl_async(smb2, fh,
+                                  SMB2_FSCTL_QUERY_ALLOCATED_RANGES,
+                                  offset, len, limit, cb, cb_data);
+}
+
+int
+smb2_zero_range_async(struct smb2_context *smb2, struct smb2fh *fh,
+                      uint64_t offset, uint64_t len,
+                      smb2_command_cb cb, void *cb_data)
+{
+        return sparse_ioctl_async(smb2, fh, SMB2_FSCTL_SET_ZERO_DATA,
+                                  offset, len, 0, cb, cb_data);
+}
+
+int
+smb2_set_sparse_async(struct smb2_context *smb2, struct smb2fh *fh,
+                      int sparse, smb2_command_cb cb, void *cb_data)
+{
+        return sparse_ioctl_async(smb2, fh, SMB2_FSCTL_SET_SPARSE,
+                                  0, sparse ? 1 : 0, 0, cb, cb_data);
+}
@@ -0,0 +1,190 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Performance counters.
+ *
+ * The hooks are called from where PDUs are queued, sent and matched with
+ * their reply. Apart from a clock read per PDU they only add to the
+ * counters in the context, under the same lock as the rest of it.
+ */
+
+static struct smb2_command_stats *
+command_stats(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        if (pdu->header.command >= SMB2_STATS_NUM_COMMANDS) {
+                return NULL;
+        }
+        return &smb2->stats.commands[pdu->header.command];
+}
+
+static void
+add_latency(struct smb2_command_stats *cs, uint64_t ns)
+{
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+
+        while (us >> bucket && bucket < SMB2_STATS_NUM_BUCKETS - 1) {
+                bucket++;
+        }
+        cs->latency[bucket]++;
+        cs->latency_total_us += us;
+        if (us > cs->latency_max_us) {
+                cs->latency_max_us = us;
+        }
+}
+
+void
+smb2_stats_queued(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_command_stats *cs;
+        uint64_t now = smb2_clock_ns();
+        int i;
+
+        for (; pdu; pdu = pdu->next_compound) {
+                pdu->stats_start = now;
+                cs = command_stats(smb2, pdu);
+                if (cs == NULL) {
+                        continue;
+                }
+                cs->sent++;
+                for (i = 0; i < pdu->out.niov; i++) {
+                        cs->bytes_sent += pdu->out.iov[i].len;
+                }
+        }
+}
+
+void
+smb2_stats_received(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                    size_t len)
+{
+        struct smb2_command_stats *cs = command_stats(smb2, pdu);
+
+        if (cs == NULL) {
+                return;
+        }
+        cs->received++;
+        cs->bytes_received += len;
+        if (smb2_is_server(smb2)) {
+                /* the service time runs until the reply is queued */
+                pdu->stats_start = smb2_clock_ns();
+                return;
+        }
+        if ((smb2->hdr.status & SMB2_STATUS_SEVERITY_MASK) ==
+            SMB2_STATUS_SEVERITY_ERROR) {
+                cs->errors++;
+        }
+        if (pdu->stats_start) {
+                add_latency(cs, smb2_clock_ns() - pdu->stats_start);
+        }
+}
+
+void
+smb2_stats_replied(struct smb2_context *smb2, struct smb2_pdu *req,
+                   struct smb2_pdu *rep)
+{
+        struct smb2_command_stats *cs = command_stats(smb2, rep);
+
+        if (cs == NULL) {
+                return;
+        }
+        if ((rep->header.status & SMB2_STATUS_SEVERITY_MASK) ==
+            SMB2_STATUS_SEVERITY_ERROR) {
+                cs->errors++;
+        }
+        if (req->stats_start) {
+                add_latency(cs, smb2_clock_ns() - req->stats_start);
+        }
+}
+
+void
+smb2_stats_timed_out(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_command_stats *cs = command_stats(smb2, pdu);
+
+        if (cs != NULL) {
+                cs->errors++;
+        }
+}
+
+void
+smb2_stats_outqueue(struct smb2_context *smb2, int delta)
+{
+        smb2->stats.outqueue_depth += delta;
+        if (smb2->stats.outqueue_depth > smb2->stats.outqueue_max) {
+                smb2->stats.outqueue_max = smb2->stats.outqueue_depth;
+        }
+}
+
+void
+smb2_stats_waitqueue(struct smb2_context *smb2, int delta)
+{
+        smb2->stats.waitqueue_depth += delta;
+        if (smb2->stats.waitqueue_depth > smb2->stats.waitqueue_max) {
+                smb2->stats.waitqueue_max = smb2->stats.waitqueue_depth;
+        }
+}
+
+void
+smb2_get_stats(struct smb2_context *smb2, struct smb2_stats *stats)
+{
+        smb2_lock_context(smb2);
+        memcpy(stats, &smb2->stats, sizeof(struct smb2_stats));
+        smb2_unlock_context(smb2);
+}
+
+void
+smb2_reset_stats(struct smb2_context *smb2)
+{
+        uint32_t outqueue_depth, waitqueue_depth;
+
+        smb2_lock_context(smb2);
+        outqueue_depth = smb2->stats.outqueue_depth;
+        waitqueue_depth = smb2->stats.waitqueue_depth;
+        memset(&smb2->stats, 0, sizeof(struct smb2_stats));
+        smb2->stats.outqueue_depth = smb2->stats.outqueue_max =
+                outqueue_depth;
+        smb2->stats.waitqueue_depth = smb2->stats.waitqueue_max =
+                waitqueue_depth;
+        smb2_unlock_context(smb2);
+}
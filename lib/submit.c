@@ -0,0 +1,448 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Thread-safe submission.
+ *
+ * Other threads hand work to the thread that services a context through
+ * a lock-free list on the context. Submitting pushes onto the head of the
+ * list with a compare and swap. The servicing thread takes the whole list
+ * with one exchange and reverses it to run the work in the order it was
+ * submitted. As it only ever takes the whole list there is no ABA
+ * problem.
+ *
+ * Only the push that finds the list empty signals the wakeup fd, so a
+ * burst of submissions costs one write and one wakeup. The consumer
+ * clears the fd before it takes the list, so a submission either lands
+ * in the list that is taken or signals the fd again.
+ *
+ * Completion queues work the same way in the other direction, with the
+ * servicing threads pushing completed commands and the thread that owns
+ * the queue running their callbacks.
+ */
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(HAVE_UNISTD_H) && \
+    (defined(HAVE_POLL_H) || defined(HAVE_SYS_POLL_H)) && \
+    (defined(HAVE_SYS_EVENTFD_H) || defined(__APPLE__) || \
+     defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__))
+
+struct smb2_submission {
+        struct smb2_submission *next;
+        struct smb2_completion_queue *cq;
+        smb2_submit_fn fn;
+        void *arg;
+        smb2_command_cb cb;
+        void *cb_data;
+
+        /* the result, while on a completion queue */
+        struct smb2_context *smb2;
+        int status;
+        void *command_data;
+};
+
+struct smb2_completion_queue {
+        struct smb2_submission *head;
+        t_socket fd;
+        t_socket wfd;
+};
+
+static int
+wakeup_open(t_socket *fd, t_socket *wfd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+        *fd = *wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (*fd < 0) {
+                return -errno;
+        }
+#else
+        int p[2], i;
+
+        if (pipe(p) < 0) {
+                return -errno;
+        }
+        for (i = 0; i < 2; i++) {
+                fcntl(p[i], F_SETFL, fcntl(p[i], F_GETFL, 0) | O_NONBLOCK);
+                fcntl(p[i], F_SETFD, FD_CLOEXEC);
+        }
+        *fd = p[0];
+        *wfd = p[1];
+#endif
+        return 0;
+}
+
+static void
+wakeup_close(t_socket fd, t_socket wfd)
+{
+        if (wfd != fd) {
+                close(wfd);
+        }
+        close(fd);
+}
+
+static void
+wakeup_signal(t_socket wfd)
+{
+        uint64_t one = 1;
+
+        /* a full pipe is already signalled */
+        if (write(wfd, &one, sizeof(one)) < 0) {
+                return;
+        }
+}
+
+static void
+wakeup_clear(t_socket fd)
+{
+        uint64_t buf[8];
+
+        while (read(fd, buf, sizeof(buf)) > 0)
+                ;
+}
+
+/* Returns 1 if the list was empty */
+static int
+list_push(struct smb2_submission **head, struct smb2_submission *s)
+{
+        struct smb2_submission *old;
+
+        old = __atomic_load_n(head, __ATOMIC_RELAXED);
+        do {
+                s->next = old;
+        } while (!__atomic_compare_exchange_n(head, &old, s, 1,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+        return old == NULL;
+}
+
+/* Takes the whole list, oldest first */
+static struct smb2_submission *
+list_take(struct smb2_submission **head)
+{
+        struct smb2_submission *s, *next, *list = NULL;
+
+        s = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+        while (s) {
+                next = s->next;
+                s->next = list;
+                list = s;
+                s = next;
+        }
+        return list;
+}
+
+static void
+submit_cb(struct smb2_context *smb2, int status,
+          void *command_data, void *private_data)
+{
+        struct smb2_submission *s = private_data;
+        struct smb2_completion_queue *cq = s->cq;
+
+        if (cq == NULL) {
+                if (s->cb) {
+                        s->cb(smb2, status, command_data, s->cb_data);
+                }
+                free(s);
+                return;
+        }
+
+        s->smb2 = smb2;
+        s->status = status;
+        s->command_data = command_data;
+        if (list_push(&cq->head, s)) {
+                wakeup_signal(cq->wfd);
+        }
+}
+
+int
+smb2_enable_submit(struct smb2_context *smb2)
+{
+        int rc;
+
+        if (SMB2_VALID_SOCKET(smb2->submit_fd)) {
+                return 0;
+        }
+        rc = wakeup_open(&smb2->submit_fd, &smb2->submit_wfd);
+        if (rc < 0) {
+                smb2_set_error(smb2, "Failed to create wakeup fd, "
+                               "errno:%d", -rc);
+                smb2->submit_fd = smb2->submit_wfd = SMB2_INVALID_SOCKET;
+                return rc;
+        }
+
+        if (smb2->change_fd) {
+                smb2->change_fd(smb2, smb2->submit_fd, SMB2_ADD_FD);
+        }
+        if (smb2->change_events) {
+                smb2->change_events(smb2, smb2->submit_fd, POLLIN);
+        }
+        return 0;
+}
+
+t_socket
+smb2_get_submit_fd(struct smb2_context *smb2)
+{
+        return smb2->submit_fd;
+}
+
+void
+smb2_submit_wakeup(struct smb2_context *smb2)
+{
+        wakeup_signal(smb2->submit_wfd);
+}
+
+int
+smb2_submit(struct smb2_context *smb2, struct smb2_completion_queue *cq,
+            smb2_submit_fn fn, void *arg,
+            smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_submission *s;
+
+        /* no smb2_set_error(), this runs on other threads */
+        if (smb2 == NULL || fn == NULL ||
+            !SMB2_VALID_SOCKET(smb2->submit_fd)) {
+                return -EINVAL;
+        }
+        s = calloc(1, sizeof(struct smb2_submission));
+        if (s == NULL) {
+                return -ENOMEM;
+        }
+        s->cq = cq;
+        s->fn = fn;
+        s->arg = arg;
+        s->cb = cb;
+        s->cb_data = cb_data;
+
+        if (list_push(&smb2->submissions, s)) {
+                wakeup_signal(smb2->submit_wfd);
+        }
+        return 0;
+}
+
+void
+smb2_submit_service(struct smb2_context *smb2)
+{
+        struct smb2_submission *s, *next;
+        int rc;
+
+        wakeup_clear(smb2->submit_fd);
+        for (s = list_take(&smb2->submissions); s; s = next) {
+                next = s->next;
+                rc = s->fn(smb2, submit_cb, s, s->arg);
+                if (rc < 0) {
+                        submit_cb(smb2, rc, NULL, s);
+                }
+        }
+}
+
+void
+smb2_submit_close(struct smb2_context *smb2)
+{
+        struct smb2_submission *s, *next;
+
+        if (!SMB2_VALID_SOCKET(smb2->submit_fd)) {
+                return;
+        }
+        for (s = list_take(&smb2->submissions); s; s = next) {
+                next = s->next;
+                submit_cb(smb2, -ECANCELED, NULL, s);
+        }
+        if (smb2->change_fd) {
+                smb2->change_fd(smb2, smb2->submit_fd, SMB2_DEL_FD);
+        }
+        wakeup_close(smb2->submit_fd, smb2->submit_wfd);
+        smb2->submit_fd = smb2->submit_wfd = SMB2_INVALID_SOCKET;
+}
+
+struct smb2_completion_queue *
+smb2_init_completion_queue(void)
+{
+        struct smb2_completion_queue *cq;
+
+        cq = calloc(1, sizeof(struct smb2_completion_queue));
+        if (cq == NULL) {
+                return NULL;
+        }
+        if (wakeup_open(&cq->fd, &cq->wfd) < 0) {
+                free(cq);
+                return NULL;
+        }
+        return cq;
+}
+
+void
+smb2_destroy_completion_queue(struct smb2_completion_queue *cq)
+{
+        struct smb2_submission *s, *next;
+
+        if (cq == NULL) {
+                return;
+        }
+        for (s = list_take(&cq->head); s; s = next) {
+                next = s->next;
+                free(s);
+        }
+        wakeup_close(cq->fd, cq->wfd);
+        free(cq);
+}
+
+t_socket
+smb2_completion_queue_get_fd(struct smb2_completion_queue *cq)
+{
+        return cq->fd;
+}
+
+int
+smb2_completion_queue_run(struct smb2_completion_queue *cq, int timeout)
+{
+        struct smb2_submission *s, *next;
+        struct pollfd pfd;
+        int count = 0;
+
+        if (cq == NULL) {
+                return -EINVAL;
+        }
+        if (timeout != 0 &&
+            __atomic_load_n(&cq->head, __ATOMIC_ACQUIRE) == NULL) {
+                pfd.fd = cq->fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+                        return -errno;
+                }
+        }
+
+        wakeup_clear(cq->fd);
+        for (s = list_take(&cq->head); s; s = next) {
+                next = s->next;
+                if (s->cb) {
+                        s->cb(s->smb2, s->status, s->command_data,
+                              s->cb_data);
+                }
+                free(s);
+                count++;
+        }
+        return count;
+}
+
+#else /* no atomics or wakeup fds */
+
+void
+smb2_submit_service(struct smb2_context *smb2)
+{
+}
+
+void
+smb2_submit_close(struct smb2_context *smb2)
+{
+}
+
+void
+smb2_submit_wakeup(struct smb2_context *smb2)
+{
+}
+
+int
+smb2_enable_submit(struct smb2_context *smb2)
+{
+        smb2_set_error(smb2, "Thread-safe submission is not supported "
+                       "on this platform");
+        return -ENOTSUP;
+}
+
+t_socket
+smb2_get_submit_fd(struct smb2_context *smb2)
+{
+        return SMB2_INVALID_SOCKET;
+}
+
+int
+smb2_submit(struct smb2_context *smb2, struct smb2_completion_queue *cq,
+            smb2_submit_fn fn, void *arg,
+            smb2_command_cb cb, void *cb_data)
+{
+        return -ENOTSUP;
+}
+
+struct smb2_completion_queue *
+smb2_init_completion_queue(void)
+{
+        errno = ENOTSUP;
+        return NULL;
+}
+
+void
+smb2_destroy_completion_queue(struct smb2_completion_queue *cq)
+{
+}
+
+t_socket
+smb2_completion_queue_get_fd(struct smb2_completion_queue *cq)
+{
+        return SMB2_INVALID_SOCKET;
+}
+
+int
+smb2_completion_queue_run(struct smb2_completion_queue *cq, int timeout)
+{
+        return -ENOTSUP;
+}
+
+#endif
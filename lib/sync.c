@@ -65,28 +65,47 @@ static int wait_for_reply(struct smb2_context *smb2,
 {
         time_t t = time(NULL);
 
+        /* the service thread polls, just wait for the callback */
+        if (smb2->thread != NULL && !smb2_is_service_thread(smb2)) {
+                return smb2_thread_wait(smb2, cb_data);
+        }
+
         while (!cb_data->is_finished) {
-		struct pollfd pfd;
-		memset(&pfd, 0, sizeof(struct pollfd));
-		pfd.fd = smb2_get_fd(smb2);
-		pfd.events = smb2_which_events(smb2);
+		struct pollfd pfd[2];
+                int timeout, nfds = 1;
+
+		memset(pfd, 0, sizeof(pfd));
+		pfd[0].fd = smb2_get_fd(smb2);
+		pfd[0].events = smb2_which_events(smb2);
+                /* keep running what other threads submit */
+                if (SMB2_VALID_SOCKET(smb2->submit_fd)) {
+                        pfd[1].fd = smb2->submit_fd;
+                        pfd[1].events = POLLIN;
+                        nfds = 2;
+                }
 
-		if (poll(&pfd, 1, 1000) < 0) {
+                /* wake up in time for the first command to time out */
+                timeout = smb2_get_next_timeout(smb2);
+                if (timeout < 0 || timeout > 1000) {
+                        timeout = 1000;
+                }
+		if (poll(pfd, nfds, timeout) < 0) {
 			smb2_set_error(smb2, "Poll failed");
 			return -1;
 		}
-                if (smb2->timeout) {
-                        smb2_timeout_pdus(smb2);
+                if (pfd[1].revents) {
+                        smb2_submit_service(smb2);
                 }
-		if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - t) > (smb2->timeout)))
+                smb2_timeout_pdus(smb2);
+		if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - t) > (smb2->timeout / 1000)))
 		{
 			smb2_set_error(smb2, "Timeout expired and no connection exists\n");
 			return -1;
 		}                
-                if (pfd.revents == 0) {
+                if (pfd[0].revents == 0) {
                         continue;
                 }
-		if (smb2_service(smb2, pfd.revents) < 0) {
+		if (smb2_service(smb2, pfd[0].revents) < 0) {
 			smb2_set_error(smb2, "smb2_service failed with : "
                                         "%s\n", smb2_get_error(smb2));
                         return -1;
@@ -96,6 +115,14 @@ static int wait_for_reply(struct smb2_context *smb2,
         return 0;
 }
 
+static void sync_finished(struct sync_cb_data *cb_data)
+{
+        cb_data->is_finished = 1;
+        if (cb_data->waiter) {
+                smb2_thread_signal(cb_data->waiter);
+        }
+}
+
 static void connect_cb(struct smb2_context *smb2, int status,
                        void *command_data, void *private_data)
 {
@@ -108,7 +135,7 @@ static void connect_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->status = status;
 }
 
@@ -124,7 +151,9 @@ int smb2_connect_share(struct smb2_context *smb2,
         int rc = 0;
 
         cb_data = &smb2->connect_cb_data;
+        smb2_lock_context(smb2);
 	rc = smb2_connect_share_async(smb2, server, share, user, connect_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -151,7 +180,9 @@ int smb2_disconnect_share(struct smb2_context *smb2)
 
         cb_data = &smb2->connect_cb_data;
 
+        smb2_lock_context(smb2);
 	rc = smb2_disconnect_share_async(smb2, connect_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -180,7 +211,7 @@ static void opendir_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->ptr = command_data;
 }
 
@@ -188,6 +219,7 @@ struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path)
 {
         struct sync_cb_data *cb_data;
         void *ptr;
+        int rc;
 
         cb_data = calloc(1, sizeof(struct sync_cb_data));
         if (cb_data == NULL) {
@@ -196,8 +228,11 @@ struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path)
         }
 
         /* smb2dir takes wnership of cb_data on success */
-	if (smb2_opendir_async(smb2, path,
-                               opendir_cb, cb_data) != 0) {
+        smb2_lock_context(smb2);
+        rc = smb2_opendir_async(smb2, path,
+                                opendir_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc != 0) {
 		smb2_set_error(smb2, "smb2_opendir_async failed");
                 free(cb_data);
 		return NULL;
@@ -212,6 +247,41 @@ struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path)
         return ptr;
 }
 
+struct smb2dir *smb2_opendir_ex(struct smb2_context *smb2, const char *path,
+                                uint8_t info_class, const char *pattern,
+                                uint32_t output_buffer_length)
+{
+        struct sync_cb_data *cb_data;
+        void *ptr;
+        int rc;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return NULL;
+        }
+
+        /* smb2dir takes ownership of cb_data on success */
+        smb2_lock_context(smb2);
+        rc = smb2_opendir_ex_async(smb2, path, info_class, pattern,
+                                   output_buffer_length,
+                                   opendir_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc != 0) {
+                smb2_set_error(smb2, "smb2_opendir_ex_async failed");
+                free(cb_data);
+                return NULL;
+        }
+
+        if (wait_for_reply(smb2, cb_data) < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return NULL;
+        }
+
+        ptr = cb_data->ptr;
+        return ptr;
+}
+
 /*
  * open()
  */
@@ -225,7 +295,7 @@ static void open_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->ptr = command_data;
 }
 
@@ -233,6 +303,7 @@ struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags)
 {
         struct sync_cb_data *cb_data;
         void *ptr;
+        int rc;
 
         cb_data = calloc(1, sizeof(struct sync_cb_data));
         if (cb_data == NULL) {
@@ -240,8 +311,11 @@ struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags)
                 return NULL;
         }
 
-	if (smb2_open_async(smb2, path, flags,
-                               open_cb, cb_data) != 0) {
+        smb2_lock_context(smb2);
+        rc = smb2_open_async(smb2, path, flags,
+                             open_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc != 0) {
 		smb2_set_error(smb2, "smb2_open_async failed");
                 free(cb_data);
 		return NULL;
@@ -270,7 +344,7 @@ static void close_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->status = status;
 }
 
@@ -285,7 +359,9 @@ int smb2_close(struct smb2_context *smb2, struct smb2fh *fh)
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_close_async(smb2, fh, close_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -293,7 +369,7 @@ int smb2_close(struct smb2_context *smb2, struct smb2fh *fh)
 	rc = wait_for_reply(smb2, cb_data);
         if (rc < 0) {
                 cb_data->status = SMB2_STATUS_CANCELLED;
-                goto out;
+                return rc;
 	}
 
         rc = cb_data->status;
@@ -316,7 +392,7 @@ static void fsync_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->status = status;
 }
 
@@ -331,7 +407,9 @@ int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh)
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_fsync_async(smb2, fh, fsync_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -362,10 +440,102 @@ static void generic_status_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->status = status;
 }
 
+/*
+ * stat_batch()
+ */
+int smb2_stat_batch(struct smb2_context *smb2,
+                    struct smb2_stat_batch_entry *entries, int count,
+                    int window)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        smb2_lock_context(smb2);
+        rc = smb2_stat_batch_async(smb2, entries, count, window,
+                                   generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+/*
+ * walk()
+ */
+struct sync_walk_cb_data {
+        struct sync_cb_data sync; /* must be first, see generic_status_cb */
+        smb2_walk_entry_cb entry_cb;
+        void *entry_cb_data;
+};
+
+static int sync_walk_entry_cb(struct smb2_context *smb2,
+                              struct smb2_walk_entry *ent,
+                              void *private_data)
+{
+        struct sync_walk_cb_data *cb_data = private_data;
+
+        return cb_data->entry_cb(smb2, ent, cb_data->entry_cb_data);
+}
+
+int smb2_walk(struct smb2_context *smb2, const char *path,
+              uint8_t info_class, int max_in_flight, int max_depth,
+              smb2_walk_entry_cb entry_cb, void *entry_cb_data)
+{
+        struct sync_walk_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_walk_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+        cb_data->entry_cb = entry_cb;
+        cb_data->entry_cb_data = entry_cb_data;
+
+        smb2_lock_context(smb2);
+        rc = smb2_walk_async(smb2, path, info_class, max_in_flight,
+                             max_depth, sync_walk_entry_cb,
+                             generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, &cb_data->sync);
+        if (rc < 0) {
+                cb_data->sync.status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->sync.status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
 int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                uint8_t *buf, uint32_t count, uint64_t offset)
 {
@@ -378,8 +548,10 @@ int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                 return -ENOMEM;
         }
         
+        smb2_lock_context(smb2);
 	rc = smb2_pread_async(smb2, fh, buf, count, offset,
                               generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -409,8 +581,10 @@ int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_pwrite_async(smb2, fh, buf, count, offset,
                                generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -440,8 +614,10 @@ int smb2_read(struct smb2_context *smb2, struct smb2fh *fh,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_read_async(smb2, fh, buf, count,
                              generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -471,8 +647,10 @@ int smb2_write(struct smb2_context *smb2, struct smb2fh *fh,
                 return -ENOMEM;
         }
         
+        smb2_lock_context(smb2);
 	rc = smb2_write_async(smb2, fh, buf, count,
                               generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -501,8 +679,10 @@ int smb2_unlink(struct smb2_context *smb2, const char *path)
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_unlink_async(smb2, path,
                                generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -531,8 +711,10 @@ int smb2_rmdir(struct smb2_context *smb2, const char *path)
                 return -ENOMEM;
         }
         
+        smb2_lock_context(smb2);
 	rc = smb2_rmdir_async(smb2, path,
                               generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -561,8 +743,10 @@ int smb2_mkdir(struct smb2_context *smb2, const char *path)
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_mkdir_async(smb2, path,
                               generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -592,8 +776,10 @@ int smb2_fstat(struct smb2_context *smb2, struct smb2fh *fh,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_fstat_async(smb2, fh, st,
                               generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -623,8 +809,10 @@ int smb2_stat(struct smb2_context *smb2, const char *path,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_stat_async(smb2, path, st,
                              generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -654,8 +842,10 @@ int smb2_rename(struct smb2_context *smb2, const char *oldpath,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_rename_async(smb2, oldpath, newpath,
                                generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -685,8 +875,10 @@ int smb2_statvfs(struct smb2_context *smb2, const char *path,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_statvfs_async(smb2, path, st,
                                 generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -716,8 +908,10 @@ int smb2_truncate(struct smb2_context *smb2, const char *path,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_truncate_async(smb2, path, length,
                                  generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -735,6 +929,275 @@ int smb2_truncate(struct smb2_context *smb2, const char *path,
 	return rc;
 }
 
+/*
+ * get_file()/put_file()
+ */
+static void xfer_file_cb(struct smb2_context *smb2, int status,
+                         void *command_data, void *private_data)
+{
+        struct sync_cb_data *cb_data = private_data;
+
+        if (cb_data->status == SMB2_STATUS_CANCELLED) {
+                free(cb_data);
+                return;
+        }
+
+        sync_finished(cb_data);
+        cb_data->status = status;
+        if (status == 0 && cb_data->ptr) {
+                *(uint64_t *)cb_data->ptr = *(uint64_t *)command_data;
+        }
+}
+
+int smb2_get_file(struct smb2_context *smb2, const char *path,
+                  uint8_t *buf, uint64_t count, uint64_t *read_count)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+        cb_data->ptr = read_count;
+
+        smb2_lock_context(smb2);
+        rc = smb2_get_file_async(smb2, path, buf, count,
+                                 xfer_file_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+int smb2_put_file(struct smb2_context *smb2, const char *path,
+                  const uint8_t *buf, uint64_t count, uint64_t *write_count)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+        cb_data->ptr = write_count;
+
+        smb2_lock_context(smb2);
+        rc = smb2_put_file_async(smb2, path, buf, count,
+                                 xfer_file_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+int smb2_copy_range(struct smb2_context *smb2,
+                    struct smb2fh *src, uint64_t src_offset,
+                    struct smb2fh *dst, uint64_t dst_offset,
+                    uint64_t len)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        smb2_lock_context(smb2);
+        rc = smb2_copy_range_async(smb2, src, src_offset, dst, dst_offset,
+                                   len, generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+struct ranges_cb_data {
+        struct smb2_allocated_range *ranges;
+        int max_ranges;
+        int count;
+};
+
+static void ranges_cb(struct smb2_context *smb2, int status,
+                      void *command_data, void *private_data)
+{
+        struct sync_cb_data *cb_data = private_data;
+        struct ranges_cb_data *r_data = cb_data->ptr;
+        struct smb2_allocated_ranges *ranges = command_data;
+        int count;
+
+        if (cb_data->status == SMB2_STATUS_CANCELLED) {
+                free(cb_data);
+                return;
+        }
+
+        sync_finished(cb_data);
+        cb_data->status = status;
+        if (status == 0) {
+                count = ranges->count;
+                if (count > r_data->max_ranges) {
+                        count = r_data->max_ranges;
+                }
+                memcpy(r_data->ranges, ranges->ranges,
+                       count * sizeof(struct smb2_allocated_range));
+                r_data->count = ranges->count;
+        }
+}
+
+int smb2_query_allocated_ranges(struct smb2_context *smb2,
+                                struct smb2fh *fh,
+                                uint64_t offset, uint64_t len,
+                                struct smb2_allocated_range *ranges,
+                                int max_ranges)
+{
+        struct sync_cb_data *cb_data;
+        struct ranges_cb_data r_data _U_;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        r_data.ranges = ranges;
+        r_data.max_ranges = max_ranges;
+        r_data.count = 0;
+
+        cb_data->ptr = &r_data;
+
+        smb2_lock_context(smb2);
+        /* one more than fits tells the caller that there is more */
+        rc = smb2_query_allocated_ranges_limit_async(smb2, fh, offset, len,
+                                                     max_ranges + 1,
+                                                     ranges_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+        if (rc == 0) {
+                rc = r_data.count;
+        }
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+int smb2_zero_range(struct smb2_context *smb2, struct smb2fh *fh,
+                    uint64_t offset, uint64_t len)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        smb2_lock_context(smb2);
+        rc = smb2_zero_range_async(smb2, fh, offset, len,
+                                   generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+int smb2_set_sparse(struct smb2_context *smb2, struct smb2fh *fh,
+                    int sparse)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        smb2_lock_context(smb2);
+        rc = smb2_set_sparse_async(smb2, fh, sparse,
+                                   generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
 int smb2_ftruncate(struct smb2_context *smb2, struct smb2fh *fh,
                    uint64_t length)
 {
@@ -747,8 +1210,10 @@ int smb2_ftruncate(struct smb2_context *smb2, struct smb2fh *fh,
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
 	rc = smb2_ftruncate_async(smb2, fh, length,
                                   generic_status_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -782,7 +1247,7 @@ static void readlink_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->status = status;
         strncpy(rl_data->buf, command_data, rl_data->len);
 }
@@ -805,7 +1270,9 @@ int smb2_readlink(struct smb2_context *smb2, const char *path,
 
         cb_data->ptr = &rl_data;
 
+        smb2_lock_context(smb2);
 	rc = smb2_readlink_async(smb2, path, readlink_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -833,7 +1300,7 @@ static void echo_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        cb_data->is_finished = 1;
+        sync_finished(cb_data);
         cb_data->status = status;
 }
 
@@ -856,7 +1323,9 @@ int smb2_echo(struct smb2_context *smb2)
                 return -ENOMEM;
         }
 
+        smb2_lock_context(smb2);
         rc = smb2_echo_async(smb2, echo_cb, cb_data);
+        smb2_unlock_context(smb2);
         if (rc < 0) {
                 goto out;
 	}
@@ -0,0 +1,363 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Service thread.
+ *
+ * Lets any number of threads use the sync API on one context. A service
+ * thread does all the polling and runs the callbacks while the threads
+ * calling the sync API only issue their command and then sleep on a
+ * condition variable of their own until the callback for it has run.
+ *
+ * A recursive mutex on the context serializes issuing commands and
+ * servicing the socket. The service thread drops it while it sleeps in
+ * poll() and the calling threads drop it while they wait, so commands
+ * from different threads are in flight at the same time and are
+ * pipelined over the one connection.
+ *
+ * A calling thread writes its command to the socket itself, as it holds
+ * the mutex anyway, and only wakes the service thread through the submit
+ * fd when something is left that the service thread has to pick up.
+ */
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32) && \
+    (defined(HAVE_POLL_H) || defined(HAVE_SYS_POLL_H))
+
+struct smb2_waiter {
+        struct smb2_waiter *next;
+        struct smb2_waiter *prev;
+        pthread_cond_t cond;
+};
+
+struct smb2_thread {
+        pthread_mutex_t mutex;
+        pthread_t id;
+        int stop;
+        int failed;
+        /* when the service thread returns from poll() by itself */
+        uint64_t wake_at;
+        struct smb2_waiter *waiters;
+};
+
+/* Called with the mutex held */
+static void
+thread_fail(struct smb2_thread *t)
+{
+        struct smb2_waiter *w;
+
+        t->failed = 1;
+        for (w = t->waiters; w; w = w->next) {
+                pthread_cond_signal(&w->cond);
+        }
+}
+
+static void *
+service_thread(void *arg)
+{
+        struct smb2_context *smb2 = arg;
+        struct smb2_thread *t = smb2->thread;
+        struct pollfd pfd[2];
+        int timeout, rc;
+
+        pthread_mutex_lock(&t->mutex);
+        while (!t->stop && !t->failed) {
+                pfd[0].fd = smb2_get_fd(smb2);
+                pfd[0].events = smb2_which_events(smb2);
+                pfd[0].revents = 0;
+                pfd[1].fd = smb2->submit_fd;
+                pfd[1].events = POLLIN;
+                pfd[1].revents = 0;
+
+                timeout = smb2_get_next_timeout(smb2);
+                if (timeout < 0 || timeout > 1000) {
+                        timeout = 1000;
+                }
+                t->wake_at = smb2_clock_ms() + timeout;
+
+                pthread_mutex_unlock(&t->mutex);
+                rc = poll(pfd, 2, timeout);
+                pthread_mutex_lock(&t->mutex);
+
+                if (rc < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        smb2_set_error(smb2, "Poll failed");
+                        thread_fail(t);
+                        break;
+                }
+                if (pfd[1].revents) {
+                        smb2_submit_service(smb2);
+                }
+                smb2_timeout_pdus(smb2);
+                if (pfd[0].revents == 0) {
+                        continue;
+                }
+                if (smb2_service(smb2, pfd[0].revents) < 0) {
+                        thread_fail(t);
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&t->mutex);
+
+        return NULL;
+}
+
+int
+smb2_start_service_thread(struct smb2_context *smb2)
+{
+        struct smb2_thread *t;
+        pthread_mutexattr_t attr;
+        int rc;
+
+        if (smb2->thread != NULL) {
+                return 0;
+        }
+        if (smb2->reactor != NULL) {
+                smb2_set_error(smb2, "Context is serviced by a reactor");
+                return -EINVAL;
+        }
+        /* the submit fd doubles as the wakeup for the service thread */
+        rc = smb2_enable_submit(smb2);
+        if (rc < 0) {
+                return rc;
+        }
+
+        t = calloc(1, sizeof(struct smb2_thread));
+        if (t == NULL) {
+                smb2_set_error(smb2, "Failed to allocate service thread");
+                return -ENOMEM;
+        }
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&t->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        smb2->thread = t;
+        rc = pthread_create(&t->id, NULL, service_thread, smb2);
+        if (rc != 0) {
+                smb2->thread = NULL;
+                pthread_mutex_destroy(&t->mutex);
+                free(t);
+                smb2_set_error(smb2, "Failed to create service thread, "
+                               "errno:%d", rc);
+                return -rc;
+        }
+        return 0;
+}
+
+void
+smb2_stop_service_thread(struct smb2_context *smb2)
+{
+        struct smb2_thread *t = smb2->thread;
+
+        if (t == NULL) {
+                return;
+        }
+        pthread_mutex_lock(&t->mutex);
+        t->stop = 1;
+        pthread_mutex_unlock(&t->mutex);
+        smb2_submit_wakeup(smb2);
+        pthread_join(t->id, NULL);
+
+        smb2->thread = NULL;
+        pthread_mutex_destroy(&t->mutex);
+        free(t);
+}
+
+void
+smb2_lock_context(struct smb2_context *smb2)
+{
+        if (smb2->thread) {
+                pthread_mutex_lock(&smb2->thread->mutex);
+        }
+}
+
+void
+smb2_unlock_context(struct smb2_context *smb2)
+{
+        if (smb2->thread) {
+                pthread_mutex_unlock(&smb2->thread->mutex);
+        }
+}
+
+int
+smb2_is_service_thread(struct smb2_context *smb2)
+{
+        return smb2->thread &&
+                pthread_equal(pthread_self(), smb2->thread->id);
+}
+
+/* Sends what was queued and wakes the service thread if it has to act */
+static void
+thread_kick(struct smb2_context *smb2)
+{
+        struct smb2_thread *t = smb2->thread;
+        int timeout;
+
+        if (smb2->uring == NULL && SMB2_VALID_SOCKET(smb2->fd) &&
+            smb2_which_events(smb2) & POLLOUT) {
+                if (smb2_service_fd(smb2, smb2->fd, POLLOUT) < 0) {
+                        thread_fail(t);
+                        smb2_submit_wakeup(smb2);
+                        return;
+                }
+        }
+
+        /* it is polling for the wrong fd or events */
+        if (!SMB2_VALID_SOCKET(smb2->fd) || smb2->outqueue != NULL) {
+                smb2_submit_wakeup(smb2);
+                return;
+        }
+        /* or would wake up too late for a new deadline */
+        timeout = smb2_get_next_timeout(smb2);
+        if (timeout >= 0 && smb2_clock_ms() + timeout < t->wake_at) {
+                smb2_submit_wakeup(smb2);
+        }
+}
+
+int
+smb2_thread_wait(struct smb2_context *smb2, struct sync_cb_data *cb_data)
+{
+        struct smb2_thread *t = smb2->thread;
+        struct smb2_waiter w;
+        int rc = 0;
+
+        pthread_mutex_lock(&t->mutex);
+        if (!cb_data->is_finished && !t->failed) {
+                thread_kick(smb2);
+        }
+        if (!cb_data->is_finished && !t->failed) {
+                pthread_cond_init(&w.cond, NULL);
+                w.prev = NULL;
+                w.next = t->waiters;
+                if (w.next) {
+                        w.next->prev = &w;
+                }
+                t->waiters = &w;
+                cb_data->waiter = &w;
+
+                while (!cb_data->is_finished && !t->failed) {
+                        pthread_cond_wait(&w.cond, &t->mutex);
+                }
+
+                cb_data->waiter = NULL;
+                if (w.next) {
+                        w.next->prev = w.prev;
+                }
+                if (w.prev) {
+                        w.prev->next = w.next;
+                } else {
+                        t->waiters = w.next;
+                }
+                pthread_cond_destroy(&w.cond);
+        }
+        if (!cb_data->is_finished) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                rc = -1;
+        }
+        pthread_mutex_unlock(&t->mutex);
+
+        return rc;
+}
+
+/* Called with the mutex held, from the callback */
+void
+smb2_thread_signal(struct smb2_waiter *waiter)
+{
+        pthread_cond_signal(&waiter->cond);
+}
+
+#else /* no pthreads */
+
+int
+smb2_start_service_thread(struct smb2_context *smb2)
+{
+        smb2_set_error(smb2, "Service threads are not supported "
+                       "on this platform");
+        return -ENOTSUP;
+}
+
+void
+smb2_stop_service_thread(struct smb2_context *smb2)
+{
+}
+
+void
+smb2_lock_context(struct smb2_context *smb2)
+{
+}
+
+void
+smb2_unlock_context(struct smb2_context *smb2)
+{
+}
+
+int
+smb2_is_service_thread(struct smb2_context *smb2)
+{
+        return 0;
+}
+
+int
+smb2_thread_wait(struct smb2_context *smb2, struct sync_cb_data *cb_data)
+{
+        return -1;
+}
+
+void
+smb2_thread_signal(struct smb2_waiter *waiter)
+{
+}
+
+#endif
@@ -68,3 +68,41 @@ smb2_win_to_timeval(uint64_t smb2_time, struct smb2_timeval *tv)
         tv->tv_usec = (smb2_time / 10) % 1000000;
         tv->tv_sec  = (smb2_time - 116444736000000000) / 10000000;
 }
+
+uint64_t
+smb2_clock_ms(void)
+{
+#if defined(_WIN32)
+        return GetTickCount64();
+#elif defined(_XBOX)
+        return GetTickCount();
+#elif defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+        return (uint64_t)time(NULL) * 1000;
+#endif
+}
+
+uint64_t
+smb2_clock_ns(void)
+{
+#if defined(_WIN32)
+        LARGE_INTEGER count, freq;
+
+        QueryPerformanceCounter(&count);
+        QueryPerformanceFrequency(&freq);
+        return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+                (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 /
+                freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC) && !defined(_XBOX)
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+        return smb2_clock_ms() * 1000000;
+#endif
+}
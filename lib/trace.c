@@ -0,0 +1,252 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * PDU tracing.
+ *
+ * The trace events are recorded in the PDU itself, so that the Chrome
+ * trace exporter can write out all the phases of a PDU in one go once
+ * it is freed, whichever of the events it got to.
+ */
+
+struct smb2_chrome_trace {
+        FILE *fp;
+        int num_events;
+};
+
+static const char *command_names[] = {
+        "NEGOTIATE",
+        "SESSION_SETUP",
+        "LOGOFF",
+        "TREE_CONNECT",
+        "TREE_DISCONNECT",
+        "CREATE",
+        "CLOSE",
+        "FLUSH",
+        "READ",
+        "WRITE",
+        "LOCK",
+        "IOCTL",
+        "CANCEL",
+        "ECHO",
+        "QUERY_DIRECTORY",
+        "CHANGE_NOTIFY",
+        "QUERY_INFO",
+        "SET_INFO",
+        "OPLOCK_BREAK",
+};
+
+/* The phases of a PDU are the time between two of its events */
+static const struct {
+        const char *name;
+        enum smb2_trace_event from;
+        enum smb2_trace_event to;
+} phases[] = {
+        { "build",    SMB2_TRACE_ALLOCATE,   SMB2_TRACE_ENQUEUE },
+        { "queued",   SMB2_TRACE_ENQUEUE,    SMB2_TRACE_SEND_START },
+        { "send",     SMB2_TRACE_SEND_START, SMB2_TRACE_SENT },
+        { "wait",     SMB2_TRACE_SENT,       SMB2_TRACE_HEADER },
+        { "receive",  SMB2_TRACE_HEADER,     SMB2_TRACE_PAYLOAD },
+        { "callback", SMB2_TRACE_PAYLOAD,    SMB2_TRACE_CALLBACK },
+};
+
+static void
+update_tracing(struct smb2_context *smb2)
+{
+        smb2->tracing = smb2->trace_cb != NULL || smb2->chrome_trace != NULL;
+}
+
+void
+smb2_trace_event(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                 enum smb2_trace_event event)
+{
+        struct smb2_trace_record rec;
+
+        pdu->trace_ts[event] = smb2_clock_ns();
+        if (smb2->trace_cb == NULL) {
+                return;
+        }
+
+        rec.event = event;
+        rec.time_ns = pdu->trace_ts[event];
+        rec.message_id = pdu->header.message_id;
+        rec.command = pdu->header.command;
+        rec.status = event == SMB2_TRACE_HEADER ||
+                event == SMB2_TRACE_PAYLOAD ?
+                smb2->hdr.status : pdu->header.status;
+        rec.pdu = pdu;
+        smb2->trace_cb(smb2, &rec, smb2->trace_data);
+}
+
+void
+smb2_set_trace_cb(struct smb2_context *smb2, smb2_trace_cb cb,
+                  void *private_data)
+{
+        smb2_lock_context(smb2);
+        smb2->trace_cb = cb;
+        smb2->trace_data = private_data;
+        update_tracing(smb2);
+        smb2_unlock_context(smb2);
+}
+
+static void
+write_event(struct smb2_chrome_trace *ct, const char *cat, const char *name,
+            char ph, uint64_t message_id, uint64_t ns)
+{
+        fprintf(ct->fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+                "\"pid\":1,\"tid\":1,\"id2\":{\"local\":\"0x%" PRIx64 "\"},"
+                "\"ts\":%" PRIu64 ".%03d}",
+                ct->num_events++ ? ",\n" : "", name, cat, ph, message_id,
+                ns / 1000, (int)(ns % 1000));
+}
+
+void
+smb2_trace_pdu_done(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_chrome_trace *ct = smb2->chrome_trace;
+        const uint64_t *ts = pdu->trace_ts;
+        uint64_t id = pdu->header.message_id;
+        uint64_t start, end = 0;
+        const char *cat = "smb2", *name;
+        int i;
+
+        if (ct == NULL) {
+                return;
+        }
+        /* a request a server received starts with its header, and
+         * shares its message id with the reply
+         */
+        if (ts[SMB2_TRACE_ENQUEUE]) {
+                start = ts[SMB2_TRACE_ALLOCATE] ? ts[SMB2_TRACE_ALLOCATE] :
+                        ts[SMB2_TRACE_ENQUEUE];
+                if (smb2_is_server(smb2)) {
+                        cat = "smb2.reply";
+                }
+        } else if (ts[SMB2_TRACE_HEADER]) {
+                start = ts[SMB2_TRACE_HEADER];
+                cat = "smb2.request";
+        } else {
+                return;
+        }
+        for (i = SMB2_TRACE_ALLOCATE; i < SMB2_TRACE_NUM_EVENTS; i++) {
+                if (ts[i] > end) {
+                        end = ts[i];
+                }
+        }
+
+        name = pdu->header.command <
+                sizeof(command_names) / sizeof(command_names[0]) ?
+                command_names[pdu->header.command] : "UNKNOWN";
+        write_event(ct, cat, name, 'b', id, start);
+        for (i = 0; i < (int)(sizeof(phases) / sizeof(phases[0])); i++) {
+                if (ts[phases[i].from] == 0 || ts[phases[i].to] == 0 ||
+                    ts[phases[i].from] < start) {
+                        continue;
+                }
+                write_event(ct, cat, phases[i].name, 'b', id,
+                            ts[phases[i].from]);
+                write_event(ct, cat, phases[i].name, 'e', id,
+                            ts[phases[i].to]);
+        }
+        write_event(ct, cat, name, 'e', id, end);
+}
+
+int
+smb2_start_chrome_trace(struct smb2_context *smb2, const char *path)
+{
+        struct smb2_chrome_trace *ct;
+
+        if (smb2->chrome_trace != NULL) {
+                smb2_set_error(smb2, "A Chrome trace is already running");
+                return -EINVAL;
+        }
+        ct = calloc(1, sizeof(struct smb2_chrome_trace));
+        if (ct == NULL) {
+                smb2_set_error(smb2, "Failed to allocate Chrome trace");
+                return -ENOMEM;
+        }
+        ct->fp = fopen(path, "w");
+        if (ct->fp == NULL) {
+                int err = errno;
+
+                smb2_set_error(smb2, "Failed to open %s, errno:%d",
+                               path, err);
+                free(ct);
+                return -err;
+        }
+        fprintf(ct->fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"args\":{\"name\":\"libsmb2 %s\"}}",
+                smb2_is_server(smb2) ? "server" : "client");
+        ct->num_events = 1;
+
+        smb2_lock_context(smb2);
+        smb2->chrome_trace = ct;
+        update_tracing(smb2);
+        smb2_unlock_context(smb2);
+
+        return 0;
+}
+
+void
+smb2_stop_chrome_trace(struct smb2_context *smb2)
+{
+        struct smb2_chrome_trace *ct;
+
+        smb2_lock_context(smb2);
+        ct = smb2->chrome_trace;
+        smb2->chrome_trace = NULL;
+        update_tracing(smb2);
+        smb2_unlock_context(smb2);
+
+        if (ct == NULL) {
+                return;
+        }
+        fprintf(ct->fp, "\n]}\n");
+        fclose(ct->fp);
+        free(ct);
+}
@@ -23,6 +23,10 @@
 #define _GNU_SOURCE
 #endif
 
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
@@ -55,6 +59,26 @@
 #include <libsmb2.h>
 #include "libsmb2-private.h"
 
+/* Vector fast paths for runs of 7-bit ASCII, which is what nearly all
+ * names on the wire are made of. Both directions are a plain widen or
+ * narrow of each byte so they are only used on little endian hosts.
+ * AVX2 is only used when the library is built for it, e.g. with
+ * -march=native. Everything else goes through the scalar code.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SMB2_UTF_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SMB2_UTF_SSE2
+#elif defined(__ARM_NEON) && (defined(_M_ARM64) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
+#include <arm_neon.h>
+#define SMB2_UTF_NEON
+#endif
+
 /* Count number of leading 1 bits in the char */
 static int
 l1(char c)
@@ -141,62 +165,224 @@ validate_utf8_cp(const char **utf8, uint16_t *ret)
         return -1;
 }
 
-/* Validate that the given string is properly formatted UTF8.
- * Returns >=0 if valid UTF8 and -1 if not.
+/* Widens the leading run of ASCII bytes in utf8 into UTF-16LE.
+ * Works in whole blocks and stops at the first block that holds a byte
+ * with the high bit set, leaving the rest to the caller.
+ * Returns the number of bytes converted.
  */
-static int
-validate_utf8_str(const char *utf8)
+static size_t
+ascii_to_utf16(const uint8_t *utf8, size_t len, uint16_t *utf16)
 {
-        const char *u = utf8;
-        int i = 0;
-        int cp_length;
-        uint16_t cp[2];
+        size_t i = 0;
 
-        while (*u) {
-                cp_length = validate_utf8_cp(&u, cp);
-                if (cp_length < 0) {
-                        return -1;
+#ifdef SMB2_UTF_AVX2
+        while (i + 32 <= len) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(utf8 + i));
+
+                if (_mm256_movemask_epi8(v)) {
+                        break;
+                }
+                _mm256_storeu_si256((__m256i *)(utf16 + i),
+                        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+                _mm256_storeu_si256((__m256i *)(utf16 + i + 16),
+                        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+                i += 32;
+        }
+#endif
+#if defined(SMB2_UTF_SSE2)
+        while (i + 16 <= len) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(utf8 + i));
+                __m128i z = _mm_setzero_si128();
+
+                if (_mm_movemask_epi8(v)) {
+                        break;
+                }
+                _mm_storeu_si128((__m128i *)(utf16 + i),
+                                 _mm_unpacklo_epi8(v, z));
+                _mm_storeu_si128((__m128i *)(utf16 + i + 8),
+                                 _mm_unpackhi_epi8(v, z));
+                i += 16;
+        }
+#elif defined(SMB2_UTF_NEON)
+        while (i + 16 <= len) {
+                uint8x16_t v = vld1q_u8(utf8 + i);
+                uint64x2_t h = vreinterpretq_u64_u8(
+                        vandq_u8(v, vdupq_n_u8(0x80)));
+
+                if (vgetq_lane_u64(h, 0) | vgetq_lane_u64(h, 1)) {
+                        break;
+                }
+                vst1q_u16(utf16 + i, vmovl_u8(vget_low_u8(v)));
+                vst1q_u16(utf16 + i + 8, vmovl_u8(vget_high_u8(v)));
+                i += 16;
+        }
+#endif
+        while (i + 8 <= len) {
+                uint64_t w;
+                int j;
+
+                memcpy(&w, utf8 + i, 8);
+                if (w & 0x8080808080808080ULL) {
+                        break;
+                }
+                for (j = 0; j < 8; j++) {
+                        utf16[i + j] = htole16(utf8[i + j]);
+                }
+                i += 8;
+        }
+        return i;
+}
+
+/* Narrows the leading run of UTF-16LE code units below 0x80 into bytes.
+ * Works in whole blocks like ascii_to_utf16().
+ * Returns the number of code units converted.
+ */
+static size_t
+utf16_to_ascii(const uint16_t *utf16, size_t len, char *utf8)
+{
+        size_t i = 0;
+
+#ifdef SMB2_UTF_AVX2
+        while (i + 32 <= len) {
+                __m256i a = _mm256_loadu_si256((const __m256i *)(utf16 + i));
+                __m256i b = _mm256_loadu_si256((const __m256i *)(utf16 + i + 16));
+                __m256i hi = _mm256_and_si256(_mm256_or_si256(a, b),
+                                              _mm256_set1_epi16((short)0xff80));
+
+                if (!_mm256_testz_si256(hi, hi)) {
+                        break;
+                }
+                _mm256_storeu_si256((__m256i *)(utf8 + i),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b),
+                                                 0xd8));
+                i += 32;
+        }
+#endif
+#if defined(SMB2_UTF_SSE2)
+        while (i + 8 <= len) {
+                __m128i a = _mm_loadu_si128((const __m128i *)(utf16 + i));
+                __m128i m = _mm_set1_epi16((short)0xff80);
+                __m128i z = _mm_setzero_si128();
+
+                if (i + 16 <= len) {
+                        __m128i b = _mm_loadu_si128((const __m128i *)(utf16 + i + 8));
+
+                        if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+                                _mm_and_si128(_mm_or_si128(a, b), m), z)) == 0xffff) {
+                                _mm_storeu_si128((__m128i *)(utf8 + i),
+                                                 _mm_packus_epi16(a, b));
+                                i += 16;
+                                continue;
+                        }
+                }
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+                        _mm_and_si128(a, m), z)) != 0xffff) {
+                        break;
+                }
+                _mm_storel_epi64((__m128i *)(utf8 + i), _mm_packus_epi16(a, a));
+                i += 8;
+        }
+#elif defined(SMB2_UTF_NEON)
+        while (i + 8 <= len) {
+                uint16x8_t a = vld1q_u16(utf16 + i);
+                uint64x2_t h = vreinterpretq_u64_u16(
+                        vandq_u16(a, vdupq_n_u16(0xff80)));
+
+                if (vgetq_lane_u64(h, 0) | vgetq_lane_u64(h, 1)) {
+                        break;
                 }
-                i += cp_length;
+                vst1_u8((uint8_t *)utf8 + i, vmovn_u16(a));
+                i += 8;
+        }
+#endif
+        while (i + 4 <= len) {
+                if (le16toh(utf16[i] | utf16[i + 1] |
+                            utf16[i + 2] | utf16[i + 3]) >= 0x80) {
+                        break;
+                }
+                utf8[i]     = (char)le16toh(utf16[i]);
+                utf8[i + 1] = (char)le16toh(utf16[i + 1]);
+                utf8[i + 2] = (char)le16toh(utf16[i + 2]);
+                utf8[i + 3] = (char)le16toh(utf16[i + 3]);
+                i += 4;
         }
         return i;
 }
 
+/*
+ * Convert a UTF8 string into UTF-16LE in a single pass.
+ * At most size code units are written to utf16.
+ * Returns the number of code units needed for the whole string, or
+ * -EINVAL if utf8 is not valid UTF8.
+ */
+int
+smb2_utf8_to_utf16_buf(const char *utf8, uint16_t *utf16, size_t size)
+{
+        const char *end = utf8 + strlen(utf8);
+        uint16_t cp[2];
+        size_t n = 0;
+        int l;
+
+        while (utf8 < end) {
+                if (!(*utf8 & 0x80)) {
+                        size_t run = n < size ? size - n : 0;
+
+                        if (run > (size_t)(end - utf8)) {
+                                run = end - utf8;
+                        }
+                        run = ascii_to_utf16((const uint8_t *)utf8, run,
+                                             utf16 + n);
+                        utf8 += run;
+                        n += run;
+                        if (utf8 == end) {
+                                break;
+                        }
+                }
+                if (!(*utf8 & 0x80)) {
+                        if (n < size) {
+                                utf16[n] = htole16(*utf8);
+                        }
+                        utf8++;
+                        n++;
+                        continue;
+                }
+                l = validate_utf8_cp(&utf8, cp);
+                if (l < 0) {
+                        return -EINVAL;
+                }
+                if (n + l <= size) {
+                        utf16[n] = htole16(cp[0]);
+                        if (l == 2) {
+                                utf16[n + 1] = htole16(cp[1]);
+                        }
+                }
+                n += l;
+        }
+
+        return (int)n;
+}
+
 /* Convert a UTF8 string into UTF-16LE */
 struct smb2_utf16 *
 smb2_utf8_to_utf16(const char *utf8)
 {
         struct smb2_utf16 *utf16;
-        int i, len;
-
-        len = validate_utf8_str(utf8);
-        if (len < 0) {
-                return NULL;
-        }
+        size_t len;
+        int n;
 
+        /* Every byte of UTF8 turns into at most one UTF-16 code unit */
+        len = strlen(utf8);
         utf16 = (struct smb2_utf16 *)(malloc(offsetof(struct smb2_utf16, val) + 2 * len));
         if (utf16 == NULL) {
                 return NULL;
         }
 
-        utf16->len = len;
-        i = 0;
-        while (i < len) {
-                switch(validate_utf8_cp(&utf8, &utf16->val[i])) {
-                case 1:
-                    utf16->val[i] = htole16(utf16->val[i]);
-                    i += 1;
-                    break;
-                case 2:
-                    utf16->val[i] = htole16(utf16->val[i]);
-                    utf16->val[i+1] = htole16(utf16->val[i+1]);
-                    i += 2;
-                    break;
-                default:
-                    /* Won't happen since we wouldn't have gotten here if the UTF-8 string was invalid */
-                    break;
-                }
+        n = smb2_utf8_to_utf16_buf(utf8, utf16->val, len);
+        if (n < 0) {
+                free(utf16);
+                return NULL;
         }
+        utf16->len = n;
 
         return utf16;
 }
@@ -223,12 +409,7 @@ utf16_size(const uint16_t *utf16, size_t utf16_len)
 
                         trail = le16toh(*utf16);
                         if (trail - 0xdc00 < 0x400) { /* Check that 0xdc00 <= trail < 0xe000 */
-                                code = 0x10000 + ((code & 0x3ff) << 10) + (trail & 0x3ff);
-                                if (code < 0x10000) {
-                                        length += 3; /* Two UTF-16 code units map to three UTF-8 code units */
-                                } else {
-                                        length += 4; /* Two UTF-16 code units map to four UTF-8 code units */
-                                }
+                                length += 4; /* Two UTF-16 code units map to four UTF-8 code units */
                                 utf16++;
                         } else { /* Invalid trailing code unit. It's still valid on its own though so only the first unit gets replaced */
                                 length += 3; /* Replacement char */
@@ -241,66 +422,130 @@ utf16_size(const uint16_t *utf16, size_t utf16_len)
         return length;
 }
 
+/* Converts the code point at *utf16 into up to four bytes of UTF8,
+ * advancing *utf16 past it. Returns the number of bytes written.
+ */
+static int
+utf16_cp_to_utf8(const uint16_t **utf16, const uint16_t *utf16_end,
+                 char *utf8)
+{
+        char *tmp = utf8;
+        uint32_t code = le16toh(*(*utf16)++);
+
+        if (code < 0x80) {
+                *tmp++ = code; /* One UTF-16 code unit maps to one UTF-8 code unit */
+        } else if (code < 0x800) {
+                *tmp++ = 0xc0 |  (code >> 6);         /* One UTF-16 code unit maps to two UTF-8 code units */
+                *tmp++ = 0x80 | ((code     ) & 0x3f);
+        } else if (code < 0xD800 || code - 0xe000 < 0x2000) {
+                *tmp++ = 0xe0 |  (code >> 12);         /* All other values where we only have one UTF-16 code unit map to 3 UTF-8 code units */
+                *tmp++ = 0x80 | ((code >>  6) & 0x3f);
+                *tmp++ = 0x80 | ((code      ) & 0x3f);
+        } else if (code < 0xdc00) { /* Surrogate pair */
+                uint32_t trail;
+                if (*utf16 == utf16_end) { /* It's possible the stream ends with a leading code unit, which is an error */
+                        *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
+                        return 3;
+                }
+
+                trail = le16toh(**utf16);
+                if (trail - 0xdc00 < 0x400) { /* Check that 0xdc00 <= trail < 0xe000 */
+                        code = 0x10000 + ((code & 0x3ff) << 10) + (trail & 0x3ff);
+                        *tmp++ = 0xF0 | (code >> 18);
+                        *tmp++ = 0x80 | ((code >> 12) & 0x3F);
+                        *tmp++ = 0x80 | ((code >> 6) & 0x3F);
+                        *tmp++ = 0x80 | (code & 0x3F);
+                        (*utf16)++;
+                } else {
+                        /* Invalid trailing code unit. It's still valid on its own though so only the first unit gets replaced */
+                        *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
+                }
+        } else {
+                /* 0xdc00 <= code < 0xe00, which makes code a trailing code unit without a leading one, which is invalid */
+                *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
+        }
+
+        return (int)(tmp - utf8);
+}
+
+/*
+ * Convert a UTF-16LE string into UTF8 in a single pass.
+ * Invalid surrogates are replaced with U+FFFD.
+ * Returns the length of the UTF8 string, not counting the terminating
+ * nul. If this is less than size the whole string, including the nul,
+ * has been written to utf8.
+ */
+int
+smb2_utf16_to_utf8_buf(const uint16_t *utf16, size_t utf16_len,
+                       char *utf8, size_t size)
+{
+        const uint16_t *utf16_end = utf16 + utf16_len;
+        char *tmp = utf8;
+        char *end = utf8 + size;
+        char cp[4];
+        size_t run;
+        int l;
+
+        while (utf16 < utf16_end) {
+                if (le16toh(*utf16) < 0x80) {
+                        /* ASCII is one byte per code unit */
+                        run = utf16_end - utf16;
+                        if (run > (size_t)(end - tmp)) {
+                                run = end - tmp;
+                        }
+                        run = utf16_to_ascii(utf16, run, tmp);
+                        utf16 += run;
+                        tmp += run;
+                        if (utf16 == utf16_end) {
+                                break;
+                        }
+                }
+
+                if (end - tmp >= 4) {
+                        tmp += utf16_cp_to_utf8(&utf16, utf16_end, tmp);
+                        continue;
+                }
+                /* Near the end of the buffer, only copy the code point
+                 * if all of it fits and otherwise just count the rest.
+                 */
+                l = utf16_cp_to_utf8(&utf16, utf16_end, cp);
+                if (l > end - tmp) {
+                        return (int)(tmp - utf8) + l +
+                                utf16_size(utf16, utf16_end - utf16);
+                }
+                memcpy(tmp, cp, l);
+                tmp += l;
+        }
+
+        if (tmp < end) {
+                *tmp = 0;
+        }
+        return (int)(tmp - utf8);
+}
+
 /*
  * Convert a UTF-16LE string into UTF8
  */
 const char *
 smb2_utf16_to_utf8(const uint16_t *utf16, size_t utf16_len)
 {
-        int utf8_len = 1;
-        char *str, *tmp;
-        const uint16_t *utf16_end;
-        
-        /* How many bytes do we need for utf8 ? */
-        utf8_len += utf16_size(utf16, utf16_len);
-        str = tmp = (char*)malloc(utf8_len);
+        char buf[1024];
+        char *str;
+        int len;
+
+        /* Names are short so convert them on the stack and copy out
+         * exactly what is needed. Only longer strings are converted
+         * a second time.
+         */
+        len = smb2_utf16_to_utf8_buf(utf16, utf16_len, buf, sizeof(buf));
+        str = (char*)malloc(len + 1);
         if (str == NULL) {
                 return NULL;
         }
-        str[utf8_len - 1] = 0;
-
-        utf16_end = utf16 + utf16_len;
-        while (utf16 < utf16_end) {
-                uint32_t code = le16toh(*utf16++);
-
-                if (code < 0x80) {
-                        *tmp++ = code; /* One UTF-16 code unit maps to one UTF-8 code unit */
-                } else if (code < 0x800) {
-                        *tmp++ = 0xc0 |  (code >> 6);         /* One UTF-16 code unit maps to two UTF-8 code units */
-                        *tmp++ = 0x80 | ((code     ) & 0x3f);
-                } else if (code < 0xD800 || code - 0xe000 < 0x2000) {
-                        *tmp++ = 0xe0 |  (code >> 12);         /* All other values where we only have one UTF-16 code unit map to 3 UTF-8 code units */
-                        *tmp++ = 0x80 | ((code >>  6) & 0x3f);
-                        *tmp++ = 0x80 | ((code      ) & 0x3f);
-                } else if (code < 0xdc00) { /* Surrogate pair */
-                        uint32_t trail;
-                        if (utf16 == utf16_end) { /* It's possible the stream ends with a leading code unit, which is an error */
-                                *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
-                                return str;
-                        }
-
-                        trail = le16toh(*utf16);
-                        if (trail - 0xdc00 < 0x400) { /* Check that 0xdc00 <= trail < 0xe000 */
-                                code = 0x10000 + ((code & 0x3ff) << 10) + (trail & 0x3ff);
-                                if (code < 0x10000) {
-                                        *tmp++ = 0xe0 |  (code >> 12);
-                                        *tmp++ = 0x80 | ((code >>  6) & 0x3f);
-                                        *tmp++ = 0x80 | ((code      ) & 0x3f);
-                                } else {
-                                        *tmp++ = 0xF0 | (code >> 18);
-                                        *tmp++ = 0x80 | ((code >> 12) & 0x3F);
-                                        *tmp++ = 0x80 | ((code >> 6) & 0x3F);
-                                        *tmp++ = 0x80 | (code & 0x3F);
-                                }
-                                utf16++;
-                        } else {
-                                /* Invalid trailing code unit. It's still valid on its own though so only the first unit gets replaced */
-                                *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
-                        }
-                } else {
-                        /* 0xdc00 <= code < 0xe00, which makes code a trailing code unit without a leading one, which is invalid */
-                        *tmp++ = 0xef; *tmp++ = 0xbf; *tmp++ = 0xbd; /* Replacement char */
-                }
+        if (len < (int)sizeof(buf)) {
+                memcpy(str, buf, len + 1);
+        } else {
+                smb2_utf16_to_utf8_buf(utf16, utf16_len, str, len + 1);
         }
 
         return str;
@@ -0,0 +1,851 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * io_uring transport.
+ *
+ * Once the socket is connected a ring is set up for it and the ring fd is
+ * what smb2_get_fd() hands to the application. The ring fd polls readable
+ * when there are completions and writable when there is room to submit,
+ * so existing event loops keep working unchanged.
+ *
+ * Receiving uses a single multishot recv that picks buffers from a
+ * provided buffer ring. The received buffers are fed through the normal
+ * receive state machine in order and given back to the ring once parsed.
+ *
+ * Sending submits every PDU in the outqueue that fits in the credits as
+ * one chain of linked SENDMSGs with MSG_WAITALL, which the kernel sends in
+ * order. The next chain is only submitted once the previous one has
+ * completed. A short send breaks the chain, whatever was not sent is
+ * submitted again from where it stopped.
+ *
+ * The provided buffer ring needs Linux 5.19 and multishot recv 6.0; on
+ * older kernels we fall back to one recv at a time, or to the socket.
+ */
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define URING_ENTRIES           64
+#define URING_CQ_ENTRIES        256
+#define URING_NUM_BUFS          64
+#define URING_BUF_SIZE          (64 * 1024)
+#define URING_BGID              0
+
+#ifndef IORING_RECV_MULTISHOT
+#define IORING_RECV_MULTISHOT   (1U << 1)
+#endif
+
+/* user_data of the requests that are not sends */
+#define URING_RECV              0
+#define URING_CANCEL            1
+
+struct uring_send {
+        struct uring_send *next;
+        struct smb2_pdu *pdu;
+        int credit_charge;
+        size_t len;
+        uint32_t spl;
+        struct msghdr msg;
+        struct iovec iov[SMB2_MAX_VECTORS];
+};
+
+/* A received buffer that has not been parsed yet */
+struct uring_rx {
+        uint16_t bid;
+        uint32_t len;
+        uint32_t pos;
+};
+
+struct smb2_uring {
+        int fd;
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_flags;
+        unsigned *sq_array;
+        unsigned sq_entries;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+        unsigned to_submit;
+
+        /* provided buffers */
+        struct io_uring_buf_ring *br;
+        size_t br_size;
+        uint16_t br_tail;
+        uint8_t *bufs;
+
+        /* received buffers in the order they arrived */
+        struct uring_rx rx[URING_NUM_BUFS];
+        unsigned rx_head;
+        unsigned rx_count;
+
+        int multishot;
+        int recv_armed;
+        /* sends of the current chain, in order */
+        struct uring_send *sends;
+        int credits_in_flight;
+        /* requests that will still complete, the cancel not included */
+        int num_ops;
+        int error;
+};
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+            unsigned flags)
+{
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit,
+                            min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg,
+                            nr_args);
+}
+
+static void
+uring_free(struct smb2_uring *ur)
+{
+        if (ur->br != NULL) {
+                munmap(ur->br, ur->br_size);
+        }
+        free(ur->bufs);
+        if (ur->sqes != NULL) {
+                munmap(ur->sqes, ur->sqes_size);
+        }
+        if (ur->cq_ring != NULL && ur->cq_ring != ur->sq_ring) {
+                munmap(ur->cq_ring, ur->cq_ring_size);
+        }
+        if (ur->sq_ring != NULL) {
+                munmap(ur->sq_ring, ur->sq_ring_size);
+        }
+        if (ur->fd >= 0) {
+                close(ur->fd);
+        }
+        free(ur);
+}
+
+/* Hands a buffer back to the kernel once all of it has been parsed */
+static void
+uring_put_buf(struct smb2_uring *ur, uint16_t bid)
+{
+        struct io_uring_buf *buf;
+
+        buf = &ur->br->bufs[ur->br_tail & (URING_NUM_BUFS - 1)];
+        buf->addr = (uint64_t)(uintptr_t)(ur->bufs +
+                                          (size_t)bid * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE;
+        buf->bid = bid;
+        ur->br_tail++;
+        __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static struct smb2_uring *
+uring_create(void)
+{
+        struct io_uring_params p;
+        struct io_uring_buf_reg reg;
+        struct smb2_uring *ur;
+        uint8_t *sq, *cq;
+        int i;
+
+        ur = calloc(1, sizeof(struct smb2_uring));
+        if (ur == NULL) {
+                return NULL;
+        }
+
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        ur->fd = uring_setup(URING_ENTRIES, &p);
+        if (ur->fd < 0 || !(p.features & IORING_FEAT_NODROP)) {
+                goto fail;
+        }
+
+        ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ur->cq_ring_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ur->cq_ring_size > ur->sq_ring_size) {
+                        ur->sq_ring_size = ur->cq_ring_size;
+                }
+                ur->cq_ring_size = ur->sq_ring_size;
+        }
+        ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ur->fd,
+                           IORING_OFF_SQ_RING);
+        if (ur->sq_ring == MAP_FAILED) {
+                ur->sq_ring = NULL;
+                goto fail;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ur->cq_ring = ur->sq_ring;
+        } else {
+                ur->cq_ring = mmap(NULL, ur->cq_ring_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, ur->fd,
+                                   IORING_OFF_CQ_RING);
+                if (ur->cq_ring == MAP_FAILED) {
+                        ur->cq_ring = NULL;
+                        goto fail;
+                }
+        }
+        ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ur->fd,
+                        IORING_OFF_SQES);
+        if (ur->sqes == MAP_FAILED) {
+                ur->sqes = NULL;
+                goto fail;
+        }
+
+        sq = ur->sq_ring;
+        ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+        ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        ur->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+        ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+        ur->sq_entries = p.sq_entries;
+        cq = ur->cq_ring;
+        ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+        ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        ur->br_size = URING_NUM_BUFS * sizeof(struct io_uring_buf);
+        ur->br = mmap(NULL, ur->br_size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ur->br == MAP_FAILED) {
+                ur->br = NULL;
+                goto fail;
+        }
+        ur->bufs = malloc((size_t)URING_NUM_BUFS * URING_BUF_SIZE);
+        if (ur->bufs == NULL) {
+                goto fail;
+        }
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)ur->br;
+        reg.ring_entries = URING_NUM_BUFS;
+        reg.bgid = URING_BGID;
+        if (uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+                goto fail;
+        }
+        for (i = 0; i < URING_NUM_BUFS; i++) {
+                uring_put_buf(ur, (uint16_t)i);
+        }
+        ur->multishot = 1;
+
+        return ur;
+
+ fail:
+        uring_free(ur);
+        return NULL;
+}
+
+static int
+uring_submit(struct smb2_uring *ur)
+{
+        int rc;
+
+        while (ur->to_submit) {
+                rc = uring_enter(ur->fd, ur->to_submit, 0, 0);
+                if (rc < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                }
+                ur->to_submit -= rc;
+        }
+        return 0;
+}
+
+/* The kernel only looks at the submission ring in io_uring_enter() so
+ * the entry can be filled in after it has been added.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(struct smb2_uring *ur)
+{
+        struct io_uring_sqe *sqe;
+        unsigned head, tail, idx;
+
+        tail = *ur->sq_tail;
+        head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ur->sq_entries) {
+                if (uring_submit(ur) < 0) {
+                        return NULL;
+                }
+                head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+                if (tail - head >= ur->sq_entries) {
+                        return NULL;
+                }
+        }
+        idx = tail & *ur->sq_mask;
+        sqe = &ur->sqes[idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        ur->sq_array[idx] = idx;
+        __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ur->to_submit++;
+
+        return sqe;
+}
+
+static int
+uring_arm_recv(struct smb2_context *smb2, struct smb2_uring *ur)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_get_sqe(ur);
+        if (sqe == NULL) {
+                return -ENOMEM;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = smb2->fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        sqe->ioprio = ur->multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = URING_RECV;
+        ur->recv_armed = 1;
+        ur->num_ops++;
+
+        return 0;
+}
+
+static int
+uring_credit_charge(struct smb2_pdu *pdu)
+{
+        int credits = 0;
+
+        while (pdu) {
+                credits += pdu->header.credit_charge;
+                pdu = pdu->next_compound;
+        }
+        return credits;
+}
+
+/* Returns the PDU that the next chain would start with, if any */
+static struct smb2_pdu *
+uring_next_send(struct smb2_context *smb2, struct smb2_uring *ur)
+{
+        struct smb2_pdu *pdu = smb2->outqueue;
+
+        if (pdu == NULL || ur->sends != NULL) {
+                return NULL;
+        }
+        if (smb2->dialect > SMB2_VERSION_0202 &&
+            uring_credit_charge(pdu) > smb2->credits) {
+                return NULL;
+        }
+        return pdu;
+}
+
+static int
+uring_send_pdus(struct smb2_context *smb2, struct smb2_uring *ur)
+{
+        struct io_uring_sqe *sqe, *last = NULL;
+        struct uring_send *s, *tail = NULL;
+        struct smb2_pdu *pdu, *tmp_pdu;
+        size_t num_done;
+        int credits = 0, charge, niov, first;
+
+        pdu = uring_next_send(smb2, ur);
+        for (; pdu; pdu = pdu->next) {
+                charge = uring_credit_charge(pdu);
+                if (smb2->dialect > SMB2_VERSION_0202 &&
+                    credits + charge > smb2->credits) {
+                        break;
+                }
+                s = calloc(1, sizeof(struct uring_send));
+                if (s == NULL) {
+                        break;
+                }
+                sqe = uring_get_sqe(ur);
+                if (sqe == NULL) {
+                        free(s);
+                        break;
+                }
+                s->pdu = pdu;
+                s->credit_charge = charge;
+                niov = smb2_get_pdu_vectors(smb2, pdu, s->iov, &s->spl,
+                                            &s->len);
+
+                /* skip what a short send already got out */
+                num_done = pdu->out.num_done;
+                s->len -= num_done;
+                first = 0;
+                while (num_done >= s->iov[first].iov_len) {
+                        num_done -= s->iov[first].iov_len;
+                        first++;
+                }
+                s->iov[first].iov_base = (char *)s->iov[first].iov_base +
+                        num_done;
+                s->iov[first].iov_len -= num_done;
+                s->msg.msg_iov = &s->iov[first];
+                s->msg.msg_iovlen = niov - first;
+
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = smb2->fd;
+                sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = (uint64_t)(uintptr_t)s;
+                last = sqe;
+
+                if (pdu->out.num_done == 0) {
+                        for (tmp_pdu = pdu; tmp_pdu;
+                             tmp_pdu = tmp_pdu->next_compound) {
+                                SMB2_TRACE(smb2, tmp_pdu,
+                                           SMB2_TRACE_SEND_START);
+                        }
+                }
+                pdu->in_flight = 1;
+                credits += charge;
+                ur->num_ops++;
+                if (tail == NULL) {
+                        ur->sends = s;
+                } else {
+                        tail->next = s;
+                }
+                tail = s;
+        }
+        if (last != NULL) {
+                /* the chain ends here */
+                last->flags &= ~IOSQE_IO_LINK;
+        }
+        ur->credits_in_flight = credits;
+
+        return 0;
+}
+
+static void
+uring_send_done(struct smb2_context *smb2, struct smb2_uring *ur,
+                struct uring_send *s, int res, int stopping)
+{
+        struct smb2_pdu *pdu = s->pdu;
+
+        SMB2_LIST_REMOVE(&ur->sends, s);
+        ur->credits_in_flight -= s->credit_charge;
+        ur->num_ops--;
+        pdu->in_flight = 0;
+
+        if (res > 0) {
+                pdu->out.num_done += (size_t)res;
+        }
+        if (!stopping && res == (int)s->len) {
+                smb2_pdu_sent(smb2, pdu);
+        } else if (res < 0 && res != -ECANCELED && res != -EINTR &&
+                   res != -EAGAIN && ur->error == 0) {
+                ur->error = res;
+        }
+        free(s);
+}
+
+static void
+uring_recv_done(struct smb2_context *smb2, struct smb2_uring *ur,
+                struct io_uring_cqe *cqe, int stopping)
+{
+        unsigned idx;
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                ur->recv_armed = 0;
+                ur->num_ops--;
+        }
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+                if (stopping || cqe->res <= 0) {
+                        uring_put_buf(ur, bid);
+                } else {
+                        idx = (ur->rx_head + ur->rx_count) %
+                                URING_NUM_BUFS;
+                        ur->rx[idx].bid = bid;
+                        ur->rx[idx].len = (uint32_t)cqe->res;
+                        ur->rx[idx].pos = 0;
+                        ur->rx_count++;
+                }
+        }
+        if (stopping || cqe->res > 0) {
+                return;
+        }
+
+        switch (cqe->res) {
+        case -ENOBUFS:
+                /* re-armed once we have parsed some of what we have */
+        case -ECANCELED:
+        case -EINTR:
+                break;
+        case -EINVAL:
+                if (ur->multishot) {
+                        /* older kernel, one recv at a time */
+                        ur->multishot = 0;
+                        break;
+                }
+                /* fall through */
+        default:
+                if (ur->error == 0) {
+                        ur->error = cqe->res ? cqe->res : -ECONNRESET;
+                }
+        }
+}
+
+/* Processes all completions that are ready */
+static void
+uring_reap(struct smb2_context *smb2, struct smb2_uring *ur, int stopping)
+{
+        struct io_uring_cqe *cqe;
+        unsigned head, tail;
+
+        if (__atomic_load_n(ur->sq_flags, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW) {
+                /* get the completions that did not fit back in the ring */
+                uring_enter(ur->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        }
+
+        head = *ur->cq_head;
+        tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+                cqe = &ur->cqes[head & *ur->cq_mask];
+                if (cqe->user_data == URING_RECV) {
+                        uring_recv_done(smb2, ur, cqe, stopping);
+                } else if (cqe->user_data != URING_CANCEL) {
+                        uring_send_done(smb2, ur,
+                                        (struct uring_send *)(uintptr_t)
+                                        cqe->user_data, cqe->res, stopping);
+                }
+                head++;
+                if (head == tail) {
+                        __atomic_store_n(ur->cq_head, head,
+                                         __ATOMIC_RELEASE);
+                        tail = __atomic_load_n(ur->cq_tail,
+                                               __ATOMIC_ACQUIRE);
+                }
+        }
+}
+
+ssize_t
+smb2_uring_readv(struct smb2_context *smb2,
+                 const struct iovec *iov, int iovcnt)
+{
+        struct smb2_uring *ur = smb2->uring;
+        struct uring_rx *rx;
+        ssize_t count = 0;
+        size_t off, len;
+        int i;
+
+        for (i = 0; i < iovcnt && ur->rx_count; i++) {
+                off = 0;
+                while (off < iov[i].iov_len && ur->rx_count) {
+                        rx = &ur->rx[ur->rx_head];
+                        len = rx->len - rx->pos;
+                        if (len > iov[i].iov_len - off) {
+                                len = iov[i].iov_len - off;
+                        }
+                        memcpy((uint8_t *)iov[i].iov_base + off,
+                               ur->bufs + (size_t)rx->bid * URING_BUF_SIZE +
+                               rx->pos, len);
+                        rx->pos += (uint32_t)len;
+                        off += len;
+                        if (rx->pos == rx->len) {
+                                uring_put_buf(ur, rx->bid);
+                                ur->rx_head = (ur->rx_head + 1) %
+                                        URING_NUM_BUFS;
+                                ur->rx_count--;
+                        }
+                }
+                count += (ssize_t)off;
+        }
+        if (count == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        return count;
+}
+
+int
+smb2_uring_which_events(struct smb2_context *smb2)
+{
+        struct smb2_uring *ur = smb2->uring;
+
+        if (ur->error || uring_next_send(smb2, ur) != NULL) {
+                return POLLIN | POLLOUT;
+        }
+        return POLLIN;
+}
+
+int
+smb2_uring_service(struct smb2_context *smb2, int revents)
+{
+        struct smb2_uring *ur = smb2->uring;
+        int rc;
+
+        uring_reap(smb2, ur, 0);
+
+        /* parse everything that has arrived, callbacks may tear down the
+         * connection and the ring with it
+         */
+        while (ur->error == 0 && ur->rx_count) {
+                if (smb2_read_from_socket(smb2) != 0) {
+                        return -1;
+                }
+                if (smb2->uring != ur) {
+                        return 0;
+                }
+        }
+        if (ur->error) {
+                smb2_set_error(smb2, "io_uring transport failed, "
+                               "errno:%d. Closing socket.", -ur->error);
+                return -1;
+        }
+
+        if (!ur->recv_armed && ur->rx_count < URING_NUM_BUFS) {
+                rc = uring_arm_recv(smb2, ur);
+                if (rc < 0) {
+                        smb2_set_error(smb2, "Failed to arm recv");
+                        return -1;
+                }
+        }
+        uring_send_pdus(smb2, ur);
+        rc = uring_submit(ur);
+        if (rc < 0) {
+                smb2_set_error(smb2, "io_uring_enter failed, errno:%d",
+                               -rc);
+                return -1;
+        }
+        smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
+
+        return 0;
+}
+
+int
+smb2_uring_start(struct smb2_context *smb2)
+{
+        struct smb2_uring *ur;
+
+        if (smb2->uring != NULL || smb2_is_server(smb2)) {
+                return 0;
+        }
+        ur = uring_create();
+        if (ur == NULL) {
+                return -ENOTSUP;
+        }
+        if (uring_arm_recv(smb2, ur) < 0 || uring_submit(ur) < 0) {
+                uring_free(ur);
+                return -ENOTSUP;
+        }
+
+        if (smb2->change_fd) {
+                smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
+                smb2->change_fd(smb2, ur->fd, SMB2_ADD_FD);
+        }
+        smb2->uring = ur;
+        smb2->uring_fd = ur->fd;
+        smb2->events = 0;
+
+        return 0;
+}
+
+void
+smb2_uring_stop(struct smb2_context *smb2)
+{
+        struct smb2_uring *ur = smb2->uring;
+        struct io_uring_sqe *sqe;
+        int tries;
+
+        if (ur == NULL) {
+                return;
+        }
+
+        /* the kernel may still be using the buffers of the PDUs we are
+         * sending, wait for everything to be cancelled
+         */
+        uring_reap(smb2, ur, 1);
+        if (ur->num_ops) {
+                sqe = uring_get_sqe(ur);
+                if (sqe != NULL) {
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->fd = -1;
+                        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY |
+                                IORING_ASYNC_CANCEL_ALL;
+                        sqe->user_data = URING_CANCEL;
+                }
+                uring_submit(ur);
+        }
+        for (tries = 0; ur->num_ops && tries < 1000; tries++) {
+                if (uring_enter(ur->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                    errno != EINTR) {
+                        break;
+                }
+                uring_reap(smb2, ur, 1);
+        }
+        while (ur->sends) {
+                /* only if the kernel did not answer, should not happen */
+                uring_send_done(smb2, ur, ur->sends, -ECANCELED, 1);
+        }
+
+        if (smb2->change_fd) {
+                smb2->change_fd(smb2, ur->fd, SMB2_DEL_FD);
+                smb2->change_fd(smb2, smb2->fd, SMB2_ADD_FD);
+        }
+        smb2->uring = NULL;
+        smb2->uring_fd = SMB2_INVALID_SOCKET;
+        smb2->events = 0;
+        uring_free(ur);
+}
+
+int
+smb2_set_io_uring(struct smb2_context *smb2, int enable)
+{
+        struct smb2_uring *ur;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (enable) {
+                /* make sure the kernel has what we need */
+                ur = uring_create();
+                if (ur == NULL) {
+                        smb2_set_error(smb2, "io_uring is not available");
+                        return -ENOTSUP;
+                }
+                uring_free(ur);
+        }
+        smb2->use_uring = enable ? 1 : 0;
+
+        return 0;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+int
+smb2_uring_start(struct smb2_context *smb2)
+{
+        return -ENOTSUP;
+}
+
+void
+smb2_uring_stop(struct smb2_context *smb2)
+{
+}
+
+int
+smb2_uring_service(struct smb2_context *smb2, int revents)
+{
+        return -1;
+}
+
+int
+smb2_uring_which_events(struct smb2_context *smb2)
+{
+        return 0;
+}
+
+ssize_t
+smb2_uring_readv(struct smb2_context *smb2,
+                 const struct iovec *iov, int iovcnt)
+{
+        errno = EAGAIN;
+        return -1;
+}
+
+int
+smb2_set_io_uring(struct smb2_context *smb2, int enable)
+{
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (enable) {
+                smb2_set_error(smb2, "libsmb2 was built without io_uring");
+                return -ENOTSUP;
+        }
+        return 0;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
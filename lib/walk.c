@@ -0,0 +1,353 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Asynchronous tree walker.
+ *
+ * Directories that still need to be listed are kept on a pending list.
+ * Up to max_in_flight of them are enumerated concurrently through
+ * smb2_opendir_ex_async(). Each completed listing is reported entry by
+ * entry to the application, and the subdirectories it contains are added
+ * to the pending list unless the application prunes them.
+ */
+
+struct walk_dir {
+        struct walk_dir *next;
+        char *path;
+        int depth;
+};
+
+struct smb2_walk {
+        smb2_walk_entry_cb entry_cb;
+        smb2_command_cb cb;
+        void *cb_data;
+
+        uint8_t info_class;
+        int max_in_flight;
+        int max_depth;
+
+        struct walk_dir *pending;
+        int in_flight;
+        int status;
+        int aborted;
+        /* listings served from the metadata cache complete from within
+         * walk_issue(), do not finish the walk underneath it
+         */
+        int issuing;
+        int started;
+};
+
+/* cb_data for smb2_opendir_ex_async(). It is owned by the smb2dir and
+ * freed together with it.
+ */
+struct walk_opendir_data {
+        struct smb2_walk *w;
+        struct walk_dir *d;
+};
+
+static void walk_pump(struct smb2_context *smb2, struct smb2_walk *w);
+
+static void
+free_walk_dir(struct walk_dir *d)
+{
+        free(d->path);
+        free(d);
+}
+
+static void
+free_walk(struct smb2_walk *w)
+{
+        while (w->pending) {
+                struct walk_dir *d = w->pending;
+
+                SMB2_LIST_REMOVE(&w->pending, d);
+                free_walk_dir(d);
+        }
+        free(w);
+}
+
+static int
+walk_add_dir(struct smb2_context *smb2, struct smb2_walk *w,
+             const char *path, int depth)
+{
+        struct walk_dir *d;
+
+        d = calloc(1, sizeof(struct walk_dir));
+        if (d == NULL) {
+                smb2_set_error(smb2, "Failed to allocate walk_dir");
+                return -ENOMEM;
+        }
+        d->path = strdup(path);
+        if (d->path == NULL) {
+                free(d);
+                smb2_set_error(smb2, "Failed to allocate walk path");
+                return -ENOMEM;
+        }
+        d->depth = depth;
+        SMB2_LIST_ADD(&w->pending, d);
+
+        return 0;
+}
+
+static void
+walk_fail(struct smb2_walk *w, int status)
+{
+        if (w->status == 0) {
+                w->status = status;
+        }
+}
+
+static char *
+walk_join(const char *parent, const char *name)
+{
+        size_t plen = strlen(parent);
+        size_t nlen = strlen(name);
+        char *path;
+
+        path = malloc(plen + nlen + 2);
+        if (path == NULL) {
+                return NULL;
+        }
+        if (plen) {
+                memcpy(path, parent, plen);
+                path[plen++] = '/';
+        }
+        memcpy(path + plen, name, nlen + 1);
+
+        return path;
+}
+
+static void
+walk_opendir_cb(struct smb2_context *smb2, int status,
+                void *command_data, void *private_data)
+{
+        struct walk_opendir_data *od = private_data;
+        struct smb2_walk *w = od->w;
+        struct walk_dir *d = od->d;
+        struct smb2dir *dir = command_data;
+        struct smb2dirent *de;
+
+        w->in_flight--;
+
+        if (status < 0) {
+                /* od is freed by the library once we return */
+                walk_fail(w, status);
+                free_walk_dir(d);
+                walk_pump(smb2, w);
+                return;
+        }
+
+        while (!w->aborted && (de = smb2_readdir(smb2, dir)) != NULL) {
+                struct smb2_walk_entry ent;
+                char *path;
+                int rc;
+
+                if (de->name == NULL ||
+                    !strcmp(de->name, ".") || !strcmp(de->name, "..")) {
+                        continue;
+                }
+                path = walk_join(d->path, de->name);
+                if (path == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate walk path");
+                        walk_fail(w, -ENOMEM);
+                        w->aborted = 1;
+                        break;
+                }
+
+                ent.path = path;
+                ent.name = de->name;
+                ent.parent = d->path;
+                ent.depth = d->depth + 1;
+                ent.st = &de->st;
+
+                rc = w->entry_cb(smb2, &ent, w->cb_data);
+                if (rc < 0) {
+                        walk_fail(w, rc);
+                        w->aborted = 1;
+                } else if (rc != SMB2_WALK_PRUNE &&
+                           de->st.smb2_type == SMB2_TYPE_DIRECTORY &&
+                           (w->max_depth <= 0 ||
+                            ent.depth < w->max_depth)) {
+                        if (walk_add_dir(smb2, w, path, ent.depth) < 0) {
+                                walk_fail(w, -ENOMEM);
+                                w->aborted = 1;
+                        }
+                }
+                free(path);
+        }
+
+        /* this also frees od */
+        smb2_closedir(smb2, dir);
+        free_walk_dir(d);
+
+        walk_pump(smb2, w);
+}
+
+static void
+walk_issue(struct smb2_context *smb2, struct smb2_walk *w)
+{
+        w->issuing = 1;
+        while (!w->aborted && w->pending && w->in_flight < w->max_in_flight) {
+                struct walk_opendir_data *od;
+                struct walk_dir *d;
+
+                /* Do not start more listings than there are credits
+                 * available, extra requests would only sit in the outqueue.
+                 */
+                if (w->in_flight && smb2_get_available_credits(smb2) <= 0) {
+                        break;
+                }
+
+                od = calloc(1, sizeof(struct walk_opendir_data));
+                if (od == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "walk_opendir_data");
+                        walk_fail(w, -ENOMEM);
+                        w->aborted = 1;
+                        break;
+                }
+                d = w->pending;
+                SMB2_LIST_REMOVE(&w->pending, d);
+                od->w = w;
+                od->d = d;
+
+                w->in_flight++;
+                if (smb2_opendir_ex_async(smb2, d->path, w->info_class, NULL,
+                                          0, walk_opendir_cb, od) < 0) {
+                        w->in_flight--;
+                        walk_fail(w, -ENOMEM);
+                        w->aborted = 1;
+                        /* od is still ours if the opendir failed */
+                        free(od);
+                        free_walk_dir(d);
+                        break;
+                }
+                w->started = 1;
+        }
+        w->issuing = 0;
+}
+
+static void
+walk_pump(struct smb2_context *smb2, struct smb2_walk *w)
+{
+        if (w->issuing) {
+                return;
+        }
+        walk_issue(smb2, w);
+
+        if (w->in_flight == 0 && (w->aborted || w->pending == NULL)) {
+                w->cb(smb2, w->status, NULL, w->cb_data);
+                free_walk(w);
+        }
+}
+
+int
+smb2_walk_async(struct smb2_context *smb2, const char *path,
+                uint8_t info_class, int max_in_flight, int max_depth,
+                smb2_walk_entry_cb entry_cb,
+                smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_walk *w;
+        int rc;
+
+        if (smb2 == NULL || entry_cb == NULL || cb == NULL) {
+                return -EINVAL;
+        }
+
+        switch (info_class) {
+        case 0:
+                info_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
+                break;
+        case SMB2_FILE_BOTH_DIRECTORY_INFORMATION:
+        case SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION:
+                break;
+        default:
+                smb2_set_error(smb2, "Directory information class 0x%02x "
+                               "can not be used for walking a tree.",
+                               info_class);
+                return -EINVAL;
+        }
+
+        if (path == NULL) {
+                path = "";
+        }
+        if (max_in_flight <= 0) {
+                max_in_flight = 1;
+        }
+
+        w = calloc(1, sizeof(struct smb2_walk));
+        if (w == NULL) {
+                smb2_set_error(smb2, "Failed to allocate smb2_walk");
+                return -ENOMEM;
+        }
+        w->entry_cb = entry_cb;
+        w->cb = cb;
+        w->cb_data = cb_data;
+        w->info_class = info_class;
+        w->max_in_flight = max_in_flight;
+        w->max_depth = max_depth;
+
+        rc = walk_add_dir(smb2, w, path, 0);
+        if (rc < 0) {
+                free_walk(w);
+                return rc;
+        }
+
+        walk_issue(smb2, w);
+        if (w->in_flight == 0 && !w->started) {
+                rc = w->status;
+                free_walk(w);
+                return rc;
+        }
+        if (w->in_flight == 0) {
+                /* everything was served from the cache */
+                w->cb(smb2, w->status, NULL, w->cb_data);
+                free_walk(w);
+        }
+
+        return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# Read and write throughput of the client against the loopback server,
+# over a link emulated by ld_shape.so at round trip times from 0.1 to
+# 100 ms, for a few queue depths.
+#
+# The last column is what the queue depth allows at most over that round
+# trip, depth * block size / RTT, before the link rate is taken into
+# account. How close the client gets to it shows how well it keeps the
+# pipe full.
+#
+# Set RTTS, DEPTHS, BS (bytes), RUNTIME, MODES (plain,signed,sealed),
+# SHAPE_RATE and SHAPE_JITTER_MS to change what is run.
+
+RTTS=${RTTS:-"0.1 0.5 1 2 5 10 20 50 100"}
+DEPTHS=${DEPTHS:-"1 8 32"}
+BS=${BS:-65536}
+RUNTIME=${RUNTIME:-2}
+MODES=${MODES:-plain}
+PORT=${PORT:-44590}
+
+BENCH=../examples/smb2-loopback-bench
+
+if [ ! -f ld_shape.so ]; then
+    echo "Build ld_shape.so first with: make ld_shape.so"
+    exit 1
+fi
+
+echo "rtt_ms,test,mode,bs,qd,ops,seconds,MiB/s,IOPS,p50_us,p99_us,max_us,bound_MiB/s"
+for RTT in $RTTS; do
+    for QD in $DEPTHS; do
+        # sh has no pipefail, so check the bench before the pipe
+        OUT=$(SHAPE_RTT_MS=$RTT LD_PRELOAD=./ld_shape.so \
+            libtool --mode=execute $BENCH -p $PORT -q $QD -b $BS -t $RUNTIME \
+                -m $MODES -T seqread,seqwrite) || exit 1
+        printf '%s\n' "$OUT" | grep -v '^test,' |
+        awk -v rtt=$RTT -v qd=$QD -v bs=$BS -F, \
+            '{ printf "%s,%s,%.1f\n", rtt, $0, qd * bs / (rtt / 1000) / 1048576 }'
+    done
+done
+
+exit 0
@@ -0,0 +1,420 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2024 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Emulates a WAN link under a client, by LD_PRELOAD.
+ *
+ * A TCP connect() is done synchronously on a socket of our own, and the
+ * application gets one end of a socketpair in place of its socket. A
+ * thread relays between the two, and holds each chunk of data back
+ * until the emulated link has delivered it:
+ *
+ *   SHAPE_RTT_MS    : round trip time, half of it in each direction
+ *   SHAPE_JITTER_MS : up to this much is added to or taken from the
+ *                     delay of each chunk, which stays in order
+ *   SHAPE_RATE      : bytes per second in each direction, with a k, m
+ *                     or g suffix in units of 1024. Unlimited if unset.
+ *   SHAPE_QUEUE     : bytes the link holds in each direction before the
+ *                     relay stops reading from the sender, default 64m
+ *   SHAPE_SEED      : seed for the jitter
+ *
+ * A chunk leaves the link at
+ *
+ *   max(arrival, link free) + size / rate + delay
+ *
+ * where arrival is when the relay thread read the chunk from the sender,
+ * so a relay that is slow to get to run adds to the delay. Nothing is
+ * shaped unless SHAPE_RTT_MS or SHAPE_RATE is set. Servers, which
+ * accept() rather than connect(), are not shaped.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <dlfcn.h>
+
+#define CHUNK_SIZE 65536
+
+static uint64_t rtt_ns;
+static uint64_t jitter_ns;
+static uint64_t rate;
+static uint64_t queue_max = 64 * 1024 * 1024;
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+static int shaping;
+static int num_links;
+
+int (*real_connect)(int fd, const struct sockaddr *addr, socklen_t len);
+
+struct chunk {
+        struct chunk *next;
+        uint64_t release;
+        size_t len;
+        size_t off;
+        uint8_t data[];
+};
+
+/* One direction of the link */
+struct link_dir {
+        int from;
+        int to;
+        struct chunk *head;
+        struct chunk *tail;
+        uint64_t queued;
+        uint64_t link_free;
+        uint64_t last_release;
+        int eof;
+        int shut;
+};
+
+struct link {
+        int app;
+        int net;
+        uint64_t rand_state;
+        struct link_dir up;
+        struct link_dir down;
+};
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(struct link *l)
+{
+        l->rand_state ^= l->rand_state << 13;
+        l->rand_state ^= l->rand_state >> 7;
+        l->rand_state ^= l->rand_state << 17;
+        return l->rand_state;
+}
+
+static uint64_t one_way_delay(struct link *l)
+{
+        int64_t delay = rtt_ns / 2;
+
+        if (jitter_ns) {
+                delay += (int64_t)(next_random(l) % (2 * jitter_ns + 1)) -
+                        (int64_t)jitter_ns;
+        }
+        return delay < 0 ? 0 : delay;
+}
+
+/* Reads a chunk from the sender and works out when it is delivered */
+static int receive_chunk(struct link *l, struct link_dir *d)
+{
+        struct chunk *c;
+        uint64_t now, start;
+        ssize_t count;
+
+        c = malloc(sizeof(struct chunk) + CHUNK_SIZE);
+        if (c == NULL) {
+                return -1;
+        }
+        count = recv(d->from, c->data, CHUNK_SIZE, 0);
+        if (count <= 0) {
+                free(c);
+                if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+                        return 0;
+                }
+                /* errors end the direction the same as EOF */
+                d->eof = 1;
+                return 0;
+        }
+
+        now = now_ns();
+        start = d->link_free > now ? d->link_free : now;
+        d->link_free = start;
+        if (rate) {
+                d->link_free += count * 1000000000ULL / rate;
+        }
+        c->release = d->link_free + one_way_delay(l);
+        if (c->release < d->last_release) {
+                c->release = d->last_release;
+        }
+        d->last_release = c->release;
+        c->len = count;
+        c->off = 0;
+        c->next = NULL;
+        if (d->tail) {
+                d->tail->next = c;
+        } else {
+                d->head = c;
+        }
+        d->tail = c;
+        d->queued += count;
+        return 0;
+}
+
+/* Writes out what the link has delivered by now */
+static int deliver(struct link_dir *d, uint64_t now)
+{
+        struct chunk *c;
+        ssize_t count;
+
+        while ((c = d->head) != NULL && c->release <= now) {
+                count = send(d->to, c->data + c->off, c->len - c->off,
+                             MSG_NOSIGNAL);
+                if (count < 0) {
+                        if (errno == EAGAIN || errno == EINTR) {
+                                return 0;
+                        }
+                        return -1;
+                }
+                c->off += count;
+                d->queued -= count;
+                if (c->off < c->len) {
+                        return 0;
+                }
+                d->head = c->next;
+                if (d->head == NULL) {
+                        d->tail = NULL;
+                }
+                free(c);
+        }
+        if (d->eof && d->head == NULL && !d->shut) {
+                shutdown(d->to, SHUT_WR);
+                d->shut = 1;
+        }
+        return 0;
+}
+
+static void free_chunks(struct link_dir *d)
+{
+        struct chunk *c;
+
+        while ((c = d->head) != NULL) {
+                d->head = c->next;
+                free(c);
+        }
+}
+
+static void add_events(struct link_dir *d, struct pollfd *from,
+                       struct pollfd *to, uint64_t now, uint64_t *wake)
+{
+        if (!d->eof && d->queued < queue_max) {
+                from->events |= POLLIN;
+        }
+        if (d->head == NULL) {
+                return;
+        }
+        if (d->head->release <= now) {
+                /* only gets here if the receiver is not keeping up */
+                to->events |= POLLOUT;
+        } else if (d->head->release < *wake) {
+                *wake = d->head->release;
+        }
+}
+
+static void *relay(void *arg)
+{
+        struct link *l = arg;
+        struct pollfd pfd[2];
+        struct timespec ts;
+        uint64_t now, wake;
+
+        while (!l->up.shut || !l->down.shut) {
+                now = now_ns();
+                if (deliver(&l->up, now) < 0 || deliver(&l->down, now) < 0) {
+                        break;
+                }
+                if (l->up.shut && l->down.shut) {
+                        break;
+                }
+
+                pfd[0].fd = l->app;
+                pfd[1].fd = l->net;
+                pfd[0].events = pfd[1].events = 0;
+                wake = UINT64_MAX;
+                add_events(&l->up, &pfd[0], &pfd[1], now, &wake);
+                add_events(&l->down, &pfd[1], &pfd[0], now, &wake);
+                if (wake != UINT64_MAX) {
+                        wake -= now;
+                        ts.tv_sec = wake / 1000000000ULL;
+                        ts.tv_nsec = wake % 1000000000ULL;
+                }
+                if (ppoll(pfd, 2, wake == UINT64_MAX ? NULL : &ts,
+                          NULL) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        break;
+                }
+                if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR) &&
+                    pfd[0].events & POLLIN) {
+                        if (receive_chunk(l, &l->up) < 0) {
+                                break;
+                        }
+                }
+                if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR) &&
+                    pfd[1].events & POLLIN) {
+                        if (receive_chunk(l, &l->down) < 0) {
+                                break;
+                        }
+                }
+        }
+
+        close(l->app);
+        close(l->net);
+        free_chunks(&l->up);
+        free_chunks(&l->down);
+        free(l);
+        return NULL;
+}
+
+static int start_link(int app, int net)
+{
+        struct link *l;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int one = 1;
+        int rc;
+
+        l = calloc(1, sizeof(struct link));
+        if (l == NULL) {
+                return -1;
+        }
+        l->app = app;
+        l->net = net;
+        l->rand_state = seed + __sync_fetch_and_add(&num_links, 1);
+        if (l->rand_state == 0) {
+                l->rand_state = 1;
+        }
+        l->up.from = l->down.to = app;
+        l->up.to = l->down.from = net;
+        fcntl(app, F_SETFL, fcntl(app, F_GETFL) | O_NONBLOCK);
+        fcntl(net, F_SETFL, fcntl(net, F_GETFL) | O_NONBLOCK);
+        setsockopt(net, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        rc = pthread_create(&thread, &attr, relay, l);
+        pthread_attr_destroy(&attr);
+        if (rc) {
+                free(l);
+                return -1;
+        }
+        return 0;
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        struct timespec ts;
+        socklen_t len = sizeof(int);
+        int type, fl, fdfl, net, sv[2], err;
+
+        if (!shaping || addr == NULL ||
+            (addr->sa_family != AF_INET && addr->sa_family != AF_INET6) ||
+            getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) ||
+            type != SOCK_STREAM) {
+                return real_connect(fd, addr, addrlen);
+        }
+
+        net = socket(addr->sa_family, SOCK_STREAM, 0);
+        if (net < 0) {
+                return -1;
+        }
+        if (real_connect(net, addr, addrlen) < 0) {
+                err = errno;
+                close(net);
+                errno = err;
+                return -1;
+        }
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+                err = errno;
+                close(net);
+                errno = err;
+                return -1;
+        }
+
+        /* the application keeps its fd, and the flags on it */
+        fl = fcntl(fd, F_GETFL);
+        fdfl = fcntl(fd, F_GETFD);
+        if (dup2(sv[0], fd) < 0 || start_link(sv[1], net) < 0) {
+                err = errno;
+                close(sv[0]);
+                close(sv[1]);
+                close(net);
+                errno = err;
+                return -1;
+        }
+        close(sv[0]);
+        fcntl(fd, F_SETFL, fl);
+        fcntl(fd, F_SETFD, fdfl);
+
+        /* the handshake takes a round trip too */
+        ts.tv_sec = rtt_ns / 1000000000ULL;
+        ts.tv_nsec = rtt_ns % 1000000000ULL;
+        nanosleep(&ts, NULL);
+        return 0;
+}
+
+static uint64_t parse_size(const char *str)
+{
+        char *end;
+        uint64_t size;
+
+        size = strtoull(str, &end, 0);
+        switch (*end) {
+        case 'k': case 'K':
+                return size << 10;
+        case 'm': case 'M':
+                return size << 20;
+        case 'g': case 'G':
+                return size << 30;
+        }
+        return size;
+}
+
+static void __attribute__((constructor))
+_init(void)
+{
+        if (getenv("SHAPE_RTT_MS") != NULL) {
+                rtt_ns = atof(getenv("SHAPE_RTT_MS")) * 1000000;
+                shaping = 1;
+        }
+        if (getenv("SHAPE_JITTER_MS") != NULL) {
+                jitter_ns = atof(getenv("SHAPE_JITTER_MS")) * 1000000;
+        }
+        if (getenv("SHAPE_RATE") != NULL) {
+                rate = parse_size(getenv("SHAPE_RATE"));
+                shaping = 1;
+        }
+        if (getenv("SHAPE_QUEUE") != NULL) {
+                queue_max = parse_size(getenv("SHAPE_QUEUE"));
+        }
+        if (getenv("SHAPE_SEED") != NULL) {
+                seed = strtoull(getenv("SHAPE_SEED"), NULL, 0);
+        }
+
+        real_connect = dlsym(RTLD_NEXT, "connect");
+}
@@ -0,0 +1,1041 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * smb2-bench: a workload generator in the spirit of fio.
+ *
+ * Runs one job against a share over one or more connections, each with a
+ * fixed number of commands in flight through the async API, and reports
+ * IOPS, bandwidth and latency percentiles for reads, writes and metadata
+ * operations.
+ *
+ * If the URL names a directory the job creates its files in it, fills
+ * them up to the file size and removes them again afterwards. If it names
+ * a file, that file is the only one the job uses, at its current size.
+ * Note that writes to it overwrite what is in it.
+ *
+ * Metadata operations are stat, open followed by close, and opendir with
+ * a full readdir of the directory the files are in.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+
+#define FILE_PREFIX "smb2-bench"
+
+enum bench_class {
+        CLASS_READ,
+        CLASS_WRITE,
+        CLASS_META,
+        NUM_CLASSES
+};
+
+static const char *class_names[NUM_CLASSES] = {
+        "read",
+        "write",
+        "meta",
+};
+
+enum bench_meta {
+        META_STAT,
+        META_OPENCLOSE,
+        META_READDIR,
+        NUM_META
+};
+
+static const char *command_names[SMB2_STATS_NUM_COMMANDS] = {
+        "negotiate", "session_setup", "logoff", "tree_connect",
+        "tree_disconnect", "create", "close", "flush", "read", "write",
+        "lock", "ioctl", "cancel", "echo", "query_directory",
+        "change_notify", "query_info", "set_info", "oplock_break",
+};
+
+static const char *meta_names[NUM_META] = {
+        "stat",
+        "openclose",
+        "readdir",
+};
+
+struct bench_conn;
+
+struct bench_slot {
+        struct bench_conn *conn;
+        enum bench_class cls;
+        uint64_t start;
+        uint8_t *buf;
+        struct smb2_stat_64 st;
+};
+
+struct bench_conn {
+        struct smb2_context *smb2;
+        struct smb2_url *url;
+        struct smb2fh **fhs;
+        struct bench_slot *slots;
+        int in_flight;
+};
+
+struct bench_stats {
+        uint64_t ops;
+        uint64_t bytes;
+        uint64_t *lat;
+        uint64_t num_lat;
+        uint64_t max_lat;
+};
+
+/* the job */
+static uint32_t block_size = 4096;
+static int depth = 16;
+static int num_conns = 1;
+static int num_files = 1;
+static uint64_t file_size = 64 * 1024 * 1024;
+static int read_pct = 100;
+static int meta_pct;
+static int random_io;
+static int meta_ops[NUM_META];
+static int num_meta_ops;
+static double runtime = 10;
+static double ramp;
+static int keep_files;
+static int csv;
+static int lib_stats;
+static const char *trace_path;
+static const char *capture_path;
+
+static char *dir_path;
+static char **paths;
+static int created_files;
+static uint64_t *cursors;
+static uint64_t next_file;
+static int next_meta;
+static uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t ramp_end;
+static uint64_t end_time;
+static int bench_error;
+
+static struct bench_conn *conns;
+static struct bench_stats stats[NUM_CLASSES];
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(void)
+{
+        rand_state ^= rand_state << 13;
+        rand_state ^= rand_state >> 7;
+        rand_state ^= rand_state << 17;
+        return rand_state;
+}
+
+/* Sizes take a k, m or g suffix, in units of 1024 */
+static uint64_t parse_size(const char *str)
+{
+        char *end;
+        uint64_t size;
+
+        size = strtoull(str, &end, 0);
+        switch (*end) {
+        case 'k': case 'K':
+                return size << 10;
+        case 'm': case 'M':
+                return size << 20;
+        case 'g': case 'G':
+                return size << 30;
+        }
+        return size;
+}
+
+static int parse_meta_ops(const char *str)
+{
+        int i;
+
+        num_meta_ops = 0;
+        for (i = 0; i < NUM_META; i++) {
+                if (strstr(str, meta_names[i])) {
+                        meta_ops[num_meta_ops++] = i;
+                }
+        }
+        return num_meta_ops ? 0 : -1;
+}
+
+static void record(struct bench_slot *slot, uint64_t bytes)
+{
+        struct bench_stats *s = &stats[slot->cls];
+        uint64_t now = now_ns();
+        uint64_t *l;
+
+        if (now < ramp_end) {
+                return;
+        }
+        if (s->num_lat == s->max_lat) {
+                s->max_lat = s->max_lat ? s->max_lat * 2 : 65536;
+                l = realloc(s->lat, s->max_lat * sizeof(uint64_t));
+                if (l == NULL) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        bench_error = 1;
+                        return;
+                }
+                s->lat = l;
+        }
+        s->lat[s->num_lat++] = now - slot->start;
+        s->ops++;
+        s->bytes += bytes;
+}
+
+static void start_op(struct bench_slot *slot);
+
+static void op_done(struct bench_slot *slot, uint64_t bytes)
+{
+        slot->conn->in_flight--;
+        record(slot, bytes);
+        start_op(slot);
+}
+
+static void op_failed(struct bench_slot *slot, const char *op, int status)
+{
+        slot->conn->in_flight--;
+        fprintf(stderr, "%s failed: %s (%s)\n", op, strerror(-status),
+                smb2_get_error(slot->conn->smb2));
+        bench_error = 1;
+}
+
+static void io_cb(struct smb2_context *smb2, int status,
+                  void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+
+        if (status < 0) {
+                op_failed(slot, class_names[slot->cls], status);
+                return;
+        }
+        op_done(slot, status);
+}
+
+static void stat_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+
+        if (status < 0) {
+                op_failed(slot, "stat", status);
+                return;
+        }
+        op_done(slot, 0);
+}
+
+static void close_cb(struct smb2_context *smb2, int status,
+                     void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+
+        if (status < 0) {
+                op_failed(slot, "close", status);
+                return;
+        }
+        op_done(slot, 0);
+}
+
+static void open_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct bench_slot *slot = private_data;
+        int rc;
+
+        if (status < 0) {
+                op_failed(slot, "open", status);
+                return;
+        }
+        rc = smb2_close_async(smb2, command_data, close_cb, slot);
+        if (rc < 0) {
+                op_failed(slot, "close", rc);
+        }
+}
+
+/* The smb2dir owns its cb_data and frees it, so it gets one of these */
+struct opendir_data {
+        struct bench_slot *slot;
+};
+
+static void opendir_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *private_data)
+{
+        struct opendir_data *od = private_data;
+        struct bench_slot *slot = od->slot;
+        struct smb2dir *dir = command_data;
+
+        if (status < 0) {
+                op_failed(slot, "opendir", status);
+                return;
+        }
+        while (smb2_readdir(smb2, dir) != NULL) {
+                ;
+        }
+        smb2_closedir(smb2, dir);
+        op_done(slot, 0);
+}
+
+static int issue_opendir(struct bench_slot *slot)
+{
+        struct opendir_data *od;
+        int rc;
+
+        od = malloc(sizeof(struct opendir_data));
+        if (od == NULL) {
+                return -ENOMEM;
+        }
+        od->slot = slot;
+        rc = smb2_opendir_async(slot->conn->smb2, dir_path, opendir_cb, od);
+        if (rc < 0) {
+                free(od);
+        }
+        return rc;
+}
+
+static int pick_file(void)
+{
+        if (random_io) {
+                return next_random() % num_files;
+        }
+        return next_file++ % num_files;
+}
+
+static uint64_t pick_offset(int file)
+{
+        uint64_t offset;
+
+        if (random_io) {
+                return next_random() % (file_size / block_size) * block_size;
+        }
+        if (cursors[file] + block_size > file_size) {
+                cursors[file] = 0;
+        }
+        offset = cursors[file];
+        cursors[file] += block_size;
+        return offset;
+}
+
+static int issue_meta(struct bench_slot *slot)
+{
+        struct smb2_context *smb2 = slot->conn->smb2;
+        const char *path = paths[pick_file()];
+
+        switch (meta_ops[next_meta++ % num_meta_ops]) {
+        case META_STAT:
+                return smb2_stat_async(smb2, path, &slot->st, stat_cb, slot);
+        case META_OPENCLOSE:
+                return smb2_open_async(smb2, path, O_RDONLY, open_cb, slot);
+        case META_READDIR:
+                return issue_opendir(slot);
+        }
+        return -EINVAL;
+}
+
+static int issue_io(struct bench_slot *slot)
+{
+        struct bench_conn *conn = slot->conn;
+        int file = pick_file();
+        uint64_t offset = pick_offset(file);
+
+        if (slot->cls == CLASS_READ) {
+                return smb2_pread_async(conn->smb2, conn->fhs[file],
+                                        slot->buf, block_size, offset,
+                                        io_cb, slot);
+        }
+        return smb2_pwrite_async(conn->smb2, conn->fhs[file],
+                                 slot->buf, block_size, offset,
+                                 io_cb, slot);
+}
+
+static void start_op(struct bench_slot *slot)
+{
+        int rc;
+
+        if (bench_error || now_ns() >= end_time) {
+                return;
+        }
+        if (meta_pct && (int)(next_random() % 100) < meta_pct) {
+                slot->cls = CLASS_META;
+        } else if ((int)(next_random() % 100) < read_pct) {
+                slot->cls = CLASS_READ;
+        } else {
+                slot->cls = CLASS_WRITE;
+        }
+
+        slot->start = now_ns();
+        rc = slot->cls == CLASS_META ? issue_meta(slot) : issue_io(slot);
+        if (rc < 0) {
+                fprintf(stderr, "Failed to issue %s: %s\n",
+                        class_names[slot->cls],
+                        smb2_get_error(slot->conn->smb2));
+                bench_error = 1;
+                return;
+        }
+        slot->conn->in_flight++;
+}
+
+static int event_loop(void)
+{
+        struct pollfd *pfds;
+        int i, in_flight;
+
+        pfds = calloc(num_conns, sizeof(struct pollfd));
+        if (pfds == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                return -1;
+        }
+        while (!bench_error) {
+                in_flight = 0;
+                for (i = 0; i < num_conns; i++) {
+                        in_flight += conns[i].in_flight;
+                        pfds[i].fd = smb2_get_fd(conns[i].smb2);
+                        pfds[i].events = smb2_which_events(conns[i].smb2);
+                        pfds[i].revents = 0;
+                }
+                if (in_flight == 0) {
+                        break;
+                }
+                if (poll(pfds, num_conns, 1000) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        fprintf(stderr, "Poll failed\n");
+                        bench_error = 1;
+                        break;
+                }
+                for (i = 0; i < num_conns; i++) {
+                        if (pfds[i].revents == 0) {
+                                continue;
+                        }
+                        if (smb2_service(conns[i].smb2, pfds[i].revents) < 0) {
+                                fprintf(stderr, "smb2_service failed with : "
+                                        "%s\n", smb2_get_error(conns[i].smb2));
+                                bench_error = 1;
+                                break;
+                        }
+                }
+        }
+        free(pfds);
+        return bench_error ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static double percentile_us(struct bench_stats *s, double p)
+{
+        uint64_t idx = (uint64_t)(p * (s->num_lat - 1) + 0.5);
+
+        return s->lat[idx] / 1000.0;
+}
+
+static void report(double secs)
+{
+        struct bench_stats *s;
+        uint64_t sum;
+        uint64_t i;
+        int c;
+
+        if (csv) {
+                printf("class,bs,qd,conns,files,ops,seconds,MiB/s,IOPS,"
+                       "min_us,avg_us,p50_us,p90_us,p99_us,p99.9_us,"
+                       "max_us\n");
+        }
+        for (c = 0; c < NUM_CLASSES; c++) {
+                s = &stats[c];
+                if (s->ops == 0) {
+                        continue;
+                }
+                qsort(s->lat, s->num_lat, sizeof(uint64_t), cmp_u64);
+                for (sum = 0, i = 0; i < s->num_lat; i++) {
+                        sum += s->lat[i];
+                }
+                if (csv) {
+                        printf("%s,%u,%d,%d,%d,%" PRIu64 ",%.3f,%.2f,%.0f,"
+                               "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                               class_names[c],
+                               c == CLASS_META ? 0 : block_size,
+                               depth, num_conns, num_files, s->ops, secs,
+                               s->bytes / secs / (1024 * 1024),
+                               s->ops / secs,
+                               percentile_us(s, 0), sum / 1000.0 / s->num_lat,
+                               percentile_us(s, 0.50), percentile_us(s, 0.90),
+                               percentile_us(s, 0.99), percentile_us(s, 0.999),
+                               percentile_us(s, 1.0));
+                        continue;
+                }
+                printf("%-5s: ops=%" PRIu64 " IOPS=%.0f BW=%.2fMiB/s\n",
+                       class_names[c], s->ops, s->ops / secs,
+                       s->bytes / secs / (1024 * 1024));
+                printf("       lat (usec): min=%.1f avg=%.1f max=%.1f\n",
+                       percentile_us(s, 0), sum / 1000.0 / s->num_lat,
+                       percentile_us(s, 1.0));
+                printf("       percentiles (usec): p50=%.1f p90=%.1f "
+                       "p99=%.1f p99.9=%.1f\n",
+                       percentile_us(s, 0.50), percentile_us(s, 0.90),
+                       percentile_us(s, 0.99), percentile_us(s, 0.999));
+        }
+        fflush(stdout);
+}
+
+/* Upper bound of the histogram bucket that the p'th latency falls in */
+static uint64_t bucket_percentile_us(struct smb2_command_stats *cs, double p)
+{
+        uint64_t n = 0, seen = 0;
+        int i;
+
+        for (i = 0; i < SMB2_STATS_NUM_BUCKETS; i++) {
+                n += cs->latency[i];
+        }
+        for (i = 0; i < SMB2_STATS_NUM_BUCKETS - 1; i++) {
+                seen += cs->latency[i];
+                if (seen >= p * n) {
+                        break;
+                }
+        }
+        return i == SMB2_STATS_NUM_BUCKETS - 1 ?
+                cs->latency_max_us : (1ULL << i);
+}
+
+/* What the library counted, summed over the connections */
+static void report_lib_stats(void)
+{
+        struct smb2_stats total, st;
+        struct smb2_command_stats *cs, *tc;
+        uint64_t received;
+        int c, i, b;
+
+        memset(&total, 0, sizeof(total));
+        for (c = 0; c < num_conns; c++) {
+                smb2_get_stats(conns[c].smb2, &st);
+                for (i = 0; i < SMB2_STATS_NUM_COMMANDS; i++) {
+                        cs = &st.commands[i];
+                        tc = &total.commands[i];
+                        tc->sent += cs->sent;
+                        tc->received += cs->received;
+                        tc->errors += cs->errors;
+                        tc->bytes_sent += cs->bytes_sent;
+                        tc->bytes_received += cs->bytes_received;
+                        tc->latency_total_us += cs->latency_total_us;
+                        if (cs->latency_max_us > tc->latency_max_us) {
+                                tc->latency_max_us = cs->latency_max_us;
+                        }
+                        for (b = 0; b < SMB2_STATS_NUM_BUCKETS; b++) {
+                                tc->latency[b] += cs->latency[b];
+                        }
+                }
+                total.credit_stalls += st.credit_stalls;
+                total.outqueue_max += st.outqueue_max;
+                total.waitqueue_max += st.waitqueue_max;
+                total.read_calls += st.read_calls;
+                total.write_calls += st.write_calls;
+                total.bytes_read += st.bytes_read;
+                total.bytes_written += st.bytes_written;
+                total.signed_bytes += st.signed_bytes;
+                total.sign_time_ns += st.sign_time_ns;
+                total.encrypted_bytes += st.encrypted_bytes;
+                total.encrypt_time_ns += st.encrypt_time_ns;
+                total.decrypted_bytes += st.decrypted_bytes;
+                total.decrypt_time_ns += st.decrypt_time_ns;
+        }
+
+        printf("\nlibrary counters:\n");
+        printf("  credit stalls=%" PRIu64 " outqueue max=%u "
+               "waitqueue max=%u\n", total.credit_stalls,
+               total.outqueue_max, total.waitqueue_max);
+        printf("  socket: readv=%" PRIu64 " (%.2fMiB) writev=%" PRIu64
+               " (%.2fMiB)\n", total.read_calls,
+               total.bytes_read / (1024.0 * 1024), total.write_calls,
+               total.bytes_written / (1024.0 * 1024));
+        printf("  signing: %.2fMiB in %.1fms, encryption: %.2fMiB in "
+               "%.1fms, decryption: %.2fMiB in %.1fms\n",
+               total.signed_bytes / (1024.0 * 1024),
+               total.sign_time_ns / 1e6,
+               total.encrypted_bytes / (1024.0 * 1024),
+               total.encrypt_time_ns / 1e6,
+               total.decrypted_bytes / (1024.0 * 1024),
+               total.decrypt_time_ns / 1e6);
+        printf("  %-16s %10s %10s %8s %10s %10s %10s\n", "command",
+               "sent", "received", "errors", "avg_us", "p99_us<=",
+               "max_us");
+        for (i = 0; i < SMB2_STATS_NUM_COMMANDS; i++) {
+                tc = &total.commands[i];
+                if (tc->sent == 0 && tc->received == 0) {
+                        continue;
+                }
+                received = tc->received ? tc->received : 1;
+                printf("  %-16s %10" PRIu64 " %10" PRIu64 " %8" PRIu64
+                       " %10.1f %10" PRIu64 " %10" PRIu64 "\n",
+                       command_names[i], tc->sent, tc->received, tc->errors,
+                       (double)tc->latency_total_us / received,
+                       bucket_percentile_us(tc, 0.99), tc->latency_max_us);
+        }
+        fflush(stdout);
+}
+
+static int connect_conn(struct bench_conn *conn, const char *url)
+{
+        conn->smb2 = smb2_init_context();
+        if (conn->smb2 == NULL) {
+                fprintf(stderr, "Failed to init context\n");
+                return -1;
+        }
+        conn->url = smb2_parse_url(conn->smb2, url);
+        if (conn->url == NULL) {
+                fprintf(stderr, "Failed to parse url: %s\n",
+                        smb2_get_error(conn->smb2));
+                return -1;
+        }
+        smb2_set_security_mode(conn->smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+        if (smb2_connect_share(conn->smb2, conn->url->server,
+                               conn->url->share, conn->url->user) < 0) {
+                fprintf(stderr, "smb2_connect_share failed. %s\n",
+                        smb2_get_error(conn->smb2));
+                return -1;
+        }
+        return 0;
+}
+
+/* Works out which files the job uses from what the URL names */
+static int setup_paths(struct smb2_context *smb2, const char *path)
+{
+        struct smb2_stat_64 st;
+        const char *slash;
+        int i, rc;
+
+        paths = calloc(num_files, sizeof(char *));
+        cursors = calloc(num_files, sizeof(uint64_t));
+        if (paths == NULL || cursors == NULL) {
+                return -ENOMEM;
+        }
+
+        if (path[0]) {
+                rc = smb2_stat(smb2, path, &st);
+                if (rc < 0) {
+                        fprintf(stderr, "stat of %s failed: %s (%s)\n", path,
+                                strerror(-rc), smb2_get_error(smb2));
+                        return -1;
+                }
+        }
+        if (path[0] && st.smb2_type == SMB2_TYPE_FILE) {
+                if (num_files != 1) {
+                        fprintf(stderr, "Only one file can be used when "
+                                "the URL names a file\n");
+                        return -1;
+                }
+                file_size = st.smb2_size;
+                slash = strrchr(path, '/');
+                dir_path = strndup(path, slash ? slash - path : 0);
+                paths[0] = strdup(path);
+                return dir_path && paths[0] ? 0 : -ENOMEM;
+        }
+
+        dir_path = strdup(path);
+        if (dir_path == NULL) {
+                return -ENOMEM;
+        }
+        for (i = 0; i < num_files; i++) {
+                if (asprintf(&paths[i], "%s%s" FILE_PREFIX ".%d", path,
+                             path[0] ? "/" : "", i) < 0) {
+                        return -ENOMEM;
+                }
+        }
+        created_files = 1;
+        return 0;
+}
+
+/* Creates the files of the job and fills them up to the file size */
+static int layout_files(struct smb2_context *smb2)
+{
+        struct smb2_stat_64 st;
+        struct smb2fh *fh;
+        uint8_t *buf;
+        uint32_t chunk;
+        uint64_t offset;
+        int i, rc = 0;
+
+        chunk = smb2_get_max_write_size(smb2);
+        if (chunk == 0 || chunk > 1024 * 1024) {
+                chunk = 1024 * 1024;
+        }
+        buf = malloc(chunk);
+        if (buf == NULL) {
+                return -ENOMEM;
+        }
+        memset(buf, 0xa5, chunk);
+
+        for (i = 0; i < num_files && rc == 0; i++) {
+                fh = smb2_open(smb2, paths[i], O_WRONLY | O_CREAT);
+                if (fh == NULL) {
+                        fprintf(stderr, "Failed to create %s: %s\n",
+                                paths[i], smb2_get_error(smb2));
+                        rc = -1;
+                        break;
+                }
+                rc = smb2_fstat(smb2, fh, &st);
+                for (offset = st.smb2_size;
+                     rc >= 0 && offset < file_size; offset += rc) {
+                        rc = smb2_pwrite(smb2, fh, buf,
+                                         file_size - offset < chunk ?
+                                         file_size - offset : chunk,
+                                         offset);
+                }
+                if (rc < 0) {
+                        fprintf(stderr, "Failed to lay out %s: %s (%s)\n",
+                                paths[i], strerror(-rc), smb2_get_error(smb2));
+                        rc = -1;
+                } else {
+                        rc = 0;
+                }
+                smb2_close(smb2, fh);
+        }
+        free(buf);
+        return rc;
+}
+
+static int open_files(struct bench_conn *conn)
+{
+        int i;
+
+        conn->fhs = calloc(num_files, sizeof(struct smb2fh *));
+        if (conn->fhs == NULL) {
+                return -ENOMEM;
+        }
+        for (i = 0; i < num_files; i++) {
+                conn->fhs[i] = smb2_open(conn->smb2, paths[i],
+                                         read_pct == 100 ? O_RDONLY : O_RDWR);
+                if (conn->fhs[i] == NULL) {
+                        fprintf(stderr, "Failed to open %s: %s\n",
+                                paths[i], smb2_get_error(conn->smb2));
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+static int setup_slots(struct bench_conn *conn)
+{
+        int i;
+
+        conn->slots = calloc(depth, sizeof(struct bench_slot));
+        if (conn->slots == NULL) {
+                return -ENOMEM;
+        }
+        for (i = 0; i < depth; i++) {
+                conn->slots[i].conn = conn;
+                conn->slots[i].buf = malloc(block_size);
+                if (conn->slots[i].buf == NULL) {
+                        return -ENOMEM;
+                }
+                memset(conn->slots[i].buf, 0xa5, block_size);
+        }
+        return 0;
+}
+
+/* One file per connection, numbered if there are several */
+static void conn_path(char *path, size_t len, const char *name, int i)
+{
+        if (num_conns == 1) {
+                snprintf(path, len, "%s", name);
+        } else {
+                snprintf(path, len, "%s.%d", name, i);
+        }
+}
+
+static int start_traces(void)
+{
+        char path[4096];
+        int i, rc;
+
+        for (i = 0; i < num_conns; i++) {
+                conn_path(path, sizeof(path), trace_path, i);
+                rc = smb2_start_chrome_trace(conns[i].smb2, path);
+                if (rc < 0) {
+                        fprintf(stderr, "Failed to start trace: %s\n",
+                                smb2_get_error(conns[i].smb2));
+                        return rc;
+                }
+        }
+        return 0;
+}
+
+/* Before the files are opened, or the I/O on them would not be captured */
+static int start_captures(void)
+{
+        char path[4096];
+        int i, rc;
+
+        for (i = 0; i < num_conns; i++) {
+                conn_path(path, sizeof(path), capture_path, i);
+                rc = smb2_start_capture(conns[i].smb2, path);
+                if (rc < 0) {
+                        fprintf(stderr, "Failed to start capture: %s\n",
+                                smb2_get_error(conns[i].smb2));
+                        return rc;
+                }
+        }
+        return 0;
+}
+
+static void teardown(void)
+{
+        struct bench_conn *conn;
+        int c, i;
+
+        for (c = 0; c < num_conns; c++) {
+                conn = &conns[c];
+                if (conn->smb2 == NULL) {
+                        continue;
+                }
+                for (i = 0; conn->fhs && i < num_files; i++) {
+                        if (conn->fhs[i] && !bench_error) {
+                                smb2_close(conn->smb2, conn->fhs[i]);
+                        }
+                }
+                if (c == 0 && created_files && !keep_files && !bench_error) {
+                        for (i = 0; i < num_files; i++) {
+                                smb2_unlink(conn->smb2, paths[i]);
+                        }
+                }
+                if (conn->url) {
+                        if (!bench_error) {
+                                smb2_disconnect_share(conn->smb2);
+                        }
+                        smb2_destroy_url(conn->url);
+                }
+                smb2_destroy_context(conn->smb2);
+                if (conn->slots) {
+                        for (i = 0; i < depth; i++) {
+                                free(conn->slots[i].buf);
+                        }
+                }
+                free(conn->slots);
+                free(conn->fhs);
+        }
+        free(conns);
+        for (i = 0; paths && i < num_files; i++) {
+                free(paths[i]);
+        }
+        free(paths);
+        free(cursors);
+        free(dir_path);
+        for (c = 0; c < NUM_CLASSES; c++) {
+                free(stats[c].lat);
+        }
+}
+
+int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-bench [-b block-size] [-q depth] [-c connections] "
+                "[-f files]\n"
+                "           [-s file-size] [-M read-percent] [-r] "
+                "[-m meta-percent]\n"
+                "           [-O stat,openclose,readdir] [-t seconds] "
+                "[-R ramp-seconds]\n"
+                "           [-k] [-C] [-S] [-T trace-file] "
+                "[-w capture-file] <smb2-url>\n\n"
+                "  -b  size of each read and write, default 4k\n"
+                "  -q  commands in flight per connection, default 16\n"
+                "  -c  number of connections, default 1\n"
+                "  -f  number of files, default 1\n"
+                "  -s  size of each file, default 64m\n"
+                "  -M  percentage of the I/O that is reads, default 100\n"
+                "  -r  random instead of sequential I/O\n"
+                "  -m  percentage of the operations that are metadata "
+                "operations, default 0\n"
+                "  -O  the metadata operations to use, default all\n"
+                "  -t  how long to run for, default 10\n"
+                "  -R  how long to run before measuring, default 0\n"
+                "  -k  keep the files the job created\n"
+                "  -C  print the results as CSV\n"
+                "  -S  also print the counters of the library, ramp included\n"
+                "  -T  write a Chrome trace of the PDUs of the job to the "
+                "file,\n"
+                "      with .<n> appended for each connection if there are "
+                "several\n"
+                "  -w  capture the calls of the job for smb2-replay, named "
+                "like -T.\n"
+                "      Use -k to keep the files to replay against\n\n"
+                "URL format: "
+                "smb://[<domain;][<username>@]<host>[:<port>]/<share>/<path>\n"
+                "where <path> is a directory to create the files in or the "
+                "file to use.\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        uint64_t start;
+        double secs;
+        int c, i, rc = 0;
+
+        parse_meta_ops("stat,openclose,readdir");
+        while ((c = getopt(argc, argv, "b:q:c:f:s:M:rm:O:t:R:kCST:w:")) != -1) {
+                switch (c) {
+                case 'b':
+                        block_size = parse_size(optarg);
+                        break;
+                case 'q':
+                        depth = atoi(optarg);
+                        break;
+                case 'c':
+                        num_conns = atoi(optarg);
+                        break;
+                case 'f':
+                        num_files = atoi(optarg);
+                        break;
+                case 's':
+                        file_size = parse_size(optarg);
+                        break;
+                case 'M':
+                        read_pct = atoi(optarg);
+                        break;
+                case 'r':
+                        random_io = 1;
+                        break;
+                case 'm':
+                        meta_pct = atoi(optarg);
+                        break;
+                case 'O':
+                        if (parse_meta_ops(optarg) < 0) {
+                                usage();
+                        }
+                        break;
+                case 't':
+                        runtime = atof(optarg);
+                        break;
+                case 'R':
+                        ramp = atof(optarg);
+                        break;
+                case 'k':
+                        keep_files = 1;
+                        break;
+                case 'C':
+                        csv = 1;
+                        break;
+                case 'S':
+                        lib_stats = 1;
+                        break;
+                case 'T':
+                        trace_path = optarg;
+                        break;
+                case 'w':
+                        capture_path = optarg;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind >= argc || block_size < 1 || depth < 1 ||
+            num_conns < 1 || num_files < 1 || read_pct < 0 ||
+            read_pct > 100 || meta_pct < 0 || meta_pct > 100 ||
+            runtime <= 0 || ramp < 0) {
+                usage();
+        }
+
+        conns = calloc(num_conns, sizeof(struct bench_conn));
+        if (conns == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+        }
+        for (i = 0; i < num_conns; i++) {
+                if (connect_conn(&conns[i], argv[optind]) < 0) {
+                        rc = -1;
+                        goto finished;
+                }
+        }
+
+        rc = setup_paths(conns[0].smb2, conns[0].url->path ?
+                         conns[0].url->path : "");
+        if (rc == 0 && block_size > file_size) {
+                fprintf(stderr, "The block size is larger than the file\n");
+                rc = -1;
+        }
+        if (rc == 0 && created_files) {
+                rc = layout_files(conns[0].smb2);
+        }
+        if (rc == 0 && capture_path) {
+                rc = start_captures();
+        }
+        for (i = 0; i < num_conns && rc == 0; i++) {
+                rc = open_files(&conns[i]);
+                if (rc == 0) {
+                        rc = setup_slots(&conns[i]);
+                }
+        }
+        if (rc < 0) {
+                if (rc == -ENOMEM) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                }
+                goto finished;
+        }
+
+        if (trace_path && start_traces() < 0) {
+                rc = -1;
+                goto finished;
+        }
+        for (i = 0; i < num_conns; i++) {
+                smb2_reset_stats(conns[i].smb2);
+        }
+        start = now_ns();
+        ramp_end = start + (uint64_t)(ramp * 1e9);
+        end_time = ramp_end + (uint64_t)(runtime * 1e9);
+        for (i = 0; i < depth; i++) {
+                for (c = 0; c < num_conns; c++) {
+                        start_op(&conns[c].slots[i]);
+                }
+        }
+        rc = event_loop();
+        for (i = 0; i < num_conns; i++) {
+                smb2_stop_chrome_trace(conns[i].smb2);
+                smb2_stop_capture(conns[i].smb2);
+        }
+        if (rc == 0) {
+                secs = (now_ns() - ramp_end) / 1e9;
+                report(secs);
+                if (lib_stats) {
+                        report_lib_stats();
+                }
+        }
+
+ finished:
+        teardown();
+        return rc < 0 ? 1 : 0;
+}
@@ -18,6 +18,7 @@
 #define _FILE_OFFSET_BITS 64
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <inttypes.h>
 #if !defined(__amigaos4__) && !defined(__AMIGA__) && !defined(__AROS__)
 #include <poll.h>
@@ -27,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -39,19 +41,30 @@
 #include "asprintf.h"
 #endif
 
+/* allocated ranges asked for at a time */
+#define NUM_RANGES 64
+
 struct file_context {
 	int is_smb2;
 	int fd;
 	struct smb2_context *smb2;
 	struct smb2fh *smb2fh;
 	struct smb2_url *url;
+	/* smb2 belongs to the context of the other file */
+	int shared;
+	/* allocated ranges of the source, known up to ranges_end */
+	struct smb2_allocated_range ranges[NUM_RANGES];
+	int num_ranges;
+	int next_range;
+	off_t ranges_end;
 };
 
 void usage(void)
 {
-	fprintf(stderr, "Usage: smb2-cp <src> <dst>\n");
+	fprintf(stderr, "Usage: smb2-cp [-s] <src> <dst>\n");
 	fprintf(stderr, "<src>,<dst> can either be a local file or "
 			"an smb2 URL.\n");
+	fprintf(stderr, "-s skips the holes of sparse files.\n");
 	exit(0);
 }
 
@@ -64,7 +77,7 @@ free_file_context(struct file_context *file_context)
 	if (file_context->smb2fh != NULL) {
 		smb2_close(file_context->smb2, file_context->smb2fh);
 	}
-	if (file_context->smb2 != NULL) {
+	if (file_context->smb2 != NULL && !file_context->shared) {
 		smb2_destroy_context(file_context->smb2);
 	}
 	smb2_destroy_url(file_context->url);
@@ -122,8 +135,21 @@ file_pwrite(struct file_context *fc, uint8_t *buf, size_t count, off_t off)
 	}
 }
 
+static int
+same_string(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+	return !strcasecmp(a, b);
+}
+
+/*
+ * Files on the same share are opened through the same context so the
+ * server can copy between them without the data passing through us.
+ */
 static struct file_context *
-open_file(const char *url, int flags)
+open_file(const char *url, int flags, struct file_context *peer)
 {
 	struct file_context *file_context;
 
@@ -137,6 +163,10 @@ open_file(const char *url, int flags)
 	file_context->smb2    = NULL;
 	file_context->smb2fh  = NULL;
 	file_context->url    = NULL;
+	file_context->shared = 0;
+	file_context->num_ranges = 0;
+	file_context->next_range = 0;
+	file_context->ranges_end = 0;
 
 	if (strncmp(url, "smb://", 6)) {
 		file_context->is_smb2 = 0;
@@ -151,6 +181,20 @@ open_file(const char *url, int flags)
 
 	file_context->is_smb2 = 1;
 
+	if (peer != NULL && peer->is_smb2) {
+		file_context->url = smb2_parse_url(peer->smb2, url);
+		if (file_context->url != NULL &&
+		    same_string(file_context->url->server, peer->url->server) &&
+		    same_string(file_context->url->share, peer->url->share) &&
+		    same_string(file_context->url->user, peer->url->user)) {
+			file_context->smb2 = peer->smb2;
+			file_context->shared = 1;
+			goto open;
+		}
+		smb2_destroy_url(file_context->url);
+		file_context->url = NULL;
+	}
+
 	file_context->smb2 = smb2_init_context();
 	if (file_context->smb2 == NULL) {
 		fprintf(stderr, "failed to init context\n");
@@ -174,6 +218,7 @@ open_file(const char *url, int flags)
 		return NULL;
 	}
 
+ open:
 	file_context->smb2fh = smb2_open(file_context->smb2, file_context->url->path, flags);
 	if (file_context->smb2fh == NULL) {
 		fprintf(stderr, "Failed to open file %s: %s\n",
@@ -188,13 +233,136 @@ open_file(const char *url, int flags)
 #define BUFSIZE 1024*1024
 static uint8_t buf[BUFSIZE];
 
+/*
+ * Finds the first range of data at or after off. Everything between off
+ * and *data is a hole. Files that can not tell us where their holes are
+ * are all data. The allocated ranges of smb2 files are asked for
+ * NUM_RANGES at a time, as off only moves forward.
+ */
+static void
+next_data(struct file_context *fc, off_t off, off_t size,
+	  off_t *data, off_t *hole)
+{
+	*data = off;
+	*hole = size;
+
+	if (fc->is_smb2 == 0) {
+#ifdef SEEK_DATA
+		off_t d, h;
+
+		d = lseek(fc->fd, off, SEEK_DATA);
+		if (d == -1) {
+			if (errno == ENXIO) {
+				*data = size;
+			}
+			return;
+		}
+		h = lseek(fc->fd, d, SEEK_HOLE);
+		if (h == -1) {
+			return;
+		}
+		*data = d < size ? d : size;
+		*hole = h < size ? h : size;
+#endif
+	} else {
+		struct smb2_allocated_range *range;
+		int rc;
+
+		while (fc->next_range < fc->num_ranges) {
+			range = &fc->ranges[fc->next_range];
+			if ((off_t)(range->offset + range->length) > off) {
+				break;
+			}
+			fc->next_range++;
+		}
+		if (fc->next_range == fc->num_ranges &&
+		    off >= fc->ranges_end) {
+			rc = smb2_query_allocated_ranges(fc->smb2, fc->smb2fh,
+							 off, size - off,
+							 fc->ranges,
+							 NUM_RANGES);
+			if (rc < 0) {
+				return;
+			}
+			fc->next_range = 0;
+			if (rc > NUM_RANGES) {
+				fc->num_ranges = NUM_RANGES;
+				range = &fc->ranges[NUM_RANGES - 1];
+				fc->ranges_end = range->offset + range->length;
+			} else {
+				fc->num_ranges = rc;
+				fc->ranges_end = size;
+			}
+		}
+		if (fc->next_range == fc->num_ranges) {
+			*data = size;
+			return;
+		}
+		range = &fc->ranges[fc->next_range];
+		if ((off_t)range->offset > off) {
+			*data = (off_t)range->offset < size ?
+				(off_t)range->offset : size;
+		}
+		if ((off_t)(range->offset + range->length) < size) {
+			*hole = (off_t)(range->offset + range->length);
+		}
+	}
+}
+
+/* Copies [off, off + len), returns the number of bytes copied or -1 */
+static off_t
+copy_data(struct file_context *src, struct file_context *dst,
+	  off_t off, off_t len)
+{
+	off_t end = off + len;
+	ssize_t count;
+
+	if (dst->shared &&
+	    smb2_copy_range(src->smb2, src->smb2fh, off, dst->smb2fh, off,
+			    len) == 0) {
+		return len;
+	}
+	while (off < end) {
+		count = (size_t)(end - off);
+		if (count > BUFSIZE) {
+			count = BUFSIZE;
+		}
+		count = file_pread(src, buf, count, off);
+		if (count < 0) {
+			fprintf(stderr, "Failed to read from source file\n");
+			return -1;
+		}
+		if (count == 0) {
+			break;
+		}
+		count = file_pwrite(dst, buf, count, off);
+		if (count < 0) {
+			fprintf(stderr, "Failed to write to dest file\n");
+			return -1;
+		}
+
+		off += count;
+	}
+	return len - (end - off);
+}
+
+static int
+set_size(struct file_context *fc, off_t size)
+{
+	if (fc->is_smb2 == 0) {
+		return ftruncate(fc->fd, size);
+	} else {
+		return smb2_ftruncate(fc->smb2, fc->smb2fh, size);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct stat st;
 	struct file_context *src;
 	struct file_context *dst;
-	off_t off;
-	ssize_t count;
+	off_t off, data, hole, copied, count;
+	int sparse = 0;
 	
 #ifdef WIN32
 	if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
@@ -207,17 +375,22 @@ int main(int argc, char *argv[])
 	aros_init_socket();
 #endif
 
+	if (argc == 4 && !strcmp(argv[1], "-s")) {
+		sparse = 1;
+		argc--;
+		argv++;
+	}
 	if (argc != 3) {
 		usage();
 	}
 
-	src = open_file(argv[1], O_RDONLY);
+	src = open_file(argv[1], O_RDONLY, NULL);
 	if (src == NULL) {
 		fprintf(stderr, "Failed to open %s\n", argv[1]);
 		return 10;
 	}
 
-	dst = open_file(argv[2], O_WRONLY|O_CREAT|O_TRUNC);
+	dst = open_file(argv[2], O_WRONLY|O_CREAT|O_TRUNC, src);
 	if (dst == NULL) {
 		fprintf(stderr, "Failed to open %s\n", argv[2]);
 		free_file_context(src);
@@ -226,38 +399,51 @@ int main(int argc, char *argv[])
 
 	if (fstat_file(src, &st) != 0) {
 		fprintf(stderr, "Failed to fstat source file\n");
-		free_file_context(src);
 		free_file_context(dst);
+		free_file_context(src);
 		return 10;
 	}
 
+	if (sparse && dst->is_smb2) {
+		/* without it the holes would be filled in on the server */
+		smb2_set_sparse(dst->smb2, dst->smb2fh, 1);
+	}
+
 	off = 0;
+	copied = 0;
 	while (off < st.st_size) {
-		count = (size_t)(st.st_size - off);
-		if (count > BUFSIZE) {
-			count = BUFSIZE;
+		data = off;
+		hole = st.st_size;
+		if (sparse) {
+			next_data(src, off, st.st_size, &data, &hole);
 		}
-		count = file_pread(src, buf, count, off);
-		if (count < 0) {
-			fprintf(stderr, "Failed to read from source file\n");
-			free_file_context(src);
-			free_file_context(dst);
-			return 10;
+		if (data >= st.st_size) {
+			break;
 		}
-		count = file_pwrite(dst, buf, count, off);
+		count = copy_data(src, dst, data, hole - data);
 		if (count < 0) {
-			fprintf(stderr, "Failed to write to dest file\n");
-			free_file_context(src);
 			free_file_context(dst);
+			free_file_context(src);
 			return 10;
 		}
-
-		off += count;
+		copied += count;
+		if (count < hole - data) {
+			/* the source file got shorter */
+			st.st_size = data + count;
+			break;
+		}
+		off = hole;
+	}
+	if (sparse && set_size(dst, st.st_size) < 0) {
+		fprintf(stderr, "Failed to set the size of the dest file\n");
+		free_file_context(dst);
+		free_file_context(src);
+		return 10;
 	}
-	printf("copied %d bytes\n", (int)off);
+	printf("copied %d bytes\n", (int)copied);
 
-	free_file_context(src);
 	free_file_context(dst);
+	free_file_context(src);
 
 	return 0;
 }
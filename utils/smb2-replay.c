@@ -0,0 +1,674 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2016 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * smb2-replay: issues the calls of a capture made with
+ * smb2_start_capture() again, against any share, and reports their
+ * latencies next to the ones that were captured.
+ *
+ * The calls are issued in the order they were captured. A call waits for
+ * every call that had completed before it was issued in the capture, so
+ * the replay has the same dependencies and never more concurrency than
+ * the original. With -s 1, the default, a call is also not issued before
+ * the time it was issued at in the capture. Higher speeds compress that
+ * time and -s 0 issues each call as soon as it may.
+ *
+ * Paths are used as they were captured, relative to the share of the URL.
+ * Writes write zeroes.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+
+static const char *op_names[SMB2_CAPTURE_NUM_OPS] = {
+        "done", "open", "close", "pread", "pwrite", "fsync", "fstat",
+        "stat", "statvfs", "opendir", "mkdir", "rmdir", "unlink", "rename",
+        "truncate", "ftruncate", "readlink", "echo",
+};
+
+enum call_state {
+        CALL_PENDING,
+        CALL_ISSUED,
+        CALL_DONE
+};
+
+struct replay_call {
+        uint8_t op;
+        uint64_t time;
+        uint64_t offset;
+        uint32_t count;
+        uint32_t fh;
+        char *path;
+        char *path2;
+        /* DONE records that came before the call in the capture */
+        uint32_t deps;
+
+        /* as captured */
+        int done;
+        int32_t status;
+        uint64_t latency;
+
+        /* as replayed */
+        enum call_state state;
+        uint64_t start;
+};
+
+/* State of a call in flight, the smb2dir owns and frees this for opendir */
+struct replay_op {
+        struct replay_call *call;
+        uint8_t *buf;
+        struct smb2_stat_64 st;
+        struct smb2_statvfs vfs;
+};
+
+struct op_stats {
+        uint64_t calls;
+        uint64_t errors;
+        uint64_t mismatches;
+        uint64_t skipped;
+        uint64_t *lat;
+        uint64_t num_lat;
+        uint64_t *orig;
+        uint64_t num_orig;
+};
+
+static double speed = 1.0;
+static int csv;
+
+static struct smb2_context *smb2;
+static struct replay_call *calls;
+static uint32_t num_calls;
+static uint32_t *done_order;
+static uint32_t num_done;
+static uint32_t completed;
+static uint32_t next_call;
+static int in_flight;
+static struct smb2fh **fhs;
+static uint8_t *zeroes;
+static uint64_t start_time;
+static int replay_error;
+
+static struct op_stats stats[SMB2_CAPTURE_NUM_OPS];
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t get_le(const uint8_t *buf, int len)
+{
+        uint64_t val = 0;
+        int i;
+
+        for (i = len - 1; i >= 0; i--) {
+                val = (val << 8) | buf[i];
+        }
+        return val;
+}
+
+static int add_latency(uint64_t **lat, uint64_t *num, uint64_t ns)
+{
+        uint64_t *l;
+
+        /* grows whenever num reaches a power of two */
+        if ((*num & (*num - 1)) == 0) {
+                l = realloc(*lat, (*num ? *num * 2 : 1) * sizeof(uint64_t));
+                if (l == NULL) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        replay_error = 1;
+                        return -1;
+                }
+                *lat = l;
+        }
+        (*lat)[(*num)++] = ns;
+        return 0;
+}
+
+static int load_capture(const char *path)
+{
+        uint8_t hdr[SMB2_CAPTURE_RECORD_SIZE];
+        struct replay_call *c;
+        uint32_t *order;
+        uint32_t id, len;
+        uint64_t max_write = 0;
+        FILE *fp;
+        int rc = -1;
+
+        fp = fopen(path, "rb");
+        if (fp == NULL) {
+                fprintf(stderr, "Failed to open %s: %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+        if (fread(hdr, 8, 1, fp) != 1 ||
+            memcmp(hdr, SMB2_CAPTURE_MAGIC, 8)) {
+                fprintf(stderr, "%s is not a capture\n", path);
+                goto finished;
+        }
+        while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+                id = get_le(&hdr[4], 4);
+                len = get_le(&hdr[2], 2);
+                if (hdr[0] >= SMB2_CAPTURE_NUM_OPS || id == 0) {
+                        fprintf(stderr, "Bad record in %s\n", path);
+                        goto finished;
+                }
+                if (hdr[0] == SMB2_CAPTURE_DONE) {
+                        if (id > num_calls || calls[id - 1].done) {
+                                fprintf(stderr, "Bad record in %s\n", path);
+                                goto finished;
+                        }
+                        c = &calls[id - 1];
+                        c->done = 1;
+                        c->status = (int32_t)get_le(&hdr[32], 4);
+                        c->latency = get_le(&hdr[8], 8) - c->time;
+                        done_order[num_done++] = id - 1;
+                        continue;
+                }
+                /* calls are numbered in the order they were issued */
+                if (id != num_calls + 1) {
+                        fprintf(stderr, "Bad record in %s\n", path);
+                        goto finished;
+                }
+                if ((num_calls & (num_calls - 1)) == 0) {
+                        c = realloc(calls, (num_calls ? num_calls * 2 : 1) *
+                                    sizeof(struct replay_call));
+                        if (c == NULL) {
+                                goto nomem;
+                        }
+                        calls = c;
+                        order = realloc(done_order,
+                                        (num_calls ? num_calls * 2 : 1) *
+                                        sizeof(uint32_t));
+                        if (order == NULL) {
+                                goto nomem;
+                        }
+                        done_order = order;
+                }
+                c = &calls[num_calls++];
+                memset(c, 0, sizeof(struct replay_call));
+                c->op = hdr[0];
+                c->time = get_le(&hdr[8], 8);
+                c->offset = get_le(&hdr[16], 8);
+                c->count = get_le(&hdr[24], 4);
+                c->fh = get_le(&hdr[28], 4);
+                c->deps = num_done;
+                c->path = malloc(len + 1);
+                if (c->path == NULL) {
+                        goto nomem;
+                }
+                if (len && fread(c->path, len, 1, fp) != 1) {
+                        fprintf(stderr, "Short record in %s\n", path);
+                        goto finished;
+                }
+                c->path[len] = 0;
+                if (c->op == SMB2_CAPTURE_RENAME) {
+                        c->path2 = c->path + strlen(c->path);
+                        if (c->path2 < c->path + len) {
+                                c->path2++;
+                        }
+                }
+                if (c->fh > num_calls) {
+                        fprintf(stderr, "Bad record in %s\n", path);
+                        goto finished;
+                }
+                if (c->op == SMB2_CAPTURE_PWRITE && c->count > max_write) {
+                        max_write = c->count;
+                }
+        }
+
+        fhs = calloc(num_calls + 1, sizeof(struct smb2fh *));
+        zeroes = calloc(max_write + 1, 1);
+        if (fhs == NULL || zeroes == NULL) {
+                goto nomem;
+        }
+        rc = 0;
+        goto finished;
+
+ nomem:
+        fprintf(stderr, "Failed to allocate memory\n");
+ finished:
+        fclose(fp);
+        return rc;
+}
+
+static void call_done(struct replay_call *c, int status)
+{
+        struct op_stats *s = &stats[c->op];
+
+        c->state = CALL_DONE;
+        s->calls++;
+        if (status < 0) {
+                s->errors++;
+        }
+        if (c->done && status != c->status) {
+                s->mismatches++;
+        }
+        add_latency(&s->lat, &s->num_lat, now_ns() - c->start);
+        if (c->done) {
+                add_latency(&s->orig, &s->num_orig, c->latency);
+        }
+
+        /* let the calls that waited for this one go */
+        while (completed < num_done &&
+               calls[done_order[completed]].state == CALL_DONE) {
+                completed++;
+        }
+}
+
+static void skip_call(struct replay_call *c)
+{
+        stats[c->op].skipped++;
+        c->state = CALL_DONE;
+        while (completed < num_done &&
+               calls[done_order[completed]].state == CALL_DONE) {
+                completed++;
+        }
+}
+
+static void generic_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *private_data)
+{
+        struct replay_op *op = private_data;
+        struct replay_call *c = op->call;
+
+        in_flight--;
+        if (c->op == SMB2_CAPTURE_OPEN && status == 0) {
+                fhs[c - calls + 1] = command_data;
+        }
+        call_done(c, status);
+        free(op->buf);
+        free(op);
+}
+
+static void opendir_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *private_data)
+{
+        struct replay_op *op = private_data;
+        struct replay_call *c = op->call;
+        struct smb2dir *dir = command_data;
+
+        in_flight--;
+        call_done(c, status);
+        if (status < 0) {
+                return;
+        }
+        while (smb2_readdir(smb2, dir) != NULL) {
+                ;
+        }
+        smb2_closedir(smb2, dir);
+}
+
+static int issue_call(struct replay_call *c)
+{
+        struct smb2fh *fh = NULL;
+        struct replay_op *op;
+        int rc;
+
+        if (c->fh) {
+                fh = fhs[c->fh];
+                if (fh == NULL) {
+                        skip_call(c);
+                        return 0;
+                }
+        }
+        op = calloc(1, sizeof(struct replay_op));
+        if (op == NULL) {
+                return -ENOMEM;
+        }
+        op->call = c;
+        c->start = now_ns();
+
+        switch (c->op) {
+        case SMB2_CAPTURE_OPEN:
+                rc = smb2_open_async(smb2, c->path, c->count, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_CLOSE:
+                /* the handle is gone for any call after this one */
+                fhs[c->fh] = NULL;
+                rc = smb2_close_async(smb2, fh, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_PREAD:
+                op->buf = malloc(c->count ? c->count : 1);
+                if (op->buf == NULL) {
+                        rc = -ENOMEM;
+                        break;
+                }
+                rc = smb2_pread_async(smb2, fh, op->buf, c->count, c->offset,
+                                      generic_cb, op);
+                break;
+        case SMB2_CAPTURE_PWRITE:
+                rc = smb2_pwrite_async(smb2, fh, zeroes, c->count, c->offset,
+                                       generic_cb, op);
+                break;
+        case SMB2_CAPTURE_FSYNC:
+                rc = smb2_fsync_async(smb2, fh, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_FSTAT:
+                rc = smb2_fstat_async(smb2, fh, &op->st, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_STAT:
+                rc = smb2_stat_async(smb2, c->path, &op->st, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_STATVFS:
+                rc = smb2_statvfs_async(smb2, c->path, &op->vfs,
+                                        generic_cb, op);
+                break;
+        case SMB2_CAPTURE_OPENDIR:
+                rc = smb2_opendir_async(smb2, c->path, opendir_cb, op);
+                break;
+        case SMB2_CAPTURE_MKDIR:
+                rc = smb2_mkdir_async(smb2, c->path, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_RMDIR:
+                rc = smb2_rmdir_async(smb2, c->path, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_UNLINK:
+                rc = smb2_unlink_async(smb2, c->path, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_RENAME:
+                rc = smb2_rename_async(smb2, c->path, c->path2,
+                                       generic_cb, op);
+                break;
+        case SMB2_CAPTURE_TRUNCATE:
+                rc = smb2_truncate_async(smb2, c->path, c->offset,
+                                         generic_cb, op);
+                break;
+        case SMB2_CAPTURE_FTRUNCATE:
+                rc = smb2_ftruncate_async(smb2, fh, c->offset,
+                                          generic_cb, op);
+                break;
+        case SMB2_CAPTURE_READLINK:
+                rc = smb2_readlink_async(smb2, c->path, generic_cb, op);
+                break;
+        case SMB2_CAPTURE_ECHO:
+                rc = smb2_echo_async(smb2, generic_cb, op);
+                break;
+        default:
+                rc = -EINVAL;
+        }
+        if (rc < 0) {
+                free(op->buf);
+                free(op);
+                if (rc == -ENOMEM) {
+                        return rc;
+                }
+                call_done(c, rc);
+                return 0;
+        }
+        c->state = CALL_ISSUED;
+        in_flight++;
+        return 0;
+}
+
+/*
+ * Issues the calls that may go. Returns how many ms until the next one
+ * is due, or -1 if it waits for another call.
+ */
+static int issue_calls(void)
+{
+        struct replay_call *c;
+        uint64_t now, due;
+
+        while (next_call < num_calls) {
+                c = &calls[next_call];
+                if (completed < c->deps) {
+                        return -1;
+                }
+                if (speed > 0) {
+                        now = now_ns();
+                        due = start_time + (uint64_t)(c->time / speed);
+                        if (due > now) {
+                                return (due - now + 999999) / 1000000;
+                        }
+                }
+                if (issue_call(c) < 0) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        replay_error = 1;
+                        return -1;
+                }
+                next_call++;
+        }
+        return -1;
+}
+
+static int event_loop(void)
+{
+        struct pollfd pfd;
+        int timeout;
+
+        while (!replay_error) {
+                timeout = issue_calls();
+                if (next_call == num_calls && in_flight == 0) {
+                        break;
+                }
+                pfd.fd = smb2_get_fd(smb2);
+                pfd.events = smb2_which_events(smb2);
+                pfd.revents = 0;
+                if (poll(&pfd, 1, timeout < 0 ? 1000 : timeout) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        fprintf(stderr, "Poll failed\n");
+                        replay_error = 1;
+                        break;
+                }
+                if (pfd.revents == 0) {
+                        continue;
+                }
+                if (smb2_service(smb2, pfd.revents) < 0) {
+                        fprintf(stderr, "smb2_service failed with : %s\n",
+                                smb2_get_error(smb2));
+                        replay_error = 1;
+                }
+        }
+        return replay_error ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *lat, uint64_t num, double p)
+{
+        if (num == 0) {
+                return 0;
+        }
+        return lat[(uint64_t)(p * (num - 1) + 0.5)] / 1000.0;
+}
+
+static double avg_us(uint64_t *lat, uint64_t num)
+{
+        uint64_t i, sum = 0;
+
+        for (i = 0; i < num; i++) {
+                sum += lat[i];
+        }
+        return num ? sum / 1000.0 / num : 0;
+}
+
+static void report(double secs)
+{
+        struct op_stats *s;
+        double captured = 0;
+        int i;
+
+        if (num_calls) {
+                captured = calls[num_calls - 1].time / 1e9;
+        }
+        if (csv) {
+                printf("op,calls,errors,mismatches,skipped,avg_us,p50_us,"
+                       "p90_us,p99_us,max_us,captured_avg_us,"
+                       "captured_p50_us,captured_p99_us\n");
+        } else {
+                printf("%u calls replayed in %.3f s, captured in %.3f s\n\n",
+                       num_calls, secs, captured);
+                printf("%-10s %8s %7s %7s %7s %9s %9s %9s %9s %9s "
+                       "| %9s %9s %9s\n", "op", "calls", "errors", "differ",
+                       "skipped", "avg", "p50", "p90", "p99", "max",
+                       "cap avg", "cap p50", "cap p99");
+        }
+        for (i = 1; i < SMB2_CAPTURE_NUM_OPS; i++) {
+                s = &stats[i];
+                if (s->calls == 0 && s->skipped == 0) {
+                        continue;
+                }
+                qsort(s->lat, s->num_lat, sizeof(uint64_t), cmp_u64);
+                qsort(s->orig, s->num_orig, sizeof(uint64_t), cmp_u64);
+                printf(csv ? "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                       ",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n" :
+                       "%-10s %8" PRIu64 " %7" PRIu64 " %7" PRIu64 " %7"
+                       PRIu64 " %9.1f %9.1f %9.1f %9.1f %9.1f "
+                       "| %9.1f %9.1f %9.1f\n",
+                       op_names[i], s->calls, s->errors, s->mismatches,
+                       s->skipped, avg_us(s->lat, s->num_lat),
+                       percentile_us(s->lat, s->num_lat, 0.50),
+                       percentile_us(s->lat, s->num_lat, 0.90),
+                       percentile_us(s->lat, s->num_lat, 0.99),
+                       percentile_us(s->lat, s->num_lat, 1.0),
+                       avg_us(s->orig, s->num_orig),
+                       percentile_us(s->orig, s->num_orig, 0.50),
+                       percentile_us(s->orig, s->num_orig, 0.99));
+        }
+        if (!csv) {
+                printf("\nLatencies are in usec. differ counts the calls "
+                       "that returned another status\nthan they did in the "
+                       "capture, skipped those on a handle that failed to "
+                       "open.\n");
+        }
+        fflush(stdout);
+}
+
+int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-replay [-s speed] [-C] <capture-file> <smb2-url>\n\n"
+                "  -s  how much faster than captured to issue the calls, "
+                "default 1,\n"
+                "      0 issues them as soon as the calls they depend on "
+                "are done\n"
+                "  -C  print the results as CSV\n\n"
+                "URL format: "
+                "smb://[<domain;][<username>@]<host>[:<port>]/<share>\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct smb2_url *url = NULL;
+        uint32_t i;
+        int c, rc = 0;
+
+        while ((c = getopt(argc, argv, "s:C")) != -1) {
+                switch (c) {
+                case 's':
+                        speed = atof(optarg);
+                        break;
+                case 'C':
+                        csv = 1;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind + 2 != argc || speed < 0) {
+                usage();
+        }
+
+        if (load_capture(argv[optind]) < 0) {
+                rc = -1;
+                goto finished;
+        }
+
+        smb2 = smb2_init_context();
+        if (smb2 == NULL) {
+                fprintf(stderr, "Failed to init context\n");
+                rc = -1;
+                goto finished;
+        }
+        url = smb2_parse_url(smb2, argv[optind + 1]);
+        if (url == NULL) {
+                fprintf(stderr, "Failed to parse url: %s\n",
+                        smb2_get_error(smb2));
+                rc = -1;
+                goto finished;
+        }
+        smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+        if (smb2_connect_share(smb2, url->server, url->share,
+                               url->user) < 0) {
+                fprintf(stderr, "smb2_connect_share failed. %s\n",
+                        smb2_get_error(smb2));
+                rc = -1;
+                goto finished;
+        }
+
+        start_time = now_ns();
+        rc = event_loop();
+        if (rc == 0) {
+                report((now_ns() - start_time) / 1e9);
+        }
+
+        /* handles the capture ended with */
+        for (i = 1; rc == 0 && i <= num_calls; i++) {
+                if (fhs[i]) {
+                        smb2_close(smb2, fhs[i]);
+                }
+        }
+        if (rc == 0) {
+                smb2_disconnect_share(smb2);
+        }
+
+ finished:
+        if (url) {
+                smb2_destroy_url(url);
+        }
+        if (smb2) {
+                smb2_destroy_context(smb2);
+        }
+        for (i = 0; i < num_calls; i++) {
+                free(calls[i].path);
+        }
+        free(calls);
+        free(done_order);
+        free(fhs);
+        free(zeroes);
+        for (c = 0; c < SMB2_CAPTURE_NUM_OPS; c++) {
+                free(stats[c].lat);
+                free(stats[c].orig);
+        }
+        return rc < 0 ? 1 : 0;
+}